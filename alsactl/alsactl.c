@@ -54,6 +54,8 @@ int ignore_nocards = 0;
 int do_lock = 0;
 int use_syslog = 0;
 int do_export = 0;
+int use_snapshot = 0;
+int jobs = 1;
 char *command;
 char *statefile = NULL;
 char *groupfile = SYS_CARD_GROUP;
@@ -99,8 +101,20 @@ static struct arg args[] = {
 { 0, NULL, "  default settings is 'no file set'" },
 { 'R', "remove", "remove runstate file at first, otherwise append errors" },
 { 'Y', "export", "export card state as key=value pairs (restore command only)" },
+{ 'B', "binary", "store a binary snapshot next to the configuration file" },
+{ 0, NULL, "  and restore from it when it matches the cards" },
 { INTARG | 'p', "period", "store period in seconds for the daemon command" },
 { FILEARG | 'e', "pid-file", "pathname for the process id (daemon mode)" },
+{ INTARG | 'j', "jobs", "restore and init up to # cards in parallel (default 1)" },
+{ FILEARG | 'T', "profile", "report the time and control calls of each phase: table or trace" },
+{ 0, NULL, "  (add :FILE to write the report to a file)" },
+{ HEADER, NULL, "Available monitor options:" },
+{ INTARG | 'w', "window", "merge the events of each control within # ms" },
+{ 0, NULL, "  and show the event counts and the last values" },
+{ FILEARG | 'o', "output", "output format: text (default), json or binary" },
+{ HEADER, NULL, "Available wait options:" },
+{ 'A', "all", "wait also for the absent cards of all card groups" },
+{ FILEARG | 'N', "group", "wait for the cards of this card group" },
 { HEADER, NULL, "Available init options:" },
 { ENVARG | 'E', "env", "set environment variable for init phase (NAME=VALUE)" },
 { FILEARG | 'i', "initfile", "main configuation file for init phase" },
@@ -124,7 +138,12 @@ static struct arg args[] = {
 { EMPCMD, NULL, "  from configuration file" },
 { CARDCMD, "nrestore", "like restore, but notify the daemon to rescan soundcards" },
 { CARDCMD, "wrestore", "wait for card ready, then restore" },
+{ CARDCMD, "wait", "wait until the cards are ready, all at once" },
 { CARDCMD, "init", "initialize driver to a default state" },
+{ CARDCMD, "diff", "show the controls which differ from the configuration file" },
+{ EMPCMD, NULL, "  (the file can be given after the card, too)" },
+{ CARDCMD, "apply", "write only the controls which differ from the configuration" },
+{ EMPCMD, NULL, "  file, switches turned off first and turned on last" },
 { CARDCMD, "daemon", "store state periodically for one or each soundcards" },
 { CARDCMD, "rdaemon", "like daemon but do the state restore at first" },
 { KILLCMD, "kill", "notify daemon to quit, rescan or save_and_quit" },
@@ -263,6 +282,10 @@ int main(int argc, char *argv[])
 	int use_nice = NO_NICE;
 	int sched_idle = 0;
 	int initflags = 0;
+	int window = 0;
+	int format = MONITOR_TEXT;
+	int wait_all = 0;
+	char *wait_group = NULL;
 	struct arg *a;
 	struct option *o;
 	int i, j, k, res;
@@ -368,6 +391,9 @@ int main(int argc, char *argv[])
 		case 'Y':
 			do_export = 1;
 			break;
+		case 'B':
+			use_snapshot = 1;
+			break;
 		case 'P':
 			force_restore = 0;
 			break;
@@ -381,6 +407,46 @@ int main(int argc, char *argv[])
 		case 'e':
 			pidfile = optarg;
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				jobs = 1;
+			else if (jobs > 64)
+				jobs = 64;
+			break;
+		case 'T':
+			if (profile_setup(optarg) < 0) {
+				fprintf(stderr, "unknown profile format '%s'\n", optarg);
+				res = EXIT_FAILURE;
+				goto out;
+			}
+			break;
+		case 'A':
+			wait_all = 1;
+			break;
+		case 'N':
+			wait_group = optarg;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			if (window < 0)
+				window = 0;
+			else if (window > 60*60*1000)
+				window = 60*60*1000;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				format = MONITOR_TEXT;
+			else if (!strcmp(optarg, "json"))
+				format = MONITOR_JSON;
+			else if (!strcmp(optarg, "binary"))
+				format = MONITOR_BINARY;
+			else {
+				fprintf(stderr, "unknown output format '%s'\n", optarg);
+				res = EXIT_FAILURE;
+				goto out;
+			}
+			break;
 		case 'b':
 			background = 1;
 			break;
@@ -487,13 +553,23 @@ int main(int argc, char *argv[])
 		}
 		if (!strcmp(cmd, "nrestore"))
 			res = state_daemon_kill(pidfile, "rescan");
+	} else if (!strcmp(cmd, "wait")) {
+		if (cardname && (wait_all || wait_group)) {
+			fprintf(stderr, "alsactl: Specify a card or a card group...\n");
+			res = -EINVAL;
+		} else {
+			res = wait_for_cards(cardname, wait_group, wait_all);
+		}
+	} else if (!strcmp(cmd, "diff") || !strcmp(cmd, "apply")) {
+		res = diff_state(extra_args ? extra_args[0] : cfgfile, cardname,
+				 !strcmp(cmd, "apply"));
 	} else if (!strcmp(cmd, "daemon")) {
 		do_nice(use_nice, sched_idle);
 		res = state_daemon(cfgfile, cardname, period, pidfile);
 	} else if (!strcmp(cmd, "kill")) {
 		res = state_daemon_kill(pidfile, cardname);
 	} else if (!strcmp(cmd, "monitor")) {
-		res = monitor(cardname);
+		res = monitor(cardname, window, format);
 	} else if (!strcmp(cmd, "info")) {
 		res = general_info(cardname);
 	} else if (!strcmp(cmd, "clean")) {
@@ -508,6 +584,7 @@ int main(int argc, char *argv[])
 	}
 
 	snd_config_update_free_global();
+	profile_report();
 	if (use_syslog) {
 		if (daemoncmd)
 			syslog(LOG_INFO, "alsactl daemon stopped");
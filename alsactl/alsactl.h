@@ -10,6 +10,8 @@ extern int ignore_nocards;
 extern int do_lock;
 extern int use_syslog;
 extern int do_export;
+extern int use_snapshot;
+extern int jobs;
 extern char *command;
 extern char *statefile;
 extern char *groupfile;
@@ -50,6 +52,12 @@ void log_handler(int prio, int interface, const char *file, int line, const char
 #define FLAG_UCM_RESTORE	(1<<5)
 #define FLAG_UCM_WAIT		(1<<6)
 
+enum {
+	MONITOR_TEXT = 0,
+	MONITOR_JSON,
+	MONITOR_BINARY,
+};
+
 enum {
 	CARD_STATE_WAIT = 1,		/* skip configuration (wait for sync) */
 	CARD_STATE_SKIP = 2,		/* skip card */
@@ -66,6 +74,15 @@ int snd_card_iterator_sinit(struct snd_card_iterator *iter, const char *cardname
 const char *snd_card_iterator_next(struct snd_card_iterator *iter);
 int snd_card_iterator_error(struct snd_card_iterator *iter);
 
+/* the result of a card_pool_run() callback besides the returned error */
+struct card_job {
+	int state;	/* the card state to export, when positive */
+	int stop;	/* a fatal error, do not process more cards */
+};
+
+typedef int (*card_pool_fn_t)(void *arg, int cardno, const char *name, struct card_job *job);
+int card_pool_run(struct snd_card_iterator *iter, card_pool_fn_t fn, void *arg);
+
 int load_configuration(const char *file, snd_config_t **top, int *open_failed);
 int init(const char *cfgdir, const char *file, int flags, const char *cardname);
 int init_ucm(const char *cfgdir, int flags, int cardno);
@@ -86,12 +103,19 @@ int card_unlock(int lock_fd, int card_number);
 int group_state_lock(const char *file, int timeout);
 int group_state_unlock(int lock_fd, const char *file);
 int save_state(const char *file, const char *cardname);
+int state_config_load(const char *file, snd_config_t **config);
+int state_config_save(const char *file, snd_config_t *config);
+int state_config_card(snd_config_t *top, int cardno);
+int state_config_controls(snd_config_t *top, snd_ctl_t *handle,
+			  const unsigned int *numids, unsigned int count);
 int load_state(const char *cfgdir, const char *file,
 	       const char *initfile, int initflags,
 	       const char *cardname, int do_init);
+int diff_state(const char *file, const char *cardname, int apply);
 int wait_for_card(long long timeout, int cardno);
+int wait_for_cards(const char *cardname, const char *group, int all);
 int power(const char *argv[], int argc);
-int monitor(const char *name);
+int monitor(const char *name, int window, int format);
 int general_info(const char *name);
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile);
@@ -100,11 +124,107 @@ int clean(const char *cardname, char *const *extra_args);
 int snd_card_clean_cfgdir(const char *cfgdir, int cardno);
 void add_linked_card(int cardno);
 
+/* snapshot */
+
+struct snapshot;
+int snapshot_save(const char *file, const char *cardname, struct snapshot *old);
+int snapshot_load(const char *file, struct snapshot **snapshot);
+void snapshot_free(struct snapshot *snap);
+int snapshot_restore(struct snapshot *snap, int cardno);
+
 /* export */
 
 int export_card_state_set(int card, int state);
 int export_cards(const char *cardname);
 
+/* profile */
+
+enum {
+	PROFILE_TABLE = 1,
+	PROFILE_TRACE,
+};
+
+enum {
+	PROFILE_WAIT = 0,
+	PROFILE_LOCK,
+	PROFILE_CONFIG,
+	PROFILE_INIT,
+	PROFILE_UCM,
+	PROFILE_RESTORE,
+	PROFILE_CONTROL,
+	PROFILE_PHASES
+};
+
+struct profile_span {
+	int phase;
+	int card;
+	unsigned int calls;
+	long long start;
+	long long cpu;
+};
+
+extern int profile_mode;
+extern unsigned int profile_calls;
+
+/*
+ * The control calls counted by the profiler: the card info and the
+ * element list, info, read and write. Other calls are not counted.
+ */
+static inline int ctl_card_info(snd_ctl_t *handle, snd_ctl_card_info_t *info)
+{
+	profile_calls++;
+	return snd_ctl_card_info(handle, info);
+}
+
+static inline int ctl_elem_list(snd_ctl_t *handle, snd_ctl_elem_list_t *list)
+{
+	profile_calls++;
+	return snd_ctl_elem_list(handle, list);
+}
+
+static inline int ctl_elem_info(snd_ctl_t *handle, snd_ctl_elem_info_t *info)
+{
+	profile_calls++;
+	return snd_ctl_elem_info(handle, info);
+}
+
+static inline int ctl_elem_read(snd_ctl_t *handle, snd_ctl_elem_value_t *value)
+{
+	profile_calls++;
+	return snd_ctl_elem_read(handle, value);
+}
+
+static inline int ctl_elem_write(snd_ctl_t *handle, snd_ctl_elem_value_t *value)
+{
+	profile_calls++;
+	return snd_ctl_elem_write(handle, value);
+}
+
+static inline int hctl_elem_info(snd_hctl_elem_t *elem, snd_ctl_elem_info_t *info)
+{
+	profile_calls++;
+	return snd_hctl_elem_info(elem, info);
+}
+
+static inline int hctl_elem_read(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
+{
+	profile_calls++;
+	return snd_hctl_elem_read(elem, value);
+}
+
+static inline int hctl_elem_write(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
+{
+	profile_calls++;
+	return snd_hctl_elem_write(elem, value);
+}
+
+int profile_setup(const char *arg);
+void profile_begin(struct profile_span *span, int phase, int card);
+void profile_end(struct profile_span *span);
+void profile_fork(void);
+void profile_flush(void);
+int profile_report(void);
+
 /* utils */
 
 int file_map(const char *filename, char **buf, size_t *bufsize);
@@ -82,7 +82,7 @@ int read_boot_params(snd_ctl_t *handle, long long *boot_time, long long *sync_ti
 	snd_ctl_elem_id_set_index(id, 0);
 
 	snd_ctl_elem_info_set_id(info, id);
-	err = snd_ctl_elem_info(handle, info);
+	err = ctl_elem_info(handle, info);
 	if (err < 0) {
 		if (err == -ENOENT)
 			return 0;
@@ -101,7 +101,7 @@ int read_boot_params(snd_ctl_t *handle, long long *boot_time, long long *sync_ti
 	}
 
 	snd_ctl_elem_value_set_id(value, id);
-	err = snd_ctl_elem_read(handle, value);
+	err = ctl_elem_read(handle, value);
 	if (err < 0) {
 		error("Cannot read '.Boot' control: %s", snd_strerror(err));
 		return err;
@@ -146,7 +146,7 @@ int write_boot_params(snd_ctl_t *handle, long long boot_time, long long sync_tim
 	snd_ctl_elem_id_set_index(id, 0);
 
 	snd_ctl_elem_info_set_id(info, id);
-	err = snd_ctl_elem_info(handle, info);
+	err = ctl_elem_info(handle, info);
 	if (err < 0) {
 		if (err == -ENOENT) {
 			/* Element not found, create a new user element with 3 integer64 values */
@@ -160,7 +160,7 @@ int write_boot_params(snd_ctl_t *handle, long long boot_time, long long sync_tim
 				return err;
 			}
 			/* Re-read the element info after creation */
-			err = snd_ctl_elem_info(handle, info);
+			err = ctl_elem_info(handle, info);
 			if (err < 0) {
 				error("Cannot read '.Boot' control info after creation: %s", snd_strerror(err));
 				return err;
@@ -190,7 +190,7 @@ int write_boot_params(snd_ctl_t *handle, long long boot_time, long long sync_tim
 	snd_ctl_elem_value_set_integer64(value, 2, restore_time);
 	snd_ctl_elem_value_set_integer64(value, 3, primary_card);
 
-	err = snd_ctl_elem_write(handle, value);
+	err = ctl_elem_write(handle, value);
 	if (err < 0) {
 		error("Cannot write '.Boot' control: %s", snd_strerror(err));
 		return err;
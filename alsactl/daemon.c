@@ -27,23 +27,48 @@
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
 #include <time.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include "alsactl.h"
 
-struct id_list {
-	snd_ctl_elem_id_t **list;
-	int size;
+/* the element ids hashed by the id without the numid */
+struct id_node {
+	struct id_node *next;
+	unsigned int hash;
+	snd_ctl_elem_id_t *id;
+};
+
+struct id_set {
+	struct id_node **buckets;
+	unsigned int size;		/* power of two */
+	unsigned int count;
 };
 
+#define DIRTY_BITS	(sizeof(unsigned long) * 8)
+
 struct card {
 	int index;
 	int pfds;
+	int watched;			/* the descriptors are in the epoll set */
 	snd_ctl_t *handle;
-	struct id_list whitelist;
-	struct id_list blacklist;
+	struct id_set whitelist;
+	struct id_set blacklist;
+	int refresh;			/* read all controls on the next save */
+	unsigned long *dirty;		/* bitmap of the changed numids */
+	unsigned int dirty_size;	/* in bits */
+	unsigned int dirty_count;
 };
 
+/* the epoll tags, the cards use the card slot + EPOLL_TAG_CARD */
+#define EPOLL_TAG_SIGNAL	0
+#define EPOLL_TAG_TIMER		1
+#define EPOLL_TAG_CARD		2
+
 static int quit = 0;
 static int rescan = 0;
 static int save_now = 0;
@@ -54,25 +79,21 @@ static void signal_handler_quit(int sig)
 	signal(sig, signal_handler_quit);
 }
 
-static void signal_handler_save_and_quit(int sig)
-{
-	quit = save_now = 1;
-	signal(sig, signal_handler_quit);
-}
-
-static void signal_handler_rescan(int sig)
-{
-	rescan = 1;
-	signal(sig, signal_handler_rescan);
-}
-
-static void free_list(struct id_list *list)
+static void free_set(struct id_set *set)
 {
-	int i;
-
-	for (i = 0; i < list->size; i++)
-		free(list->list[i]);
-	free(list->list);
+	struct id_node *node, *next;
+	unsigned int i;
+
+	for (i = 0; i < set->size; i++) {
+		for (node = set->buckets[i]; node; node = next) {
+			next = node->next;
+			free(node->id);
+			free(node);
+		}
+	}
+	free(set->buckets);
+	set->buckets = NULL;
+	set->size = set->count = 0;
 }
 
 static void card_free(struct card **card)
@@ -81,8 +102,9 @@ static void card_free(struct card **card)
 
 	if (c == NULL)
 		return;
-	free_list(&c->blacklist);
-	free_list(&c->whitelist);
+	free_set(&c->blacklist);
+	free_set(&c->whitelist);
+	free(c->dirty);
 	if (c->handle)
 		snd_ctl_close(c->handle);
 	free(c);
@@ -110,6 +132,7 @@ static void add_card(struct card ***cards, int *count, const char *cardname)
 	if (card == NULL)
 		return;
 	card->index = index;
+	card->refresh = 1;
 	sprintf(device, "hw:%i", index);
 	if (snd_ctl_open(&card->handle, device, SND_CTL_READONLY|SND_CTL_NONBLOCK) < 0) {
 		card_free(&card);
@@ -166,54 +189,103 @@ static int compare_ids(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2)
 	       snd_ctl_elem_id_get_subdevice(id1) == snd_ctl_elem_id_get_subdevice(id2);
 }
 
-static int in_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static unsigned int id_hash(snd_ctl_elem_id_t *id)
 {
-	int i;
-	snd_ctl_elem_id_t *id1;
+	const char *name = snd_ctl_elem_id_get_name(id);
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_interface(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_index(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_device(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_subdevice(id)) * 16777619U;
+	return h;
+}
 
-	for (i = 0; i < list->size; i++) {
-		id1 = list->list[i];
-		if (id1 == NULL)
-			continue;
-		if (compare_ids(id, id1))
-			return 1;
+/* return the link which points to the matching node (or the chain end) */
+static struct id_node **find_in_set(struct id_set *set, snd_ctl_elem_id_t *id,
+				    unsigned int hash)
+{
+	struct id_node **link;
+
+	if (set->size == 0)
+		return NULL;
+	link = &set->buckets[hash & (set->size - 1)];
+	while (*link) {
+		if ((*link)->hash == hash && compare_ids(id, (*link)->id))
+			break;
+		link = &(*link)->next;
 	}
-	return 0;
+	return link;
+}
+
+static int in_set(struct id_set *set, snd_ctl_elem_id_t *id)
+{
+	struct id_node **link = find_in_set(set, id, id_hash(id));
+
+	return link && *link;
 }
 
-static void remove_from_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static void remove_from_set(struct id_set *set, snd_ctl_elem_id_t *id)
 {
-	int i;
+	struct id_node **link = find_in_set(set, id, id_hash(id));
+	struct id_node *node;
+
+	if (link == NULL || *link == NULL)
+		return;
+	node = *link;
+	*link = node->next;
+	free(node->id);
+	free(node);
+	set->count--;
+}
 
-	for (i = 0; i < list->size; i++) {
-		if (compare_ids(id, list->list[i])) {
-			free(list->list[i]);
-			list->list[i] = NULL;
+static int grow_set(struct id_set *set)
+{
+	struct id_node **buckets, *node, *next;
+	unsigned int i, size = set->size ? set->size * 2 : 64;
+
+	buckets = calloc(size, sizeof(*buckets));
+	if (buckets == NULL)
+		return -ENOMEM;
+	for (i = 0; i < set->size; i++) {
+		for (node = set->buckets[i]; node; node = next) {
+			next = node->next;
+			node->next = buckets[node->hash & (size - 1)];
+			buckets[node->hash & (size - 1)] = node;
 		}
 	}
+	free(set->buckets);
+	set->buckets = buckets;
+	set->size = size;
+	return 0;
 }
 
-static void add_to_list(struct id_list *list, snd_ctl_elem_id_t *id)
+static void add_to_set(struct id_set *set, snd_ctl_elem_id_t *id)
 {
-	snd_ctl_elem_id_t *id1;
-	snd_ctl_elem_id_t **n;
-	int i;
+	struct id_node **link, *node;
+	unsigned int hash = id_hash(id);
 
-	if (snd_ctl_elem_id_malloc(&id1))
+	link = find_in_set(set, id, hash);
+	if (link && *link)
 		return;
-	snd_ctl_elem_id_copy(id1, id);
-	for (i = 0; i < list->size; i++) {
-		if (list->list[i] == NULL) {
-			list->list[i] = id1;
+	if (set->count >= set->size) {
+		if (grow_set(set) < 0)
 			return;
-		}
+		link = find_in_set(set, id, hash);
 	}
-	n = realloc(list->list, sizeof(void *) * (list->size + 1));
-	if (n == NULL)
+	node = calloc(1, sizeof(*node));
+	if (node == NULL)
 		return;
-	n[list->size] = id1;
-	list->size++;
-	list->list = n;
+	if (snd_ctl_elem_id_malloc(&node->id)) {
+		free(node);
+		return;
+	}
+	snd_ctl_elem_id_copy(node->id, id);
+	node->hash = hash;
+	*link = node;
+	set->count++;
 }
 
 static int check_lists(struct card *card, snd_ctl_elem_id_t *id)
@@ -221,23 +293,61 @@ static int check_lists(struct card *card, snd_ctl_elem_id_t *id)
 	snd_ctl_elem_info_t *info;
 	snd_ctl_elem_info_alloca(&info);
 
-	if (in_list(&card->blacklist, id))
+	if (in_set(&card->blacklist, id))
 		return 0;
-	if (in_list(&card->whitelist, id))
+	if (in_set(&card->whitelist, id))
 		return 1;
 	snd_ctl_elem_info_set_id(info, id);
 	if (snd_ctl_elem_info(card->handle, info) < 0)
 		return 0;
 	if (snd_ctl_elem_info_is_writable(info) ||
 	    snd_ctl_elem_info_is_tlv_writable(info)) {
-		add_to_list(&card->whitelist, id);
+		add_to_set(&card->whitelist, id);
 		return 1;
 	} else {
-		add_to_list(&card->blacklist, id);
+		add_to_set(&card->blacklist, id);
 		return 0;
 	}
 }
 
+static void dirty_set(struct card *card, unsigned int numid)
+{
+	unsigned int words = card->dirty_size / DIRTY_BITS, nwords;
+	unsigned long *n, bit;
+
+	if (numid == 0)
+		return;
+	if (numid >= card->dirty_size) {
+		nwords = numid / DIRTY_BITS + 1;
+		if (nwords < words * 2)
+			nwords = words * 2;
+		n = realloc(card->dirty, nwords * sizeof(*n));
+		if (n == NULL) {
+			card->refresh = 1;
+			return;
+		}
+		memset(n + words, 0, (nwords - words) * sizeof(*n));
+		card->dirty = n;
+		card->dirty_size = nwords * DIRTY_BITS;
+	}
+	bit = 1UL << (numid % DIRTY_BITS);
+	if (!(card->dirty[numid / DIRTY_BITS] & bit)) {
+		card->dirty[numid / DIRTY_BITS] |= bit;
+		card->dirty_count++;
+	}
+}
+
+static void dirty_clear(struct card *card)
+{
+	if (card->dirty_count)
+		memset(card->dirty, 0, card->dirty_size / DIRTY_BITS * sizeof(*card->dirty));
+	card->dirty_count = 0;
+}
+
+/*
+ * All changed controls are marked dirty, but only a change of a writable
+ * control schedules the save.
+ */
 static int card_events(struct card *card)
 {
 	int res = 0;
@@ -254,14 +364,17 @@ static int card_events(struct card *card)
 			continue;
 		mask = snd_ctl_event_elem_get_mask(ev);
 		snd_ctl_event_elem_get_id(ev, id);
+		dirty_set(card, snd_ctl_elem_id_get_numid(id));
 		if (mask == SND_CTL_EVENT_MASK_REMOVE) {
-			remove_from_list(&card->whitelist, id);
-			remove_from_list(&card->blacklist, id);
+			if (in_set(&card->whitelist, id))
+				res = 1;
+			remove_from_set(&card->whitelist, id);
+			remove_from_set(&card->blacklist, id);
 			continue;
 		}
 		if (mask & SND_CTL_EVENT_MASK_INFO) {
-			remove_from_list(&card->whitelist, id);
-			remove_from_list(&card->blacklist, id);
+			remove_from_set(&card->whitelist, id);
+			remove_from_set(&card->blacklist, id);
 		}
 		if (mask & (SND_CTL_EVENT_MASK_VALUE|
 			    SND_CTL_EVENT_MASK_ADD|
@@ -273,6 +386,91 @@ static int card_events(struct card *card)
 	return res;
 }
 
+static int card_save(snd_config_t *config, struct card *card, int reload)
+{
+	unsigned int *numids, idx, count;
+	int err;
+
+	if (reload || card->refresh) {
+		err = state_config_card(config, card->index);
+		if (err >= 0) {
+			card->refresh = 0;
+			dirty_clear(card);
+		}
+		return err;
+	}
+	if (card->dirty_count == 0)
+		return 0;
+	numids = malloc(sizeof(*numids) * card->dirty_count);
+	if (numids == NULL)
+		return -ENOMEM;
+	for (idx = count = 0; idx < card->dirty_size && count < card->dirty_count; idx++)
+		if (card->dirty[idx / DIRTY_BITS] & (1UL << (idx % DIRTY_BITS)))
+			numids[count++] = idx;
+	err = state_config_controls(config, card->handle, numids, count);
+	free(numids);
+	if (err >= 0)
+		dirty_clear(card);
+	return err;
+}
+
+static int same_file(const char *file, const struct stat *st)
+{
+	struct stat st1;
+
+	if (stat(file, &st1) < 0)
+		return 0;
+	return st1.st_dev == st->st_dev && st1.st_ino == st->st_ino &&
+	       st1.st_size == st->st_size &&
+	       st1.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+	       st1.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Write the state tree kept in memory. The file is read again only when
+ * somebody else wrote it since the last save.
+ */
+static int save_cards(const char *file, snd_config_t **config, struct stat *st,
+		      struct card **cards, int count, int snapshot)
+{
+	int lock_fd, reload, i, err;
+
+	lock_fd = state_lock(file, LOCK_TIMEOUT);
+	if (lock_fd < 0)
+		return lock_fd;
+	reload = *config == NULL || !same_file(file, st);
+	if (reload) {
+		if (*config) {
+			snd_config_delete(*config);
+			*config = NULL;
+		}
+		err = state_config_load(file, config);
+		if (err < 0)
+			goto out;
+	}
+	for (i = 0; i < count; i++) {
+		if (cards[i] == NULL)
+			continue;
+		err = card_save(*config, cards[i], reload);
+		if (err < 0)
+			goto out;
+	}
+	err = state_config_save(file, *config);
+	if (err >= 0 && stat(file, st) < 0)
+		err = -errno;
+	if (err >= 0 && snapshot)
+		snapshot_save(file, NULL, NULL);
+out:
+	/* start again from the file on the next save */
+	if (err < 0 && *config) {
+		snd_config_delete(*config);
+		*config = NULL;
+	}
+	state_unlock(lock_fd, file);
+	snd_config_update_free_global();
+	return err;
+}
+
 static long read_pid_file(const char *pidfile)
 {
 	int fd, err;
@@ -358,25 +556,132 @@ static int check_another_instance(const char *pidfile)
 	return 0;
 }
 
+static int watch_card(int epfd, struct card *card, int slot, int op)
+{
+	struct epoll_event ev = {0};
+	struct pollfd *pfds;
+	int i, err = 0;
+
+	pfds = calloc(card->pfds, sizeof(*pfds));
+	if (pfds == NULL)
+		return -ENOMEM;
+	if (snd_ctl_poll_descriptors(card->handle, pfds, card->pfds) != card->pfds) {
+		err = -EIO;
+		goto out;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = slot + EPOLL_TAG_CARD;
+	for (i = 0; i < card->pfds; i++) {
+		if (epoll_ctl(epfd, op, pfds[i].fd, &ev) < 0) {
+			err = -errno;
+			break;
+		}
+	}
+	card->watched = op == EPOLL_CTL_ADD && err == 0;
+out:
+	free(pfds);
+	return err;
+}
+
+static int add_fd(int epfd, int fd, unsigned int tag)
+{
+	struct epoll_event ev = {0};
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+static int prepare_signalfd(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+		return -errno;
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	return fd;
+}
+
+static void read_signals(int sigfd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGUSR1:
+			rescan = 1;
+			break;
+		case SIGUSR2:
+			quit = save_now = 1;
+			break;
+		default:
+			quit = 1;
+			break;
+		}
+	}
+}
+
+/* the save deadline, zero seconds disarms the timer */
+static void set_deadline(int tfd, int seconds)
+{
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = seconds;
+	if (timerfd_settime(tfd, 0, &its, NULL) < 0)
+		error("timerfd_settime failed: %s", strerror(errno));
+}
+
+/*
+ * The control descriptors of all cards, the signals and the save deadline
+ * timer are in one epoll set, so the daemon sleeps until something
+ * happens. The first change of a writable control arms the timer, the
+ * state is saved when it expires.
+ */
 int state_daemon(const char *file, const char *cardname, int period,
 		 const char *pidfile)
 {
-	int count = 0, pcount, psize = 0, i, j, k, changed = 0;
-	time_t last_write, now;
-	unsigned short revents;
-	struct card **cards = NULL;
-	struct pollfd *pfd = NULL, *pfdn;
+	int count = 0, i, n, changed = 0, expired, final, err;
+	int epfd = -1, sigfd = -1, tfd = -1;
+	struct epoll_event evs[16];
+	struct card **cards = NULL, *card;
+	snd_config_t *config = NULL;
+	struct stat st;
+	uint64_t expirations;
 
 	if (check_another_instance(pidfile))
 		return 0;
 	rescan = 1;
 	signal(SIGABRT, signal_handler_quit);
-	signal(SIGTERM, signal_handler_quit);
-	signal(SIGINT, signal_handler_quit);
-	signal(SIGUSR1, signal_handler_rescan);
-	signal(SIGUSR2, signal_handler_save_and_quit);
+	sigfd = prepare_signalfd();
+	if (sigfd < 0) {
+		error("signalfd failed: %s", strerror(-sigfd));
+		return sigfd;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epfd < 0 || tfd < 0) {
+		err = -errno;
+		error("epoll or timerfd failed: %s", strerror(errno));
+		goto close;
+	}
+	err = add_fd(epfd, sigfd, EPOLL_TAG_SIGNAL);
+	if (err >= 0)
+		err = add_fd(epfd, tfd, EPOLL_TAG_TIMER);
+	if (err < 0) {
+		error("epoll_ctl failed: %s", strerror(-err));
+		goto close;
+	}
 	write_pid_file(pidfile);
-	time(&last_write);
 	while (!quit || save_now) {
 		if (save_now)
 			goto save;
@@ -386,76 +691,81 @@ int state_daemon(const char *file, const char *cardname, int period,
 			} else {
 				add_cards(&cards, &count);
 			}
+			for (i = 0; i < count; i++) {
+				if (cards[i] == NULL || cards[i]->watched)
+					continue;
+				err = watch_card(epfd, cards[i], i, EPOLL_CTL_ADD);
+				if (err < 0) {
+					error("cannot watch card %i: %s",
+					      cards[i]->index, strerror(-err));
+					card_free(&cards[i]);
+				}
+			}
 			snd_config_update_free_global();
 			rescan = 0;
 		}
-		for (i = pcount = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			pcount += cards[i]->pfds;
-		}
-		if (pcount > psize) {
-			pfdn = realloc(pfd, sizeof(struct pollfd) * pcount);
-			if (pfdn) {
-				psize = pcount;
-				pfd = pfdn;
-			} else {
-				error("No enough memory...");
-				goto out;
-			}
-		}
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
-				continue;
-			k = snd_ctl_poll_descriptors(cards[i]->handle, pfd + j, pcount - j);
-			if (k != cards[i]->pfds) {
-				error("poll prepare failed: %i", k);
-				goto out;
-			}
-			j += k;
-		}
-		i = poll(pfd, j, (period / 2) * 1000);
-		if (i < 0 && errno == EINTR)
+		n = epoll_wait(epfd, evs, ARRAY_SIZE(evs), -1);
+		if (n < 0 && errno == EINTR)
 			continue;
-		if (i < 0) {
-			error("poll failed: %s", strerror(errno));
+		if (n < 0) {
+			error("epoll_wait failed: %s", strerror(errno));
 			break;
 		}
-		time(&now);
-		for (i = j = 0; i < count; i++) {
-			if (cards[i] == NULL)
+		expired = 0;
+		for (i = 0; i < n; i++) {
+			switch (evs[i].data.u32) {
+			case EPOLL_TAG_SIGNAL:
+				read_signals(sigfd);
+				continue;
+			case EPOLL_TAG_TIMER:
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					expired = 1;
 				continue;
-			k = snd_ctl_poll_descriptors_revents(cards[i]->handle,
-					pfd + j, cards[i]->pfds, &revents);
-			if (k < 0) {
-				error("poll post failed: %i\n", k);
-				goto out;
 			}
-			j += cards[i]->pfds;
-			if (revents & (POLLERR|POLLNVAL)) {
-				card_free(&cards[i]);
-			} else if (revents & POLLIN) {
-				if (card_events(cards[i])) {
+			/* the card might be freed by an earlier event */
+			card = cards[evs[i].data.u32 - EPOLL_TAG_CARD];
+			if (card == NULL)
+				continue;
+			if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+				watch_card(epfd, card, evs[i].data.u32 - EPOLL_TAG_CARD,
+					   EPOLL_CTL_DEL);
+				card_free(&cards[evs[i].data.u32 - EPOLL_TAG_CARD]);
+			} else if (evs[i].events & EPOLLIN) {
+				if (card_events(card)) {
 					/* delay the write */
 					if (!changed)
-						last_write = now;
+						set_deadline(tfd, period);
 					changed = 1;
 				}
 			}
 		}
-		if ((now - last_write >= period && changed) || save_now) {
+		if ((expired && changed) || save_now) {
 save:
+			/* the snapshot is written only before the exit */
+			final = save_now;
 			changed = save_now = 0;
-			save_state(file, cardname);
+			set_deadline(tfd, 0);
+			if (strcmp(file, "-") == 0)
+				save_state(file, cardname);
+			else
+				save_cards(file, &config, &st, cards, count,
+					   use_snapshot && final);
 		}
 	}
-out:
-	free(pfd);
+	err = 0;
+	if (config)
+		snd_config_delete(config);
 	remove(pidfile);
+close:
 	if (cards) {
 		for (i = 0; i < count; i++)
 			card_free(&cards[i]);
 		free(cards);
 	}
-	return 0;
+	if (tfd >= 0)
+		close(tfd);
+	if (epfd >= 0)
+		close(epfd);
+	close(sigfd);
+	return err;
 }
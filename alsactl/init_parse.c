@@ -60,8 +60,10 @@ struct pair {
 	struct pair *next;
 };
 
+#define PAIR_HASH_SIZE	64
+
 struct space {
-	struct pair *pairs;
+	struct pair *pairs[PAIR_HASH_SIZE];
 	char *rootdir;
 	char *go_to;
 	char *program_result;
@@ -95,17 +97,20 @@ static void Perror(struct space *space, const char *fmt, ...)
 
 static void free_space(struct space *space)
 {
-	struct pair *pair = space->pairs;
-	struct pair *next = pair;
-
-	while (next) {
-		pair = next;
-		next = pair->next;
-		free(pair->value);
-		free(pair->key);
-		free(pair);
+	struct pair *pair, *next;
+	unsigned int idx;
+
+	for (idx = 0; idx < PAIR_HASH_SIZE; idx++) {
+		next = space->pairs[idx];
+		while (next) {
+			pair = next;
+			next = pair->next;
+			free(pair->value);
+			free(pair->key);
+			free(pair);
+		}
+		space->pairs[idx] = NULL;
 	}
-	space->pairs = NULL;
 	if (space->ctl_value) {
 		snd_ctl_elem_value_free(space->ctl_value);
 		space->ctl_value = NULL;
@@ -135,9 +140,18 @@ static void free_space(struct space *space)
 	free(space);
 }
 
+static unsigned int pair_hash(const char *key)
+{
+	unsigned int h = 2166136261U;
+
+	while (*key)
+		h = (h ^ (unsigned char)*key++) * 16777619U;
+	return h % PAIR_HASH_SIZE;
+}
+
 static struct pair *value_find(struct space *space, const char *key)
 {
-	struct pair *pair = space->pairs;
+	struct pair *pair = space->pairs[pair_hash(key)];
 	
 	while (pair && strcmp(pair->key, key) != 0)
 		pair = pair->next;
@@ -147,6 +161,7 @@ static struct pair *value_find(struct space *space, const char *key)
 static int value_set(struct space *space, const char *key, const char *value)
 {
 	struct pair *pair;
+	unsigned int hash;
 	
 	pair = value_find(space, key);
 	if (pair) {
@@ -169,8 +184,9 @@ static int value_set(struct space *space, const char *key, const char *value)
 			free(pair);
 			return -ENOMEM;
 		}
-		pair->next = space->pairs;
-		space->pairs = pair;
+		hash = pair_hash(key);
+		pair->next = space->pairs[hash];
+		space->pairs[hash] = pair;
 	}
 	return 0;
 }
@@ -196,7 +212,7 @@ static int init_space(struct space **space, int card)
 	err = snd_ctl_card_info_malloc(&res->ctl_card_info);
 	if (err < 0)
 		goto error;
-	err = snd_ctl_card_info(snd_hctl_ctl(res->ctl_handle), res->ctl_card_info);
+	err = ctl_card_info(snd_hctl_ctl(res->ctl_handle), res->ctl_card_info);
 	if (err < 0)
 		goto error;
 	err = snd_ctl_elem_id_malloc(&res->ctl_id);
@@ -248,7 +264,7 @@ static int check_id_changed(struct space *space, unsigned int what)
 		elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
 		if (!elem)
 			return -ENOENT;
-		err = snd_hctl_elem_info(elem, space->ctl_info);
+		err = hctl_elem_info(elem, space->ctl_info);
 		if (err == 0)
 			space->ctl_id_changed &= ~1;
 		return err;
@@ -258,7 +274,7 @@ static int check_id_changed(struct space *space, unsigned int what)
 		elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
 		if (!elem)
 			return -ENOENT;
-		err = snd_hctl_elem_read(elem, space->ctl_value);
+		err = hctl_elem_read(elem, space->ctl_value);
 		if (err == 0)
 			space->ctl_id_changed &= ~2;
 		return err;
@@ -435,7 +451,7 @@ static int set_ctl_value(struct space *space, const char *value, int all)
 					elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
 					if (elem == NULL)
 						return -ENOENT;
-					val = snd_hctl_elem_info(elem, space->ctl_info);
+					val = hctl_elem_info(elem, space->ctl_info);
 					if (val < 0)
 						return val;
 					if (strcasecmp(snd_ctl_elem_info_get_item_name(space->ctl_info), value) == 0) {
@@ -681,7 +697,7 @@ dbvalue:
 			elem = snd_hctl_find_elem(space->ctl_handle, space->ctl_id);
 			if (elem == NULL)
 				break;
-			if (snd_hctl_elem_info(elem, space->ctl_info) < 0)
+			if (hctl_elem_info(elem, space->ctl_info) < 0)
 				break;
 			strlcat(res, snd_ctl_elem_info_get_item_name(space->ctl_info), sizeof(res));
 			strlcat(res, "|", sizeof(res));
@@ -818,7 +834,7 @@ static int elemid_set(struct space *space, const char *attr, const char *value)
 		} else {
 			space->ctl_id_changed &= ~2;
 			snd_ctl_elem_value_set_id(space->ctl_value, space->ctl_id);
-			err = snd_ctl_elem_write(snd_hctl_ctl(space->ctl_handle), space->ctl_value);
+			err = ctl_elem_write(snd_hctl_ctl(space->ctl_handle), space->ctl_value);
 			if (err < 0) {
 				Perror(space, "value write error: %s", snd_strerror(err));
 				return err;
@@ -1001,6 +1017,36 @@ static int get_format_len(struct space *space, char **str)
 	return -1;
 }
 
+/* unescape the backslash sequences in place */
+static void unescape_string(char *string)
+{
+	char *head, *tail;
+
+	head = tail = string;
+	while (*head != '\0') {
+		if (*head == '\\') {
+			head++;
+			if (*head == '\0')
+				break;
+			switch (*head) {
+			case 'a': *tail++ = '\a'; break;
+			case 'b': *tail++ = '\b'; break;
+			case 'n': *tail++ = '\n'; break;
+			case 'r': *tail++ = '\r'; break;
+			case 't': *tail++ = '\t'; break;
+			case 'v': *tail++ = '\v'; break;
+			case '\\': *tail++ = '\\'; break;
+			default: *tail++ = *head; break;
+			}
+			head++;
+			continue;
+		}
+		if (*head)
+			*tail++ = *head++;
+	}
+	*tail = 0;
+}
+
 static void apply_format(struct space *space, char *string, size_t maxsize)
 {
 	char temp[PATH_SIZE];
@@ -1213,30 +1259,7 @@ found:
 		}
 		strlcat(string, temp, maxsize);
 	}
-	/* unescape strings */
-	head = tail = string;
-	while (*head != '\0') {
-		if (*head == '\\') {
-			head++;
-			if (*head == '\0')
-				break;
-			switch (*head) {
-			case 'a': *tail++ = '\a'; break;
-			case 'b': *tail++ = '\b'; break;
-			case 'n': *tail++ = '\n'; break;
-			case 'r': *tail++ = '\r'; break;
-			case 't': *tail++ = '\t'; break;
-			case 'v': *tail++ = '\v'; break;
-			case '\\': *tail++ = '\\'; break;
-			default: *tail++ = *head; break;
-			}
-			head++;
-			continue;
-		}
-		if (*head)
-			*tail++ = *head++;
-	}
-	*tail = 0;
+	unescape_string(string);
 }
 
 static
@@ -1262,7 +1285,60 @@ int run_program1(struct space *space,
 	return EXIT_FAILURE;
 }
 
+/*
+ * The rule files are compiled once per process: the lines are split to
+ * the keys, the key names are resolved to the rule types, the attributes
+ * are extracted and the values without substitutions are unescaped.
+ * A cached file is reused when its stat data are the same, or when its
+ * content hash is the same after a change of the stat data.
+ */
+enum rule_type {
+	RULE_INVALID,		/* the rest of the line can not be parsed */
+	RULE_UNKNOWN,
+	RULE_LABEL,
+	RULE_CTL,
+	RULE_RESULT,
+	RULE_PROGRAM,
+	RULE_CARDINFO,
+	RULE_ATTR,
+	RULE_ENV,
+	RULE_GOTO,
+	RULE_INCLUDE,
+	RULE_ACCESS,
+	RULE_PRINT,
+	RULE_ERROR,
+	RULE_EXIT,
+	RULE_CONFIG
+};
+
+struct rule_key {
+	enum rule_type type;
+	enum key_op op;
+	char *key;
+	char *attr;		/* NULL when the braces are not closed */
+	char *value;
+	char *fixed;		/* unescaped value without substitutions */
+};
+
+struct rule_line {
+	unsigned int linenum;
+	unsigned int count;
+	struct rule_key *keys;
+	char *text;
+};
+
+struct rule_file {
+	struct list_head list;
+	char *filename;
+	unsigned int count;
+	struct rule_line *lines;
+	unsigned int toolong;	/* the line number of a too long line */
+};
+
+static LIST_HEAD(rule_files);
+
 static int parse(struct space *space, const char *filename);
+static struct rule_file *rules_get(const char *filename);
 
 static char *new_root_dir(const char *filename)
 {
@@ -1285,25 +1361,318 @@ static int conf_name_filter(const struct dirent *d)
 	return ext && !strcmp(ext, ".conf");
 }
 
-static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE_UNUSED)
+static const struct rule_name {
+	const char *name;
+	size_t len;		/* compared length, 0 is the whole name */
+	enum rule_type type;
+	int attr;		/* offset of the attribute braces */
+} rule_names[] = {
+	{ "LABEL", 5, RULE_LABEL, 0 },
+	{ "CTL{", 4, RULE_CTL, 3 },
+	{ "RESULT", 0, RULE_RESULT, 0 },
+	{ "PROGRAM", 0, RULE_PROGRAM, 0 },
+	{ "CARDINFO{", 9, RULE_CARDINFO, 8 },
+	{ "ATTR{", 5, RULE_ATTR, 4 },
+	{ "ENV{", 4, RULE_ENV, 3 },
+	{ "GOTO", 0, RULE_GOTO, 0 },
+	{ "INCLUDE", 0, RULE_INCLUDE, 0 },
+	{ "ACCESS", 6, RULE_ACCESS, 0 },
+	{ "PRINT", 5, RULE_PRINT, 0 },
+	{ "ERROR", 5, RULE_ERROR, 0 },
+	{ "EXIT", 4, RULE_EXIT, 0 },
+	{ "CONFIG{", 7, RULE_CONFIG, 6 },
+	{ NULL, 0, 0, 0 }
+};
+
+static int compile_key(struct rule_key *k)
 {
-	char *linepos;
+	const struct rule_name *n;
+	char *attr, *pos;
+
+	k->type = RULE_UNKNOWN;
+	for (n = rule_names; n->name; n++) {
+		if (n->len ? strncasecmp(k->key, n->name, n->len) == 0 :
+			     strcasecmp(k->key, n->name) == 0) {
+			k->type = n->type;
+			break;
+		}
+	}
+	if (n->name && n->attr) {
+		attr = strchr(k->key + n->attr, '{');
+		pos = attr ? strchr(attr, '}') : NULL;
+		if (attr && pos) {
+			k->attr = strndup(attr + 1, pos - attr - 1);
+			if (k->attr == NULL)
+				return -ENOMEM;
+		}
+	}
+	if (strpbrk(k->value, "$%") == NULL) {
+		k->fixed = malloc(PATH_SIZE);
+		if (k->fixed == NULL)
+			return -ENOMEM;
+		strlcpy(k->fixed, k->value, PATH_SIZE);
+		unescape_string(k->fixed);
+	}
+	return 0;
+}
+
+static int compile_line(struct rule_line *rl, const char *line)
+{
+	struct rule_key *keys, *k;
+	char *linepos, *key, *value;
+	enum key_op op;
+	unsigned int alloc = 0;
+	int err;
+
+	rl->text = strdup(line);
+	if (rl->text == NULL)
+		return -ENOMEM;
+	linepos = rl->text;
+	while (*linepos != '\0') {
+		if (rl->count >= alloc) {
+			alloc = alloc ? alloc * 2 : 4;
+			keys = realloc(rl->keys, alloc * sizeof(*keys));
+			if (keys == NULL)
+				return -ENOMEM;
+			rl->keys = keys;
+		}
+		k = &rl->keys[rl->count];
+		memset(k, 0, sizeof(*k));
+		op = KEY_OP_UNSET;
+		if (get_key(&linepos, &key, &op, &value) < 0) {
+			/* the previous keys are still evaluated */
+			k->type = RULE_INVALID;
+			rl->count++;
+			break;
+		}
+		k->key = key;
+		k->op = op;
+		k->value = value;
+		rl->count++;
+		err = compile_key(k);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+static void free_rules(struct rule_file *rf)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < rf->count; i++) {
+		for (j = 0; j < rf->lines[i].count; j++) {
+			free(rf->lines[i].keys[j].attr);
+			free(rf->lines[i].keys[j].fixed);
+		}
+		free(rf->lines[i].keys);
+		free(rf->lines[i].text);
+	}
+	free(rf->lines);
+	free(rf->filename);
+	free(rf);
+}
+
+static int compile_rules(struct rule_file *rf, const char *buf, size_t bufsize)
+{
+	struct rule_line *lines;
+	const char *bufline;
+	char *line;
+	size_t pos, count, linesize;
+	unsigned int linenum, i, j, linenum_adj, alloc = 0;
+	int err = 0;
+
+	pos = 0;
+	linenum = 0;
+	linesize = 128;
+	line = malloc(linesize);
+	if (line == NULL)
+		return -ENOMEM;
+	while (pos < bufsize) {
+		count = line_width(buf, bufsize, pos);
+		bufline = buf + pos;
+		pos += count + 1;
+		linenum++;
+
+		/* skip whitespaces */
+		while (count > 0 && isspace(bufline[0])) {
+			bufline++;
+			count--;
+		}
+		if (count == 0)
+			continue;
+
+		/* comment check */
+		if (bufline[0] == '#')
+			continue;
+
+		if (count > linesize - 1) {
+			free(line);
+			linesize = (count + 127 + 1) & ~127;
+			if (linesize > 2048) {
+				/* reported when the previous lines are evaluated */
+				rf->toolong = linenum;
+				line = NULL;
+				break;
+			}
+			line = malloc(linesize);
+			if (line == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		/* skip backslash and newline from multiline rules */
+		linenum_adj = 0;
+		for (i = j = 0; i < count; i++) {
+			if (bufline[i] == '\\' && bufline[i+1] == '\n') {
+				linenum_adj++;
+				continue;
+			}
+			line[j++] = bufline[i];
+		}
+		line[j] = '\0';
+
+		if (rf->count >= alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			lines = realloc(rf->lines, alloc * sizeof(*lines));
+			if (lines == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			rf->lines = lines;
+		}
+		memset(&rf->lines[rf->count], 0, sizeof(*lines));
+		rf->lines[rf->count].linenum = linenum;
+		err = compile_line(&rf->lines[rf->count++], line);
+		if (err < 0)
+			break;
+		linenum += linenum_adj;
+	}
+	free(line);
+	return err;
+}
+
+/* compile the included files too, so the forked card workers share them */
+static void rules_preload(struct rule_file *rf)
+{
+	struct dirent **list;
+	struct stat st;
+	char string[PATH_SIZE], *rootdir;
+	struct rule_key *k;
+	unsigned int i, j;
+	int idx, num;
+	size_t count;
+
+	rootdir = new_root_dir(rf->filename);
+	if (rootdir == NULL)
+		return;
+	for (i = 0; i < rf->count; i++) {
+		for (j = 0; j < rf->lines[i].count; j++) {
+			k = &rf->lines[i].keys[j];
+			if (k->type != RULE_INCLUDE || k->op != KEY_OP_ASSIGN)
+				continue;
+			if (k->value[0] == '/')
+				strlcpy(string, k->value, sizeof(string));
+			else {
+				strlcpy(string, rootdir, sizeof(string));
+				strlcat(string, "/", sizeof(string));
+				strlcat(string, k->value, sizeof(string));
+			}
+			if (stat(string, &st))
+				continue;
+			if (!S_ISDIR(st.st_mode)) {
+				rules_get(string);
+				continue;
+			}
+			num = scandir(string, &list, conf_name_filter, alphasort);
+			if (num < 0)
+				continue;
+			count = strlen(string);
+			for (idx = 0; idx < num; idx++) {
+				string[count] = '\0';
+				strlcat(string, "/", sizeof(string));
+				strlcat(string, list[idx]->d_name, sizeof(string));
+				free(list[idx]);
+				rules_get(string);
+			}
+			free(list);
+		}
+	}
+	free(rootdir);
+}
+
+/*
+ * The rules are compiled on the first use and kept until the process
+ * exits, the files are not expected to change during one alsactl run.
+ */
+static struct rule_file *rules_get(const char *filename)
+{
+	struct rule_file *rf;
+	struct list_head *pos;
+	char *buf;
+	size_t bufsize;
+	int err;
+
+	list_for_each(pos, &rule_files) {
+		rf = list_entry(pos, struct rule_file, list);
+		if (strcmp(rf->filename, filename) == 0)
+			return rf;
+	}
+	if (file_map(filename, &buf, &bufsize) != 0)
+		return NULL;
+	rf = calloc(1, sizeof(*rf));
+	if (rf == NULL)
+		goto __unmap;
+	rf->filename = strdup(filename);
+	err = rf->filename ? compile_rules(rf, buf, bufsize) : -ENOMEM;
+	if (err < 0) {
+		error("Unable to compile rules '%s': %s", filename, snd_strerror(err));
+		free_rules(rf);
+		rf = NULL;
+		goto __unmap;
+	}
+	dbg("rules '%s' compiled (%u lines)", filename, rf->count);
+	list_add_tail(&rf->list, &rule_files);
+      __unmap:
+	file_unmap(buf, bufsize);
+	if (rf)
+		rules_preload(rf);
+	return rf;
+}
+
+/* the value of the key with the substitutions */
+static void key_format(struct space *space, struct rule_key *k, char *string, size_t size)
+{
+	if (k->fixed) {
+		strlcpy(string, k->fixed, size);
+		return;
+	}
+	strlcpy(string, k->value, size);
+	apply_format(space, string, size);
+}
+
+static int run_line(struct space *space, struct rule_line *rl)
+{
+	struct rule_key *k;
 	char *key, *value, *attr, *temp;
 	struct pair *pair;
 	enum key_op op;
 	int err = 0, count;
+	unsigned int idx;
 	char string[PATH_SIZE];
 	char result[PATH_SIZE];
 
-	linepos = line;
-	while (*linepos != '\0') {
-		op = KEY_OP_UNSET;
-		
-		err = get_key(&linepos, &key, &op, &value);
-		if (err < 0)
+	for (idx = 0; idx < rl->count; idx++) {
+		k = &rl->keys[idx];
+		if (k->type == RULE_INVALID)
 			goto invalid;
+		key = k->key;
+		op = k->op;
+		value = k->value;
+		attr = k->attr;
 
-		if (strncasecmp(key, "LABEL", 5) == 0) {
+		if (k->type == RULE_LABEL) {
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid LABEL operation");
 				goto invalid;
@@ -1320,15 +1689,15 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 			break;		/* not for us */
 		}
 
-		if (strncasecmp(key, "CTL{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		switch (k->type) {
+		case RULE_CTL:
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CTL attribute");
 				goto invalid;
 			}
 			if (op == KEY_OP_ASSIGN) {
-				strlcpy(result, value, sizeof(result));
-				apply_format(space, result, sizeof(result));
+				key_format(space, k, result, sizeof(result));
 				dbg("ctl assign: '%s' '%s'", value, attr);
 				err = elemid_set(space, attr, result);
 				if (space->program_result) {
@@ -1339,54 +1708,49 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 				space->program_result = strdup(string);
 				err = 0;
 				if (space->program_result == NULL)
-					break;
+					return err;
 			} else if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (strncmp(attr, "write", 5) == 0) {
-					strlcpy(result, value, sizeof(result));
-					apply_format(space, result, sizeof(result));
+					key_format(space, k, result, sizeof(result));
 					dbg("ctl write: '%s' '%s'", value, attr);
 					err = elemid_set(space, "values", result);
 					if (err == 0 && op == KEY_OP_NOMATCH)
-						break;
+						return err;
 					if (err != 0 && op == KEY_OP_MATCH)
-						break;
+						return err;
 				} else {
 					temp = (char *)elemid_get(space, attr);
 					dbg("ctl match: '%s' '%s' '%s'", attr, value, temp);
 					if (!do_match(key, op, value, temp))
-						break;
+						return err;
 				}
 			} else {
 				Perror(space, "invalid CTL{} operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strcasecmp(key, "RESULT") == 0) {
+		case RULE_RESULT:
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (!do_match(key, op, value, space->program_result))
-					break;
+					return err;
 			} else if (op == KEY_OP_ASSIGN) {
 				if (space->program_result) {
 					free(space->program_result);
 					space->program_result = NULL;
 				}
-				strlcpy(string, value, sizeof(string));
-				apply_format(space, string, sizeof(string));
+				key_format(space, k, string, sizeof(string));
 				space->program_result = strdup(string);
 				if (space->program_result == NULL)
-					break;
- 			} else {
+					return err;
+			} else {
 				Perror(space, "invalid RESULT operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strcasecmp(key, "PROGRAM") == 0) {
+		case RULE_PROGRAM:
 			if (op == KEY_OP_UNSET)
 				continue;
-			strlcpy(string, value, sizeof(string));
-			apply_format(space, string, sizeof(string));
+			key_format(space, k, string, sizeof(string));
 			if (space->program_result) {
 				free(space->program_result);
 				space->program_result = NULL;
@@ -1394,7 +1758,7 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 			if (run_program(space, string, result, sizeof(result), NULL, space->log_run) != 0) {
 				dbg("PROGRAM '%s' is false", string);
 				if (op != KEY_OP_NOMATCH)
-					break;
+					return err;
 			} else {
 				remove_trailing_chars(result, '\n');
 				count = replace_untrusted_chars(result);
@@ -1403,17 +1767,16 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 				dbg("PROGRAM '%s' result is '%s'", string, result);
 				space->program_result = strdup(result);
 				if (space->program_result == NULL)
-					break;
+					return err;
 				dbg("PROGRAM returned successful");
 				if (op == KEY_OP_NOMATCH)
-					break;
+					return err;
 			}
 			dbg("PROGRAM key is true");
 			continue;
-		}
-		if (strncasecmp(key, "CARDINFO{", 9) == 0) {
-			attr = get_key_attribute(space, key + 8, string, sizeof(string));
+		case RULE_CARDINFO:
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CARDINFO attribute");
 				goto invalid;
 			}
@@ -1421,36 +1784,34 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 				dbg("cardinfo: '%s' '%s'", value, attr);
 				temp = (char *)cardinfo_get(space, attr);
 				if (!do_match(key, op, value, temp))
-					break;
+					return err;
 			} else {
 				Perror(space, "invalid CARDINFO{} operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strncasecmp(key, "ATTR{", 5) == 0) {
-			attr = get_key_attribute(space, key + 4, string, sizeof(string));
+		case RULE_ATTR:
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing ATTR attribute");
 				goto invalid;
 			}
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				pair = value_find(space, "sysfs_device");
 				if (pair == NULL)
-					break;
+					return err;
 				dbg("sysfs_attr: '%s' '%s'", pair->value, attr);
 				temp = sysfs_attr_get_value(pair->value, attr);
 				if (!do_match(key, op, value, temp))
-					break;
+					return err;
 			} else {
 				Perror(space, "invalid ATTR{} operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strncasecmp(key, "ENV{", 4) == 0) {
-			attr = get_key_attribute(space, key + 3, string, sizeof(string));
+		case RULE_ENV:
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing ENV attribute");
 				goto invalid;
 			}
@@ -1458,33 +1819,28 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 				temp = getenv(attr);
 				dbg("env: '%s' '%s'", attr, temp);
 				if (!do_match(key, op, value, temp))
-					break;
+					return err;
 			} else if (op == KEY_OP_ASSIGN ||
 				   op == KEY_OP_ASSIGN_FINAL) {
-				strlcpy(result, value, sizeof(result));
-				apply_format(space, result, sizeof(result));
+				key_format(space, k, result, sizeof(result));
 				dbg("env set: '%s' '%s'", attr, result);
 				if (setenv(attr, result, op == KEY_OP_ASSIGN_FINAL))
-					break;
+					return err;
 			} else {
 				Perror(space, "invalid ENV{} operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strcasecmp(key, "GOTO") == 0) {
+		case RULE_GOTO:
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid GOTO operation");
 				goto invalid;
 			}
 			space->go_to = strdup(value);
-			if (space->go_to == NULL) {
-				err = -ENOMEM;
-				break;
-			}
+			if (space->go_to == NULL)
+				return -ENOMEM;
 			continue;
-		}
-		if (strcasecmp(key, "INCLUDE") == 0) {
+		case RULE_INCLUDE: {
 			char *rootdir, *go_to;
 			const char *filename;
 			struct stat st;
@@ -1556,16 +1912,15 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 			space->filename = filename;
 			space->linenum = linenum;
 			if (space->quit)
-				break;
+				return err;
 			if (err)
-				break;
+				return err;
 			continue;
 		}
-		if (strncasecmp(key, "ACCESS", 6) == 0) {
+		case RULE_ACCESS:
 			if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				if (value[0] == '$') {
-					strlcpy(string, value, sizeof(string));
-					apply_format(space, string, sizeof(string));
+					key_format(space, k, string, sizeof(string));
 					if (string[0] == '/')
 						goto __access1;
 				}
@@ -1581,70 +1936,65 @@ static int parse_line(struct space *space, char *line, size_t linesize ATTRIBUTE
 				count = access(string, F_OK);
 				dbg("access(%s) = %i (%s)", string, count, value);
 				if (op == KEY_OP_MATCH && count != 0)
-					break;
+					return err;
 				if (op == KEY_OP_NOMATCH && count == 0)
-					break;
+					return err;
 			} else {
 				Perror(space, "invalid ACCESS operation");
 				goto invalid;
 			}
 			continue;
-		}
-		if (strncasecmp(key, "PRINT", 5) == 0) {
+		case RULE_PRINT:
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid PRINT operation");
 				goto invalid;
 			}
-			strlcpy(string, value, sizeof(string));
-			apply_format(space, string, sizeof(string));
+			key_format(space, k, string, sizeof(string));
 			fwrite(string, strlen(string), 1, stdout);
 			continue;
-		}
-		if (strncasecmp(key, "ERROR", 5) == 0) {
+		case RULE_ERROR:
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid ERROR operation");
 				goto invalid;
 			}
-			strlcpy(string, value, sizeof(string));
-			apply_format(space, string, sizeof(string));
+			key_format(space, k, string, sizeof(string));
 			fwrite(string, strlen(string), 1, stderr);
 			continue;
-		}
-		if (strncasecmp(key, "EXIT", 4) == 0) {
+		case RULE_EXIT:
 			if (op != KEY_OP_ASSIGN) {
 				Perror(space, "invalid EXIT operation");
 				goto invalid;
 			}
-			strlcpy(string, value, sizeof(string));
-			apply_format(space, string, sizeof(string));
+			key_format(space, k, string, sizeof(string));
 			if (strcmp(string, "return") == 0)
 				return -EJUSTRETURN;
 			space->exit_code = strtol(string, NULL, 0);
 			space->quit = 1;
-			break;
-		}
-		if (strncasecmp(key, "CONFIG{", 7) == 0) {
-			attr = get_key_attribute(space, key + 6, string, sizeof(string));
+			return err;
+		case RULE_CONFIG:
 			if (attr == NULL) {
+				Perror(space, "missing closing brace for format");
 				Perror(space, "error parsing CONFIG attribute");
 				goto invalid;
 			}
-			strlcpy(result, value, sizeof(result));
-			apply_format(space, result, sizeof(result));
+			key_format(space, k, result, sizeof(result));
 			if (op == KEY_OP_ASSIGN) {
 				err = value_set(space, attr, result);
 				dbg("CONFIG{%s}='%s'", attr, result);
-				break;
+				return err;
 			} else if (op == KEY_OP_MATCH || op == KEY_OP_NOMATCH) {
 				pair = value_find(space, attr);
 				if (pair == NULL)
-					break;
+					return err;
 				if (!do_match(key, op, result, pair->value))
-					break;
+					return err;
 			} else {
 				Perror(space, "invalid CONFIG{} operation");
 				goto invalid;
 			}
+			break;
+		default:
+			break;
 		}
 
 		Perror(space, "unknown key '%s'", key);
@@ -1658,129 +2008,103 @@ invalid:
 
 static int parse(struct space *space, const char *filename)
 {
-	char *buf, *bufline, *line;
-	size_t bufsize, pos, count, linesize;
-	unsigned int linenum, i, j, linenum_adj;
+	struct rule_file *rf;
+	unsigned int idx;
 	int err;
 
 	dbg("start of file '%s'", filename);
 
-	if (file_map(filename, &buf, &bufsize) != 0) {
+	rf = rules_get(filename);
+	if (rf == NULL) {
 		err = errno;
 		error("Unable to open file '%s': %s", filename, strerror(err));
 		return -err;
 	}
 
-	err = 0;	
-	pos = 0;
-	linenum = 0;
-	linesize = 128;
-	line = malloc(linesize);
-	if (line == NULL) {
-		file_unmap(buf, bufsize);
-		return -ENOMEM;
-	}
+	err = 0;
 	space->filename = filename;
-	while (!err && pos < bufsize && !space->quit) {
-		count = line_width(buf, bufsize, pos);
-		bufline = buf + pos;
-		pos += count + 1;
-		linenum++;
-		
-		/* skip whitespaces */
-		while (count > 0 && isspace(bufline[0])) {
-			bufline++;
-			count--;
-		}
-		if (count == 0)
-			continue;
-			
-		/* comment check */
-		if (bufline[0] == '#')
-			continue;
-		
-		if (count > linesize - 1) {
-			free(line);
-			line = NULL;
-			linesize = (count + 127 + 1) & ~127;
-			if (linesize > 2048) {
-				error("file %s, line %i too long", filename, linenum);
-				err = -EINVAL;
-				break;
-			}
-			line = malloc(linesize);
-			if (line == NULL) {
-				err = -EINVAL;
-				break;
-			}
-		}
-		
-		/* skip backslash and newline from multiline rules */
-		linenum_adj = 0;
-		for (i = j = 0; i < count; i++) {
-			if (bufline[i] == '\\' && bufline[i+1] == '\n') {
-				linenum_adj++;
-				continue;
-			}
-			line[j++] = bufline[i];
-		}
-		line[j] = '\0';
-
-		dbg("read (%i) '%s'", linenum, line);
-		space->linenum = linenum;
-		err = parse_line(space, line, linesize);
+	for (idx = 0; !err && idx < rf->count && !space->quit; idx++) {
+		dbg("read (%i) '%s'", rf->lines[idx].linenum, rf->lines[idx].text);
+		space->linenum = rf->lines[idx].linenum;
+		err = run_line(space, &rf->lines[idx]);
 		if (err == -EJUSTRETURN) {
 			err = 0;
-			break;
+			goto __end;
 		}
-		linenum += linenum_adj;
+	}
+	if (!err && !space->quit && rf->toolong) {
+		error("file %s, line %i too long", filename, rf->toolong);
+		err = -EINVAL;
 	}
 
-	free(line);
+      __end:
 	space->filename = NULL;
 	space->linenum = -1;
-	file_unmap(buf, bufsize);
 	dbg("end of file '%s'", filename);
 	return err ? err : -abs(space->exit_code);
 }
 
-int init(const char *cfgdir, const char *filename, int flags, const char *cardname)
+struct init_ctx {
+	const char *cfgdir;
+	const char *filename;
+	const char *cardname;
+	int flags;
+};
+
+static int init_card(void *arg, int cardno, const char *name, struct card_job *job)
 {
+	struct init_ctx *ctx = arg;
 	struct space *space;
+	struct profile_span span;
+	int err;
+
+	err = snd_card_clean_cfgdir(ctx->cfgdir, cardno);
+	if (err < 0)
+		return err;
+	err = init_ucm(ctx->cfgdir, ctx->flags, cardno);
+	if (err == 0 || card_state_is_okay(err))
+		return 0;
+	profile_begin(&span, PROFILE_INIT, cardno);
+	err = init_space(&space, cardno);
+	if (err != 0) {
+		profile_end(&span);
+		return 0;
+	}
+	space->rootdir = new_root_dir(ctx->filename);
+	if (space->rootdir != NULL) {
+		err = parse(space, ctx->filename);
+		/* -99 and below are non-fatal errors for all cards */
+		if (err < 0 && (ctx->cardname || err > -99))
+			job->stop = 1;
+	}
+	free_space(space);
+	profile_end(&span);
+	return err;
+}
+
+int init(const char *cfgdir, const char *filename, int flags, const char *cardname)
+{
 	struct snd_card_iterator iter;
-	int err = 0, lasterr = 0;
-	
+	struct init_ctx ctx = {
+		.cfgdir = cfgdir,
+		.filename = filename,
+		.cardname = cardname,
+		.flags = flags,
+	};
+	struct profile_span span;
+	int err;
+
 	sysfs_init();
 	err = snd_card_iterator_sinit(&iter, cardname);
 	if (err < 0)
 		goto out;
-	while (snd_card_iterator_next(&iter)) {
-		err = snd_card_clean_cfgdir(cfgdir, iter.card);
-		if (err < 0) {
-			if (lasterr == 0)
-				lasterr = err;
-			continue;
-		}
-		err = init_ucm(cfgdir, flags, iter.card);
-		if (err == 0 || card_state_is_okay(err))
-			continue;
-		err = init_space(&space, iter.card);
-		if (err != 0)
-			continue;
-		space->rootdir = new_root_dir(filename);
-		if (space->rootdir != NULL) {
-			err = parse(space, filename);
-			if (!cardname && err <= -99) { /* non-fatal errors */
-				if (lasterr == 0)
-					lasterr = err;
-				err = 0;
-			}
-		}
-		free_space(space);
-		if (err < 0)
-			goto out;
-	}
-	err = lasterr ? lasterr : snd_card_iterator_error(&iter);
+	/* compile the rules before the card workers are forked */
+	profile_begin(&span, PROFILE_INIT, -1);
+	rules_get(filename);
+	profile_end(&span);
+	err = card_pool_run(&iter, init_card, &ctx);
+	if (err == 0)
+		err = snd_card_iterator_error(&iter);
 out:
 	sysfs_cleanup();
 	return err;
@@ -176,7 +176,7 @@ static int execute_boot_sequences(const char *cfgdir, snd_use_case_mgr_t *uc_mgr
  * Handle also card groups.
  * Returns: 0 = success, 1 = skip this card (e.g. linked or in-sync), negative on error
  */
-int init_ucm(const char *cfgdir, int flags, int cardno)
+static int init_ucm_(const char *cfgdir, int flags, int cardno)
 {
 	snd_use_case_mgr_t *uc_mgr;
 	char id[64];
@@ -311,6 +311,19 @@ _fin:
 	return err;
 }
 
+int init_ucm(const char *cfgdir, int flags, int cardno)
+{
+	struct profile_span span;
+	int err;
+
+	if (flags & FLAG_UCM_DISABLED)
+		return -ENXIO;
+	profile_begin(&span, PROFILE_UCM, cardno);
+	err = init_ucm_(cfgdir, flags, cardno);
+	profile_end(&span);
+	return err;
+}
+
 #else
 
 int init_ucm(const char *cfgdir, int flags, int cardno)
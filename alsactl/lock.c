@@ -159,11 +159,14 @@ static void state_lock_file(char *buf, size_t buflen)
 
 int state_lock(const char *file, int timeout)
 {
+	struct profile_span span;
 	char fn[PATH_SIZE];
 	int err;
 
 	state_lock_file(fn, sizeof(fn));
+	profile_begin(&span, PROFILE_LOCK, -1);
 	err = state_lock_(fn, 1, timeout, -1);
+	profile_end(&span);
 	if (err < 0)
 		error("file %s lock error: %s", file, strerror(-err));
 	return err;
@@ -193,11 +196,14 @@ static void group_state_lock_file(char *buf, size_t buflen)
 
 int group_state_lock(const char *file, int timeout)
 {
+	struct profile_span span;
 	char fn[PATH_SIZE];
 	int err;
 
 	group_state_lock_file(fn, sizeof(fn));
+	profile_begin(&span, PROFILE_LOCK, -1);
 	err = state_lock_(fn, 1, timeout, -1);
+	profile_end(&span);
 	if (err < 0)
 		error("file %s lock error: %s", file, strerror(-err));
 	return err;
@@ -222,11 +228,14 @@ static void card_lock_file(char *buf, size_t buflen, int card_number)
 
 int card_lock(int card_number, int timeout)
 {
+	struct profile_span span;
 	char fn[PATH_SIZE];
 	int err;
 
 	card_lock_file(fn, sizeof(fn), card_number);
+	profile_begin(&span, PROFILE_LOCK, card_number);
 	err = state_lock_(fn, 1, timeout, -1);
+	profile_end(&span);
 	if (err < 0)
 		error("card %d lock error: %s", card_number, strerror(-err));
 	return err;
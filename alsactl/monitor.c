@@ -27,25 +27,154 @@
 #include <limits.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <stddef.h>
 #include "list.h"
 
 #include "alsactl.h"
 
+/*
+ * In the coalescing mode (window > 0) the events are collected per element
+ * and each window emits one record for each changed element, with the
+ * event count, the merged event mask and the value read at the end of the
+ * window, followed by the event counts of the cards.
+ */
+struct elem_stat {
+	unsigned int numid;
+	unsigned int iface;
+	unsigned int device;
+	unsigned int subdevice;
+	unsigned int index;
+	char name[44];
+	unsigned int mask;		/* merged event mask */
+	unsigned int count;		/* events in the window */
+	bool dirty;
+	bool info_valid;
+	snd_ctl_elem_type_t type;
+	unsigned int values;
+};
+
 struct src_entry {
 	snd_ctl_t *handle;
 	char *name;
 	unsigned int pfd_count;
+	unsigned int source;
+	struct elem_stat **elems;	/* indexed by numid */
+	unsigned int elems_size;
+	unsigned int *dirty;		/* numids in the order of the first event */
+	unsigned int dirty_count;
+	unsigned int dirty_alloc;
+	unsigned long long events;	/* events in the window */
+	unsigned long long total;
 	struct list_head list;
 };
 
+static int monitor_window;		/* ms, zero prints each event */
+static int monitor_format;
+static unsigned int monitor_sources;
+
+/*
+ * The binary records have a 16 byte header with the record type, the
+ * record size (including the header, padded to 8 bytes), the source
+ * number and the monotonic time in microseconds, all in the host byte
+ * order.
+ */
+#define RECORD_SOURCE	1	/* name of the source, NUL terminated */
+#define RECORD_ELEM	2	/* struct elem_record, value data */
+#define RECORD_RATE	3	/* struct rate_record */
+
+struct record_header {
+	uint16_t type;
+	uint16_t size;
+	uint32_t source;
+	uint64_t time;
+};
+
+struct elem_record {
+	uint32_t numid;
+	uint32_t iface;
+	uint32_t device;
+	uint32_t subdevice;
+	uint32_t index;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t type;		/* SND_CTL_ELEM_TYPE_NONE without the value */
+	uint32_t values;	/* int64_t items or bytes */
+	char name[44];
+};
+
+struct rate_record {
+	uint32_t window;	/* ms */
+	uint32_t events;
+	uint64_t total;
+};
+
+static const struct {
+	unsigned int mask;
+	const char *name;
+} event_masks[] = {
+	{ SND_CTL_EVENT_MASK_VALUE, "VALUE" },
+	{ SND_CTL_EVENT_MASK_INFO, "INFO" },
+	{ SND_CTL_EVENT_MASK_ADD, "ADD" },
+	{ SND_CTL_EVENT_MASK_TLV, "TLV" },
+};
+
+static uint64_t monitor_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void write_record(unsigned int type, unsigned int source,
+			 const void *data, size_t size,
+			 const void *extra, size_t extra_size)
+{
+	static const char pad[8];
+	struct record_header hdr;
+	size_t len = sizeof(hdr) + size + extra_size;
+
+	hdr.type = type;
+	hdr.size = (len + 7) & ~7;
+	hdr.source = source;
+	hdr.time = monitor_time();
+	fwrite(&hdr, sizeof(hdr), 1, stdout);
+	fwrite(data, size, 1, stdout);
+	if (extra_size > 0)
+		fwrite(extra, extra_size, 1, stdout);
+	if (hdr.size > len)
+		fwrite(pad, hdr.size - len, 1, stdout);
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
 static void remove_source_entry(struct src_entry *entry)
 {
+	unsigned int idx;
+
 	list_del(&entry->list);
 	if (entry->handle)
 		snd_ctl_close(entry->handle);
+	for (idx = 0; idx < entry->elems_size; idx++)
+		free(entry->elems[idx]);
+	free(entry->elems);
+	free(entry->dirty);
 	free(entry->name);
 	free(entry);
 }
@@ -87,8 +216,12 @@ static int insert_source_entry(struct list_head *srcs, snd_ctl_t *handle,
 		goto error;
 	}
 	entry->pfd_count = count;
+	entry->source = monitor_sources++;
 
 	list_add_tail(&entry->list, srcs);
+	if (monitor_format == MONITOR_BINARY)
+		write_record(RECORD_SOURCE, entry->source, name,
+			     strlen(name) + 1, NULL, 0);
 
 	return 0;
 error:
@@ -112,6 +245,8 @@ static int open_ctl(const char *name, snd_ctl_t **ctlp)
 		snd_ctl_close(ctl);
 		return err;
 	}
+	/* the pending events are read in one batch */
+	snd_ctl_nonblock(ctl, 1);
 	*ctlp = ctl;
 	return 0;
 }
@@ -197,46 +332,360 @@ static int check_control_cdev(int infd, bool *retry)
 	return err;
 }
 
-static int print_event(snd_ctl_t *ctl, const char *name)
+static void elem_from_event(struct elem_stat *stat, snd_ctl_event_t *event)
 {
-	snd_ctl_event_t *event;
-	unsigned int mask;
-	int err;
+	stat->numid = snd_ctl_event_elem_get_numid(event);
+	stat->iface = snd_ctl_event_elem_get_interface(event);
+	stat->device = snd_ctl_event_elem_get_device(event);
+	stat->subdevice = snd_ctl_event_elem_get_subdevice(event);
+	stat->index = snd_ctl_event_elem_get_index(event);
+	snprintf(stat->name, sizeof(stat->name), "%s",
+		 snd_ctl_event_elem_get_name(event));
+}
 
-	snd_ctl_event_alloca(&event);
-	err = snd_ctl_read(ctl, event);
-	if (err < 0)
-		return err;
+static bool elem_has_value(struct elem_stat *stat, snd_ctl_elem_value_t *value)
+{
+	return value && stat->mask != SND_CTL_EVENT_MASK_REMOVE &&
+	       (stat->mask & SND_CTL_EVENT_MASK_VALUE) && stat->info_valid &&
+	       stat->values > 0;
+}
 
-	if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+static long long elem_value_item(struct elem_stat *stat,
+				 snd_ctl_elem_value_t *value, unsigned int idx)
+{
+	switch (stat->type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		return snd_ctl_elem_value_get_boolean(value, idx);
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		return snd_ctl_elem_value_get_integer(value, idx);
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return snd_ctl_elem_value_get_integer64(value, idx);
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return snd_ctl_elem_value_get_enumerated(value, idx);
+	default:
 		return 0;
+	}
+}
+
+static void print_elem_text(struct src_entry *entry, struct elem_stat *stat,
+			    snd_ctl_elem_value_t *value)
+{
+	const unsigned char *bytes;
+	unsigned int idx;
 
 	printf("node %s, #%d (%i,%i,%i,%s,%i)",
-	       name,
-	       snd_ctl_event_elem_get_numid(event),
-	       snd_ctl_event_elem_get_interface(event),
-	       snd_ctl_event_elem_get_device(event),
-	       snd_ctl_event_elem_get_subdevice(event),
-	       snd_ctl_event_elem_get_name(event),
-	       snd_ctl_event_elem_get_index(event));
+	       entry->name, stat->numid, stat->iface, stat->device,
+	       stat->subdevice, stat->name, stat->index);
+
+	if (stat->mask == SND_CTL_EVENT_MASK_REMOVE) {
+		printf(" REMOVE");
+	} else {
+		for (idx = 0; idx < ARRAY_SIZE(event_masks); idx++) {
+			if (stat->mask & event_masks[idx].mask)
+				printf(" %s", event_masks[idx].name);
+		}
+	}
+	if (monitor_window > 0)
+		printf(" x%u", stat->count);
+	if (elem_has_value(stat, value)) {
+		if (stat->type == SND_CTL_ELEM_TYPE_BYTES) {
+			bytes = snd_ctl_elem_value_get_bytes(value);
+			printf(" = ");
+			for (idx = 0; idx < stat->values; idx++)
+				printf("%02x", bytes[idx]);
+		} else {
+			for (idx = 0; idx < stat->values; idx++)
+				printf("%s%lld", idx ? "," : " = ",
+				       elem_value_item(stat, value, idx));
+		}
+	}
+	putchar('\n');
+}
+
+static void print_elem_json(struct src_entry *entry, struct elem_stat *stat,
+			    snd_ctl_elem_value_t *value)
+{
+	const unsigned char *bytes;
+	unsigned int idx, first = 1;
+
+	printf("{\"source\":");
+	print_json_string(entry->name);
+	printf(",\"time\":%llu,\"numid\":%u,\"iface\":\"%s\",\"device\":%u,"
+	       "\"subdevice\":%u,\"name\":",
+	       (unsigned long long)monitor_time(), stat->numid,
+	       snd_ctl_elem_iface_name(stat->iface), stat->device,
+	       stat->subdevice);
+	print_json_string(stat->name);
+	printf(",\"index\":%u,\"events\":[", stat->index);
+	if (stat->mask == SND_CTL_EVENT_MASK_REMOVE) {
+		printf("\"REMOVE\"");
+	} else {
+		for (idx = 0; idx < ARRAY_SIZE(event_masks); idx++) {
+			if (!(stat->mask & event_masks[idx].mask))
+				continue;
+			printf("%s\"%s\"", first ? "" : ",", event_masks[idx].name);
+			first = 0;
+		}
+	}
+	printf("],\"count\":%u", stat->count);
+	if (elem_has_value(stat, value)) {
+		if (stat->type == SND_CTL_ELEM_TYPE_BYTES) {
+			bytes = snd_ctl_elem_value_get_bytes(value);
+			printf(",\"bytes\":\"");
+			for (idx = 0; idx < stat->values; idx++)
+				printf("%02x", bytes[idx]);
+			putchar('"');
+		} else {
+			printf(",\"values\":[");
+			for (idx = 0; idx < stat->values; idx++)
+				printf("%s%lld", idx ? "," : "",
+				       elem_value_item(stat, value, idx));
+			putchar(']');
+		}
+	}
+	printf("}\n");
+}
+
+static void write_elem_record(struct src_entry *entry, struct elem_stat *stat,
+			      snd_ctl_elem_value_t *value)
+{
+	struct elem_record rec;
+	int64_t items[128];
+	const void *data = NULL;
+	size_t size = 0;
+	unsigned int idx;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.numid = stat->numid;
+	rec.iface = stat->iface;
+	rec.device = stat->device;
+	rec.subdevice = stat->subdevice;
+	rec.index = stat->index;
+	rec.mask = stat->mask;
+	rec.count = stat->count;
+	rec.type = SND_CTL_ELEM_TYPE_NONE;
+	memcpy(rec.name, stat->name, sizeof(rec.name));
+	if (elem_has_value(stat, value)) {
+		rec.type = stat->type;
+		rec.values = stat->values;
+		if (stat->type == SND_CTL_ELEM_TYPE_BYTES) {
+			data = snd_ctl_elem_value_get_bytes(value);
+			size = stat->values;
+		} else {
+			if (rec.values > ARRAY_SIZE(items))
+				rec.values = ARRAY_SIZE(items);
+			for (idx = 0; idx < rec.values; idx++)
+				items[idx] = elem_value_item(stat, value, idx);
+			data = items;
+			size = rec.values * sizeof(items[0]);
+		}
+	}
+	write_record(RECORD_ELEM, entry->source, &rec, sizeof(rec), data, size);
+}
+
+static void emit_elem(struct src_entry *entry, struct elem_stat *stat,
+		      snd_ctl_elem_value_t *value)
+{
+	switch (monitor_format) {
+	case MONITOR_JSON:
+		print_elem_json(entry, stat, value);
+		break;
+	case MONITOR_BINARY:
+		write_elem_record(entry, stat, value);
+		break;
+	default:
+		print_elem_text(entry, stat, value);
+		break;
+	}
+}
+
+static void emit_rate(struct src_entry *entry)
+{
+	struct rate_record rec;
+	unsigned long long rate = entry->events * 1000 / monitor_window;
+
+	switch (monitor_format) {
+	case MONITOR_JSON:
+		printf("{\"source\":");
+		print_json_string(entry->name);
+		printf(",\"time\":%llu,\"window\":%d,\"events\":%llu,"
+		       "\"rate\":%llu,\"total\":%llu}\n",
+		       (unsigned long long)monitor_time(), monitor_window,
+		       entry->events, rate, entry->total);
+		break;
+	case MONITOR_BINARY:
+		rec.window = monitor_window;
+		rec.events = entry->events;
+		rec.total = entry->total;
+		write_record(RECORD_RATE, entry->source, &rec, sizeof(rec), NULL, 0);
+		break;
+	default:
+		printf("card %s: %llu events in %d ms (%llu/s), %llu total\n",
+		       entry->name, entry->events, monitor_window, rate,
+		       entry->total);
+		break;
+	}
+}
+
+static struct elem_stat *get_elem_stat(struct src_entry *entry, unsigned int numid)
+{
+	struct elem_stat **elems;
+	unsigned int size;
+
+	if (numid >= entry->elems_size) {
+		for (size = entry->elems_size ? entry->elems_size : 64;
+		     size <= numid; size *= 2)
+			;
+		elems = realloc(entry->elems, size * sizeof(*elems));
+		if (elems == NULL)
+			return NULL;
+		memset(elems + entry->elems_size, 0,
+		       (size - entry->elems_size) * sizeof(*elems));
+		entry->elems = elems;
+		entry->elems_size = size;
+	}
+	if (entry->elems[numid] == NULL)
+		entry->elems[numid] = calloc(1, sizeof(struct elem_stat));
+	return entry->elems[numid];
+}
+
+static int collect_event(struct src_entry *entry, snd_ctl_event_t *event)
+{
+	struct elem_stat *stat;
+	unsigned int *dirty, mask;
 
+	stat = get_elem_stat(entry, snd_ctl_event_elem_get_numid(event));
+	if (stat == NULL)
+		return -ENOMEM;
+	if (!stat->dirty) {
+		if (entry->dirty_count >= entry->dirty_alloc) {
+			entry->dirty_alloc = entry->dirty_alloc ? entry->dirty_alloc * 2 : 64;
+			dirty = realloc(entry->dirty, entry->dirty_alloc * sizeof(*dirty));
+			if (dirty == NULL)
+				return -ENOMEM;
+			entry->dirty = dirty;
+		}
+		entry->dirty[entry->dirty_count++] = snd_ctl_event_elem_get_numid(event);
+		elem_from_event(stat, event);
+		stat->dirty = true;
+		stat->mask = 0;
+		stat->count = 0;
+	}
 	mask = snd_ctl_event_elem_get_mask(event);
 	if (mask == SND_CTL_EVENT_MASK_REMOVE) {
-		printf(" REMOVE\n");
-		return 0;
+		stat->mask = mask;
+	} else {
+		/* an element added again after the removal */
+		if (stat->mask == SND_CTL_EVENT_MASK_REMOVE)
+			stat->mask = 0;
+		stat->mask |= mask;
+		if (mask & (SND_CTL_EVENT_MASK_INFO | SND_CTL_EVENT_MASK_ADD))
+			stat->info_valid = false;
+	}
+	stat->count++;
+	return 0;
+}
+
+static void read_elem_value(struct src_entry *entry, struct elem_stat *stat,
+			    snd_ctl_elem_value_t *value)
+{
+	snd_ctl_elem_info_t *info;
+
+	snd_ctl_elem_info_alloca(&info);
+	if (!stat->info_valid) {
+		snd_ctl_elem_info_set_numid(info, stat->numid);
+		if (snd_ctl_elem_info(entry->handle, info) < 0)
+			return;
+		stat->type = snd_ctl_elem_info_get_type(info);
+		stat->values = snd_ctl_elem_info_get_count(info);
+		switch (stat->type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+		case SND_CTL_ELEM_TYPE_INTEGER:
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+		case SND_CTL_ELEM_TYPE_BYTES:
+			break;
+		default:
+			/* IEC958 values are not shown */
+			stat->values = 0;
+			break;
+		}
+		stat->info_valid = true;
 	}
+	if (stat->values == 0)
+		return;
+	snd_ctl_elem_value_set_numid(value, stat->numid);
+	if (snd_ctl_elem_read(entry->handle, value) < 0)
+		stat->info_valid = false;
+}
+
+/* emit the elements changed in the window and the event rates */
+static void flush_source(struct src_entry *entry)
+{
+	snd_ctl_elem_value_t *value;
+	struct elem_stat *stat;
+	unsigned int idx;
+	snd_ctl_elem_value_alloca(&value);
+
+	for (idx = 0; idx < entry->dirty_count; idx++) {
+		stat = entry->elems[entry->dirty[idx]];
+		if (stat->mask != SND_CTL_EVENT_MASK_REMOVE &&
+		    (stat->mask & SND_CTL_EVENT_MASK_VALUE))
+			read_elem_value(entry, stat, value);
+		emit_elem(entry, stat, value);
+		stat->dirty = false;
+		if (stat->mask == SND_CTL_EVENT_MASK_REMOVE) {
+			entry->elems[stat->numid] = NULL;
+			free(stat);
+		}
+	}
+	entry->dirty_count = 0;
+	if (entry->events > 0)
+		emit_rate(entry);
+	entry->events = 0;
+}
+
+static void flush_sources(struct list_head *srcs)
+{
+	struct src_entry *entry;
 
-	if (mask & SND_CTL_EVENT_MASK_VALUE)
-		printf(" VALUE");
-	if (mask & SND_CTL_EVENT_MASK_INFO)
-		printf(" INFO");
-	if (mask & SND_CTL_EVENT_MASK_ADD)
-		printf(" ADD");
-	if (mask & SND_CTL_EVENT_MASK_TLV)
-		printf(" TLV");
-	printf("\n");
+	list_for_each_entry(entry, srcs, list)
+		flush_source(entry);
 	fflush(stdout);
-	return 0;
+}
+
+static int print_event(struct src_entry *entry)
+{
+	snd_ctl_event_t *event;
+	struct elem_stat stat;
+	int err;
+
+	snd_ctl_event_alloca(&event);
+	while (1) {
+		err = snd_ctl_read(entry->handle, event);
+		if (err <= 0)
+			break;
+
+		if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+			continue;
+
+		entry->events++;
+		entry->total++;
+		if (monitor_window > 0) {
+			err = collect_event(entry, event);
+			if (err < 0)
+				break;
+			continue;
+		}
+		memset(&stat, 0, sizeof(stat));
+		elem_from_event(&stat, event);
+		stat.mask = snd_ctl_event_elem_get_mask(event);
+		stat.count = 1;
+		emit_elem(entry, &stat, NULL);
+	}
+	if (monitor_window == 0)
+		fflush(stdout);
+	return err == -EAGAIN ? 0 : err;
 }
 
 static int operate_dispatcher(int epfd, uint32_t op, struct epoll_event *epev,
@@ -271,13 +720,20 @@ end:
 	return err;
 }
 
-static int prepare_dispatcher(int epfd, int sigfd, int infd,
+static int prepare_dispatcher(int epfd, int sigfd, int infd, int tfd,
 			      struct list_head *srcs)
 {
 	struct epoll_event ev = {0};
 	struct src_entry *entry;
 	int err = 0;
 
+	if (tfd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.fd = tfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+			return -errno;
+	}
+
 	ev.events = EPOLLIN;
 	ev.data.fd = sigfd;
 	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
@@ -299,8 +755,8 @@ static int prepare_dispatcher(int epfd, int sigfd, int infd,
 	return err;
 }
 
-static int run_dispatcher(int epfd, int sigfd, int infd, struct list_head *srcs,
-			  bool *retry)
+static int run_dispatcher(int epfd, int sigfd, int infd, int tfd,
+			  struct list_head *srcs, bool *retry)
 {
 	struct src_entry *entry;
 	unsigned int max_ev_count;
@@ -342,9 +798,17 @@ static int run_dispatcher(int epfd, int sigfd, int infd, struct list_head *srcs,
 				continue;
 			}
 
+			if (tfd >= 0 && ev->data.fd == tfd) {
+				uint64_t expirations;
+
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					flush_sources(srcs);
+				continue;
+			}
+
 			entry = ev->data.ptr;
 			if (ev->events & EPOLLIN)
-				print_event(entry->handle, entry->name);
+				print_event(entry);
 			if (ev->events & EPOLLERR) {
 				operate_dispatcher(epfd, EPOLL_CTL_DEL, NULL, entry);
 				remove_source_entry(entry);
@@ -356,7 +820,7 @@ end:
 	return err;
 }
 
-static void clear_dispatcher(int epfd, int sigfd, int infd,
+static void clear_dispatcher(int epfd, int sigfd, int infd, int tfd,
 			     struct list_head *srcs)
 {
 	struct src_entry *entry;
@@ -364,6 +828,9 @@ static void clear_dispatcher(int epfd, int sigfd, int infd,
 	list_for_each_entry(entry, srcs, list)
 		operate_dispatcher(epfd, EPOLL_CTL_DEL, NULL, entry);
 
+	if (tfd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, tfd, NULL);
+
 	epoll_ctl(epfd, EPOLL_CTL_DEL, infd, NULL);
 
 	epoll_ctl(epfd, EPOLL_CTL_DEL, sigfd, NULL);
@@ -389,24 +856,58 @@ static int prepare_signalfd(int *sigfd)
 	return 0;
 }
 
-int monitor(const char *name)
+static int prepare_timerfd(int *tfd)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	its.it_interval.tv_sec = monitor_window / 1000;
+	its.it_interval.tv_nsec = (monitor_window % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		close(fd);
+		return -errno;
+	}
+	*tfd = fd;
+	return 0;
+}
+
+int monitor(const char *name, int window, int format)
 {
 	LIST_HEAD(srcs);
 	int sigfd = 0;
 	int epfd;
 	int infd;
+	int tfd = -1;
 	int wd = 0;
 	bool retry;
 	int err = 0;
 
+	monitor_window = window > 0 ? window : 0;
+	monitor_format = format;
+
 	err = prepare_signalfd(&sigfd);
 	if (err < 0)
 		return err;
 
+	if (monitor_window > 0) {
+		err = prepare_timerfd(&tfd);
+		if (err < 0) {
+			close(sigfd);
+			return err;
+		}
+	}
+
 	epfd = epoll_create(1);
 	if (epfd < 0) {
+		err = -errno;
+		if (tfd >= 0)
+			close(tfd);
 		close(sigfd);
-		return -errno;
+		return err;
 	}
 
 	infd = inotify_init1(IN_NONBLOCK);
@@ -425,10 +926,10 @@ retry:
 	if (err < 0)
 		goto error;
 
-	err = prepare_dispatcher(epfd, sigfd, infd, &srcs);
+	err = prepare_dispatcher(epfd, sigfd, infd, tfd, &srcs);
 	if (err >= 0)
-		err = run_dispatcher(epfd, sigfd, infd, &srcs, &retry);
-	clear_dispatcher(epfd, sigfd, infd, &srcs);
+		err = run_dispatcher(epfd, sigfd, infd, tfd, &srcs, &retry);
+	clear_dispatcher(epfd, sigfd, infd, tfd, &srcs);
 
 	if (retry) {
 		// A simple makeshift for timing gap between creation of nodes
@@ -438,6 +939,8 @@ retry:
 		goto retry;
 	}
 error:
+	if (monitor_window > 0)
+		flush_sources(&srcs);
 	clear_source_list(&srcs);
 
 	if (wd > 0)
@@ -446,6 +949,9 @@ error:
 
 	close(epfd);
 
+	if (tfd >= 0)
+		close(tfd);
+
 	close(sigfd);
 
 	return err;
@@ -0,0 +1,217 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Parallel card jobs
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The cards are processed by up to 'jobs' forked workers. The processes
+ * (and not threads) keep the card, state and card group file locks
+ * working between the workers (they are fcntl() locks, which are owned
+ * by the process), and the global state of alsa-lib and of the init
+ * parser is not shared. Each card group state update in boot_params.c is
+ * done under the group lock, so the workers see the same sequence of
+ * the group states as a serial run in some card order.
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "alsactl.h"
+
+struct card_result {
+	int err;
+	struct card_job job;
+};
+
+struct worker {
+	pid_t pid;
+	int card;
+	int fd;
+	long long start;
+};
+
+static long long pool_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void card_done(int card, int err, struct card_job *job, long long start)
+{
+	long long usec = pool_time() - start;
+
+	if (job->state > 0)
+		export_card_state_set(card, job->state);
+	dbg("card %d done in %lld.%03lld ms (result %d)",
+	    card, usec / 1000, usec % 1000, err);
+}
+
+static int run_card(int card, const char *name, card_pool_fn_t fn, void *arg,
+		    struct card_job *job)
+{
+	long long start = pool_time();
+	int err;
+
+	job->state = job->stop = 0;
+	err = fn(arg, card, name, job);
+	card_done(card, err, job, start);
+	return err;
+}
+
+static int start_worker(struct worker *w, int card, const char *name,
+			card_pool_fn_t fn, void *arg)
+{
+	struct card_result res;
+	int fd[2];
+
+	if (pipe(fd) < 0)
+		return -errno;
+	/* do not write the buffered output twice */
+	fflush(NULL);
+	w->start = pool_time();
+	w->pid = fork();
+	if (w->pid < 0) {
+		close(fd[0]);
+		close(fd[1]);
+		w->pid = 0;
+		return -errno;
+	}
+	if (w->pid == 0) {
+		close(fd[0]);
+		profile_fork();
+		res.job.state = res.job.stop = 0;
+		res.err = fn(arg, card, name, &res.job);
+		profile_flush();
+		fflush(NULL);
+		if (write(fd[1], &res, sizeof(res)) != sizeof(res))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fd[1]);
+	w->card = card;
+	w->fd = fd[0];
+	return 0;
+}
+
+static int finish_worker(struct worker *w, int status, struct card_job *job)
+{
+	struct card_result res;
+
+	if (read(w->fd, &res, sizeof(res)) != sizeof(res)) {
+		error("worker for card %d failed (status 0x%x)", w->card, status);
+		res.err = -EIO;
+		res.job.state = res.job.stop = 0;
+	}
+	close(w->fd);
+	w->pid = 0;
+	*job = res.job;
+	card_done(w->card, res.err, job, w->start);
+	return res.err;
+}
+
+/*
+ * Call fn for each card from the iterator, in parallel when more jobs
+ * are allowed. Returns the last non-zero result of fn, or the result of
+ * the card which stopped the run. No other card is started after a stop,
+ * the running workers are finished.
+ */
+int card_pool_run(struct snd_card_iterator *iter, card_pool_fn_t fn, void *arg)
+{
+	struct worker *workers;
+	struct card_job job;
+	const char *name;
+	long long start = pool_time();
+	int i, err, lasterr = 0, fatal = 0, running = 0, count = 0, status;
+	pid_t pid;
+
+	/* the workers must be serialized by the file locks */
+	if (jobs <= 1 || iter->single || do_lock < 0) {
+		while ((name = snd_card_iterator_next(iter)) != NULL) {
+			err = run_card(iter->card, name, fn, arg, &job);
+			if (err)
+				lasterr = err;
+			count++;
+			if (job.stop)
+				break;
+		}
+		goto out;
+	}
+	if (do_lock == 0)
+		do_lock = 1;
+	workers = calloc(jobs, sizeof(*workers));
+	if (workers == NULL)
+		return -ENOMEM;
+	name = snd_card_iterator_next(iter);
+	while (name || running > 0) {
+		if (name && running < jobs) {
+			for (i = 0; workers[i].pid > 0; i++)
+				;
+			err = start_worker(&workers[i], iter->card, name, fn, arg);
+			if (err < 0) {
+				error("cannot start worker for card %d: %s",
+				      iter->card, strerror(-err));
+				err = run_card(iter->card, name, fn, arg, &job);
+				if (err)
+					lasterr = err;
+				if (job.stop && !fatal)
+					fatal = err;
+			} else {
+				running++;
+			}
+			count++;
+			name = fatal ? NULL : snd_card_iterator_next(iter);
+			continue;
+		}
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			error("waitpid failed: %s", strerror(errno));
+			lasterr = -errno;
+			break;
+		}
+		for (i = 0; i < jobs; i++) {
+			if (workers[i].pid == pid)
+				break;
+		}
+		if (i >= jobs)
+			continue;
+		err = finish_worker(&workers[i], status, &job);
+		if (err)
+			lasterr = err;
+		running--;
+		if (job.stop && !fatal) {
+			fatal = err;
+			name = NULL;
+		}
+	}
+	free(workers);
+	if (fatal)
+		lasterr = fatal;
+out:
+	start = pool_time() - start;
+	dbg("%d cards done in %lld.%03lld ms (%d jobs)",
+	    count, start / 1000, start % 1000, jobs);
+	return lasterr;
+}
@@ -0,0 +1,298 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Phase profiling
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Each profiled phase is a span with the wall time, the process CPU time
+ * and the number of the control calls made through the counting wrappers
+ * in alsactl.h (the calls inside the UCM and hctl layers, like the hctl
+ * element list load, are not visible here). The
+ * spans of the forked card workers are appended to an unnamed temporary
+ * file shared with the parent, so the report covers the parallel runs,
+ * too.
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "alsactl.h"
+
+struct profile_record {
+	int phase;
+	int card;
+	int pid;
+	unsigned int calls;
+	long long start;
+	long long wall;
+	long long cpu;
+};
+
+int profile_mode;
+unsigned int profile_calls;
+
+static const char *profile_file;
+static long long profile_start;
+static struct profile_record *records;
+static unsigned int records_count;
+static unsigned int records_alloc;
+static int records_fd = -1;
+
+static const char *const phase_names[PROFILE_PHASES] = {
+	[PROFILE_WAIT] = "wait",
+	[PROFILE_LOCK] = "lock",
+	[PROFILE_CONFIG] = "config",
+	[PROFILE_INIT] = "init",
+	[PROFILE_UCM] = "ucm",
+	[PROFILE_RESTORE] = "restore",
+	[PROFILE_CONTROL] = "control",
+};
+
+static long long profile_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* "table", "trace", "table:FILE" or "trace:FILE" */
+int profile_setup(const char *arg)
+{
+	FILE *fp;
+
+	if (!strncmp(arg, "table", 5) && (arg[5] == '\0' || arg[5] == ':'))
+		profile_mode = PROFILE_TABLE;
+	else if (!strncmp(arg, "trace", 5) && (arg[5] == '\0' || arg[5] == ':'))
+		profile_mode = PROFILE_TRACE;
+	else
+		return -EINVAL;
+	profile_file = arg[5] == ':' ? arg + 6 : NULL;
+	profile_start = profile_clock(CLOCK_MONOTONIC);
+	/* the workers append their records here */
+	fp = tmpfile();
+	if (fp) {
+		records_fd = dup(fileno(fp));
+		fclose(fp);
+		if (records_fd >= 0)
+			fcntl(records_fd, F_SETFL, O_APPEND);
+	}
+	return 0;
+}
+
+void profile_begin(struct profile_span *span, int phase, int card)
+{
+	span->phase = phase;
+	if (!profile_mode)
+		return;
+	span->card = card;
+	span->calls = profile_calls;
+	span->cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+	span->start = profile_clock(CLOCK_MONOTONIC);
+}
+
+void profile_end(struct profile_span *span)
+{
+	struct profile_record *r;
+	long long now;
+
+	if (!profile_mode)
+		return;
+	now = profile_clock(CLOCK_MONOTONIC);
+	if (records_count >= records_alloc) {
+		r = realloc(records, (records_alloc + 256) * sizeof(*r));
+		if (r == NULL)
+			return;
+		records = r;
+		records_alloc += 256;
+	}
+	r = &records[records_count++];
+	r->phase = span->phase;
+	r->card = span->card;
+	r->pid = getpid();
+	r->calls = profile_calls - span->calls;
+	r->start = span->start;
+	r->wall = now - span->start;
+	r->cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID) - span->cpu;
+}
+
+/* the forked worker keeps only its own records */
+void profile_fork(void)
+{
+	records_count = 0;
+}
+
+/* called by the worker before the exit */
+void profile_flush(void)
+{
+	size_t size = records_count * sizeof(*records);
+
+	if (!profile_mode || records_fd < 0 || size == 0)
+		return;
+	/* one append, so the records of the workers are not interleaved */
+	if (write(records_fd, records, size) != (ssize_t)size)
+		error("cannot write the profile records");
+	records_count = 0;
+}
+
+static void profile_merge(void)
+{
+	struct profile_record *r;
+	off_t size;
+	unsigned int count;
+
+	if (records_fd < 0)
+		return;
+	size = lseek(records_fd, 0, SEEK_END);
+	count = size > 0 ? size / sizeof(*r) : 0;
+	if (count == 0)
+		return;
+	r = realloc(records, (records_count + count) * sizeof(*r));
+	if (r == NULL)
+		return;
+	records = r;
+	records_alloc = records_count + count;
+	if (pread(records_fd, records + records_count, count * sizeof(*r), 0) ==
+	    (ssize_t)(count * sizeof(*r)))
+		records_count += count;
+}
+
+static int compare_records(const void *p1, const void *p2)
+{
+	const struct profile_record *r1 = p1, *r2 = p2;
+
+	if (r1->phase != r2->phase)
+		return r1->phase - r2->phase;
+	if (r1->card != r2->card)
+		return r1->card - r2->card;
+	return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+
+static void print_ms(FILE *fp, long long usec)
+{
+	fprintf(fp, " %9lld.%03lld", usec / 1000, usec % 1000);
+}
+
+/*
+ * One line per phase and card. The times are inclusive, the lock and
+ * control spans are nested in the restore and init ones.
+ */
+static void report_table(FILE *fp)
+{
+	struct profile_record *r, *end = records + records_count;
+	struct rusage self, children;
+	long long wall, cpu, max;
+	unsigned int count, calls;
+	char card[16];
+
+	qsort(records, records_count, sizeof(*records), compare_records);
+	fprintf(fp, "%-8s %5s %6s %13s %13s %13s %9s\n",
+		"phase", "card", "count", "wall ms", "max ms", "cpu ms", "ctl calls");
+	for (r = records; r < end; ) {
+		struct profile_record *first = r;
+		wall = cpu = max = 0;
+		count = calls = 0;
+		for (; r < end && r->phase == first->phase && r->card == first->card; r++) {
+			wall += r->wall;
+			cpu += r->cpu;
+			calls += r->calls;
+			if (r->wall > max)
+				max = r->wall;
+			count++;
+		}
+		if (first->card >= 0)
+			snprintf(card, sizeof(card), "%d", first->card);
+		else
+			strcpy(card, "-");
+		fprintf(fp, "%-8s %5s %6u", phase_names[first->phase], card, count);
+		print_ms(fp, wall);
+		print_ms(fp, max);
+		print_ms(fp, cpu);
+		fprintf(fp, " %9u\n", calls);
+	}
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	cpu = (self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+	       children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000LL +
+	      self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+	      children.ru_utime.tv_usec + children.ru_stime.tv_usec;
+	fprintf(fp, "%-8s %5s %6s", "total", "-", "-");
+	print_ms(fp, profile_clock(CLOCK_MONOTONIC) - profile_start);
+	fprintf(fp, " %13s", "-");
+	print_ms(fp, cpu);
+	fprintf(fp, " %9s\n", "-");
+}
+
+/* the Chrome trace event format ("X" complete events, times in us) */
+static void report_trace(FILE *fp)
+{
+	struct profile_record *r;
+	unsigned int idx;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (idx = 0; idx < records_count; idx++) {
+		r = &records[idx];
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"alsactl\",\"ph\":\"X\","
+			"\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"card\":%d,\"cpu_us\":%lld,\"ctl_calls\":%u}}",
+			idx ? "," : "", phase_names[r->phase],
+			r->start - profile_start, r->wall, r->pid, r->pid,
+			r->card, r->cpu, r->calls);
+	}
+	fprintf(fp, "\n]}\n");
+}
+
+int profile_report(void)
+{
+	FILE *fp = stderr;
+	int err = 0;
+
+	if (!profile_mode)
+		return 0;
+	profile_merge();
+	if (profile_file && !strcmp(profile_file, "-")) {
+		fp = stdout;
+	} else if (profile_file) {
+		fp = fopen(profile_file, "w");
+		if (fp == NULL) {
+			err = -errno;
+			error("Cannot open %s for writing: %s", profile_file, strerror(errno));
+			goto out;
+		}
+	}
+	if (profile_mode == PROFILE_TRACE)
+		report_trace(fp);
+	else
+		report_table(fp);
+	if (fp != stderr && fp != stdout)
+		fclose(fp);
+out:
+	if (records_fd >= 0)
+		close(records_fd);
+	records_fd = -1;
+	free(records);
+	records = NULL;
+	records_count = records_alloc = 0;
+	return err;
+}
@@ -0,0 +1,619 @@
+/*
+ *  Advanced Linux Sound Architecture Control Program - Binary state snapshot
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The snapshot is a cache of the text state file for the restore at boot.
+ * It holds only the values of the writable controls, keyed by numid, in
+ * the native byte order. It is used only when the text file was not
+ * changed since the snapshot was written, the kernel is the same and the
+ * identity of the card (the card info and the IDs of all elements) did
+ * not change, so the values are written without any info queries or
+ * parsing. Otherwise, the card is restored from the text file.
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <alsa/asoundlib.h>
+#include "alsactl.h"
+
+#define SNAPSHOT_MAGIC		"ALSB"
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t cards;
+	uint32_t mtime_nsec;	/* identity of the text state file */
+	int64_t mtime;
+	uint64_t size;
+	uint64_t ino;
+	char release[72];	/* kernel release */
+};
+
+struct snapshot_card {
+	char id[32];
+	uint64_t hash;
+	uint32_t controls;
+	uint32_t size;		/* size of the control records */
+};
+
+struct snapshot_control {
+	uint32_t numid;
+	uint32_t type;
+	uint32_t count;
+	uint32_t size;		/* size of the values, the record is padded to 8 bytes */
+};
+
+struct snapshot {
+	char *buf;
+	size_t size;
+};
+
+struct buffer {
+	char *data;
+	size_t size;
+	size_t alloc;
+};
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	while (size-- > 0) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint64_t hash_str(uint64_t hash, const char *s)
+{
+	return hash_bytes(hash, s, strlen(s) + 1);
+}
+
+static uint64_t hash_u32(uint64_t hash, uint32_t val)
+{
+	return hash_bytes(hash, &val, sizeof(val));
+}
+
+/*
+ * Read the element list of the card and compute the identity hash.
+ * The list space is allocated, the caller frees it.
+ */
+static int card_identity(snd_ctl_t *handle, snd_ctl_card_info_t *info,
+			 snd_ctl_elem_list_t *list, uint64_t *hash)
+{
+	unsigned int idx, count;
+	uint64_t h = FNV_OFFSET;
+	int err;
+
+	h = hash_str(h, snd_ctl_card_info_get_id(info));
+	h = hash_str(h, snd_ctl_card_info_get_driver(info));
+	h = hash_str(h, snd_ctl_card_info_get_name(info));
+	h = hash_str(h, snd_ctl_card_info_get_longname(info));
+	h = hash_str(h, snd_ctl_card_info_get_mixername(info));
+	h = hash_str(h, snd_ctl_card_info_get_components(info));
+	err = ctl_elem_list(handle, list);
+	if (err < 0)
+		return err;
+	count = snd_ctl_elem_list_get_count(list);
+	h = hash_u32(h, count);
+	if (count > 0) {
+		err = snd_ctl_elem_list_alloc_space(list, count);
+		if (err < 0)
+			return err;
+		err = ctl_elem_list(handle, list);
+		if (err < 0)
+			return err;
+		if (snd_ctl_elem_list_get_used(list) != count)
+			return -EAGAIN;
+	}
+	for (idx = 0; idx < count; idx++) {
+		h = hash_u32(h, snd_ctl_elem_list_get_numid(list, idx));
+		h = hash_u32(h, snd_ctl_elem_list_get_interface(list, idx));
+		h = hash_u32(h, snd_ctl_elem_list_get_device(list, idx));
+		h = hash_u32(h, snd_ctl_elem_list_get_subdevice(list, idx));
+		h = hash_u32(h, snd_ctl_elem_list_get_index(list, idx));
+		h = hash_str(h, snd_ctl_elem_list_get_name(list, idx));
+	}
+	*hash = h;
+	return 0;
+}
+
+static void *buffer_add(struct buffer *buf, size_t size)
+{
+	size_t nalloc;
+	char *n;
+
+	/* all records are aligned to 8 bytes */
+	size = (size + 7) & ~(size_t)7;
+	if (buf->size + size > buf->alloc) {
+		nalloc = buf->alloc ? buf->alloc * 2 : 64 * 1024;
+		while (nalloc < buf->size + size)
+			nalloc *= 2;
+		n = realloc(buf->data, nalloc);
+		if (n == NULL)
+			return NULL;
+		buf->data = n;
+		buf->alloc = nalloc;
+	}
+	n = buf->data + buf->size;
+	memset(n, 0, size);
+	buf->size += size;
+	return n;
+}
+
+static size_t value_size(snd_ctl_elem_type_t type, unsigned int count)
+{
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+	case SND_CTL_ELEM_TYPE_BYTES:
+		return count;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return count * sizeof(int64_t);
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return count * sizeof(uint32_t);
+	case SND_CTL_ELEM_TYPE_IEC958:
+		return sizeof(snd_aes_iec958_t);
+	default:
+		return 0;
+	}
+}
+
+static int add_control(struct buffer *buf, snd_ctl_t *handle,
+		       snd_ctl_elem_info_t *info, snd_ctl_elem_value_t *ctl)
+{
+	struct snapshot_control *c;
+	snd_ctl_elem_type_t type;
+	unsigned int idx, count;
+	size_t size, offset;
+	char *v;
+	int err;
+
+	type = snd_ctl_elem_info_get_type(info);
+	count = snd_ctl_elem_info_get_count(info);
+	size = value_size(type, count);
+	if (size == 0)
+		return 0;
+	snd_ctl_elem_value_set_numid(ctl, snd_ctl_elem_info_get_numid(info));
+	err = ctl_elem_read(handle, ctl);
+	if (err < 0)
+		return err;
+	offset = buf->size;
+	if (buffer_add(buf, sizeof(*c) + size) == NULL)
+		return -ENOMEM;
+	c = (struct snapshot_control *)(buf->data + offset);
+	c->numid = snd_ctl_elem_info_get_numid(info);
+	c->type = type;
+	c->count = count;
+	c->size = size;
+	v = (char *)(c + 1);
+	for (idx = 0; idx < count; idx++) {
+		switch (type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+			v[idx] = snd_ctl_elem_value_get_boolean(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			((int64_t *)v)[idx] = snd_ctl_elem_value_get_integer(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			((int64_t *)v)[idx] = snd_ctl_elem_value_get_integer64(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			((uint32_t *)v)[idx] = snd_ctl_elem_value_get_enumerated(ctl, idx);
+			break;
+		case SND_CTL_ELEM_TYPE_BYTES:
+			v[idx] = snd_ctl_elem_value_get_byte(ctl, idx);
+			break;
+		default:
+			break;
+		}
+	}
+	if (type == SND_CTL_ELEM_TYPE_IEC958)
+		snd_ctl_elem_value_get_iec958(ctl, (snd_aes_iec958_t *)v);
+	return 1;
+}
+
+static int add_card(struct buffer *buf, int cardno)
+{
+	snd_ctl_t *handle;
+	snd_ctl_card_info_t *info;
+	snd_ctl_elem_list_t *list;
+	snd_ctl_elem_info_t *elem_info;
+	snd_ctl_elem_value_t *ctl;
+	struct snapshot_card *card;
+	unsigned int idx, count, controls = 0;
+	size_t offset;
+	uint64_t hash;
+	char name[32];
+	int err;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_list_alloca(&list);
+	snd_ctl_elem_info_alloca(&elem_info);
+	snd_ctl_elem_value_alloca(&ctl);
+
+	sprintf(name, "hw:%d", cardno);
+	err = snd_ctl_open(&handle, name, SND_CTL_READONLY);
+	if (err < 0)
+		return err;
+	err = ctl_card_info(handle, info);
+	if (err < 0)
+		goto _close;
+	err = card_identity(handle, info, list, &hash);
+	if (err < 0)
+		goto _free;
+	offset = buf->size;
+	if (buffer_add(buf, sizeof(*card)) == NULL) {
+		err = -ENOMEM;
+		goto _free;
+	}
+	count = snd_ctl_elem_list_get_used(list);
+	for (idx = 0; idx < count; idx++) {
+		snd_ctl_elem_info_set_numid(elem_info, snd_ctl_elem_list_get_numid(list, idx));
+		err = ctl_elem_info(handle, elem_info);
+		if (err < 0)
+			goto _free;
+		/* the same controls as restored from the text state */
+		if (!snd_ctl_elem_info_is_readable(elem_info) ||
+		    !snd_ctl_elem_info_is_writable(elem_info) ||
+		    snd_ctl_elem_info_is_inactive(elem_info))
+			continue;
+		err = add_control(buf, handle, elem_info, ctl);
+		if (err < 0)
+			goto _free;
+		controls += err;
+	}
+	card = (struct snapshot_card *)(buf->data + offset);
+	snprintf(card->id, sizeof(card->id), "%s", snd_ctl_card_info_get_id(info));
+	card->hash = hash;
+	card->controls = controls;
+	card->size = buf->size - offset - sizeof(*card);
+	err = 0;
+ _free:
+	snd_ctl_elem_list_free_space(list);
+ _close:
+	snd_ctl_close(handle);
+	return err;
+}
+
+static char *snapshot_name(const char *file)
+{
+	char *name;
+
+	name = malloc(strlen(file) + 5);
+	if (name) {
+		strcpy(name, file);
+		strcat(name, ".bin");
+	}
+	return name;
+}
+
+/* find the card record by the card ID in the records following the header */
+static struct snapshot_card *find_card_in(char *data, size_t size,
+					  unsigned int cards, const char *id)
+{
+	struct snapshot_card *card;
+	size_t pos = sizeof(struct snapshot_header);
+	unsigned int idx;
+
+	for (idx = 0; idx < cards; idx++) {
+		if (pos + sizeof(*card) > size)
+			return NULL;
+		card = (struct snapshot_card *)(data + pos);
+		if (card->size > size - pos - sizeof(*card))
+			return NULL;
+		if (strncmp(card->id, id, sizeof(card->id)) == 0)
+			return card;
+		pos += sizeof(*card) + card->size;
+	}
+	return NULL;
+}
+
+static struct snapshot_card *find_card(struct snapshot *snap, const char *id)
+{
+	struct snapshot_header *hdr = (struct snapshot_header *)snap->buf;
+
+	return find_card_in(snap->buf, snap->size, hdr->cards, id);
+}
+
+/* copy the records of the cards which were not saved now */
+static int copy_cards(struct buffer *buf, unsigned int *cards,
+		      struct snapshot *old)
+{
+	struct snapshot_header *hdr = (struct snapshot_header *)old->buf;
+	struct snapshot_card *card;
+	size_t pos = sizeof(*hdr), size;
+	unsigned int idx;
+	void *dst;
+
+	for (idx = 0; idx < hdr->cards; idx++) {
+		if (pos + sizeof(*card) > old->size)
+			return -EINVAL;
+		card = (struct snapshot_card *)(old->buf + pos);
+		if (card->size > old->size - pos - sizeof(*card))
+			return -EINVAL;
+		size = sizeof(*card) + card->size;
+		pos += size;
+		if (find_card_in(buf->data, buf->size, *cards, card->id))
+			continue;
+		dst = buffer_add(buf, size);
+		if (dst == NULL)
+			return -ENOMEM;
+		memcpy(dst, card, size);
+		(*cards)++;
+	}
+	return 0;
+}
+
+/*
+ * Write the snapshot for the given text state file, which was just
+ * written. The caller holds the state lock. With a card name, only this
+ * card is read, the records of the other cards are kept from the old
+ * snapshot (which matched the previous text state file), if any.
+ */
+int snapshot_save(const char *file, const char *cardname, struct snapshot *old)
+{
+	struct buffer buf = { NULL, 0, 0 };
+	struct snapshot_header *hdr;
+	struct utsname uts;
+	struct stat st;
+	char *name = NULL, *nname = NULL;
+	FILE *f;
+	struct snd_card_iterator iter;
+	unsigned int cards = 0;
+	int err;
+
+	if (stat(file, &st) < 0 || uname(&uts) < 0)
+		return -errno;
+	err = snd_card_iterator_sinit(&iter, cardname);
+	if (err < 0)
+		return err;
+	if (buffer_add(&buf, sizeof(*hdr)) == NULL)
+		return -ENOMEM;
+	while (snd_card_iterator_next(&iter)) {
+		err = add_card(&buf, iter.card);
+		if (err < 0) {
+			error("Cannot create the snapshot of card %d: %s", iter.card, snd_strerror(err));
+			goto out;
+		}
+		cards++;
+	}
+	if (cardname && old) {
+		err = copy_cards(&buf, &cards, old);
+		if (err < 0)
+			goto out;
+	}
+	hdr = (struct snapshot_header *)buf.data;
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->cards = cards;
+	hdr->mtime = st.st_mtim.tv_sec;
+	hdr->mtime_nsec = st.st_mtim.tv_nsec;
+	hdr->size = st.st_size;
+	hdr->ino = st.st_ino;
+	snprintf(hdr->release, sizeof(hdr->release), "%s", uts.release);
+
+	name = snapshot_name(file);
+	nname = name ? malloc(strlen(name) + 5) : NULL;
+	if (nname == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	strcpy(nname, name);
+	strcat(nname, ".new");
+	f = fopen(nname, "w");
+	if (f == NULL) {
+		err = -errno;
+		error("Cannot open %s for writing: %s", nname, strerror(errno));
+		goto out;
+	}
+	err = fwrite(buf.data, buf.size, 1, f) == 1 ? 0 : -EIO;
+	if (fclose(f) && err == 0)
+		err = -errno;
+	if (err == 0 && rename(nname, name) < 0)
+		err = -errno;
+	if (err < 0) {
+		error("Cannot write %s: %s", name, strerror(-err));
+		unlink(nname);
+	} else {
+		dbg("snapshot %s: %u cards, %zu bytes", name, cards, buf.size);
+	}
+out:
+	free(nname);
+	free(name);
+	free(buf.data);
+	return err;
+}
+
+/* map the snapshot, it must match the current text state file and kernel */
+int snapshot_load(const char *file, struct snapshot **snapshot)
+{
+	struct snapshot *snap;
+	struct snapshot_header *hdr;
+	struct utsname uts;
+	struct stat st;
+	char *name;
+	int err = -ESTALE;
+
+	*snapshot = NULL;
+	if (stat(file, &st) < 0 || uname(&uts) < 0)
+		return -errno;
+	name = snapshot_name(file);
+	if (name == NULL)
+		return -ENOMEM;
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL) {
+		free(name);
+		return -ENOMEM;
+	}
+	if (file_map(name, &snap->buf, &snap->size) < 0) {
+		err = -errno;
+		free(snap);
+		free(name);
+		return err;
+	}
+	hdr = (struct snapshot_header *)snap->buf;
+	if (snap->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SNAPSHOT_VERSION ||
+	    hdr->mtime != st.st_mtim.tv_sec ||
+	    hdr->mtime_nsec != (uint32_t)st.st_mtim.tv_nsec ||
+	    hdr->size != (uint64_t)st.st_size ||
+	    hdr->ino != (uint64_t)st.st_ino ||
+	    strncmp(hdr->release, uts.release, sizeof(hdr->release))) {
+		dbg("snapshot %s does not match %s", name, file);
+		snapshot_free(snap);
+		free(name);
+		return err;
+	}
+	free(name);
+	*snapshot = snap;
+	return 0;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	file_unmap(snap->buf, snap->size);
+	free(snap);
+}
+
+static int restore_control(snd_ctl_t *handle, snd_ctl_elem_value_t *ctl,
+			   const struct snapshot_control *c)
+{
+	const char *v = (const char *)(c + 1);
+	unsigned int idx;
+
+	if (c->size != value_size(c->type, c->count))
+		return -EINVAL;
+	snd_ctl_elem_value_clear(ctl);
+	snd_ctl_elem_value_set_numid(ctl, c->numid);
+	for (idx = 0; idx < c->count; idx++) {
+		switch (c->type) {
+		case SND_CTL_ELEM_TYPE_BOOLEAN:
+			snd_ctl_elem_value_set_boolean(ctl, idx, v[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER:
+			snd_ctl_elem_value_set_integer(ctl, idx, ((const int64_t *)v)[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_INTEGER64:
+			snd_ctl_elem_value_set_integer64(ctl, idx, ((const int64_t *)v)[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_ENUMERATED:
+			snd_ctl_elem_value_set_enumerated(ctl, idx, ((const uint32_t *)v)[idx]);
+			break;
+		case SND_CTL_ELEM_TYPE_BYTES:
+			snd_ctl_elem_value_set_byte(ctl, idx, v[idx]);
+			break;
+		default:
+			break;
+		}
+	}
+	if (c->type == SND_CTL_ELEM_TYPE_IEC958)
+		snd_ctl_elem_value_set_iec958(ctl, (const snd_aes_iec958_t *)v);
+	return ctl_elem_write(handle, ctl);
+}
+
+/*
+ * Restore the card from the snapshot. Returns -ESTALE when the card does
+ * not match, the text state file should be used then.
+ */
+int snapshot_restore(struct snapshot *snap, int cardno)
+{
+	snd_ctl_t *handle;
+	snd_ctl_card_info_t *info;
+	snd_ctl_elem_list_t *list;
+	snd_ctl_elem_value_t *ctl;
+	struct snapshot_card *card;
+	const struct snapshot_control *c;
+	struct profile_span span;
+	unsigned int idx;
+	size_t pos;
+	uint64_t hash;
+	char name[32];
+	int err;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_list_alloca(&list);
+	snd_ctl_elem_value_alloca(&ctl);
+
+	sprintf(name, "hw:%d", cardno);
+	profile_begin(&span, PROFILE_RESTORE, cardno);
+	err = snd_ctl_open(&handle, name, 0);
+	if (err < 0) {
+		error("snd_ctl_open error: %s", snd_strerror(err));
+		profile_end(&span);
+		return err;
+	}
+	err = ctl_card_info(handle, info);
+	if (err < 0) {
+		error("snd_ctl_card_info error: %s", snd_strerror(err));
+		goto _close;
+	}
+	card = find_card(snap, snd_ctl_card_info_get_id(info));
+	if (card == NULL) {
+		dbg("card %d is not in the snapshot", cardno);
+		err = -ESTALE;
+		goto _close;
+	}
+	err = card_identity(handle, info, list, &hash);
+	if (err < 0)
+		goto _free;
+	if (hash != card->hash) {
+		dbg("card %d does not match the snapshot", cardno);
+		err = -ESTALE;
+		goto _free;
+	}
+	for (idx = pos = 0; idx < card->controls; idx++) {
+		c = (const struct snapshot_control *)((char *)(card + 1) + pos);
+		if (pos + sizeof(*c) > card->size ||
+		    c->size > card->size - pos - sizeof(*c)) {
+			error("snapshot of card %d is corrupted", cardno);
+			err = -ESTALE;
+			goto _free;
+		}
+		err = restore_control(handle, ctl, c);
+		if (err < 0) {
+			dbg("cannot restore control #%u from the snapshot: %s",
+			    c->numid, snd_strerror(err));
+			err = -ESTALE;
+			goto _free;
+		}
+		pos += (sizeof(*c) + c->size + 7) & ~(size_t)7;
+	}
+	dbg("card %d restored from the snapshot (%u controls)", cardno, card->controls);
+	err = 0;
+ _free:
+	snd_ctl_elem_list_free_space(list);
+ _close:
+	snd_ctl_close(handle);
+	profile_end(&span);
+	return err;
+}
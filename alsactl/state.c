@@ -252,11 +252,18 @@ static int add_tlv_comments(snd_ctl_t *handle, snd_ctl_elem_id_t *id,
 	return 0;
 }
 
-static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *top)
+/*
+ * Add the control node to the top compound. With replace, an existing node
+ * with the same numid is refilled in place (the control order is kept) or
+ * deleted when the control is gone.
+ */
+static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *top,
+		       int replace)
 {
 	snd_ctl_elem_value_t *ctl;
 	snd_ctl_elem_info_t *info;
-	snd_config_t *control, *comment, *item = NULL, *value;
+	snd_config_t *control = NULL, *comment, *item = NULL, *value;
+	snd_config_iterator_t i, next;
 	const char *s;
 	char buf[256];
 	unsigned int idx;
@@ -268,25 +275,48 @@ static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *t
 	snd_ctl_elem_value_alloca(&ctl);
 	snd_ctl_elem_info_alloca(&info);
 	snd_ctl_elem_info_set_id(info, id);
-	err = snd_ctl_elem_info(handle, info);
+	err = ctl_elem_info(handle, info);
+	if (err == -ENOENT && replace) {
+		if (snd_config_search(top, num_str(snd_ctl_elem_id_get_numid(id)), &control) == 0)
+			snd_config_delete(control);
+		return 0;
+	}
 	if (err < 0) {
 		error("Cannot read control info '%s': %s", id_str(id), snd_strerror(err));
 		return err;
 	}
+	/* the caller may know only the numid */
+	snd_ctl_elem_info_get_id(info, id);
 
-	if (!snd_ctl_elem_info_is_readable(info))
+	if (replace &&
+	    snd_config_search(top, num_str(snd_ctl_elem_info_get_numid(info)), &control) < 0)
+		control = NULL;
+	if (!snd_ctl_elem_info_is_readable(info)) {
+		if (control)
+			snd_config_delete(control);
 		return 0;
+	}
 	snd_ctl_elem_value_set_id(ctl, id);
-	err = snd_ctl_elem_read(handle, ctl);
+	err = ctl_elem_read(handle, ctl);
 	if (err < 0) {
 		error("Cannot read control '%s': %s", id_str(id), snd_strerror(err));
 		return err;
 	}
 
-	err = snd_config_compound_add(top, num_str(snd_ctl_elem_info_get_numid(info)), 0, &control);
-	if (err < 0) {
-		error("snd_config_compound_add: %s", snd_strerror(err));
-		return err;
+	if (control) {
+		snd_config_for_each(i, next, control) {
+			err = snd_config_delete(snd_config_iterator_entry(i));
+			if (err < 0) {
+				error("snd_config_delete: %s", snd_strerror(err));
+				return err;
+			}
+		}
+	} else {
+		err = snd_config_compound_add(top, num_str(snd_ctl_elem_info_get_numid(info)), 0, &control);
+		if (err < 0) {
+			error("snd_config_compound_add: %s", snd_strerror(err));
+			return err;
+		}
 	}
 	err = snd_config_make_compound(&comment, "comment", 0);
 	if (err < 0) {
@@ -383,7 +413,7 @@ static int get_control(snd_ctl_t *handle, snd_ctl_elem_id_t *id, snd_config_t *t
 		items = snd_ctl_elem_info_get_items(info);
 		for (idx = 0; idx < items; idx++) {
 			snd_ctl_elem_info_set_item(info, idx);
-			err = snd_ctl_elem_info(handle, info);
+			err = ctl_elem_info(handle, info);
 			if (err < 0) {
 				error("snd_ctl_card_info: %s", snd_strerror(err));
 				return err;
@@ -571,11 +601,46 @@ finish:
 	return 0;
 }
 	
+/* find or create the state.<id> compound */
+static int get_card_config(snd_config_t *top, const char *id, snd_config_t **card)
+{
+	snd_config_t *state;
+	int err;
+
+	err = snd_config_search(top, "state", &state);
+	if (err == 0 &&
+	    snd_config_get_type(state) != SND_CONFIG_TYPE_COMPOUND) {
+		error("config state node is not a compound");
+		return -EINVAL;
+	}
+	if (err < 0) {
+		err = snd_config_compound_add(top, "state", 1, &state);
+		if (err < 0) {
+			error("snd_config_compound_add: %s", snd_strerror(err));
+			return err;
+		}
+	}
+	err = snd_config_search(state, id, card);
+	if (err == 0 &&
+	    snd_config_get_type(*card) != SND_CONFIG_TYPE_COMPOUND) {
+		error("config state.%s node is not a compound", id);
+		return -EINVAL;
+	}
+	if (err < 0) {
+		err = snd_config_compound_add(state, id, 0, card);
+		if (err < 0) {
+			error("snd_config_compound_add: %s", snd_strerror(err));
+			return err;
+		}
+	}
+	return 0;
+}
+
 static int get_controls(int cardno, snd_config_t *top)
 {
 	snd_ctl_t *handle;
 	snd_ctl_card_info_t *info;
-	snd_config_t *state, *card, *control;
+	snd_config_t *card, *control;
 	snd_ctl_elem_list_t *list;
 	snd_ctl_elem_id_t *elem_id;
 	unsigned int idx;
@@ -593,40 +658,15 @@ static int get_controls(int cardno, snd_config_t *top)
 		error("snd_ctl_open error: %s", snd_strerror(err));
 		return err;
 	}
-	err = snd_ctl_card_info(handle, info);
+	err = ctl_card_info(handle, info);
 	if (err < 0) {
 		error("snd_ctl_card_info error: %s", snd_strerror(err));
 		goto _close;
 	}
 	id = snd_ctl_card_info_get_id(info);
-	err = snd_config_search(top, "state", &state);
-	if (err == 0 &&
-	    snd_config_get_type(state) != SND_CONFIG_TYPE_COMPOUND) {
-		error("config state node is not a compound");
-		err = -EINVAL;
-		goto _close;
-	}
-	if (err < 0) {
-		err = snd_config_compound_add(top, "state", 1, &state);
-		if (err < 0) {
-			error("snd_config_compound_add: %s", snd_strerror(err));
-			goto _close;
-		}
-	}
-	err = snd_config_search(state, id, &card);
-	if (err == 0 &&
-	    snd_config_get_type(card) != SND_CONFIG_TYPE_COMPOUND) {
-		error("config state.%s node is not a compound", id);
-		err = -EINVAL;
+	err = get_card_config(top, id, &card);
+	if (err < 0)
 		goto _close;
-	}
-	if (err < 0) {
-		err = snd_config_compound_add(state, id, 0, &card);
-		if (err < 0) {
-			error("snd_config_compound_add: %s", snd_strerror(err));
-			goto _close;
-		}
-	}
 	err = snd_config_search(card, "control", &control);
 	if (err == 0) {
 		err = snd_config_delete(control);
@@ -635,7 +675,7 @@ static int get_controls(int cardno, snd_config_t *top)
 			goto _close;
 		}
 	}
-	err = snd_ctl_elem_list(handle, list);
+	err = ctl_elem_list(handle, list);
 	if (err < 0) {
 		error("Cannot determine controls: %s", snd_strerror(err));
 		goto _close;
@@ -655,13 +695,13 @@ static int get_controls(int cardno, snd_config_t *top)
 		error("No enough memory...");
 		goto _close;
 	}
-	if ((err = snd_ctl_elem_list(handle, list)) < 0) {
+	if ((err = ctl_elem_list(handle, list)) < 0) {
 		error("Cannot determine controls (2): %s", snd_strerror(err));
 		goto _free;
 	}
 	for (idx = 0; idx < count; ++idx) {
 		snd_ctl_elem_list_get_id(list, idx, elem_id);
-		err = get_control(handle, elem_id, control);
+		err = get_control(handle, elem_id, control, 0);
 		if (err < 0)
 			goto _free;
 	}		
@@ -674,6 +714,110 @@ static int get_controls(int cardno, snd_config_t *top)
 	return err;
 }
 
+/*
+ * The daemon keeps the state tree between the saves: the cards are read
+ * completely only once and then only the changed controls are updated.
+ */
+int state_config_card(snd_config_t *top, int cardno)
+{
+	return get_controls(cardno, top);
+}
+
+int state_config_controls(snd_config_t *top, snd_ctl_t *handle,
+			  const unsigned int *numids, unsigned int count)
+{
+	snd_ctl_card_info_t *info;
+	snd_ctl_elem_id_t *id;
+	snd_config_t *card, *control;
+	unsigned int idx;
+	int err;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_id_alloca(&id);
+
+	err = ctl_card_info(handle, info);
+	if (err < 0) {
+		error("snd_ctl_card_info error: %s", snd_strerror(err));
+		return err;
+	}
+	err = get_card_config(top, snd_ctl_card_info_get_id(info), &card);
+	if (err < 0)
+		return err;
+	if (snd_config_search(card, "control", &control) < 0)
+		return get_controls(snd_ctl_card_info_get_card(info), top);
+	for (idx = 0; idx < count; idx++) {
+		snd_ctl_elem_id_clear(id);
+		snd_ctl_elem_id_set_numid(id, numids[idx]);
+		err = get_control(handle, id, control, 1);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* load the state file, a missing file gives an empty tree */
+int state_config_load(const char *file, snd_config_t **config)
+{
+	snd_input_t *in;
+	int err;
+
+	err = snd_config_top(config);
+	if (err < 0) {
+		error("snd_config_top error: %s", snd_strerror(err));
+		return err;
+	}
+	if (strcmp(file, "-") && snd_input_stdio_open(&in, file, "r") >= 0) {
+		err = snd_config_load(*config, in);
+		snd_input_close(in);
+#if 0
+		if (err < 0) {
+			error("snd_config_load error: %s", snd_strerror(err));
+			snd_config_delete(*config);
+			*config = NULL;
+			return err;
+		}
+#endif
+	}
+	return 0;
+}
+
+/* write the state tree to <file>.new and rename it, the caller holds the lock */
+int state_config_save(const char *file, snd_config_t *config)
+{
+	snd_output_t *out;
+	char *nfile = NULL;
+	int err;
+
+	if (strcmp(file, "-") == 0) {
+		err = snd_output_stdio_attach(&out, stdout, 0);
+	} else {
+		nfile = malloc(strlen(file) + 5);
+		if (nfile == NULL) {
+			error("No enough memory...");
+			return -ENOMEM;
+		}
+		strcpy(nfile, file);
+		strcat(nfile, ".new");
+		err = snd_output_stdio_open(&out, nfile, "w");
+	}
+	if (err < 0) {
+		error("Cannot open %s for writing: %s", file, snd_strerror(err));
+		err = -errno;
+		goto out;
+	}
+	err = snd_config_save(config, out);
+	snd_output_close(out);
+	if (err < 0) {
+		error("snd_config_save: %s", snd_strerror(err));
+	} else if (nfile) {
+		err = rename(nfile, file);
+		if (err < 0)
+			error("rename failed: %s (%s)", strerror(-err), file);
+	}
+out:
+	free(nfile);
+	return err;
+}
+
 static long config_iface(snd_config_t *n)
 {
 	long i;
@@ -774,7 +918,7 @@ static int config_enumerated(snd_config_t *n, snd_ctl_t *handle,
 	for (idx = 0; idx < items; idx++) {
 		int err;
 		snd_ctl_elem_info_set_item(info, idx);
-		err = snd_ctl_elem_info(handle, info);
+		err = ctl_elem_info(handle, info);
 		if (err < 0) {
 			error("snd_ctl_elem_info: %s", snd_strerror(err));
 			return err;
@@ -1020,7 +1164,7 @@ static int add_user_control(snd_ctl_t *handle, snd_ctl_elem_info_t *info, snd_co
 	free(enum_items.strings);
 	if (err < 0)
 		return err;
-	return snd_ctl_elem_info(handle, info);
+	return ctl_elem_info(handle, info);
 }
 
 /*
@@ -1319,70 +1463,479 @@ static int parse_config_id(snd_config_t *control, snd_ctl_elem_id_t *id,
 	return 0;
 }
 
-static int set_control(snd_ctl_t *handle, snd_config_t *control, int doit)
-{
-	snd_ctl_elem_value_t *ctl;
-	snd_ctl_elem_info_t *info;
-	snd_config_iterator_t i, next;
-	snd_ctl_elem_id_t *elem_id, *elem_id1;
+/*
+ * The live controls of the card hashed by the element ID (without numid),
+ * so the saved controls are matched without the kernel name lookups.
+ */
+#define CTL_MATCHED	(1<<0)		/* a saved control was found */
+#define CTL_INFO	(1<<1)		/* the flags below are valid */
+#define CTL_READABLE	(1<<2)
+#define CTL_USER	(1<<3)
+#define CTL_WRITABLE	(1<<4)		/* writable and active */
+
+struct ctl_entry {
 	unsigned int numid;
-	snd_ctl_elem_type_t type;
+	unsigned int iface;
+	unsigned int device;
+	unsigned int subdevice;
+	unsigned int index;
+	unsigned int flags;
+	char name[44];
+};
+
+struct ctl_index {
+	struct ctl_entry *entries;
+	unsigned int *slots;		/* entry + 1, zero is a free slot */
 	unsigned int count;
-	snd_config_t *value = NULL;
-	snd_config_t *comment = NULL;
-	unsigned int idx;
-	int err;
-	char *set;
-	const char *id;
-	snd_ctl_elem_id_alloca(&elem_id);
-	snd_ctl_elem_id_alloca(&elem_id1);
-	snd_ctl_elem_value_alloca(&ctl);
-	snd_ctl_elem_info_alloca(&info);
-	if (snd_config_get_type(control) != SND_CONFIG_TYPE_COMPOUND) {
-		cerror(doit, "control is not a compound");
-		return -EINVAL;
-	}
-	err = snd_config_get_id(control, &id);
-	if (err < 0) {
-		cerror(doit, "unable to get id");
-		return -EINVAL;
+	unsigned int alloc;
+	unsigned int mask;
+};
+
+static unsigned int ctl_hash(unsigned int iface, const char *name, unsigned int index,
+			     unsigned int device, unsigned int subdevice)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	h = (h ^ iface) * 16777619U;
+	h = (h ^ index) * 16777619U;
+	h = (h ^ device) * 16777619U;
+	h = (h ^ subdevice) * 16777619U;
+	return h;
+}
+
+static void ctl_index_insert(struct ctl_index *ix, unsigned int idx)
+{
+	struct ctl_entry *e = &ix->entries[idx];
+	unsigned int pos;
+
+	pos = ctl_hash(e->iface, e->name, e->index, e->device, e->subdevice);
+	while (ix->slots[pos & ix->mask])
+		pos++;
+	ix->slots[pos & ix->mask] = idx + 1;
+}
+
+/* keep the table at most half full */
+static int ctl_index_grow(struct ctl_index *ix, unsigned int count)
+{
+	struct ctl_entry *entries;
+	unsigned int *slots, size, idx;
+
+	if (count > ix->alloc) {
+		entries = realloc(ix->entries, count * sizeof(*entries));
+		if (entries == NULL)
+			return -ENOMEM;
+		ix->entries = entries;
+		ix->alloc = count;
 	}
-	numid = atoi(id);
-	err = parse_config_id(control, elem_id, &comment, &value, doit);
+	if (ix->slots && count * 2 <= ix->mask + 1)
+		return 0;
+	for (size = 64; size < count * 2; size *= 2)
+		;
+	slots = calloc(size, sizeof(*slots));
+	if (slots == NULL)
+		return -ENOMEM;
+	free(ix->slots);
+	ix->slots = slots;
+	ix->mask = size - 1;
+	for (idx = 0; idx < ix->count; idx++)
+		ctl_index_insert(ix, idx);
+	return 0;
+}
+
+static struct ctl_entry *ctl_index_find(struct ctl_index *ix, snd_ctl_elem_id_t *id)
+{
+	struct ctl_entry *e;
+	unsigned int iface, device, subdevice, index, pos, slot;
+	const char *name;
+
+	if (ix->slots == NULL)
+		return NULL;
+	iface = snd_ctl_elem_id_get_interface(id);
+	device = snd_ctl_elem_id_get_device(id);
+	subdevice = snd_ctl_elem_id_get_subdevice(id);
+	index = snd_ctl_elem_id_get_index(id);
+	name = snd_ctl_elem_id_get_name(id);
+	pos = ctl_hash(iface, name, index, device, subdevice);
+	while ((slot = ix->slots[pos++ & ix->mask]) != 0) {
+		e = &ix->entries[slot - 1];
+		if (e->iface == iface && e->index == index &&
+		    e->device == device && e->subdevice == subdevice &&
+		    strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static struct ctl_entry *ctl_index_add(struct ctl_index *ix, snd_ctl_elem_id_t *id)
+{
+	struct ctl_entry *e;
+
+	if (ctl_index_grow(ix, ix->count + 1) < 0)
+		return NULL;
+	e = &ix->entries[ix->count];
+	e->numid = snd_ctl_elem_id_get_numid(id);
+	e->iface = snd_ctl_elem_id_get_interface(id);
+	e->device = snd_ctl_elem_id_get_device(id);
+	e->subdevice = snd_ctl_elem_id_get_subdevice(id);
+	e->index = snd_ctl_elem_id_get_index(id);
+	e->flags = 0;
+	snprintf(e->name, sizeof(e->name), "%s", snd_ctl_elem_id_get_name(id));
+	ctl_index_insert(ix, ix->count);
+	ix->count++;
+	return e;
+}
+
+static void ctl_entry_set_info(struct ctl_entry *e, snd_ctl_elem_info_t *info)
+{
+	e->flags |= CTL_INFO;
+	if (snd_ctl_elem_info_is_readable(info))
+		e->flags |= CTL_READABLE;
+	if (snd_ctl_elem_info_is_user(info))
+		e->flags |= CTL_USER;
+	if (snd_ctl_elem_info_is_writable(info) &&
+	    !snd_ctl_elem_info_is_inactive(info))
+		e->flags |= CTL_WRITABLE;
+}
+
+static int ctl_index_build(snd_ctl_t *handle, struct ctl_index *ix)
+{
+	snd_ctl_elem_list_t *list;
+	snd_ctl_elem_id_t *id;
+	unsigned int idx, count;
+	int err;
+	snd_ctl_elem_list_alloca(&list);
+	snd_ctl_elem_id_alloca(&id);
+
+	memset(ix, 0, sizeof(*ix));
+	err = ctl_elem_list(handle, list);
 	if (err < 0)
 		return err;
-	err = -EINVAL;
-	if (!force_restore) {
-		snd_ctl_elem_info_set_numid(info, numid);
-		err = snd_ctl_elem_info(handle, info);
-	}
-	id = snd_ctl_elem_id_get_name(elem_id);
-	if (err < 0 && id && id[0]) {
-		snd_ctl_elem_info_set_id(info, elem_id);
-		err = snd_ctl_elem_info(handle, info);
-		if (err < 0 && comment && check_comment_access(comment, "user")) {
-			err = add_user_control(handle, info, comment);
-			if (err < 0) {
-				cerror(doit, "failed to add user control #%d (%s)",
-				       numid, snd_strerror(err));
-				return err;
-			}
-		}
-	}
-	if (err < 0) {
-		cerror(doit, "failed to obtain info for control #%d (%s)", numid, snd_strerror(err));
-		return -ENOENT;
+	count = snd_ctl_elem_list_get_count(list);
+	if (count == 0)
+		return 0;
+	err = snd_ctl_elem_list_alloc_space(list, count);
+	if (err < 0)
+		return err;
+	err = ctl_elem_list(handle, list);
+	if (err < 0)
+		goto _free;
+	count = snd_ctl_elem_list_get_used(list);
+	err = ctl_index_grow(ix, count);
+	if (err < 0)
+		goto _free;
+	for (idx = 0; idx < count; idx++) {
+		snd_ctl_elem_list_get_id(list, idx, id);
+		ctl_index_add(ix, id);
 	}
-	count = snd_ctl_elem_info_get_count(info);
-	snd_ctl_elem_info_get_id(info, elem_id1);
-	type = snd_ctl_elem_info_get_type(info);
-	err = 0;
-	if (err |= !force_restore && numid != snd_ctl_elem_id_get_numid(elem_id1))
-		cerror(doit, "warning: numid mismatch (%u/%u) for control #%d",
-			     (unsigned int)numid, snd_ctl_elem_id_get_numid(elem_id1), numid);
-	if (err |= snd_ctl_elem_id_get_interface(elem_id) != snd_ctl_elem_id_get_interface(elem_id1))
-		cerror(doit, "warning: iface mismatch (%d/%d) for control #%d",
-			     (int)snd_ctl_elem_id_get_interface(elem_id),
+ _free:
+	snd_ctl_elem_list_free_space(list);
+	return err;
+}
+
+static void ctl_index_free(struct ctl_index *ix)
+{
+	free(ix->entries);
+	free(ix->slots);
+}
+
+/*
+ * The diff and apply commands collect the parsed values in a batch
+ * instead of writing them. The current values are read before anything
+ * is written, and only the differing controls are written then.
+ */
+struct ctl_change {
+	unsigned int numid;
+	int order;
+	snd_ctl_elem_value_t *value;
+};
+
+struct ctl_batch {
+	int card;
+	int apply;
+	struct ctl_change *changes;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int same;
+};
+
+/* the switches which are turned off are written first, turned on last */
+#define ORDER_OFF	0
+#define ORDER_VALUE	1
+#define ORDER_ON	2
+
+static int value_item_differs(snd_ctl_elem_type_t type,
+			      snd_ctl_elem_value_t *v1, snd_ctl_elem_value_t *v2,
+			      unsigned int idx)
+{
+	snd_aes_iec958_t iec1, iec2;
+
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		return snd_ctl_elem_value_get_boolean(v1, idx) !=
+		       snd_ctl_elem_value_get_boolean(v2, idx);
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		return snd_ctl_elem_value_get_integer(v1, idx) !=
+		       snd_ctl_elem_value_get_integer(v2, idx);
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		return snd_ctl_elem_value_get_integer64(v1, idx) !=
+		       snd_ctl_elem_value_get_integer64(v2, idx);
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		return snd_ctl_elem_value_get_enumerated(v1, idx) !=
+		       snd_ctl_elem_value_get_enumerated(v2, idx);
+	case SND_CTL_ELEM_TYPE_BYTES:
+		return snd_ctl_elem_value_get_byte(v1, idx) !=
+		       snd_ctl_elem_value_get_byte(v2, idx);
+	case SND_CTL_ELEM_TYPE_IEC958:
+		snd_ctl_elem_value_get_iec958(v1, &iec1);
+		snd_ctl_elem_value_get_iec958(v2, &iec2);
+		return memcmp(&iec1, &iec2, sizeof(iec1)) != 0;
+	default:
+		return 0;
+	}
+}
+
+static void print_value_item(snd_ctl_elem_type_t type,
+			     snd_ctl_elem_value_t *value, unsigned int idx)
+{
+	switch (type) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		printf("%s", snd_ctl_elem_value_get_boolean(value, idx) ? "true" : "false");
+		break;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		printf("%li", snd_ctl_elem_value_get_integer(value, idx));
+		break;
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		printf("%lli", snd_ctl_elem_value_get_integer64(value, idx));
+		break;
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		printf("%u", snd_ctl_elem_value_get_enumerated(value, idx));
+		break;
+	case SND_CTL_ELEM_TYPE_BYTES:
+		printf("0x%02x", snd_ctl_elem_value_get_byte(value, idx));
+		break;
+	default:
+		break;
+	}
+}
+
+static void print_change(struct ctl_batch *batch, snd_ctl_elem_info_t *info,
+			 snd_ctl_elem_value_t *cur, snd_ctl_elem_value_t *ctl)
+{
+	snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
+	unsigned int idx, count = snd_ctl_elem_info_get_count(info);
+	snd_ctl_elem_id_t *id;
+	char *s;
+	snd_ctl_elem_id_alloca(&id);
+
+	snd_ctl_elem_info_get_id(info, id);
+	s = snd_ctl_ascii_elem_id_get(id);
+	printf("card %i: %s\n", batch->card, s ? s : "?");
+	free(s);
+	if (cur == NULL) {
+		printf("  not readable, written\n");
+		return;
+	}
+	if (type == SND_CTL_ELEM_TYPE_IEC958) {
+		printf("  iec958 status differs\n");
+		return;
+	}
+	for (idx = 0; idx < count; idx++) {
+		if (!value_item_differs(type, cur, ctl, idx))
+			continue;
+		printf("  %u: ", idx);
+		print_value_item(type, cur, idx);
+		printf(" -> ");
+		print_value_item(type, ctl, idx);
+		putchar('\n');
+	}
+}
+
+static int batch_add(struct ctl_batch *batch, snd_ctl_t *handle,
+		     snd_ctl_elem_info_t *info, snd_ctl_elem_value_t *ctl)
+{
+	snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
+	unsigned int idx, count = snd_ctl_elem_info_get_count(info);
+	snd_ctl_elem_value_t *cur;
+	struct ctl_change *c;
+	int err, differs = 0, on = 0;
+	snd_ctl_elem_value_alloca(&cur);
+
+	if (type == SND_CTL_ELEM_TYPE_IEC958)
+		count = 1;
+	/* a write-only control can not be compared, it is always written */
+	if (!snd_ctl_elem_info_is_readable(info)) {
+		cur = NULL;
+		goto __write;
+	}
+	snd_ctl_elem_value_set_numid(cur, snd_ctl_elem_info_get_numid(info));
+	err = ctl_elem_read(handle, cur);
+	if (err < 0) {
+		error("Cannot read control #%u: %s",
+		      snd_ctl_elem_info_get_numid(info), snd_strerror(err));
+		return err;
+	}
+      __write:
+	for (idx = 0; idx < count; idx++) {
+		if (cur && !value_item_differs(type, cur, ctl, idx))
+			continue;
+		differs = 1;
+		if (type == SND_CTL_ELEM_TYPE_BOOLEAN &&
+		    snd_ctl_elem_value_get_boolean(ctl, idx))
+			on = 1;
+	}
+	if (!differs) {
+		batch->same++;
+		return 0;
+	}
+	if (!batch->apply) {
+		print_change(batch, info, cur, ctl);
+		batch->count++;
+		return 0;
+	}
+	if (batch->count >= batch->alloc) {
+		c = realloc(batch->changes, (batch->alloc + 64) * sizeof(*c));
+		if (c == NULL)
+			return -ENOMEM;
+		batch->changes = c;
+		batch->alloc += 64;
+	}
+	c = &batch->changes[batch->count];
+	err = snd_ctl_elem_value_malloc(&c->value);
+	if (err < 0)
+		return err;
+	snd_ctl_elem_value_copy(c->value, ctl);
+	c->numid = snd_ctl_elem_info_get_numid(info);
+	if (type != SND_CTL_ELEM_TYPE_BOOLEAN)
+		c->order = ORDER_VALUE;
+	else
+		c->order = on ? ORDER_ON : ORDER_OFF;
+	batch->count++;
+	return 0;
+}
+
+static int compare_changes(const void *p1, const void *p2)
+{
+	const struct ctl_change *c1 = p1, *c2 = p2;
+
+	if (c1->order != c2->order)
+		return c1->order - c2->order;
+	return c1->numid < c2->numid ? -1 : c1->numid > c2->numid;
+}
+
+/* write the collected changes in one run, in the switch order */
+static int batch_write(struct ctl_batch *batch, snd_ctl_t *handle)
+{
+	unsigned int idx;
+	int err, finalerr = 0;
+
+	qsort(batch->changes, batch->count, sizeof(*batch->changes),
+	      compare_changes);
+	for (idx = 0; idx < batch->count; idx++) {
+		err = ctl_elem_write(handle, batch->changes[idx].value);
+		if (err < 0) {
+			error("Cannot write control #%u : %s",
+			      batch->changes[idx].numid, snd_strerror(err));
+			finalerr = err;
+		}
+	}
+	return finalerr;
+}
+
+static void batch_free(struct ctl_batch *batch)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < batch->count && batch->changes; idx++)
+		snd_ctl_elem_value_free(batch->changes[idx].value);
+	free(batch->changes);
+}
+
+static int set_control(snd_ctl_t *handle, snd_config_t *control, int doit,
+		       struct ctl_index *ix, struct ctl_batch *batch)
+{
+	snd_ctl_elem_value_t *ctl;
+	snd_ctl_elem_info_t *info;
+	snd_config_iterator_t i, next;
+	snd_ctl_elem_id_t *elem_id, *elem_id1;
+	unsigned int numid;
+	snd_ctl_elem_type_t type;
+	unsigned int count;
+	snd_config_t *value = NULL;
+	snd_config_t *comment = NULL;
+	struct ctl_entry *entry = NULL;
+	unsigned int idx;
+	int err;
+	char *set;
+	const char *id;
+	snd_ctl_elem_id_alloca(&elem_id);
+	snd_ctl_elem_id_alloca(&elem_id1);
+	snd_ctl_elem_value_alloca(&ctl);
+	snd_ctl_elem_info_alloca(&info);
+	if (snd_config_get_type(control) != SND_CONFIG_TYPE_COMPOUND) {
+		cerror(doit, "control is not a compound");
+		return -EINVAL;
+	}
+	err = snd_config_get_id(control, &id);
+	if (err < 0) {
+		cerror(doit, "unable to get id");
+		return -EINVAL;
+	}
+	numid = atoi(id);
+	err = parse_config_id(control, elem_id, &comment, &value, doit);
+	if (err < 0)
+		return err;
+	err = -EINVAL;
+	if (!force_restore) {
+		snd_ctl_elem_info_set_numid(info, numid);
+		err = ctl_elem_info(handle, info);
+	}
+	id = snd_ctl_elem_id_get_name(elem_id);
+	if (err < 0 && id && id[0]) {
+		entry = ctl_index_find(ix, elem_id);
+		if (entry) {
+			snd_ctl_elem_info_set_numid(info, entry->numid);
+			err = ctl_elem_info(handle, info);
+		} else {
+			err = -ENOENT;
+		}
+		/* the diff command does not add the user controls */
+		if (err < 0 && comment && check_comment_access(comment, "user") &&
+		    (batch == NULL || batch->apply)) {
+			snd_ctl_elem_info_clear(info);
+			snd_ctl_elem_info_set_id(info, elem_id);
+			err = add_user_control(handle, info, comment);
+			if (err < 0) {
+				cerror(doit, "failed to add user control #%d (%s)",
+				       numid, snd_strerror(err));
+				return err;
+			}
+			entry = NULL;
+		}
+	}
+	if (err < 0) {
+		cerror(doit, "failed to obtain info for control #%d (%s)", numid, snd_strerror(err));
+		return -ENOENT;
+	}
+	count = snd_ctl_elem_info_get_count(info);
+	snd_ctl_elem_info_get_id(info, elem_id1);
+	if (entry == NULL)
+		entry = ctl_index_find(ix, elem_id1);
+	if (entry == NULL)
+		entry = ctl_index_add(ix, elem_id1);
+	if (entry) {
+		entry->flags |= CTL_MATCHED;
+		ctl_entry_set_info(entry, info);
+	}
+	type = snd_ctl_elem_info_get_type(info);
+	err = 0;
+	if (err |= !force_restore && numid != snd_ctl_elem_id_get_numid(elem_id1))
+		cerror(doit, "warning: numid mismatch (%u/%u) for control #%d",
+			     (unsigned int)numid, snd_ctl_elem_id_get_numid(elem_id1), numid);
+	if (err |= snd_ctl_elem_id_get_interface(elem_id) != snd_ctl_elem_id_get_interface(elem_id1))
+		cerror(doit, "warning: iface mismatch (%d/%d) for control #%d",
+			     (int)snd_ctl_elem_id_get_interface(elem_id),
 			     (int)snd_ctl_elem_id_get_interface(elem_id1),
 			     numid);
 	if (err |= snd_ctl_elem_id_get_device(elem_id) != snd_ctl_elem_id_get_device(elem_id1))
@@ -1515,7 +2068,12 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control, int doit)
 	}
 
  _ok:
-	err = doit ? snd_ctl_elem_write(handle, ctl) : 0;
+	if (batch)
+		return batch_add(batch, handle, info, ctl);
+	err = 0;
+	if (doit) {
+		err = ctl_elem_write(handle, ctl);
+	}
 	if (err < 0) {
 		char *s = snd_ctl_ascii_elem_id_get(elem_id1);
 		error("Cannot write control '%s' : %s", s, snd_strerror(err));
@@ -1529,98 +2087,105 @@ static int set_control(snd_ctl_t *handle, snd_config_t *control, int doit)
 	return 0;
 }
 
+/* find state.<id>.control for the card */
+static int find_card_state(snd_config_t *top, int card, const char *id,
+			   snd_config_t **control, int doit)
+{
+	char tmpid[16];
+	int err;
+
+	dbg("card-info-id: '%s'", id);
+	err = snd_config_searchv(top, control, "state", id, "control", 0);
+	if (err < 0) {
+		if (force_restore) {
+			sprintf(tmpid, "card%d", card);
+			err = snd_config_searchv(top, control, "state", tmpid, "control", 0);
+			if (! err)
+				id = tmpid;
+		}
+		if (err < 0) {
+			fprintf(stderr, "No state is present for card %s\n", id);
+			return err;
+		}
+	}
+	if (snd_config_get_type(*control) != SND_CONFIG_TYPE_COMPOUND) {
+		cerror(doit, "state.%s.control is not a compound\n", id);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 static int set_controls(int card, snd_config_t *top, int doit)
 {
 	snd_ctl_t *handle;
 	snd_ctl_card_info_t *info;
-	snd_ctl_elem_list_t *list;
 	snd_ctl_elem_info_t *elem_info;
-	snd_ctl_elem_id_t *elem_id;
 	snd_config_t *control;
 	snd_config_iterator_t i, next;
+	struct ctl_index ix;
+	struct ctl_entry *e;
+	struct profile_span span, cspan;
 	int err, controls1 = -1, controls2 = -1, ucontrols = -1, diff;
-	unsigned int idx, count = 0;
-	char name[32], tmpid[16];
-	const char *id;
+	unsigned int idx;
+	char name[32];
 	snd_ctl_card_info_alloca(&info);
-	snd_ctl_elem_list_alloca(&list);
 	snd_ctl_elem_info_alloca(&elem_info);
-	snd_ctl_elem_id_alloca(&elem_id);
 	sprintf(name, "hw:%d", card);
 	dbg("device='%s', doit=%i", name, doit);
+	memset(&ix, 0, sizeof(ix));
+	profile_begin(&span, PROFILE_RESTORE, card);
 	err = snd_ctl_open(&handle, name, 0);
 	if (err < 0) {
 		error("snd_ctl_open error: %s", snd_strerror(err));
+		profile_end(&span);
 		return err;
 	}
-	err = snd_ctl_card_info(handle, info);
+	err = ctl_card_info(handle, info);
 	if (err < 0) {
 		error("snd_ctl_card_info error: %s", snd_strerror(err));
 		goto _close;
 	}
-	id = snd_ctl_card_info_get_id(info);
-	dbg("card-info-id: '%s'", id);
-	err = snd_config_searchv(top, &control, "state", id, "control", 0);
+	err = find_card_state(top, card, snd_ctl_card_info_get_id(info),
+			      &control, doit);
+	if (err < 0)
+		goto _close;
+	err = ctl_index_build(handle, &ix);
 	if (err < 0) {
-		if (force_restore) {
-			sprintf(tmpid, "card%d", card);
-			err = snd_config_searchv(top, &control, "state", tmpid, "control", 0);
-			if (! err)
-				id = tmpid;
-		}
-		if (err < 0) {
-			fprintf(stderr, "No state is present for card %s\n", id);
-			goto _close;
-		}
-		id = tmpid;
-	}
-	if (snd_config_get_type(control) != SND_CONFIG_TYPE_COMPOUND) {
-		cerror(doit, "state.%s.control is not a compound\n", id);
-		return -EINVAL;
+		error("Cannot determine controls: %s", snd_strerror(err));
+		goto _free;
 	}
+	dbg("list count: %u", ix.count);
 	controls1 = 0;
 	snd_config_for_each(i, next, control) {
 		snd_config_t *n = snd_config_iterator_entry(i);
-		err = set_control(handle, n, doit);
+		profile_begin(&cspan, PROFILE_CONTROL, card);
+		err = set_control(handle, n, doit, &ix, NULL);
+		profile_end(&cspan);
 		if (err < 0 && (!force_restore || !doit))
-			goto _close;
+			goto _free;
 		controls1++;
 	}
 
-	if (doit)
-		goto _close;
-
-	err = snd_ctl_elem_list(handle, list);
-	if (err < 0) {
-		error("Cannot determine controls: %s", snd_strerror(err));
-		goto _close;
-	}
-	count = snd_ctl_elem_list_get_count(list);
-	dbg("list count: %u", count);
-	if (count == 0)
-		goto _free;
-	snd_ctl_elem_list_set_offset(list, 0);
-	if (snd_ctl_elem_list_alloc_space(list, count) < 0) {
-		error("No enough memory...");
-		goto _close;
-	}
-	if ((err = snd_ctl_elem_list(handle, list)) < 0) {
-		error("Cannot determine controls (2): %s", snd_strerror(err));
+	if (doit || ix.count == 0)
 		goto _free;
-	}
+
 	controls2 = ucontrols = 0;
-	/* skip non-readable and count user elements */
-	for (idx = 0; idx < count; ++idx) {
-		snd_ctl_elem_info_clear(elem_info);
-		snd_ctl_elem_list_get_id(list, idx, elem_id);
-		snd_ctl_elem_info_set_id(elem_info, elem_id);
-		if (snd_ctl_elem_info(handle, elem_info) == 0) {
-			if (snd_ctl_elem_info_is_user(elem_info))
-				ucontrols++;
-			if (!snd_ctl_elem_info_is_readable(elem_info))
+	/* skip non-readable and count user elements, only the controls */
+	/* without a saved state are queried */
+	for (idx = 0; idx < ix.count; ++idx) {
+		e = &ix.entries[idx];
+		if (!(e->flags & CTL_INFO)) {
+			snd_ctl_elem_info_clear(elem_info);
+			snd_ctl_elem_info_set_numid(elem_info, e->numid);
+			if (ctl_elem_info(handle, elem_info) < 0)
 				continue;
-			controls2++;
+			ctl_entry_set_info(e, elem_info);
 		}
+		if (e->flags & CTL_USER)
+			ucontrols++;
+		if (!(e->flags & CTL_READABLE))
+			continue;
+		controls2++;
 	}
 
 	/* check if we have additional controls in driver */
@@ -1635,56 +2200,181 @@ static int set_controls(int card, snd_config_t *top, int doit)
 	}
 
  _free:
-	if (count > 0)
-		snd_ctl_elem_list_free_space(list);
+	ctl_index_free(&ix);
  _close:
 	snd_ctl_close(handle);
+	profile_end(&span);
 	dbg("result code: %i", err);
 	return err;
 }
 
+/*
+ * Compare the state with the current control values. In the apply mode,
+ * the values are read before any write and only the differing controls
+ * are written under the card lock: the switches turned off first, the
+ * other values and the switches turned on last, so the path is never
+ * enabled with the old levels.
+ */
+static int diff_controls(int card, snd_config_t *top, int apply)
+{
+	snd_ctl_t *handle;
+	snd_ctl_card_info_t *info;
+	snd_config_t *control;
+	snd_config_iterator_t i, next;
+	struct ctl_index ix;
+	struct ctl_batch batch;
+	struct ctl_entry *e;
+	snd_ctl_elem_id_t *id;
+	int err, lock_fd = -EINVAL, missing = 0, failed = 0, extra = 0;
+	unsigned int idx;
+	char name[32], *s;
+	snd_ctl_card_info_alloca(&info);
+	snd_ctl_elem_id_alloca(&id);
+	sprintf(name, "hw:%d", card);
+	dbg("device='%s', apply=%i", name, apply);
+	memset(&ix, 0, sizeof(ix));
+	memset(&batch, 0, sizeof(batch));
+	batch.card = card;
+	batch.apply = apply;
+	if (apply) {
+		lock_fd = card_lock(card, LOCK_TIMEOUT);
+		if (lock_fd < 0)
+			return lock_fd;
+	}
+	err = snd_ctl_open(&handle, name, 0);
+	if (err < 0) {
+		error("snd_ctl_open error: %s", snd_strerror(err));
+		goto _unlock;
+	}
+	err = ctl_card_info(handle, info);
+	if (err < 0) {
+		error("snd_ctl_card_info error: %s", snd_strerror(err));
+		goto _close;
+	}
+	err = find_card_state(top, card, snd_ctl_card_info_get_id(info),
+			      &control, 1);
+	if (err < 0)
+		goto _close;
+	err = ctl_index_build(handle, &ix);
+	if (err < 0) {
+		error("Cannot determine controls: %s", snd_strerror(err));
+		goto _free;
+	}
+	snd_config_for_each(i, next, control) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *cid;
+		err = set_control(handle, n, apply, &ix, &batch);
+		if (err == -ENOMEM)
+			goto _free;
+		if (err == -ENOENT) {
+			if (snd_config_get_id(n, &cid) < 0)
+				cid = "?";
+			printf("card %i: control #%s is not present\n", card, cid);
+			missing++;
+		} else if (err < 0) {
+			if (snd_config_get_id(n, &cid) < 0)
+				cid = "?";
+			printf("card %i: control #%s failed: %s\n",
+			       card, cid, snd_strerror(err));
+			failed++;
+		}
+	}
+	err = 0;
+	/* the writable controls which are not saved in the state */
+	for (idx = 0; idx < ix.count; idx++) {
+		e = &ix.entries[idx];
+		if (e->flags & CTL_MATCHED)
+			continue;
+		if (!(e->flags & CTL_INFO)) {
+			snd_ctl_elem_info_t *elem_info;
+			snd_ctl_elem_info_alloca(&elem_info);
+			snd_ctl_elem_info_set_numid(elem_info, e->numid);
+			if (ctl_elem_info(handle, elem_info) < 0)
+				continue;
+			ctl_entry_set_info(e, elem_info);
+		}
+		if (!(e->flags & CTL_WRITABLE) || !(e->flags & CTL_READABLE))
+			continue;
+		snd_ctl_elem_id_clear(id);
+		snd_ctl_elem_id_set_numid(id, e->numid);
+		snd_ctl_elem_id_set_interface(id, e->iface);
+		snd_ctl_elem_id_set_device(id, e->device);
+		snd_ctl_elem_id_set_subdevice(id, e->subdevice);
+		snd_ctl_elem_id_set_name(id, e->name);
+		snd_ctl_elem_id_set_index(id, e->index);
+		s = snd_ctl_ascii_elem_id_get(id);
+		printf("card %i: %s is not in the state file\n", card, s ? s : "?");
+		free(s);
+		extra++;
+	}
+	if (apply) {
+		err = batch_write(&batch, handle);
+		printf("card %i: %u controls written, %u unchanged\n",
+		       card, batch.count, batch.same);
+	} else {
+		printf("card %i: %u changed, %u unchanged, %i missing, %i not saved\n",
+		       card, batch.count, batch.same, missing, extra);
+	}
+	if (err == 0 && failed)
+		err = -EINVAL;
+
+ _free:
+	batch_free(&batch);
+	ctl_index_free(&ix);
+ _close:
+	snd_ctl_close(handle);
+ _unlock:
+	if (lock_fd >= 0)
+		card_unlock(lock_fd, card);
+	dbg("result code: %i", err);
+	return err;
+}
+
+int diff_state(const char *file, const char *cardname, int apply)
+{
+	snd_config_t *config = NULL;
+	struct snd_card_iterator iter;
+	int err, finalerr = 0, open_failed;
+
+	err = load_configuration(file, &config, &open_failed);
+	if (err < 0) {
+		if (open_failed)
+			error("Cannot open %s for reading: %s", file, snd_strerror(err));
+		return err;
+	}
+	err = snd_card_iterator_sinit(&iter, cardname);
+	if (err < 0)
+		goto out;
+	while (snd_card_iterator_next(&iter)) {
+		err = diff_controls(iter.card, config, apply);
+		if (err < 0)
+			finalerr = err;
+	}
+	err = finalerr ? finalerr : snd_card_iterator_error(&iter);
+out:
+	snd_config_delete(config);
+	snd_config_update_free_global();
+	return err;
+}
+
 int save_state(const char *file, const char *cardname)
 {
 	int err;
-	snd_config_t *config;
-	snd_input_t *in;
-	snd_output_t *out;
+	snd_config_t *config = NULL;
 	int stdio;
-	char *nfile = NULL;
 	int lock_fd = -EINVAL;
 	struct snd_card_iterator iter;
+	struct snapshot *snap = NULL;
 
-	err = snd_config_top(&config);
-	if (err < 0) {
-		error("snd_config_top error: %s", snd_strerror(err));
-		return err;
-	}
 	stdio = !strcmp(file, "-");
 	if (!stdio) {
-		nfile = malloc(strlen(file) + 5);
-		if (nfile == NULL) {
-			error("No enough memory...");
-			err = -ENOMEM;
-			goto out;
-		}
-		strcpy(nfile, file);
-		strcat(nfile, ".new");
 		lock_fd = state_lock(file, LOCK_TIMEOUT);
-		if (lock_fd < 0) {
-			err = lock_fd;
-			goto out;
-		}
-	}
-	if (!stdio && (err = snd_input_stdio_open(&in, file, "r")) >= 0) {
-		err = snd_config_load(config, in);
-		snd_input_close(in);
-#if 0
-		if (err < 0) {
-			error("snd_config_load error: %s", snd_strerror(err));
-			goto out;
-		}
-#endif
+		if (lock_fd < 0)
+			return lock_fd;
 	}
+	err = state_config_load(file, &config);
+	if (err < 0)
+		goto out;
 
 	err = snd_card_iterator_sinit(&iter, cardname);
 	if (err < 0)
@@ -1698,48 +2388,168 @@ int save_state(const char *file, const char *cardname)
 		goto out;
 	}
 
-	if (stdio) {
-		err = snd_output_stdio_attach(&out, stdout, 0);
-	} else {
-		err = snd_output_stdio_open(&out, nfile, "w");
-	}
-	if (err < 0) {
-		error("Cannot open %s for writing: %s", file, snd_strerror(err));
-		err = -errno;
-		goto out;
-	}
-	err = snd_config_save(config, out);
-	snd_output_close(out);
-	if (err < 0) {
-		error("snd_config_save: %s", snd_strerror(err));
-	} else if (nfile) {
-		err = rename(nfile, file);
-		if (err < 0)
-			error("rename failed: %s (%s)", strerror(-err), file);
-	}
+	/* the records of the other cards are valid only for the old file */
+	if (!stdio && use_snapshot && cardname)
+		snapshot_load(file, &snap);
+	err = state_config_save(file, config);
+	if (err >= 0 && !stdio && use_snapshot)
+		snapshot_save(file, cardname, snap);
 out:
 	if (!stdio && lock_fd >= 0)
 		state_unlock(lock_fd, file);
-	free(nfile);
-	snd_config_delete(config);
+	snapshot_free(snap);
+	if (config)
+		snd_config_delete(config);
 	snd_config_update_free_global();
 	return err;
 }
 
+struct restore_ctx {
+	const char *cfgdir;
+	const char *file;
+	const char *initfile;
+	int initflags;
+	int do_init;
+	snd_config_t *config;
+	struct snapshot *snap;
+};
+
+/* restore from the snapshot, the text state is parsed only when needed */
+static int restore_controls(struct restore_ctx *ctx, int cardno)
+{
+	int err;
+
+	if (ctx->snap && snapshot_restore(ctx->snap, cardno) == 0)
+		return 0;
+	if (ctx->config == NULL) {
+		err = load_configuration(ctx->file, &ctx->config, NULL);
+		if (err < 0)
+			return err;
+	}
+	return set_controls(cardno, ctx->config, 1);
+}
+
+/* no state file, only the init */
+static int init_card(void *arg, int cardno, const char *name, struct card_job *job)
+{
+	struct restore_ctx *ctx = arg;
+	int err, lock_fd;
+
+	init_linked_cards();
+	if (ctx->initflags & FLAG_UCM_WAIT)
+		wait_for_card(-1, cardno);
+	lock_fd = card_lock(cardno, LOCK_TIMEOUT);
+	if (lock_fd < 0) {
+		initfailed(cardno, "lock", lock_fd);
+		return lock_fd;
+	}
+	err = init(ctx->cfgdir, ctx->initfile, ctx->initflags | FLAG_UCM_FBOOT | FLAG_UCM_BOOT, name);
+	card_unlock(lock_fd, cardno);
+	if (card_state_is_okay(err))
+		job->state = err;
+	if (err < 0) {
+		initfailed(cardno, "init", err);
+		return err;
+	}
+	initfailed(cardno, "restore", -ENOENT);
+	return 0;
+}
+
+static int restore_card(void *arg, int cardno, const char *name, struct card_job *job)
+{
+	struct restore_ctx *ctx = arg;
+	int err, finalerr = 0, lock_fd, linked;
+	size_t index;
+
+	init_linked_cards();
+	if (ctx->initflags & FLAG_UCM_WAIT)
+		wait_for_card(-1, cardno);
+	lock_fd = card_lock(cardno, LOCK_TIMEOUT);
+	if (lock_fd < 0) {
+		initfailed(cardno, "lock", lock_fd);
+		return lock_fd;
+	}
+	/* error is ignored */
+	err = init_ucm(ctx->cfgdir, ctx->initflags | FLAG_UCM_FBOOT, cardno);
+	/* return code 1 and 2 -> postpone initialization */
+	if (card_state_is_okay(err)) {
+		job->state = err;
+		goto unlock_card;
+	} else if (err < 0) {
+		/* no UCM - remove card specific configuration */
+		err = snd_card_clean_cfgdir(ctx->cfgdir, cardno);
+		if (err < 0) {
+			initfailed(cardno, "cfgdir", err);
+			finalerr = err;
+			goto unlock_card;
+		}
+	}
+	/* the snapshot matches the card, no init is required */
+	if (ctx->snap && snapshot_restore(ctx->snap, cardno) == 0)
+		goto linked;
+	if (ctx->config == NULL) {
+		err = load_configuration(ctx->file, &ctx->config, NULL);
+		if (err < 0) {
+			initfailed(cardno, "restore", err);
+			finalerr = err;
+			goto unlock_card;
+		}
+	}
+	/* do a check if controls matches state file */
+	if (ctx->do_init && set_controls(cardno, ctx->config, 0)) {
+		err = init(ctx->cfgdir, ctx->initfile, ctx->initflags | FLAG_UCM_BOOT, name);
+		if (err < 0) {
+			initfailed(cardno, "init", err);
+			finalerr = err;
+		}
+	}
+	if ((err = set_controls(cardno, ctx->config, 1))) {
+		if (!force_restore)
+			finalerr = err;
+		initfailed(cardno, "restore", err);
+	}
+linked:
+	/* for linked cards, restore controls, too */
+	for (index = 0; index < ARRAY_SIZE(linked_cards); index++) {
+		if ((linked = linked_cards[index]) < 0)
+			break;
+		dbg("Restore for linked card %d", linked);
+		if ((err = restore_controls(ctx, linked))) {
+			if (!force_restore)
+				finalerr = err;
+			initfailed(linked, "restore", err);
+		}
+	}
+unlock_card:
+	card_unlock(lock_fd, cardno);
+	return finalerr;
+}
+
 int load_state(const char *cfgdir, const char *file,
 	       const char *initfile, int initflags,
 	       const char *cardname, int do_init)
 {
-	int err, finalerr = 0, open_failed, lock_fd, cardno;
+	int err, finalerr = 0, open_failed = 0;
 	struct snd_card_iterator iter;
-	snd_config_t *config;
-	const char *cardname1;
-	size_t index;
+	struct profile_span span;
+	struct restore_ctx ctx = {
+		.cfgdir = cfgdir,
+		.file = file,
+		.initfile = initfile,
+		.initflags = initflags,
+		.do_init = do_init,
+	};
 
-	config = NULL;
-	err = load_configuration(file, &config, &open_failed);
-	if (err < 0 && !open_failed)
-		return err;
+	if (use_snapshot) {
+		profile_begin(&span, PROFILE_CONFIG, -1);
+		snapshot_load(file, &ctx.snap);
+		profile_end(&span);
+	}
+	if (ctx.snap == NULL) {
+		err = load_configuration(file, &ctx.config, &open_failed);
+		if (err < 0 && !open_failed)
+			return err;
+	}
 
 	if (open_failed) {
 		error("Cannot open %s for reading: %s", file, snd_strerror(err));
@@ -1748,28 +2558,12 @@ int load_state(const char *cfgdir, const char *file,
 		err = snd_card_iterator_sinit(&iter, cardname);
 		if (err < 0)
 			return err;
-		while ((cardname1 = snd_card_iterator_next(&iter)) != NULL) {
-			if (!do_init)
-				break;
-			init_linked_cards();
-			if (initflags & FLAG_UCM_WAIT)
-				wait_for_card(-1, iter.card);
-			lock_fd = card_lock(iter.card, LOCK_TIMEOUT);
-			if (lock_fd < 0) {
-				finalerr = lock_fd;
-				initfailed(iter.card, "lock", err);
-				continue;
-			}
-			err = init(cfgdir, initfile, initflags | FLAG_UCM_FBOOT | FLAG_UCM_BOOT, cardname1);
-			card_unlock(lock_fd, iter.card);
-			if (card_state_is_okay(err))
-				export_card_state_set(iter.card, err);
-			if (err < 0) {
+		if (do_init) {
+			err = card_pool_run(&iter, init_card, &ctx);
+			if (err < 0)
 				finalerr = err;
-				initfailed(iter.card, "init", err);
-				continue;
-			}
-			initfailed(iter.card, "restore", -ENOENT);
+		} else {
+			snd_card_iterator_next(&iter);
 		}
 		err = finalerr;
 		if (iter.first)
@@ -1780,62 +2574,12 @@ int load_state(const char *cfgdir, const char *file,
 	err = snd_card_iterator_sinit(&iter, cardname);
 	if (err < 0)
 		goto out;
-	while ((cardname1 = snd_card_iterator_next(&iter)) != NULL) {
-		init_linked_cards();
-		if (initflags & FLAG_UCM_WAIT)
-			wait_for_card(-1, iter.card);
-		lock_fd = card_lock(iter.card, LOCK_TIMEOUT);
-		if (lock_fd < 0) {
-			initfailed(iter.card, "lock", lock_fd);
-			finalerr = lock_fd;
-			continue;
-		}
-		/* error is ignored */
-		err = init_ucm(cfgdir, initflags | FLAG_UCM_FBOOT, iter.card);
-		/* return code 1 and 2 -> postpone initialization */
-		if (card_state_is_okay(err)) {
-			export_card_state_set(iter.card, err);
-			goto unlock_card;
-		} else if (err < 0) {
-			/* no UCM - remove card specific configuration */
-			err = snd_card_clean_cfgdir(cfgdir, iter.card);
-			if (err < 0) {
-				initfailed(iter.card, "cfgdir", err);
-				finalerr = err;
-				continue;
-			}
-		}
-		/* do a check if controls matches state file */
-		if (do_init && set_controls(iter.card, config, 0)) {
-			err = init(cfgdir, initfile, initflags | FLAG_UCM_BOOT, cardname1);
-			if (err < 0) {
-				initfailed(iter.card, "init", err);
-				finalerr = err;
-			}
-		}
-		if ((err = set_controls(iter.card, config, 1))) {
-			if (!force_restore)
-				finalerr = err;
-			initfailed(iter.card, "restore", err);
-		}
-		/* for linked cards, restore controls, too */
-		for (index = 0; index < ARRAY_SIZE(linked_cards); index++) {
-			if ((cardno = linked_cards[index]) < 0)
-				break;
-			dbg("Restore for linked card %d", cardno);
-			if ((err = set_controls(cardno, config, 1))) {
-				if (!force_restore)
-					finalerr = err;
-				initfailed(cardno, "restore", err);
-			}
-		}
-unlock_card:
-		card_unlock(lock_fd, iter.card);
-	}
+	finalerr = card_pool_run(&iter, restore_card, &ctx);
 	err = finalerr ? finalerr : snd_card_iterator_error(&iter);
 out:
-	if (config)
-		snd_config_delete(config);
+	snapshot_free(ctx.snap);
+	if (ctx.config)
+		snd_config_delete(ctx.config);
 	snd_config_update_free_global();
 	return err;
 }
@@ -221,6 +221,7 @@ int load_configuration(const char *file, snd_config_t **top, int *open_failed)
 {
 	snd_config_t *config;
 	snd_input_t *in;
+	struct profile_span span;
 	int err, stdio_flag, lock_fd = -EINVAL;
 
 	*top = NULL;
@@ -243,7 +244,9 @@ int load_configuration(const char *file, snd_config_t **top, int *open_failed)
 			*open_failed = 1;
 		goto out;
 	}
+	profile_begin(&span, PROFILE_CONFIG, -1);
 	err = snd_config_load(config, in);
+	profile_end(&span);
 	snd_input_close(in);
 	if (err < 0) {
 		error("snd_config_load error: %s", snd_strerror(err));
@@ -23,23 +23,17 @@
 #include "version.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <alsa/asoundlib.h>
 #include "alsactl.h"
 
-/**
- * \brief Wait for card boot synchronization using Boot control element
- * \param timeout Maximum wait time in seconds
- * \param cardno Card number
- * \return 0 on success, negative error code on failure
- *
- * This function waits until the card releases the 'waiting' state (UCM).
- * It monitors the '.Boot' control element and uses snd_ctl_wait() and
- * snd_ctl_read() for event-based waiting, similar to boot_wait() in
- * ../alsa-lib/alsa-lib/src/ucm/main.c
- */
-int wait_for_card(long long timeout, int cardno)
+/* the wait itself, profiled by wait_for_card() */
+static int wait_for_card_(long long timeout, int cardno)
 {
 	snd_ctl_t *handle;
 	snd_ctl_event_t *event;
@@ -86,7 +80,7 @@ int wait_for_card(long long timeout, int cardno)
 	snd_ctl_elem_id_set_name(id, ".Boot");
 
 	snd_ctl_elem_info_set_id(info, id);
-	err = snd_ctl_elem_info(handle, info);
+	err = ctl_elem_info(handle, info);
 	if (err < 0) {
 		dbg("Boot control element not present on card %d, skipping wait", cardno);
 		snd_ctl_close(handle);
@@ -198,3 +192,480 @@ _fin:
 	snd_ctl_close(handle);
 	return err;
 }
+
+/**
+ * \brief Wait for card boot synchronization using Boot control element
+ * \param timeout Maximum wait time in seconds
+ * \param cardno Card number
+ * \return 0 on success, negative error code on failure
+ *
+ * This function waits until the card releases the 'waiting' state (UCM).
+ * It monitors the '.Boot' control element and uses snd_ctl_wait() and
+ * snd_ctl_read() for event-based waiting, similar to boot_wait() in
+ * ../alsa-lib/alsa-lib/src/ucm/main.c
+ */
+int wait_for_card(long long timeout, int cardno)
+{
+	struct profile_span span;
+	int err;
+
+	profile_begin(&span, PROFILE_WAIT, cardno);
+	err = wait_for_card_(timeout, cardno);
+	profile_end(&span);
+	return err;
+}
+
+/*
+ * The concurrent wait: all cards share one epoll set and one deadline.
+ * The cards which are not present yet are opened when their device
+ * appears in /dev/snd (inotify). A card is ready under the same
+ * conditions as in wait_for_card().
+ */
+
+#define WAIT_TAG_INOTIFY	0
+#define WAIT_TAG_CARD		1
+
+struct wait_card {
+	int card;
+	snd_ctl_t *handle;
+	bool ready;		/* ready or failed, the wait is over */
+	int error;		/* failed with this error */
+	const char *reason;
+	long long expire;	/* end of the boot sync window (seconds), -1 = none */
+	long long time;		/* ready or failed after (ms) */
+	struct profile_span span;
+};
+
+struct wait_set {
+	struct wait_card *cards;
+	int count;
+	int pending;
+	int epfd;
+	int ifd;
+	int wd;			/* /dev/snd watch, -1 when /dev is watched */
+	long long start;	/* ms */
+	long long timeout;	/* seconds */
+};
+
+static long long wait_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int wait_add_card(struct wait_set *ws, int card)
+{
+	struct wait_card *w;
+	int i;
+
+	for (i = 0; i < ws->count; i++) {
+		if (ws->cards[i].card == card)
+			return 0;
+	}
+	w = realloc(ws->cards, (ws->count + 1) * sizeof(*w));
+	if (w == NULL)
+		return -ENOMEM;
+	ws->cards = w;
+	w = &ws->cards[ws->count++];
+	memset(w, 0, sizeof(*w));
+	w->card = card;
+	w->expire = -1;
+	return 0;
+}
+
+/* the group cards and the longest group sync time */
+static int wait_collect(struct wait_set *ws, int cardno, const char *group, int all)
+{
+	snd_config_t *config = NULL, *card_compound;
+	snd_config_iterator_t i, next, j, jnext;
+	long long synctime;
+	bool found = false, member;
+	long card_val;
+	const char *id;
+	int err, card;
+
+	err = card_group_load(&config);
+	if (err < 0)
+		return err;
+	snd_config_for_each(i, next, config) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		if (snd_config_get_id(n, &id) < 0 ||
+		    snd_config_get_type(n) != SND_CONFIG_TYPE_COMPOUND)
+			continue;
+		if (group && strcmp(group, id))
+			continue;
+		if (snd_config_search(n, "card", &card_compound) < 0)
+			continue;
+		member = group || all;
+		snd_config_for_each(j, jnext, card_compound) {
+			snd_config_t *c = snd_config_iterator_entry(j);
+			if (snd_config_get_integer(c, &card_val) < 0)
+				continue;
+			if (cardno >= 0) {
+				if (card_val == cardno)
+					member = true;
+				continue;
+			}
+			if (!member)
+				continue;
+			err = wait_add_card(ws, card_val);
+			if (err < 0)
+				goto out;
+		}
+		if (!member)
+			continue;
+		found = true;
+		if (card_group_get_int64(n, "boot_synctime", &synctime) >= 0 &&
+		    synctime > ws->timeout)
+			ws->timeout = synctime;
+	}
+	if (group && !found) {
+		error("Card group '%s' not found", group);
+		err = -ENOENT;
+		goto out;
+	}
+	if (cardno >= 0) {
+		err = wait_add_card(ws, cardno);
+	} else if (group == NULL) {
+		/* the present cards */
+		card = -1;
+		while (snd_card_next(&card) >= 0 && card >= 0) {
+			err = wait_add_card(ws, card);
+			if (err < 0)
+				goto out;
+		}
+	}
+	err = 0;
+out:
+	if (config)
+		snd_config_delete(config);
+	return err;
+}
+
+/* the wait for the card is over, it failed with a non-zero error */
+static void wait_card_done(struct wait_set *ws, struct wait_card *w,
+			   const char *reason, int err)
+{
+	w->ready = true;
+	w->error = err;
+	w->reason = reason;
+	w->time = wait_time() - ws->start;
+	profile_end(&w->span);
+	if (w->handle) {
+		snd_ctl_subscribe_events(w->handle, 0);
+		snd_ctl_close(w->handle);
+		w->handle = NULL;
+	}
+	ws->pending--;
+	dbg("card %d %s in %lld ms (%s)", w->card, err ? "failed" : "ready",
+	    w->time, reason);
+}
+
+static void wait_card_ready(struct wait_set *ws, struct wait_card *w,
+			    const char *reason)
+{
+	wait_card_done(ws, w, reason, 0);
+}
+
+/* the card can not be waited for, it is not counted as ready */
+static void wait_card_failed(struct wait_set *ws, struct wait_card *w,
+			     const char *reason, int err)
+{
+	wait_card_done(ws, w, reason, err);
+}
+
+/* read the Boot control and decide if the card is still booting */
+static void wait_card_check(struct wait_set *ws, struct wait_card *w)
+{
+	long long boot_time, sync_time = -1, restore_time, timeout = ws->timeout;
+	int err;
+
+	err = read_boot_params(w->handle, &boot_time, &sync_time, &restore_time, NULL);
+	if (err < 0) {
+		error("Failed to read Boot control element: %s", snd_strerror(err));
+		wait_card_failed(ws, w, "boot control error", err);
+		return;
+	}
+	if (restore_time > 0) {
+		wait_card_ready(ws, w, "restored");
+		return;
+	}
+	if (sync_time > 0 && sync_time < timeout)
+		timeout = sync_time;
+	if (!validate_boot_time(boot_time, wait_time() / 1000, timeout)) {
+		wait_card_ready(ws, w, "boot sync time elapsed");
+		return;
+	}
+	w->expire = boot_time + timeout;
+}
+
+/* open the card when present and add it to the epoll set */
+static void wait_card_open(struct wait_set *ws, struct wait_card *w)
+{
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_info_t *info;
+	struct epoll_event ev = {0};
+	struct pollfd pfd;
+	bool valid = false, restored = false;
+	long long synctime = -1;
+	char name[32];
+	int err;
+	snd_ctl_elem_id_alloca(&id);
+	snd_ctl_elem_info_alloca(&info);
+
+	sprintf(name, "hw:%d", w->card);
+	if (snd_ctl_open(&w->handle, name, SND_CTL_READONLY|SND_CTL_NONBLOCK) < 0) {
+		w->handle = NULL;
+		return;
+	}
+	dbg("card %d is present", w->card);
+	err = check_boot_params_validity(w->handle, w->card, NULL, &valid, NULL, &restored, NULL, &synctime);
+	if (err < 0 || !valid || restored) {
+		wait_card_ready(ws, w, restored ? "restored" : "no valid boot group");
+		return;
+	}
+	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_CARD);
+	snd_ctl_elem_id_set_name(id, ".Boot");
+	snd_ctl_elem_info_set_id(info, id);
+	if (ctl_elem_info(w->handle, info) < 0) {
+		wait_card_ready(ws, w, "no boot control");
+		return;
+	}
+	if (snd_ctl_elem_info_get_type(info) != SND_CTL_ELEM_TYPE_INTEGER64 ||
+	    snd_ctl_elem_info_get_count(info) < 3) {
+		error("Boot control element is invalid on card %d", w->card);
+		wait_card_failed(ws, w, "invalid boot control", -EINVAL);
+		return;
+	}
+	err = snd_ctl_subscribe_events(w->handle, 1);
+	if (err < 0) {
+		error("Cannot subscribe to control events: %s", snd_strerror(err));
+		wait_card_failed(ws, w, "no events", err);
+		return;
+	}
+	if (snd_ctl_poll_descriptors(w->handle, &pfd, 1) != 1) {
+		error("Cannot get the poll descriptor of card %d", w->card);
+		wait_card_failed(ws, w, "no events", -EIO);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = WAIT_TAG_CARD + (w - ws->cards);
+	if (epoll_ctl(ws->epfd, EPOLL_CTL_ADD, pfd.fd, &ev) < 0) {
+		err = -errno;
+		error("Cannot watch card %d: %s", w->card, strerror(errno));
+		wait_card_failed(ws, w, "no events", err);
+		return;
+	}
+	/* the value may change before the subscription */
+	wait_card_check(ws, w);
+}
+
+static void wait_card_events(struct wait_set *ws, struct wait_card *w)
+{
+	snd_ctl_event_t *event;
+	bool changed = false;
+	snd_ctl_event_alloca(&event);
+
+	while (snd_ctl_read(w->handle, event) > 0) {
+		if (!(snd_ctl_event_elem_get_mask(event) & SND_CTL_EVENT_MASK_VALUE))
+			continue;
+		if (snd_ctl_event_elem_get_interface(event) != SND_CTL_ELEM_IFACE_CARD ||
+		    snd_ctl_event_elem_get_index(event) != 0 ||
+		    strcmp(snd_ctl_event_elem_get_name(event), ".Boot") != 0)
+			continue;
+		changed = true;
+	}
+	if (changed)
+		wait_card_check(ws, w);
+}
+
+/* watch /dev/snd, or /dev until /dev/snd is created */
+static int wait_watch_devices(struct wait_set *ws)
+{
+	if (ws->wd >= 0)
+		return 0;
+	ws->wd = inotify_add_watch(ws->ifd, "/dev/snd", IN_CREATE|IN_ATTRIB|IN_MOVED_TO);
+	if (ws->wd >= 0 || errno != ENOENT)
+		return ws->wd >= 0 ? 0 : -errno;
+	if (inotify_add_watch(ws->ifd, "/dev", IN_CREATE|IN_MOVED_TO) < 0)
+		return -errno;
+	return 0;
+}
+
+static void wait_open_cards(struct wait_set *ws)
+{
+	int i;
+
+	for (i = 0; i < ws->count; i++) {
+		if (!ws->cards[i].ready && ws->cards[i].handle == NULL)
+			wait_card_open(ws, &ws->cards[i]);
+	}
+}
+
+static void wait_device_events(struct wait_set *ws)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (read(ws->ifd, buf, sizeof(buf)) > 0)
+		;
+	if (wait_watch_devices(ws) < 0)
+		error("Cannot watch /dev/snd: %s", strerror(errno));
+	wait_open_cards(ws);
+}
+
+/* the timeout for epoll_wait(), the deadline or the first sync window end */
+static int wait_next_timeout(struct wait_set *ws, long long now)
+{
+	long long tmo = ws->start + ws->timeout * 1000 - now, t;
+	int i;
+
+	for (i = 0; i < ws->count; i++) {
+		if (ws->cards[i].ready || ws->cards[i].expire < 0)
+			continue;
+		t = ws->cards[i].expire * 1000 - now;
+		if (t < tmo)
+			tmo = t;
+	}
+	return tmo < 0 ? 0 : tmo;
+}
+
+/* the first card error, if any */
+static int wait_report(struct wait_set *ws)
+{
+	struct wait_card *w;
+	int i, err = 0;
+
+	for (i = 0; i < ws->count; i++) {
+		w = &ws->cards[i];
+		if (w->error) {
+			printf("card %d: failed after %lld.%03lld s (%s: %s)\n",
+			       w->card, w->time / 1000, w->time % 1000,
+			       w->reason, snd_strerror(w->error));
+			if (err == 0)
+				err = w->error;
+		} else if (w->ready)
+			printf("card %d: ready in %lld.%03lld s (%s)\n", w->card,
+			       w->time / 1000, w->time % 1000, w->reason);
+		else
+			printf("card %d: not ready after %lld s (%s)\n", w->card,
+			       ws->timeout, w->handle ? "booting" : "not present");
+	}
+	fflush(stdout);
+	return err;
+}
+
+/**
+ * \brief Wait for more cards at once
+ * \param cardname One card, NULL for the cards selected by group and all
+ * \param group Card group name, NULL for the present cards
+ * \param all Add the cards of all card groups, too
+ * \return 0 when all cards are ready, the error of the first failed card
+ *         (-ENODEV when removed), -ETIMEDOUT or a negative error code
+ *
+ * The deadline is the longest sync time of the involved card groups
+ * (DEFAULT_SYNC_TIME when unknown), counted from the start. The function
+ * returns as soon as the last card is ready and prints the time of each
+ * card.
+ */
+int wait_for_cards(const char *cardname, const char *group, int all)
+{
+	struct wait_set ws;
+	struct epoll_event evs[16];
+	struct wait_card *w;
+	long long now;
+	char *end;
+	int i, n, err, cardno = -1;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.epfd = ws.ifd = ws.wd = -1;
+	if (cardname) {
+		/* the card number is accepted also for the absent cards */
+		cardno = strtol(cardname, &end, 10);
+		if (*cardname == '\0' || *end != '\0' || cardno < 0 || cardno > 31)
+			cardno = snd_card_get_index(cardname);
+		if (cardno < 0) {
+			error("Cannot find soundcard '%s'...", cardname);
+			return cardno;
+		}
+	}
+	err = wait_collect(&ws, cardno, group, all);
+	if (err < 0)
+		goto out;
+	if (ws.timeout <= 0)
+		ws.timeout = DEFAULT_SYNC_TIME;
+	ws.epfd = epoll_create1(EPOLL_CLOEXEC);
+	ws.ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ws.epfd < 0 || ws.ifd < 0) {
+		err = -errno;
+		error("Cannot create the wait set: %s", strerror(errno));
+		goto out;
+	}
+	/* watch before the first open, so no device is missed */
+	err = wait_watch_devices(&ws);
+	if (err >= 0) {
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN;
+		ev.data.u32 = WAIT_TAG_INOTIFY;
+		if (epoll_ctl(ws.epfd, EPOLL_CTL_ADD, ws.ifd, &ev) < 0)
+			err = -errno;
+	}
+	if (err < 0) {
+		error("Cannot watch /dev/snd: %s", snd_strerror(err));
+		goto out;
+	}
+	ws.start = wait_time();
+	ws.pending = ws.count;
+	dbg("Waiting for %d cards (timeout=%lld seconds)", ws.count, ws.timeout);
+	for (i = 0; i < ws.count; i++)
+		profile_begin(&ws.cards[i].span, PROFILE_WAIT, ws.cards[i].card);
+	wait_open_cards(&ws);
+	while (ws.pending > 0) {
+		now = wait_time();
+		if (now - ws.start >= ws.timeout * 1000)
+			break;
+		n = epoll_wait(ws.epfd, evs, ARRAY_SIZE(evs), wait_next_timeout(&ws, now));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error("epoll_wait failed: %s", strerror(errno));
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.u32 == WAIT_TAG_INOTIFY) {
+				wait_device_events(&ws);
+				continue;
+			}
+			w = &ws.cards[evs[i].data.u32 - WAIT_TAG_CARD];
+			if (w->ready || w->handle == NULL)
+				continue;
+			if (evs[i].events & (EPOLLERR|EPOLLHUP))
+				wait_card_failed(&ws, w, "removed", -ENODEV);
+			else
+				wait_card_events(&ws, w);
+		}
+		/* the ended sync windows */
+		now = wait_time();
+		for (i = 0; i < ws.count; i++) {
+			w = &ws.cards[i];
+			if (!w->ready && w->expire >= 0 && now >= w->expire * 1000)
+				wait_card_check(&ws, w);
+		}
+	}
+	err = wait_report(&ws);
+	if (err == 0 && ws.pending > 0)
+		err = -ETIMEDOUT;
+out:
+	for (i = 0; i < ws.count; i++) {
+		if (ws.cards[i].handle)
+			snd_ctl_close(ws.cards[i].handle);
+	}
+	free(ws.cards);
+	if (ws.ifd >= 0)
+		close(ws.ifd);
+	if (ws.epfd >= 0)
+		close(ws.epfd);
+	return err;
+}
@@ -31,6 +31,9 @@
 #include <sys/time.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <syslog.h>
 #include <signal.h>
 #include "alsaloop.h"
@@ -43,6 +46,14 @@ struct loopback_thread {
 	struct loopback **loopbacks;
 	int loopbacks_count;
 	snd_output_t *output;
+	int epfd;
+	struct epoll_event *events;
+	int events_count;
+	int *ready;			/* loops with pending events */
+	const char *cpus;
+	int rtprio;
+	int wake_stats;			/* measure the wake latency */
+	struct loopback_hist wake;	/* wake latency */
 };
 
 int quit = 0;
@@ -59,11 +70,31 @@ int threads_count = 0;
 pthread_t main_job;
 int arg_default_xrun = 0;
 int arg_default_wake = 0;
+int split_threads = 0;
+char *stats_socket = NULL;
+
+static void thread_state(struct loopback_thread *thread)
+{
+	struct loopback_hist *wake = &thread->wake;
+
+	if (wake->count == 0)
+		return;
+	snd_output_printf(thread->output,
+		"Thread %i: wake latency %lu wakeups, mean %.1fus, p50 <%lius, p99 <%lius, max %lius\n",
+		thread->loopbacks[0]->thread, wake->count,
+		wake->sum / wake->count,
+		hist_percentile(wake, 50), hist_percentile(wake, 99),
+		wake->max);
+}
 
 static void my_exit(struct loopback_thread *thread, int exitcode)
 {
 	int i;
 
+	if (verbose)
+		thread_state(thread);
+	if (thread->epfd >= 0)
+		close(thread->epfd);
 	for (i = 0; i < thread->loopbacks_count; i++)
 		pcmjob_done(thread->loopbacks[i]);
 	if (thread->threaded) {
@@ -131,11 +162,16 @@ static int create_loopback(struct loopback **_handle,
 	handle->latency_reqtime = 10000;
 	handle->loop_time = ~0UL;
 	handle->loop_limit = ~0ULL;
+	handle->sync_bandwidth = SYNC_BANDWIDTH;
+	handle->gain = 1.0;
+	handle->proc.width = 5;
 	handle->output = output;
 	handle->state = output;
-#ifdef USE_SAMPLERATE
 	handle->src_enable = 1;
+#ifdef USE_SAMPLERATE
 	handle->src_converter_type = SRC_SINC_BEST_QUALITY;
+#else
+	handle->src_converter_type = SRC_INTERNAL;
 #endif
 	*_handle = handle;
 	return 0;
@@ -147,22 +183,99 @@ static void set_loop_time(struct loopback *loop, unsigned long loop_time)
 	loop->loop_limit = loop->capt->rate * loop_time;
 }
 
-static void setscheduler(void)
+static int parse_cpus(const char *str, cpu_set_t *set)
+{
+	char *end;
+	long cpu, last;
+
+	CPU_ZERO(set);
+	while (*str) {
+		cpu = strtol(str, &end, 10);
+		if (end == str || cpu < 0 || cpu >= CPU_SETSIZE)
+			return -EINVAL;
+		last = cpu;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < cpu || last >= CPU_SETSIZE)
+				return -EINVAL;
+		}
+		for (; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+		str = end;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -EINVAL;
+}
+
+/* comma separated capture channels, -1 = silence */
+static int parse_chmap(const char *str, int **_map, unsigned int *_count)
+{
+	unsigned int count = 0;
+	int *map = NULL, *nmap;
+	char *end;
+	long chn;
+
+	while (*str) {
+		chn = strtol(str, &end, 10);
+		if (end == str || chn < -1 || chn > 255)
+			goto __error;
+		nmap = realloc(map, (count + 1) * sizeof(int));
+		if (nmap == NULL)
+			goto __error;
+		map = nmap;
+		map[count++] = chn;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			goto __error;
+		str = end;
+	}
+	if (count == 0)
+		goto __error;
+	*_map = map;
+	*_count = count;
+	return 0;
+      __error:
+	free(map);
+	return -EINVAL;
+}
+
+static void setscheduler(struct loopback_thread *thread)
 {
 	struct sched_param sched_param;
+	int policy = SCHED_RR;
+	const char *name = "Round Robin";
+	cpu_set_t cpus;
 
+	if (thread->cpus && parse_cpus(thread->cpus, &cpus) == 0) {
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+			logit(LOG_WARNING, "Unable to set CPU affinity %s\n", thread->cpus);
+		else if (verbose)
+			logit(LOG_INFO, "Thread pinned to CPUs %s\n", thread->cpus);
+	}
 	if (sched_getparam(0, &sched_param) < 0) {
 		logit(LOG_WARNING, "Scheduler getparam failed.\n");
 		return;
 	}
 	sched_param.sched_priority = sched_get_priority_max(SCHED_RR);
-	if (!sched_setscheduler(0, SCHED_RR, &sched_param)) {
+	if (thread->rtprio > 0) {
+		policy = SCHED_FIFO;
+		name = "FIFO";
+		sched_param.sched_priority = thread->rtprio;
+		if (sched_param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+			sched_param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	}
+	if (!sched_setscheduler(0, policy, &sched_param)) {
 		if (verbose)
-			logit(LOG_WARNING, "Scheduler set to Round Robin with priority %i\n", sched_param.sched_priority);
+			logit(LOG_WARNING, "Scheduler set to %s with priority %i\n", name, sched_param.sched_priority);
 		return;
 	}
 	if (verbose)
-		logit(LOG_INFO, "!!!Scheduler set to Round Robin with priority %i FAILED!\n", sched_param.sched_priority);
+		logit(LOG_INFO, "!!!Scheduler set to %s with priority %i FAILED!\n", name, sched_param.sched_priority);
 }
 
 void help(void)
@@ -185,20 +298,31 @@ void help(void)
 "-r,--rate      rate\n"
 "-n,--resample  resample in alsa-lib\n"
 "-A,--samplerate use converter (0=sincbest,1=sincmedium,2=sincfastest,\n"
-"                               3=zerohold,4=linear)\n"
+"                               3=zerohold,4=linear,5=internal)\n"
 "-B,--buffer    buffer size in frames\n"
 "-E,--period    period size in frames\n"
 "-s,--seconds   duration of loop in seconds\n"
 "-b,--nblock    non-block mode (very early process wakeup)\n"
+"-M,--mmap      copy directly between the mmap areas (same stream params)\n"
 "-S,--sync      sync mode(0=none,1=simple,2=captshift,3=playshift,4=samplerate,\n"
 "                         5=auto)\n"
+"-k,--syncbw    sync loop bandwidth in Hz (default 0.1)\n"
 "-a,--slave     stream parameters slave mode (0=auto, 1=on, 2=off)\n"
 "-T,--thread    thread number (-1 = create unique)\n"
+"-L,--split     run each job in its own thread\n"
+"-j,--cpus      pin the job thread to CPUs (for example 0,2-3)\n"
+"-R,--rtprio    SCHED_FIFO priority of the job thread\n"
+"-G,--gain      gain of the job in a shared playback mix (dB)\n"
+"-Q,--socket    UNIX socket for JSON statistics and runtime commands\n"
 "-m,--mixer	redirect mixer, argument is:\n"
 "		    SRC_SLAVE_ID(PLAYBACK)[@DST_SLAVE_ID(CAPTURE)]\n"
 "-O,--ossmixer	rescan and redirect oss mixer, argument is:\n"
 "		    ALSA_ID@OSS_ID  (for example: \"Master@VOLUME\")\n"
+"-D,--dsp       DSP chain, effects separated by commas\n"
 "-e,--effect    apply an effect (bandpass filter sweep)\n"
+"-H,--chmap     capture channel for each playback channel (-1 = silence)\n"
+"-I,--probe     reference capture PCM for the measured latency test\n"
+"-N,--probe-interval latency test marker interval in ms (default 1000)\n"
 "-v,--verbose   verbose mode (more -v means more verbose)\n"
 "-w,--workaround use workaround (serialopen)\n"
 "-U,--xrun      xrun profiling\n"
@@ -211,7 +335,9 @@ void help(void)
 		if (s)
 			printf(" %s", s);
 	}
-	printf("\n\n");
+	printf("\n\nRecognized DSP effects are:\n");
+	dsp_usage();
+	printf("\n");
 	printf(
 "Tip #1 (usable 500ms latency, good CPU usage, superb xrun prevention):\n"
 "  alsaloop -t 500000\n"
@@ -375,13 +501,24 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"period", 1, NULL, 'E'},
 		{"seconds", 1, NULL, 's'},
 		{"nblock", 0, NULL, 'b'},
+		{"mmap", 0, NULL, 'M'},
+		{"dsp", 1, NULL, 'D'},
 		{"effect", 0, NULL, 'e'},
+		{"chmap", 1, NULL, 'H'},
+		{"probe", 1, NULL, 'I'},
+		{"probe-interval", 1, NULL, 'N'},
 		{"verbose", 0, NULL, 'v'},
 		{"resample", 0, NULL, 'n'},
 		{"samplerate", 1, NULL, 'A'},
 		{"sync", 1, NULL, 'S'},
+		{"syncbw", 1, NULL, 'k'},
 		{"slave", 1, NULL, 'a'},
 		{"thread", 1, NULL, 'T'},
+		{"split", 0, NULL, 'L'},
+		{"cpus", 1, NULL, 'j'},
+		{"rtprio", 1, NULL, 'R'},
+		{"gain", 1, NULL, 'G'},
+		{"socket", 1, NULL, 'Q'},
 		{"mixer", 1, NULL, 'm'},
 		{"ossmixer", 1, NULL, 'O'},
 		{"workaround", 1, NULL, 'w'},
@@ -406,14 +543,25 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	snd_pcm_uframes_t arg_period_size = 0;
 	unsigned long arg_loop_time = ~0UL;
 	int arg_nblock = 0;
-	// int arg_effect = 0;
+	int arg_mmap = 0;
+	int arg_effect = 0;
+	char *arg_dsp = NULL;
+	char *arg_probe = NULL;
+	int *arg_chmap = NULL;
+	unsigned int arg_chmap_count = 0;
+	unsigned int arg_probe_interval = 1000;
 	int arg_resample = 0;
 #ifdef USE_SAMPLERATE
 	int arg_samplerate = SRC_SINC_FASTEST + 1;
 #endif
 	int arg_sync = SYNC_TYPE_AUTO;
+	double arg_sync_bandwidth = SYNC_BANDWIDTH;
 	int arg_slave = SLAVE_TYPE_AUTO;
 	int arg_thread = 0;
+	char *arg_cpus = NULL;
+	int arg_rtprio = 0;
+	double arg_gain = 1.0;
+	cpu_set_t cpus;
 	struct loopback *loop = NULL;
 	char *arg_mixers[MAX_MIXERS];
 	int arg_mixers_count = 0;
@@ -426,7 +574,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hg:dP:C:X:Y:x:l:t:f:c:r:B:E:s:benvA:S:a:T:m:O:w:UW:z",
+				"hg:dP:C:X:Y:x:l:t:f:c:r:B:E:s:bMD:eH:I:N:nvA:S:k:a:T:Lj:R:G:Q:m:O:w:UW:z",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -493,8 +641,28 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'b':
 			arg_nblock = 1;
 			break;
+		case 'M':
+			arg_mmap = 1;
+			break;
+		case 'D':
+			arg_dsp = optarg;
+			break;
 		case 'e':
-			// arg_effect = 1;
+			arg_effect = 1;
+			break;
+		case 'H':
+			free(arg_chmap);
+			if (parse_chmap(optarg, &arg_chmap, &arg_chmap_count) < 0) {
+				logit(LOG_CRIT, "Wrong channel map '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'I':
+			arg_probe = optarg;
+			break;
+		case 'N':
+			err = atoi(optarg);
+			arg_probe_interval = err >= 100 && err <= 3600000 ? err : 1000;
 			break;
 		case 'n':
 			arg_resample = 1;
@@ -511,9 +679,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 				arg_samplerate = SRC_ZERO_ORDER_HOLD;
 			else if (strcasecmp(optarg, "linear") == 0)
 				arg_samplerate = SRC_LINEAR;
+			else if (strcasecmp(optarg, "internal") == 0)
+				arg_samplerate = SRC_INTERNAL;
 			else
 				arg_samplerate = atoi(optarg);
-			if (arg_samplerate < 0 || arg_samplerate > SRC_LINEAR)
+			if (arg_samplerate < 0 || arg_samplerate > SRC_INTERNAL)
 				arg_sync = SRC_SINC_FASTEST;
 			arg_samplerate += 1;
 			break;
@@ -538,6 +708,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (arg_sync < 0 || arg_sync > SYNC_TYPE_LAST)
 				arg_sync = SYNC_TYPE_AUTO;
 			break;
+		case 'k':
+			arg_sync_bandwidth = atof(optarg);
+			if (arg_sync_bandwidth < 0.001 || arg_sync_bandwidth > 10)
+				arg_sync_bandwidth = SYNC_BANDWIDTH;
+			break;
 		case 'a':
 			if (optarg[0] == 'a')
 				arg_slave = SLAVE_TYPE_AUTO;
@@ -555,6 +730,28 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (arg_thread < 0)
 				arg_thread = 10000000 + loopbacks_count;
 			break;
+		case 'L':
+			split_threads = 1;
+			break;
+		case 'j':
+			if (parse_cpus(optarg, &cpus) < 0) {
+				logit(LOG_CRIT, "Wrong CPU list '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			free(arg_cpus);
+			arg_cpus = strdup(optarg);
+			break;
+		case 'R':
+			err = atoi(optarg);
+			arg_rtprio = err >= 1 && err <= 99 ? err : 0;
+			break;
+		case 'G':
+			arg_gain = pow(10, atof(optarg) / 20);
+			break;
+		case 'Q':
+			free(stats_socket);
+			stats_socket = strdup(optarg);
+			break;
 		case 'm':
 			if (arg_mixers_count >= MAX_MIXERS) {
 				logit(LOG_CRIT, "Maximum redirected mixer controls reached (max %i)\n", (int)MAX_MIXERS);
@@ -623,9 +820,27 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		play->nblock = capt->nblock = arg_nblock ? 1 : 0;
 		loop->latency_req = arg_latency_req;
 		loop->latency_reqtime = arg_latency_reqtime;
+		loop->mmap = arg_mmap;
 		loop->sync = arg_sync;
+		loop->sync_bandwidth = arg_sync_bandwidth;
 		loop->slave = arg_slave;
 		loop->thread = arg_thread;
+		loop->cpus = arg_cpus;
+		loop->rtprio = arg_rtprio;
+		loop->gain = arg_gain;
+		if (arg_dsp && dsp_parse(loop, arg_dsp) < 0) {
+			logit(LOG_CRIT, "Unable to create the DSP chain.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (arg_probe)
+			loop->probe_device = strdup(arg_probe);
+		loop->probe_interval = arg_probe_interval;
+		loop->chmap = arg_chmap;
+		loop->chmap_count = arg_chmap_count;
+		if (arg_effect && dsp_parse(loop, "sweep") < 0) {
+			logit(LOG_CRIT, "Unable to create the sweep effect.\n");
+			exit(EXIT_FAILURE);
+		}
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
@@ -724,15 +939,62 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
+/*
+ * Register the poll descriptors of one loop in the epoll set of the thread.
+ * The event data holds the loop index and the descriptor index, so the
+ * events are dispatched directly to the owning loop. The descriptors change
+ * when the loop is started or stopped or when their count changes
+ * (pollfd_gen).
+ */
+static int thread_arm(struct loopback_thread *thread, int idx)
+{
+	struct loopback *loop = thread->loopbacks[idx];
+	struct epoll_event ev, *events;
+	int i, err, count;
+
+	/* the descriptor count may grow after a restart */
+	for (i = count = 0; i < thread->loopbacks_count; i++)
+		count += thread->loopbacks[i]->pollfd_count;
+	if (thread->events && count > thread->events_count) {
+		events = realloc(thread->events, count * sizeof(*events));
+		if (events == NULL)
+			return -ENOMEM;
+		thread->events = events;
+		thread->events_count = count;
+	}
+	for (i = 0; i < loop->active_pollfd_count; i++)
+		epoll_ctl(thread->epfd, EPOLL_CTL_DEL, loop->pollfds[i].fd, NULL);
+	loop->active_pollfd_count = 0;
+	free(loop->pollfds);
+	loop->pollfds = calloc(loop->pollfd_count > 0 ? loop->pollfd_count : 1,
+			       sizeof(struct pollfd));
+	if (loop->pollfds == NULL)
+		return -ENOMEM;
+	err = pcmjob_pollfds_init(loop, loop->pollfds);
+	if (err < 0)
+		return err;
+	for (i = 0; i < err; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = loop->pollfds[i].events;
+		ev.data.u64 = ((uint64_t)idx << 32) | i;
+		if (epoll_ctl(thread->epfd, EPOLL_CTL_ADD, loop->pollfds[i].fd, &ev) < 0)
+			return -errno;
+	}
+	loop->pollfd_armed = loop->pollfd_gen;
+	return 0;
+}
+
 static void thread_job1(void *_data)
 {
 	struct loopback_thread *thread = _data;
 	snd_output_t *output = thread->output;
-	struct pollfd *pfds = NULL;
-	int pfds_count = 0;
-	int i, j, err, wake = 1000000;
+	struct loopback *loop;
+	struct timespec ts1, ts2;
+	int ready_count;
+	int i, j, k, err, wake = 1000000;
+	long lat, minlat;
 
-	setscheduler();
+	setscheduler(thread);
 
 	for (i = 0; i < thread->loopbacks_count; i++) {
 		err = pcmjob_init(thread->loopbacks[i]);
@@ -741,37 +1003,42 @@ static void thread_job1(void *_data)
 			my_exit(thread, EXIT_FAILURE);
 		}
 	}
+	thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (thread->epfd < 0) {
+		logit(LOG_CRIT, "epoll_create failed: %s\n", strerror(errno));
+		my_exit(thread, EXIT_FAILURE);
+	}
 	for (i = 0; i < thread->loopbacks_count; i++) {
 		err = pcmjob_start(thread->loopbacks[i]);
 		if (err < 0) {
 			logit(LOG_CRIT, "Loopback start failure.\n");
 			my_exit(thread, EXIT_FAILURE);
 		}
-		pfds_count += thread->loopbacks[i]->pollfd_count;
+		thread->events_count += thread->loopbacks[i]->pollfd_count;
 		j = thread->loopbacks[i]->wake;
 		if (j > 0 && j < wake)
 			wake = j;
+		err = thread_arm(thread, i);
+		if (err < 0) {
+			logit(LOG_CRIT, "Poll FD initialization failed.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
 	}
 	if (wake >= 1000000)
 		wake = -1;
-	pfds = calloc(pfds_count, sizeof(struct pollfd));
-	if (pfds == NULL || pfds_count <= 0) {
+	thread->events = calloc(thread->events_count, sizeof(struct epoll_event));
+	thread->ready = calloc(thread->loopbacks_count, sizeof(int));
+	if (thread->events == NULL || thread->ready == NULL ||
+	    thread->events_count <= 0) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
 		my_exit(thread, EXIT_FAILURE);
 	}
 	while (!quit) {
 		struct timeval tv1, tv2;
-		for (i = j = 0; i < thread->loopbacks_count; i++) {
-			err = pcmjob_pollfds_init(thread->loopbacks[i], &pfds[j]);
-			if (err < 0) {
-				logit(LOG_CRIT, "Poll FD initialization failed.\n");
-				my_exit(thread, EXIT_FAILURE);
-			}
-			j += err;
-		}
 		if (verbose > 10)
 			gettimeofday(&tv1, NULL);
-		err = poll(pfds, j, wake);
+		err = epoll_wait(thread->epfd, thread->events,
+				 thread->events_count, wake);
 		if (err < 0)
 			err = -errno;
 		if (verbose > 10) {
@@ -784,16 +1051,52 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Poll failed: %s\n", strerror(-err));
 			my_exit(thread, EXIT_FAILURE);
 		}
-		for (i = j = 0; i < thread->loopbacks_count; i++) {
-			struct loopback *loop = thread->loopbacks[i];
-			if (j < loop->active_pollfd_count) {
-				err = pcmjob_pollfds_handle(loop, &pfds[j]);
-				if (err < 0) {
-					logit(LOG_CRIT, "pcmjob failed.\n");
-					exit(EXIT_FAILURE);
-				}
+		ready_count = 0;
+		if (err == 0) {
+			/* wake timeout, give every loop a chance */
+			for (i = 0; i < thread->loopbacks_count; i++)
+				thread->ready[ready_count++] = i;
+		}
+		for (j = 0; j < err; j++) {
+			uint64_t data = thread->events[j].data.u64;
+			i = data >> 32;
+			loop = thread->loopbacks[i];
+			loop->pollfds[(uint32_t)data].revents =
+						thread->events[j].events;
+			if (!loop->poll_ready) {
+				loop->poll_ready = 1;
+				thread->ready[ready_count++] = i;
+			}
+		}
+		/* the loop with the latest interrupt most likely woke us */
+		for (j = 0, minlat = -1; thread->wake_stats && err > 0 && j < ready_count; j++) {
+			lat = pcmjob_wake_latency(thread->loopbacks[thread->ready[j]]);
+			if (lat >= 0 && (minlat < 0 || lat < minlat))
+				minlat = lat;
+		}
+		if (minlat >= 0)
+			hist_add(&thread->wake, minlat);
+		for (j = 0; j < ready_count; j++) {
+			i = thread->ready[j];
+			loop = thread->loopbacks[i];
+			loop->poll_ready = 0;
+			clock_gettime(CLOCK_MONOTONIC, &ts1);
+			err = pcmjob_pollfds_handle(loop, loop->pollfds);
+			if (err < 0) {
+				logit(LOG_CRIT, "pcmjob failed.\n");
+				exit(EXIT_FAILURE);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &ts2);
+			hist_add(&loop->proc, (ts2.tv_sec - ts1.tv_sec) * 1000000L +
+					      (ts2.tv_nsec - ts1.tv_nsec) / 1000);
+			stats_publish(loop);
+			for (k = 0; k < loop->active_pollfd_count; k++)
+				loop->pollfds[k].revents = 0;
+			if (loop->pollfd_armed != loop->pollfd_gen &&
+			    thread_arm(thread, i) < 0) {
+				logit(LOG_CRIT, "Poll FD initialization failed.\n");
+				exit(EXIT_FAILURE);
 			}
-			j += loop->active_pollfd_count;
 		}
 	}
 
@@ -841,6 +1144,7 @@ static void signal_handler_state(int sig)
 		if (thread->thread == self) {
 			for (j = 0; j < thread->loopbacks_count; j++)
 				pcmjob_state(thread->loopbacks[j]);
+			thread_state(thread);
 		}
 	}
 	signal(sig, signal_handler_state);
@@ -851,6 +1155,71 @@ static void signal_handler_ignore(int sig)
 	signal(sig, signal_handler_ignore);
 }
 
+static int route_share(struct loopback *loop1, struct loopback *loop2)
+{
+	return !strcmp(loop1->capt->device, loop2->capt->device) ||
+	       !strcmp(loop1->play->device, loop2->play->device);
+}
+
+/*
+ * Jobs using the same PCM device share it: one capture feeds several
+ * playbacks and several captures are mixed to one playback. The sharing
+ * jobs are moved to one thread.
+ */
+static void route_graph(void)
+{
+	struct loopback *loop1, *loop2;
+	int i, j, k, thread, changed;
+
+	do {
+		changed = 0;
+		for (i = 0; i < loopbacks_count; i++) {
+			for (j = i + 1; j < loopbacks_count; j++) {
+				loop1 = loopbacks[i];
+				loop2 = loopbacks[j];
+				if (loop1->thread == loop2->thread ||
+				    !route_share(loop1, loop2))
+					continue;
+				thread = loop2->thread;
+				for (k = 0; k < loopbacks_count; k++)
+					if (loopbacks[k]->thread == thread)
+						loopbacks[k]->thread = loop1->thread;
+				changed = 1;
+			}
+		}
+	} while (changed);
+	for (i = 0; i < loopbacks_count; i++) {
+		for (j = i + 1; j < loopbacks_count; j++) {
+			loop1 = loopbacks[i];
+			loop2 = loopbacks[j];
+			if (!strcmp(loop1->capt->device, loop2->capt->device) &&
+			    !strcmp(loop1->play->device, loop2->play->device)) {
+				logit(LOG_CRIT, "Duplicate job %s -> %s\n", loop2->capt->device, loop2->play->device);
+				exit(EXIT_FAILURE);
+			}
+			if (!strcmp(loop1->capt->device, loop2->capt->device) &&
+			    route_link(loop1->capt, loop2->capt) < 0)
+				goto __nomem;
+			if (!strcmp(loop1->play->device, loop2->play->device) &&
+			    route_link(loop1->play, loop2->play) < 0)
+				goto __nomem;
+		}
+	}
+	for (i = 0; i < loopbacks_count; i++) {
+		loop1 = loopbacks[i];
+		if (loop1->capt->route && loop1->slave == SLAVE_TYPE_ON) {
+			logit(LOG_CRIT, "Slave mode cannot be used for the shared capture %s\n", loop1->capt->device);
+			exit(EXIT_FAILURE);
+		}
+		if (loop1->gain != 1.0 && loop1->play->route == NULL)
+			logit(LOG_WARNING, "Gain is used only for a shared playback, ignored for %s\n", loop1->play->device);
+	}
+	return;
+      __nomem:
+	logit(LOG_CRIT, "No enough memory\n");
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[])
 {
 	snd_output_t *output;
@@ -891,6 +1260,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (split_threads) {
+		for (i = 0; i < loopbacks_count; i++)
+			loopbacks[i]->thread = i;
+	}
+	route_graph();
+
 	/* we must sort thread IDs */
 	j = -1;
 	do {
@@ -925,13 +1300,29 @@ int main(int argc, char *argv[])
 		threads[k].loopbacks = malloc(l * sizeof(struct loopback *));
 		threads[k].loopbacks_count = l;
 		threads[k].output = output;
+		threads[k].wake.width = 25;
+		threads[k].epfd = -1;
 		threads[k].threaded = j > 1;
 		for (i = l = 0; i < loopbacks_count; i++)
 			if (loopbacks[i]->thread == k)
 				threads[k].loopbacks[l++] = loopbacks[i];
+		/* the first job which sets them decides for the thread */
+		for (i = 0; i < l; i++) {
+			if (threads[k].cpus == NULL)
+				threads[k].cpus = threads[k].loopbacks[i]->cpus;
+			if (threads[k].rtprio == 0)
+				threads[k].rtprio = threads[k].loopbacks[i]->rtprio;
+		}
+		/* two timestamp queries per wakeup, only when asked for */
+		threads[k].wake_stats = verbose > 0 || threads[k].cpus ||
+					threads[k].rtprio > 0;
 	}
 	threads_count = j;
 	main_job = pthread_self();
+
+	if (stats_socket &&
+	    stats_start(stats_socket, loopbacks, loopbacks_count) < 0)
+		exit(EXIT_FAILURE);
  
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
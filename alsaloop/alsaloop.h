@@ -31,10 +31,13 @@ enum {
 	SRC_LINEAR		= 4
 };
 #endif
+#define SRC_INTERNAL		(SRC_LINEAR + 1)
 
 #define MAX_ARGS	128
 #define MAX_MIXERS	64
 
+#define SYNC_BANDWIDTH	0.1	/* default clock drift loop bandwidth in Hz */
+
 #if 0
 #define FILE_PWRITE "/tmp/alsaloop.praw"
 #define FILE_CWRITE "/tmp/alsaloop.craw"
@@ -60,6 +63,52 @@ typedef enum _slave_type {
 	SLAVE_TYPE_LAST = SLAVE_TYPE_OFF
 } slave_type_t;
 
+struct resampler;
+struct loopback_route;
+struct loopback_probe;
+struct dsp_effect;
+
+/* in place processing of interleaved float blocks */
+struct dsp_plugin {
+	const char *name;
+	const char *usage;
+	size_t private_size;
+	/* parse the arguments when the chain is created */
+	int (*init)(struct dsp_effect *effect, int argc, char **argv);
+	/* allocate the state for the stream parameters */
+	int (*start)(struct dsp_effect *effect);
+	void (*run)(struct dsp_effect *effect, float *buf, unsigned int frames);
+	void (*stop)(struct dsp_effect *effect);
+};
+
+struct dsp_effect {
+	const struct dsp_plugin *plugin;
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int started:1;
+	void *priv;
+	struct dsp_effect *next;
+};
+
+#define HIST_BUCKETS	200
+
+/* time statistics with percentiles */
+struct loopback_hist {
+	unsigned int width;		/* bucket width in usec */
+	unsigned long count;
+	double sum;
+	long max;
+	unsigned long bucket[HIST_BUCKETS + 1];
+};
+
+/* captured period shared by the routes of one capture PCM */
+struct route_period {
+	struct route_period *next;	/* free list */
+	int refs;
+	snd_pcm_uframes_t frames;
+	char data[];
+};
+
 struct loopback_control {
 	snd_ctl_elem_id_t *id;
 	snd_ctl_elem_info_t *info;
@@ -103,6 +152,7 @@ struct loopback_handle {
 	unsigned int nblock:1;		/* do block (period size) transfers */
 	unsigned int xrun_pending:1;
 	unsigned int pollfd_count;
+	unsigned long xruns;		/* xrun count */
 	/* I/O job */
 	char *buf;			/* I/O buffer */
 	snd_pcm_uframes_t buf_pos;	/* I/O position */
@@ -114,9 +164,7 @@ struct loopback_handle {
 	snd_pcm_uframes_t max;
 	unsigned long long counter;
 	unsigned long sync_point;	/* in samples */
-	snd_pcm_sframes_t last_delay;
 	double pitch;
-	snd_pcm_uframes_t total_queued;
 	/* control */
 	snd_ctl_t *ctl;
 	unsigned int ctl_pollfd_count;
@@ -128,8 +176,50 @@ struct loopback_handle {
 	snd_ctl_elem_value_t *ctl_rate;
 	snd_ctl_elem_value_t *ctl_channels;
 	char *prateshift_name; /* ascii name for the playback rate shift ctl elem */
+	/* routing */
+	struct loopback_route *route;	/* PCM shared with other jobs */
+	unsigned int route_active:1;	/* member of the running PCM */
+	unsigned int route_joined:1;	/* PCM set up by another member */
+	struct route_period **queue;	/* captured periods not in buf yet */
+	unsigned int queue_size;
+	unsigned int queue_head;
+	unsigned int queue_count;
+	snd_pcm_uframes_t queue_pos;	/* consumed frames of the head period */
+	snd_pcm_uframes_t queue_frames;	/* queued frames */
+};
+
+struct loopback_route {
+	struct loopback_handle **members;	/* the first one owns the PCM */
+	int members_count;
+	int running;			/* active members */
+	/* setup of the shared PCM */
+	snd_pcm_format_t format;
+	unsigned int rate;
+	unsigned int rate_req;
+	unsigned int channels;
+	unsigned int buffer_size;
+	unsigned int period_size;
+	unsigned int frame_size;
+	snd_pcm_uframes_t avail_min;
+	double pitch;
+	struct route_period *pool;	/* free capture periods */
+	char *mix;			/* playback mix period */
+	long long *acc;			/* mix accumulator */
 };
 
+struct loopback_probe_stats {
+	unsigned long count;		/* detected markers */
+	unsigned long lost;		/* markers not detected */
+	double loop_ms;			/* capture -> reference input */
+	double round_trip_ms;		/* playback -> reference input */
+	double loop_min;
+	double loop_max;
+	double loop_sum;
+	double correlation;
+};
+
+struct loopback_stats;
+
 struct loopback {
 	char *id;
 	struct loopback_handle *capt;
@@ -143,22 +233,58 @@ struct loopback {
 	snd_output_t *state;
 	int pollfd_count;
 	int active_pollfd_count;
+	struct pollfd *pollfds;		/* descriptors registered for the loop */
+	unsigned int pollfd_gen;	/* changed when the descriptors change */
+	unsigned int pollfd_armed;	/* pollfd_gen of the registration */
 	unsigned int linked:1;		/* linked streams */
 	unsigned int reinit:1;
 	unsigned int running:1;
 	unsigned int stop_pending:1;
+	unsigned int poll_ready:1;	/* queued for the event dispatch */
+	unsigned int mmap:1;		/* direct transfer requested */
+	unsigned int direct:1;		/* capture mmap -> playback mmap */
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
 	int thread;			/* thread number */
-	unsigned int wake;
+	double gain;			/* gain in a playback mix */
+	struct dsp_effect *dsp;		/* processing chain */
+	float *dsp_block;		/* conversion block of the chain */
+	/* latency self-test */
+	char *probe_device;		/* reference capture */
+	unsigned int probe_interval;	/* marker interval in ms */
+	struct loopback_probe *probe;
+	struct loopback_probe_stats probe_stats;
+	/* runtime commands from the stats socket */
+	volatile unsigned int cmd_latency;	/* new latency in usec */
+	volatile int cmd_reset;			/* reset statistics */
+	volatile int mute;
 	/* statistics */
+	double latency_now;		/* measured latency in frames */
+	struct loopback_hist proc;	/* processing time */
+	struct loopback_stats *stats;	/* published for the stats socket */
+	char *cpus;			/* CPU list for the thread */
+	int rtprio;			/* SCHED_FIFO priority of the thread */
+	unsigned int wake;
+	/* clock drift loop */
 	double pitch;
-	double pitch_delta;
-	snd_pcm_sframes_t pitch_diff;
-	snd_pcm_sframes_t pitch_diff_min;
-	snd_pcm_sframes_t pitch_diff_max;
-	unsigned int total_queued_count;
+	double sync_bandwidth;		/* loop bandwidth in Hz */
+	double sync_kp;			/* proportional gain */
+	double sync_ki;			/* integral gain */
+	double sync_integ;		/* integrator (pitch - 1) */
+	double sync_err;		/* filtered latency error in frames */
+	double sync_time;		/* last measurement time in seconds */
+	double sync_start;		/* first measurement time */
+	double sync_in_range;		/* error within range since */
+	double sync_lock_time;		/* first lock after start in seconds */
+	unsigned int sync_locked:1;
+	unsigned int sync_relocks;
+	/* latency error statistics while locked */
+	unsigned long sync_count;
+	double sync_err_min;
+	double sync_err_max;
+	double sync_err_sum;
+	double sync_err_sum2;
 	snd_timestamp_t tstamp_start;
 	snd_timestamp_t tstamp_end;
 	/* xrun profiling */
@@ -180,9 +306,15 @@ struct loopback {
 	struct loopback_ossmixer *oss_controls;
 	/* sample rate */
 	unsigned int use_samplerate:1;
-#ifdef USE_SAMPLERATE
 	unsigned int src_enable:1;
 	int src_converter_type;
+	struct resampler *resampler;	/* internal drift resampler */
+	/* format conversion between the rings */
+	int *chmap;			/* capture channel per playback channel */
+	unsigned int chmap_count;
+	int *convert_map;		/* NULL = same channels */
+	float *convert_block;		/* NULL = copy */
+#ifdef USE_SAMPLERATE
 	SRC_STATE *src_state;
 	SRC_DATA src_data;
 	unsigned int src_out_frames;
@@ -196,6 +328,7 @@ struct loopback {
 };
 
 extern int verbose;
+extern int quit;
 extern int workarounds;
 extern int use_syslog;
 
@@ -213,6 +346,54 @@ int pcmjob_stop(struct loopback *loop);
 int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds);
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds);
 void pcmjob_state(struct loopback *loop);
+long pcmjob_wake_latency(struct loopback *loop);
+void pcmjob_reset_stats(struct loopback *loop);
+
+void hist_add(struct loopback_hist *hist, long usec);
+long hist_percentile(struct loopback_hist *hist, int pc);
+void hist_reset(struct loopback_hist *hist);
+int stats_start(const char *path, struct loopback **loops, int count);
+void stats_publish(struct loopback *loop);
+
+int route_link(struct loopback_handle *lhandle, struct loopback_handle *member);
+int route_owner(struct loopback_handle *lhandle);
+int route_join(struct loopback_handle *lhandle);
+int route_config(struct loopback_handle *lhandle);
+int route_release(struct loopback_handle *lhandle);
+snd_pcm_sframes_t route_capture(struct loopback_handle *lhandle);
+snd_pcm_uframes_t route_dequeue(struct loopback_handle *lhandle);
+snd_pcm_sframes_t route_playback(struct loopback_handle *lhandle);
+snd_pcm_uframes_t route_queued(struct loopback_handle *lhandle);
+
+int resample_init(struct loopback *loop);
+void resample_done(struct loopback *loop);
+double resample_set_ratio(struct loopback *loop, double ratio);
+void resample_process(struct loopback *loop,
+		      const char *src, snd_pcm_uframes_t *src_frames,
+		      char *dst, snd_pcm_uframes_t *dst_frames);
+
+extern const struct dsp_plugin dsp_sweep;
+
+int dsp_parse(struct loopback *loop, const char *str);
+int dsp_start(struct loopback *loop);
+void dsp_stop(struct loopback *loop);
+void dsp_free(struct loopback *loop);
+void dsp_process(struct loopback *loop, snd_pcm_uframes_t from);
+void dsp_usage(void);
+
+int convert_supported(snd_pcm_format_t format);
+void convert_to_float(snd_pcm_format_t format, const char *src,
+		      unsigned int src_channels, float *dst,
+		      unsigned int channels, const int *map,
+		      snd_pcm_uframes_t frames);
+void convert_from_float(snd_pcm_format_t format, const float *src,
+			char *dst, unsigned int count);
+
+int probe_start(struct loopback *loop);
+void probe_stop(struct loopback *loop);
+void probe_reset_stats(struct loopback *loop);
+void probe_inject(struct loopback *loop, snd_pcm_uframes_t from);
+void probe_capture(struct loopback *loop);
 
 int control_parse_id(const char *str, snd_ctl_elem_id_t *id);
 int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2);
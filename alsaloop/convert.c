@@ -0,0 +1,187 @@
+/*
+ *  A simple PCM loopback utility - sample format conversion
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Interleaved native endian S16, S24 (in 32 bits), S24_3LE, S32 and
+ * FLOAT samples to float and back. The format switch is done once per
+ * call and the inner loops have no branches and no dependencies between
+ * the samples, so the compiler can vectorize them. The channel map is
+ * applied while converting to float: the output channel N takes the
+ * input channel map[N], or silence for a negative entry.
+ */
+
+#include "aconfig.h"
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define S16_SCALE	32768.0f
+#define S24_SCALE	8388608.0f
+#define S32_SCALE	2147483648.0
+
+int convert_supported(snd_pcm_format_t format)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+	case SND_PCM_FORMAT_S24:
+	case SND_PCM_FORMAT_S24_3LE:
+	case SND_PCM_FORMAT_S32:
+	case SND_PCM_FORMAT_FLOAT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static inline float get_s16(const char *src, size_t idx)
+{
+	return ((const int16_t *)src)[idx] * (1.0f / S16_SCALE);
+}
+
+static inline float get_s24(const char *src, size_t idx)
+{
+	/* sign extend the low 24 bits */
+	return ((int32_t)(((const uint32_t *)src)[idx] << 8) >> 8) *
+	       (1.0f / S24_SCALE);
+}
+
+static inline float get_s24_3le(const char *src, size_t idx)
+{
+	const uint8_t *p = (const uint8_t *)src + idx * 3;
+
+	return ((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+			  (uint32_t)p[2] << 24) >> 8) * (1.0f / S24_SCALE);
+}
+
+static inline float get_s32(const char *src, size_t idx)
+{
+	return ((const int32_t *)src)[idx] * (float)(1.0 / S32_SCALE);
+}
+
+static inline float get_float(const char *src, size_t idx)
+{
+	return ((const float *)src)[idx];
+}
+
+#define CONVERT_TO_FLOAT(get)						\
+	do {								\
+		if (map == NULL) {					\
+			for (i = 0; i < frames * channels; i++)		\
+				dst[i] = get(src, i);			\
+			break;						\
+		}							\
+		for (i = 0; i < frames; i++, dst += channels) {		\
+			for (c = 0; c < channels; c++)			\
+				dst[c] = map[c] < 0 ? 0 :		\
+					get(src, i * src_channels + map[c]); \
+		}							\
+	} while (0)
+
+/*
+ * Convert the frames with src_channels to float frames with channels.
+ * The map must be given when the channel counts differ.
+ */
+void convert_to_float(snd_pcm_format_t format, const char *src,
+		      unsigned int src_channels, float *dst,
+		      unsigned int channels, const int *map,
+		      snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		CONVERT_TO_FLOAT(get_s16);
+		break;
+	case SND_PCM_FORMAT_S24:
+		CONVERT_TO_FLOAT(get_s24);
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		CONVERT_TO_FLOAT(get_s24_3le);
+		break;
+	case SND_PCM_FORMAT_S32:
+		CONVERT_TO_FLOAT(get_s32);
+		break;
+	default:
+		if (map == NULL) {
+			memcpy(dst, src, frames * channels * sizeof(float));
+			break;
+		}
+		CONVERT_TO_FLOAT(get_float);
+		break;
+	}
+}
+
+static inline float clip(float v, float min, float max)
+{
+	/* a NaN (not equal to itself) is silence, it has no integer value */
+	v = v == v ? v : 0;
+	/* plain compares, fminf/fmaxf do not vectorize with the NaN rules */
+	v = v < min ? min : v;
+	return v > max ? max : v;
+}
+
+/* round half away from zero, lrintf() does not vectorize with errno */
+static inline int32_t round_s32(float v)
+{
+	return (int32_t)(v + copysignf(0.5f, v));
+}
+
+/* convert the given count of float samples, out of range values are clipped */
+void convert_from_float(snd_pcm_format_t format, const float *src,
+			char *dst, unsigned int count)
+{
+	unsigned int i;
+	double d;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		for (i = 0; i < count; i++)
+			((int16_t *)dst)[i] =
+				round_s32(clip(src[i] * S16_SCALE, -S16_SCALE, S16_SCALE - 1));
+		break;
+	case SND_PCM_FORMAT_S24:
+		for (i = 0; i < count; i++)
+			((int32_t *)dst)[i] =
+				round_s32(clip(src[i] * S24_SCALE, -S24_SCALE, S24_SCALE - 1));
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		for (i = 0; i < count; i++) {
+			int32_t s = round_s32(clip(src[i] * S24_SCALE, -S24_SCALE, S24_SCALE - 1));
+			dst[i * 3] = s;
+			dst[i * 3 + 1] = s >> 8;
+			dst[i * 3 + 2] = s >> 16;
+		}
+		break;
+	case SND_PCM_FORMAT_S32:
+		/* a float can not hold 0x7fffffff, clip in double */
+		for (i = 0; i < count; i++) {
+			d = src[i] == src[i] ? src[i] * S32_SCALE : 0;
+			d = d < -S32_SCALE ? -S32_SCALE : d;
+			d = d > S32_SCALE - 1 ? S32_SCALE - 1 : d;
+			((int32_t *)dst)[i] = (int32_t)(d + copysign(0.5, d));
+		}
+		break;
+	default:
+		memcpy(dst, src, count * sizeof(float));
+		break;
+	}
+}
@@ -0,0 +1,562 @@
+/*
+ *  A simple PCM loopback utility - in-loop DSP chain
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The chain runs on the frames just added to the playback ring, so the
+ * processing is done in place and needs no extra buffering. The ring
+ * segments are converted to interleaved float in blocks of DSP_BLOCK
+ * frames (FLOAT rings are processed directly) and passed through all
+ * effects of the chain. All effect state is allocated in dsp_start(),
+ * nothing is allocated while the stream runs.
+ *
+ * The chain is described as "name[:arg...][,name[:arg...]]...".
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define DSP_BLOCK	256	/* frames per processing block */
+#define DSP_ARGS	16
+
+static inline float db_to_gain(double db)
+{
+	return pow(10, db / 20);
+}
+
+/*
+ * gain:<dB>
+ */
+
+struct gain_private {
+	float gain;
+};
+
+static int gain_init(struct dsp_effect *effect, int argc, char **argv)
+{
+	struct gain_private *priv = effect->priv;
+
+	if (argc != 1)
+		return -EINVAL;
+	priv->gain = db_to_gain(atof(argv[0]));
+	return 0;
+}
+
+static void gain_run(struct dsp_effect *effect, float *buf, unsigned int frames)
+{
+	struct gain_private *priv = effect->priv;
+	unsigned int i, count = frames * effect->channels;
+
+	for (i = 0; i < count; i++)
+		buf[i] *= priv->gain;
+}
+
+static const struct dsp_plugin dsp_gain = {
+	.name = "gain",
+	.usage = "gain:<dB>",
+	.private_size = sizeof(struct gain_private),
+	.init = gain_init,
+	.run = gain_run,
+};
+
+/*
+ * biquad:<type>:<Hz>:<Q>[:<dB>]
+ *
+ * The coefficients follow the RBJ audio EQ cookbook, the filter is
+ * the transposed direct form II with the state per channel.
+ */
+
+enum {
+	BIQUAD_LOWPASS,
+	BIQUAD_HIGHPASS,
+	BIQUAD_BANDPASS,
+	BIQUAD_NOTCH,
+	BIQUAD_PEAK,
+	BIQUAD_LOWSHELF,
+	BIQUAD_HIGHSHELF,
+};
+
+static const char *biquad_types[] = {
+	"lowpass", "highpass", "bandpass", "notch", "peak",
+	"lowshelf", "highshelf", NULL
+};
+
+struct biquad_private {
+	int type;
+	double freq, q, db;
+	float b0, b1, b2, a1, a2;
+	float *z;			/* two state values per channel */
+};
+
+static int biquad_init(struct dsp_effect *effect, int argc, char **argv)
+{
+	struct biquad_private *priv = effect->priv;
+	int i;
+
+	if (argc < 3 || argc > 4)
+		return -EINVAL;
+	for (i = 0; biquad_types[i]; i++)
+		if (strcmp(argv[0], biquad_types[i]) == 0)
+			break;
+	if (biquad_types[i] == NULL)
+		return -EINVAL;
+	priv->type = i;
+	priv->freq = atof(argv[1]);
+	priv->q = atof(argv[2]);
+	priv->db = argc > 3 ? atof(argv[3]) : 0;
+	if (priv->freq <= 0 || priv->q <= 0)
+		return -EINVAL;
+	return 0;
+}
+
+static int biquad_start(struct dsp_effect *effect)
+{
+	struct biquad_private *priv = effect->priv;
+	double w0, cw, alpha, a, sa, b0, b1, b2, a0, a1, a2;
+
+	if (priv->freq >= effect->rate / 2.0) {
+		logit(LOG_CRIT, "biquad frequency %.0fHz is above the Nyquist frequency\n", priv->freq);
+		return -EINVAL;
+	}
+	priv->z = calloc(effect->channels * 2, sizeof(float));
+	if (priv->z == NULL)
+		return -ENOMEM;
+	w0 = 2 * M_PI * priv->freq / effect->rate;
+	cw = cos(w0);
+	alpha = sin(w0) / (2 * priv->q);
+	a = pow(10, priv->db / 40);
+	sa = 2 * sqrt(a) * alpha;
+	switch (priv->type) {
+	case BIQUAD_LOWPASS:
+		b0 = b2 = (1 - cw) / 2;
+		b1 = 1 - cw;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_HIGHPASS:
+		b0 = b2 = (1 + cw) / 2;
+		b1 = -(1 + cw);
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_BANDPASS:
+		b0 = alpha; b1 = 0; b2 = -alpha;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_NOTCH:
+		b0 = b2 = 1;
+		b1 = -2 * cw;
+		a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+		break;
+	case BIQUAD_PEAK:
+		b0 = 1 + alpha * a; b1 = -2 * cw; b2 = 1 - alpha * a;
+		a0 = 1 + alpha / a; a1 = -2 * cw; a2 = 1 - alpha / a;
+		break;
+	case BIQUAD_LOWSHELF:
+		b0 = a * ((a + 1) - (a - 1) * cw + sa);
+		b1 = 2 * a * ((a - 1) - (a + 1) * cw);
+		b2 = a * ((a + 1) - (a - 1) * cw - sa);
+		a0 = (a + 1) + (a - 1) * cw + sa;
+		a1 = -2 * ((a - 1) + (a + 1) * cw);
+		a2 = (a + 1) + (a - 1) * cw - sa;
+		break;
+	default:
+		b0 = a * ((a + 1) + (a - 1) * cw + sa);
+		b1 = -2 * a * ((a - 1) + (a + 1) * cw);
+		b2 = a * ((a + 1) + (a - 1) * cw - sa);
+		a0 = (a + 1) - (a - 1) * cw + sa;
+		a1 = 2 * ((a - 1) - (a + 1) * cw);
+		a2 = (a + 1) - (a - 1) * cw - sa;
+		break;
+	}
+	priv->b0 = b0 / a0;
+	priv->b1 = b1 / a0;
+	priv->b2 = b2 / a0;
+	priv->a1 = a1 / a0;
+	priv->a2 = a2 / a0;
+	return 0;
+}
+
+static void biquad_run(struct dsp_effect *effect, float *buf, unsigned int frames)
+{
+	struct biquad_private *priv = effect->priv;
+	unsigned int c, i, channels = effect->channels;
+	float x, y, z1, z2;
+
+	for (c = 0; c < channels; c++) {
+		z1 = priv->z[c * 2];
+		z2 = priv->z[c * 2 + 1];
+		for (i = 0; i < frames; i++) {
+			x = buf[i * channels + c];
+			y = priv->b0 * x + z1;
+			z1 = priv->b1 * x - priv->a1 * y + z2;
+			z2 = priv->b2 * x - priv->a2 * y;
+			buf[i * channels + c] = y;
+		}
+		/* flush the denormals on long silence */
+		priv->z[c * 2] = fabsf(z1) < 1e-20f ? 0 : z1;
+		priv->z[c * 2 + 1] = fabsf(z2) < 1e-20f ? 0 : z2;
+	}
+}
+
+static void biquad_stop(struct dsp_effect *effect)
+{
+	struct biquad_private *priv = effect->priv;
+
+	free(priv->z);
+	priv->z = NULL;
+}
+
+static const struct dsp_plugin dsp_biquad = {
+	.name = "biquad",
+	.usage = "biquad:lowpass|highpass|bandpass|notch|peak|lowshelf|highshelf:<Hz>:<Q>[:<dB>]",
+	.private_size = sizeof(struct biquad_private),
+	.init = biquad_init,
+	.start = biquad_start,
+	.run = biquad_run,
+	.stop = biquad_stop,
+};
+
+/*
+ * limiter:<dB>[:<release ms>]
+ *
+ * Peak limiter with an instant attack, all channels share the gain.
+ */
+
+struct limiter_private {
+	float threshold;
+	double release_ms;
+	float release;			/* gain recovery per frame */
+	float gain;
+};
+
+static int limiter_init(struct dsp_effect *effect, int argc, char **argv)
+{
+	struct limiter_private *priv = effect->priv;
+
+	if (argc < 1 || argc > 2)
+		return -EINVAL;
+	priv->threshold = db_to_gain(atof(argv[0]));
+	priv->release_ms = argc > 1 ? atof(argv[1]) : 50;
+	if (priv->threshold > 1 || priv->release_ms <= 0)
+		return -EINVAL;
+	return 0;
+}
+
+static int limiter_start(struct dsp_effect *effect)
+{
+	struct limiter_private *priv = effect->priv;
+
+	priv->release = 1 - exp(-1000.0 / (priv->release_ms * effect->rate));
+	priv->gain = 1;
+	return 0;
+}
+
+static void limiter_run(struct dsp_effect *effect, float *buf, unsigned int frames)
+{
+	struct limiter_private *priv = effect->priv;
+	unsigned int c, i, channels = effect->channels;
+	float peak, gain = priv->gain;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		peak = 0;
+		for (c = 0; c < channels; c++)
+			if (fabsf(buf[c]) > peak)
+				peak = fabsf(buf[c]);
+		gain += (1 - gain) * priv->release;
+		if (peak * gain > priv->threshold)
+			gain = priv->threshold / peak;
+		if (gain < 1)
+			for (c = 0; c < channels; c++)
+				buf[c] *= gain;
+	}
+	priv->gain = gain;
+}
+
+static const struct dsp_plugin dsp_limiter = {
+	.name = "limiter",
+	.usage = "limiter:<dB>[:<release ms>]",
+	.private_size = sizeof(struct limiter_private),
+	.init = limiter_init,
+	.start = limiter_start,
+	.run = limiter_run,
+};
+
+/*
+ * remap:<src>[:<src>...]
+ *
+ * The output channel N takes the input channel given by the N-th
+ * argument, channels without an argument are kept.
+ */
+
+#define REMAP_CHANNELS	32
+
+struct remap_private {
+	unsigned int count;
+	unsigned int map[REMAP_CHANNELS];
+	float *frame;
+};
+
+static int remap_init(struct dsp_effect *effect, int argc, char **argv)
+{
+	struct remap_private *priv = effect->priv;
+	char *end;
+	int i;
+
+	if (argc < 1 || argc > REMAP_CHANNELS)
+		return -EINVAL;
+	for (i = 0; i < argc; i++) {
+		priv->map[i] = strtoul(argv[i], &end, 10);
+		if (end == argv[i] || *end)
+			return -EINVAL;
+	}
+	priv->count = argc;
+	return 0;
+}
+
+static int remap_start(struct dsp_effect *effect)
+{
+	struct remap_private *priv = effect->priv;
+	unsigned int i;
+
+	if (priv->count > effect->channels)
+		goto __wrong;
+	for (i = 0; i < priv->count; i++)
+		if (priv->map[i] >= effect->channels)
+			goto __wrong;
+	for (; i < effect->channels && i < REMAP_CHANNELS; i++)
+		priv->map[i] = i;
+	priv->frame = malloc(effect->channels * sizeof(float));
+	if (priv->frame == NULL)
+		return -ENOMEM;
+	return 0;
+      __wrong:
+	logit(LOG_CRIT, "remap does not match %u channels\n", effect->channels);
+	return -EINVAL;
+}
+
+static void remap_run(struct dsp_effect *effect, float *buf, unsigned int frames)
+{
+	struct remap_private *priv = effect->priv;
+	unsigned int c, i, channels = effect->channels;
+
+	if (channels > REMAP_CHANNELS)
+		channels = REMAP_CHANNELS;
+	for (i = 0; i < frames; i++, buf += effect->channels) {
+		memcpy(priv->frame, buf, channels * sizeof(float));
+		for (c = 0; c < channels; c++)
+			buf[c] = priv->frame[priv->map[c]];
+	}
+}
+
+static void remap_stop(struct dsp_effect *effect)
+{
+	struct remap_private *priv = effect->priv;
+
+	free(priv->frame);
+	priv->frame = NULL;
+}
+
+static const struct dsp_plugin dsp_remap = {
+	.name = "remap",
+	.usage = "remap:<src>[:<src>...]",
+	.private_size = sizeof(struct remap_private),
+	.init = remap_init,
+	.start = remap_start,
+	.run = remap_run,
+	.stop = remap_stop,
+};
+
+/*
+ * chain
+ */
+
+static const struct dsp_plugin *dsp_plugins[] = {
+	&dsp_gain,
+	&dsp_biquad,
+	&dsp_limiter,
+	&dsp_remap,
+	&dsp_sweep,
+	NULL
+};
+
+void dsp_usage(void)
+{
+	const struct dsp_plugin **plugin;
+
+	for (plugin = dsp_plugins; *plugin; plugin++)
+		printf("  %s\n", (*plugin)->usage);
+}
+
+static int dsp_add(struct loopback *loop, char *spec)
+{
+	const struct dsp_plugin **plugin;
+	struct dsp_effect *effect, **last;
+	char *argv[DSP_ARGS + 1], *save;
+	int argc = 0, err;
+
+	argv[0] = strtok_r(spec, ":", &save);
+	if (argv[0] == NULL)
+		return -EINVAL;
+	while (argc < DSP_ARGS &&
+	       (argv[argc + 1] = strtok_r(NULL, ":", &save)) != NULL)
+		argc++;
+	for (plugin = dsp_plugins; *plugin; plugin++)
+		if (strcmp((*plugin)->name, argv[0]) == 0)
+			break;
+	if (*plugin == NULL) {
+		logit(LOG_CRIT, "Unknown DSP effect '%s'\n", argv[0]);
+		return -EINVAL;
+	}
+	effect = calloc(1, sizeof(*effect) + (*plugin)->private_size);
+	if (effect == NULL)
+		return -ENOMEM;
+	effect->plugin = *plugin;
+	effect->priv = effect + 1;
+	if (effect->plugin->init &&
+	    (err = effect->plugin->init(effect, argc, argv + 1)) < 0) {
+		logit(LOG_CRIT, "Wrong DSP effect arguments, use %s\n", effect->plugin->usage);
+		free(effect);
+		return err;
+	}
+	for (last = &loop->dsp; *last; last = &(*last)->next)
+		;
+	*last = effect;
+	return 0;
+}
+
+int dsp_parse(struct loopback *loop, const char *str)
+{
+	char *spec, *item, *save;
+	int err = 0;
+
+	spec = strdup(str);
+	if (spec == NULL)
+		return -ENOMEM;
+	for (item = strtok_r(spec, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		err = dsp_add(loop, item);
+		if (err < 0)
+			break;
+	}
+	free(spec);
+	return err;
+}
+
+int dsp_start(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct dsp_effect *effect;
+	int err;
+
+	if (loop->dsp == NULL)
+		return 0;
+	if (!convert_supported(play->format)) {
+		logit(LOG_CRIT, "%s: DSP chain does not support the %s format\n", loop->id, snd_pcm_format_name(play->format));
+		return -EINVAL;
+	}
+	if (play->format != SND_PCM_FORMAT_FLOAT) {
+		loop->dsp_block = malloc(DSP_BLOCK * play->channels * sizeof(float));
+		if (loop->dsp_block == NULL)
+			return -ENOMEM;
+	}
+	for (effect = loop->dsp; effect; effect = effect->next) {
+		effect->channels = play->channels;
+		effect->rate = play->rate;
+		/* stop is called for a partially started effect, too */
+		effect->started = 1;
+		if (effect->plugin->start &&
+		    (err = effect->plugin->start(effect)) < 0) {
+			dsp_stop(loop);
+			return err;
+		}
+	}
+	return 0;
+}
+
+void dsp_stop(struct loopback *loop)
+{
+	struct dsp_effect *effect;
+
+	for (effect = loop->dsp; effect; effect = effect->next) {
+		if (effect->started && effect->plugin->stop)
+			effect->plugin->stop(effect);
+		effect->started = 0;
+	}
+	free(loop->dsp_block);
+	loop->dsp_block = NULL;
+}
+
+void dsp_free(struct loopback *loop)
+{
+	struct dsp_effect *effect;
+
+	dsp_stop(loop);
+	while (loop->dsp) {
+		effect = loop->dsp;
+		loop->dsp = effect->next;
+		free(effect);
+	}
+}
+
+static void dsp_run(struct loopback *loop, float *buf, unsigned int frames)
+{
+	struct dsp_effect *effect;
+
+	for (effect = loop->dsp; effect; effect = effect->next)
+		effect->plugin->run(effect, buf, frames);
+}
+
+/* process the playback ring from the given queued frame to the end */
+void dsp_process(struct loopback *loop, snd_pcm_uframes_t from)
+{
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t pos, count, count1;
+	unsigned int channels = play->channels;
+	char *ptr;
+
+	pos = (play->buf_pos + from) % play->buf_size;
+	while (from < play->buf_count) {
+		count = play->buf_count - from;
+		if (count + pos > play->buf_size)
+			count = play->buf_size - pos;
+		from += count;
+		ptr = play->buf + pos * play->frame_size;
+		pos = 0;
+		if (loop->dsp_block == NULL) {
+			dsp_run(loop, (float *)ptr, count);
+			continue;
+		}
+		while (count > 0) {
+			count1 = count > DSP_BLOCK ? DSP_BLOCK : count;
+			convert_to_float(play->format, ptr, channels,
+					 loop->dsp_block, channels, NULL, count1);
+			dsp_run(loop, loop->dsp_block, count1);
+			convert_from_float(play->format, loop->dsp_block, ptr,
+				       count1 * channels);
+			ptr += count1 * play->frame_size;
+			count -= count1;
+		}
+	}
+}
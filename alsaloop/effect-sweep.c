@@ -19,111 +19,112 @@
  */
 
 #include "aconfig.h"
+#include <stdlib.h>
+#include <errno.h>
 #include <math.h>
+#include <syslog.h>
 #include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+/*
+ * sweep[:<center Hz>:<depth Hz>:<lfo Hz>:<bandwidth Hz>]
+ */
 
 struct effect_private {
 	/* filter the sweep variables */
-	float lfo,dlfo,fs,fc,BW,C,D,a0,a1,a2,b1,b2,*x[3],*y[3];
-	float lfo_depth, lfo_center;
-	unsigned int channels;
+	float lfo, dlfo, fs, BW, C, a0, a2;
+	float lfo_depth, lfo_center, lfo_freq;
+	float *x[2], *y[2];
 };
 
-static int effect_init(struct lookback *loopback,
-		       void *private_data,
-		       snd_pcm_access_t access,
-		       unsigned int channels,
-		       unsigned int rate,
-		       snd_pcm_format_t format)
+static int effect_init(struct dsp_effect *effect, int argc, char **argv)
+{
+	struct effect_private *priv = effect->priv;
+
+	if (argc > 4)
+		return -EINVAL;
+	priv->lfo_center = argc > 0 ? atof(argv[0]) : 2000.;
+	priv->lfo_depth = argc > 1 ? atof(argv[1]) : 1800.;
+	priv->lfo_freq = argc > 2 ? atof(argv[2]) : 0.2;
+	priv->BW = argc > 3 ? atof(argv[3]) : 50;
+	if (priv->lfo_depth < 0 || priv->lfo_depth >= priv->lfo_center ||
+	    priv->lfo_freq <= 0 || priv->BW <= 0)
+		return -EINVAL;
+	return 0;
+}
+
+static int effect_start(struct dsp_effect *effect)
 {
-	struct effect_private *priv = private_data;
+	struct effect_private *priv = effect->priv;
 	int i;
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-	if (format != SND_PCM_FORMAT_S16_LE)
-		return -EIO;
-#elif __BYTE_ORDER == __BIG_ENDIAN
-	if (format != SND_PCM_FORMAT_S16_BE)
-		return -EIO;
-#else
-	return -EIO;
-#endif
-	priv->fs = (float) rate;
-	priv->channels = channels;
-	for (i = 0; i < 3; i++) {
-		priv->x[i] = calloc(channels * sizeof(float));
-		priv->y[i] = calloc(channels * sizeof(float));
+	priv->fs = (float) effect->rate;
+	if (priv->lfo_center + priv->lfo_depth >= priv->fs / 2) {
+		logit(LOG_CRIT, "sweep range is above the Nyquist frequency\n");
+		return -EINVAL;
+	}
+	priv->lfo = 0;
+	priv->dlfo = 2. * M_PI * priv->lfo_freq / priv->fs;
+	/* the bandwidth part of the coefficients does not change */
+	priv->C = 1. / tan(M_PI * priv->BW / priv->fs);
+	priv->a0 = 1. / (1. + priv->C);
+	priv->a2 = -priv->a0;
+	for (i = 0; i < 2; i++) {
+		priv->x[i] = calloc(effect->channels, sizeof(float));
+		priv->y[i] = calloc(effect->channels, sizeof(float));
+		if (priv->x[i] == NULL || priv->y[i] == NULL)
+			return -ENOMEM;
 	}
 	return 0;
 }
 
-static int effect_done(struct loopback *loopback,
-		       void *private_data)
+static void effect_stop(struct dsp_effect *effect)
 {
-	struct effect_private *priv = private_data;
+	struct effect_private *priv = effect->priv;
 	int i;
 
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < 2; i++) {
 		free(priv->x[i]);
 		free(priv->y[i]);
+		priv->x[i] = priv->y[i] = NULL;
 	}
-	return 0;
 }
 
-static int effect_apply(struct loopback *loopback,
-			void *private_data,
-			const snd_pcm_channel_area_t *areas,
-			snd_uframes_t offset,
-			snd_uframes_t frames)
+static void effect_run(struct dsp_effect *effect, float *samples,
+		       unsigned int frames)
 {
-	struct effect_private *priv = private_data;
-	short *samples = (short*)areas[0].addr + offset*priv->channels;
-	snd_uframes_t i;
+	struct effect_private *priv = effect->priv;
+	unsigned int i, chn, channels = effect->channels;
+	float fc, D, b1, b2, x, y;
 
-	for (i=0; i < frames; i++) {
-		int chn;
-
-		fc = sin(priv->lfo)*priv->lfo_depth+priv->lfo_center;
+	for (i = 0; i < frames; i++) {
+		fc = sin(priv->lfo) * priv->lfo_depth + priv->lfo_center;
 		priv->lfo += priv->dlfo;
-		if (priv->lfo>2.*M_PI) priv->lfo -= 2.*M_PI;
-		priv->C = 1./tan(M_PI*priv->BW/priv->fs);
-		priv->D = 2.*cos(2*M_PI*fc/fs);
-		priv->a0 = 1./(1.+priv->C);
-		priv->a1 = 0;
-		priv->a2 = -priv->a0;
-		priv->b1 = -priv->C*priv->D*a0;
-		priv->b2 = (priv->C-1)*priv->a0;
-
-		for (chn=0; chn < priv->channels; chn++)
-		{
-			priv->x[chn][2] = priv->x[chn][1];
-			priv->x[chn][1] = priv->x[chn][0];
-
-			priv->y[chn][2] = priv->y[chn][1];
-			priv->y[chn][1] = priv->y[chn][0];
+		if (priv->lfo > 2. * M_PI)
+			priv->lfo -= 2. * M_PI;
+		D = 2. * cos(2 * M_PI * fc / priv->fs);
+		b1 = -priv->C * D * priv->a0;
+		b2 = (priv->C - 1) * priv->a0;
 
-			priv->x[chn][0] = samples[i*channels+chn];
-			priv->y[chn][0] = priv->a0*priv->x[0][chn]
-				+ priv->a1*priv->x[1][chn] + priv->a2*x[2][chn]
-				- priv->b1*priv->y[1][chn] - priv->b2*y[2][chn];
-			samples[i*channels+chn] = priv->y[chn][0];
+		for (chn = 0; chn < channels; chn++) {
+			x = samples[i * channels + chn];
+			y = priv->a0 * x + priv->a2 * priv->x[1][chn]
+				- b1 * priv->y[0][chn] - b2 * priv->y[1][chn];
+			priv->x[1][chn] = priv->x[0][chn];
+			priv->x[0][chn] = x;
+			priv->y[1][chn] = priv->y[0][chn];
+			priv->y[0][chn] = y;
+			samples[i * channels + chn] = y;
 		}
 	}
-	return 0;
 }
 
-void effect_init_sweep(void)
-{
-	struct effect_private *priv;
-
-	priv = register_effect(effect_init,
-			       effect_apply,
-			       effect_done,
-			       sizeof(struct effectprivate));
-	if (priv) {
-		priv->lfo_center = 2000.;
-		priv->lfo_depth = 1800.;
-		priv->lfo_freq = 0.2;
-		priv->BW = 50;
-	}
-}
+const struct dsp_plugin dsp_sweep = {
+	.name = "sweep",
+	.usage = "sweep[:<center Hz>:<depth Hz>:<lfo Hz>:<bandwidth Hz>]",
+	.private_size = sizeof(struct effect_private),
+	.init = effect_init,
+	.start = effect_start,
+	.run = effect_run,
+	.stop = effect_stop,
+};
@@ -38,8 +38,17 @@
 
 #define XRUN_PROFILE_UNKNOWN (-10000000)
 
+#define SYNC_DAMPING		1.0	/* critically damped loop */
+#define SYNC_PITCH_MAX		0.01	/* integrator limit */
+#define SYNC_PITCH_STEP		1e-7	/* smallest applied pitch change */
+#define SYNC_LOCK_FRAMES	1.0	/* locked within +-1 frame */
+#define SYNC_LOCK_TIME		1.0	/* for one second */
+
+#define CONVERT_BLOCK		256	/* frames per format conversion */
+
 static int set_rate_shift(struct loopback_handle *lhandle, double pitch);
 static int get_rate(struct loopback_handle *lhandle);
+static void sync_restart(struct loopback *loop);
 
 #define SYNCTYPE(v) [SYNC_TYPE_##v] = #v
 
@@ -54,15 +63,14 @@ static const char *sync_types[] = {
 
 #define SRCTYPE(v) [SRC_##v] = "SRC_" #v
 
-#ifdef USE_SAMPLERATE
 static const char *src_types[] = {
 	SRCTYPE(SINC_BEST_QUALITY),
 	SRCTYPE(SINC_MEDIUM_QUALITY),
 	SRCTYPE(SINC_FASTEST),
 	SRCTYPE(ZERO_ORDER_HOLD),
-	SRCTYPE(LINEAR)
+	SRCTYPE(LINEAR),
+	SRCTYPE(INTERNAL)
 };
-#endif
 
 static pthread_once_t pcm_open_mutex_once = PTHREAD_ONCE_INIT;
 static pthread_mutex_t pcm_open_mutex;
@@ -115,6 +123,8 @@ static int setparams_stream(struct loopback_handle *lhandle,
 	int err;
 	unsigned int rrate;
 
+	if (lhandle->route_joined)
+		return 0;
 	err = snd_pcm_hw_params_any(handle, params);
 	if (err < 0) {
 		logit(LOG_CRIT, "Broken configuration for %s PCM: no configurations available: %s\n", lhandle->id, snd_strerror(err));
@@ -172,6 +182,8 @@ static int setparams_bufsize(struct loopback_handle *lhandle,
 	snd_pcm_uframes_t buffersize;
 	snd_pcm_uframes_t last_bufsize = 0;
 
+	if (lhandle->route_joined)
+		return 0;
 	if (lhandle->buffer_size_req > 0) {
 		bufsize = lhandle->buffer_size_req;
 		last_bufsize = bufsize;
@@ -231,6 +243,8 @@ static int setparams_set(struct loopback_handle *lhandle,
 	int err;
 	snd_pcm_uframes_t val, period_size, buffer_size;
 
+	if (lhandle->route_joined)
+		return 0;
 	err = snd_pcm_hw_params(handle, params);
 	if (err < 0) {
 		logit(LOG_CRIT, "Unable to set hw params for %s: %s\n", lhandle->id, snd_strerror(err));
@@ -246,6 +260,13 @@ static int setparams_set(struct loopback_handle *lhandle,
 		logit(LOG_CRIT, "Unable to set start threshold mode for %s: %s\n", lhandle->id, snd_strerror(err));
 		return err;
 	}
+	/* only the drift measurement uses the timestamps, not all plugins have them */
+	err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+	if (err < 0)
+		logit(LOG_WARNING, "Unable to set timestamp mode for %s: %s\n", lhandle->id, snd_strerror(err));
+	err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if (err < 0)
+		logit(LOG_WARNING, "Unable to set timestamp type for %s: %s\n", lhandle->id, snd_strerror(err));
 	snd_pcm_hw_params_get_period_size(params, &period_size, NULL);
 	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
 	if (lhandle->nblock) {
@@ -365,11 +386,13 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 		if (snd_pcm_link(loop->capt->handle, loop->play->handle) >= 0)
 			loop->linked = 1;
 #endif
-	if ((err = snd_pcm_prepare(loop->play->handle)) < 0) {
+	if (!loop->play->route_joined &&
+	    (err = snd_pcm_prepare(loop->play->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if (!loop->linked && (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
+	if (!loop->linked && !loop->capt->route_joined &&
+	    (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
@@ -503,12 +526,13 @@ static void buf_remove(struct loopback *loop, snd_pcm_uframes_t count)
 	}
 }
 
-#if 0
-static void buf_add_copy(struct loopback *loop)
+/* copy or convert from the capture ring segments to the playback ring */
+static void buf_add_convert(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
 	struct loopback_handle *play = loop->play;
 	snd_pcm_uframes_t count, count1, cpos, ppos;
+	char *src, *dst;
 
 	count = capt->buf_count;
 	cpos = capt->buf_pos - count;
@@ -523,11 +547,21 @@ static void buf_add_copy(struct loopback *loop)
 			count1 = buf_avail(play);
 		if (count1 + ppos > play->buf_size)
 			count1 = play->buf_size - ppos;
+		if (loop->convert_block && count1 > CONVERT_BLOCK)
+			count1 = CONVERT_BLOCK;
 		if (count1 == 0)
 			break;
-		memcpy(play->buf + ppos * play->frame_size,
-		       capt->buf + cpos * capt->frame_size,
-		       count1 * capt->frame_size);
+		src = capt->buf + cpos * capt->frame_size;
+		dst = play->buf + ppos * play->frame_size;
+		if (loop->convert_block) {
+			convert_to_float(capt->format, src, capt->channels,
+					 loop->convert_block, play->channels,
+					 loop->convert_map, count1);
+			convert_from_float(play->format, loop->convert_block,
+					   dst, count1 * play->channels);
+		} else {
+			memcpy(dst, src, count1 * capt->frame_size);
+		}
 		play->buf_count += count1;
 		capt->buf_count -= count1;
 		ppos += count1;
@@ -537,7 +571,6 @@ static void buf_add_copy(struct loopback *loop)
 		count -= count1;
 	}
 }
-#endif
 
 #ifdef USE_SAMPLERATE
 static void buf_add_src(struct loopback *loop)
@@ -555,18 +588,12 @@ static void buf_add_src(struct loopback *loop)
 		count1 = count;
 		if (count1 + pos1 > capt->buf_size)
 			count1 = capt->buf_size - pos1;
-		if (capt->format == SND_PCM_FORMAT_S32)
-			src_int_to_float_array((int *)(capt->buf +
-						pos1 * capt->frame_size),
-					 (float *)loop->src_data.data_in +
-					   pos * capt->channels,
-					 count1 * capt->channels);
-		else
-			src_short_to_float_array((short *)(capt->buf +
-						pos1 * capt->frame_size),
-					 (float *)loop->src_data.data_in +
-					   pos * capt->channels,
-					 count1 * capt->channels);
+		convert_to_float(capt->format,
+				 capt->buf + pos1 * capt->frame_size,
+				 capt->channels,
+				 (float *)loop->src_data.data_in +
+				   pos * play->channels,
+				 play->channels, loop->convert_map, count1);
 		count -= count1;
 		pos += count1;
 		pos1 += count1;
@@ -593,18 +620,11 @@ static void buf_add_src(struct loopback *loop)
 			count1 = buf_avail(play);
 		if (count1 == 0)
 			break;
-		if (capt->format == SND_PCM_FORMAT_S32)
-			src_float_to_int_array(loop->src_data.data_out +
-					   pos * play->channels,
-					 (int *)(play->buf +
-					   pos1 * play->frame_size),
-					 count1 * play->channels);
-		else
-			src_float_to_short_array(loop->src_data.data_out +
-					   pos * play->channels,
-					 (short *)(play->buf +
-					   pos1 * play->frame_size),
-					 count1 * play->channels);
+		convert_from_float(play->format,
+				   loop->src_data.data_out +
+				     pos * play->channels,
+				   play->buf + pos1 * play->frame_size,
+				   count1 * play->channels);
 		play->buf_count += count1;
 		count -= count1;
 		pos += count1;
@@ -630,22 +650,88 @@ static void buf_add_src(struct loopback *loop ATTRIBUTE_UNUSED)
 }
 #endif
 
+static void buf_add_resample(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t count, space, cpos, ppos, in, out;
+
+	/* resample from the capture ring segments to the playback ring */
+	count = capt->buf_count;
+	cpos = capt->buf_pos - count;
+	if (cpos > capt->buf_size)
+		cpos += capt->buf_size;
+	ppos = (play->buf_pos + play->buf_count) % play->buf_size;
+	space = buf_avail(play);
+	while (count > 0 && space > 0) {
+		in = count;
+		if (in + cpos > capt->buf_size)
+			in = capt->buf_size - cpos;
+		out = space;
+		if (out + ppos > play->buf_size)
+			out = play->buf_size - ppos;
+		resample_process(loop, capt->buf + cpos * capt->frame_size, &in,
+				 play->buf + ppos * play->frame_size, &out);
+		if (in == 0 && out == 0)
+			break;
+		capt->buf_count -= in;
+		count -= in;
+		cpos += in;
+		cpos %= capt->buf_size;
+		play->buf_count += out;
+		space -= out;
+		ppos += out;
+		ppos %= play->buf_size;
+	}
+}
+
+/* silence the playback buffer from the given queued frame to the end */
+static void buf_mute(struct loopback_handle *lhandle, snd_pcm_uframes_t from)
+{
+	snd_pcm_uframes_t pos, count;
+
+	pos = (lhandle->buf_pos + from) % lhandle->buf_size;
+	while (from < lhandle->buf_count) {
+		count = lhandle->buf_count - from;
+		if (count + pos > lhandle->buf_size)
+			count = lhandle->buf_size - pos;
+		snd_pcm_format_set_silence(lhandle->format,
+					   lhandle->buf + pos * lhandle->frame_size,
+					   count * lhandle->channels);
+		from += count;
+		pos = 0;
+	}
+}
+
 static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 {
+	snd_pcm_uframes_t queued = loop->play->buf_count;
+
 	/* copy samples from capture to playback buffer */
 	if (count <= 0)
 		return;
 	if (loop->play->buf == loop->capt->buf) {
 		loop->play->buf_count += count;
-	} else {
+	} else if (loop->resampler) {
+		buf_add_resample(loop);
+	} else if (loop->use_samplerate) {
 		buf_add_src(loop);
-	}
+	} else {
+		buf_add_convert(loop);
+	}
+	if (loop->mute)
+		buf_mute(loop->play, queued);
+	else if (loop->dsp)
+		dsp_process(loop, queued);
+	if (loop->probe && !loop->mute)
+		probe_inject(loop, queued);
 }
 
 static int xrun(struct loopback_handle *lhandle)
 {
 	int err;
 
+	lhandle->xruns++;
 	if (lhandle == lhandle->loopback->play) {
 		if (verbose)
 			logit(LOG_DEBUG, "underrun for %s\n", lhandle->id);
@@ -681,6 +767,19 @@ static int readit(struct loopback_handle *lhandle)
 	snd_pcm_sframes_t avail;
 	int err;
 
+	if (lhandle->route) {
+		avail = route_capture(lhandle);
+		if (avail == -EPIPE) {
+			if ((err = xrun(lhandle)) < 0)
+				return err;
+		} else if (avail == -ESTRPIPE) {
+			if ((err = suspend(lhandle)) < 0)
+				return err;
+		} else if (avail < 0) {
+			return avail;
+		}
+		return route_dequeue(lhandle);
+	}
 	avail = snd_pcm_avail_update(lhandle->handle);
 	if (avail == -EPIPE) {
 		return xrun(lhandle);
@@ -745,6 +844,30 @@ static int writeit(struct loopback_handle *lhandle)
 	int err;
 
       __again:
+	if (lhandle->route) {
+		r = route_playback(lhandle);
+		if (r == -EPIPE) {
+			if ((err = xrun(lhandle)) < 0)
+				return err;
+			return 0;
+		} else if (r == -ESTRPIPE) {
+			if ((err = suspend(lhandle)) < 0)
+				return err;
+			goto __again;
+		} else if (r <= 0) {
+			return r;
+		}
+		xrun_profile(lhandle->loopback);
+		if (lhandle->loopback->stop_pending) {
+			lhandle->loopback->stop_count += r;
+			if (lhandle->loopback->stop_count * lhandle->pitch >
+			    lhandle->loopback->latency * 3) {
+				lhandle->loopback->stop_pending = 0;
+				lhandle->loopback->reinit = 1;
+			}
+		}
+		return r;
+	}
 	avail = snd_pcm_avail_update(lhandle->handle);
 	if (avail == -EPIPE) {
 		if ((err = xrun(lhandle)) < 0)
@@ -798,6 +921,127 @@ static int writeit(struct loopback_handle *lhandle)
 	return res;
 }
 
+static int direct_error(struct loopback_handle *lhandle, int err)
+{
+	if (err == -EPIPE)
+		return xrun(lhandle);
+	if (err == -ESTRPIPE)
+		return suspend(lhandle);
+	return err;
+}
+
+static int direct_silence(struct loopback_handle *lhandle,
+			  snd_pcm_uframes_t count)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r, res = 0;
+	int err;
+
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail < 0)
+		return avail;
+	if (count > (snd_pcm_uframes_t)avail)
+		count = avail;
+	while (count > 0) {
+		frames = count;
+		err = snd_pcm_mmap_begin(lhandle->handle, &areas, &offset, &frames);
+		if (err < 0)
+			return err;
+		err = snd_pcm_areas_silence(areas, offset, lhandle->channels,
+					    frames, lhandle->format);
+		if (err < 0)
+			return err;
+		r = snd_pcm_mmap_commit(lhandle->handle, offset, frames);
+		if (r < 0)
+			return r;
+		if (r == 0)
+			break;
+		res += r;
+		count -= r;
+	}
+	return res;
+}
+
+/*
+ * Copy the captured frames from the capture mmap area directly to the
+ * playback mmap area. There is no intermediate buffer, the frames which
+ * do not fit to the playback ring stay in the capture ring.
+ */
+static snd_pcm_sframes_t direct_transfer(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t coffset, poffset, frames;
+	snd_pcm_sframes_t cavail, pavail, r, res = 0;
+	int err;
+
+	cavail = snd_pcm_avail_update(capt->handle);
+	if (cavail < 0)
+		return direct_error(capt, cavail);
+	if (cavail == 0) {
+		if (snd_pcm_state(capt->handle) == SND_PCM_STATE_DRAINING)
+			loop->reinit = 1;
+		return 0;
+	}
+	pavail = snd_pcm_avail_update(play->handle);
+	if (pavail < 0)
+		return direct_error(play, pavail);
+	if (cavail > pavail)
+		cavail = pavail;
+	while (cavail > 0) {
+		frames = cavail;
+		err = snd_pcm_mmap_begin(capt->handle, &careas, &coffset, &frames);
+		if (err < 0)
+			return res > 0 ? res : direct_error(capt, err);
+		err = snd_pcm_mmap_begin(play->handle, &pareas, &poffset, &frames);
+		if (err < 0)
+			return res > 0 ? res : direct_error(play, err);
+		if (frames == 0)
+			break;
+		if (loop->mute)
+			err = snd_pcm_areas_silence(pareas, poffset,
+						    play->channels, frames,
+						    play->format);
+		else
+			err = snd_pcm_areas_copy(pareas, poffset, careas, coffset,
+						 play->channels, frames,
+						 play->format);
+		if (err < 0)
+			return res > 0 ? res : err;
+		r = snd_pcm_mmap_commit(play->handle, poffset, frames);
+		if (r < 0) {
+			err = direct_error(play, r);
+			return res > 0 ? res : err;
+		}
+		r = snd_pcm_mmap_commit(capt->handle, coffset, r);
+		if (r < 0) {
+			err = direct_error(capt, r);
+			return res > 0 ? res : err;
+		}
+		if (r == 0)
+			break;
+		res += r;
+		if (capt->max < (snd_pcm_uframes_t)res)
+			capt->max = res;
+		capt->counter += r;
+		play->counter += r;
+		cavail -= r;
+		xrun_profile(loop);
+		if (loop->stop_pending) {
+			loop->stop_count += r;
+			if (loop->stop_count * play->pitch >
+			    loop->latency * 3) {
+				loop->stop_pending = 0;
+				loop->reinit = 1;
+				break;
+			}
+		}
+	}
+	return res;
+}
+
 static snd_pcm_sframes_t remove_samples(struct loopback *loop,
 					int capture_preferred,
 					snd_pcm_sframes_t count)
@@ -828,6 +1072,53 @@ static snd_pcm_sframes_t remove_samples(struct loopback *loop,
 	return count;
 }
 
+static int xrun_sync_direct(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_uframes_t fill = get_whole_latency(loop) / play->pitch;
+	int err;
+
+	if (verbose > 5)
+		snd_output_printf(loop->output, "%s: xrun sync %i %i\n", loop->id, capt->xrun_pending, play->xrun_pending);
+	/* there is no buffer to keep the latency, restart both rings */
+	capt->xrun_pending = 0;
+	play->xrun_pending = 0;
+	snd_pcm_drop(capt->handle);
+	snd_pcm_drop(play->handle);
+	if ((err = snd_pcm_prepare(capt->handle)) < 0) {
+		logit(LOG_CRIT, "%s prepare failed: %s\n", capt->id, snd_strerror(err));
+		return err;
+	}
+	if ((err = snd_pcm_prepare(play->handle)) < 0) {
+		logit(LOG_CRIT, "%s prepare failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	if (fill > play->buffer_size)
+		fill = play->buffer_size;
+	err = direct_silence(play, fill);
+	if (err < 0) {
+		logit(LOG_CRIT, "%s silence failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	if (verbose > 6)
+		snd_output_printf(loop->output,
+			"sync: playback silence added %li samples\n", (long)err);
+	capt->counter = 0;
+	play->counter = 0;
+	sync_restart(loop);
+	if ((err = snd_pcm_start(capt->handle)) < 0) {
+		logit(LOG_CRIT, "%s start failed: %s\n", capt->id, snd_strerror(err));
+		return err;
+	}
+	if ((err = snd_pcm_start(play->handle)) < 0) {
+		logit(LOG_CRIT, "%s start failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	loop->xrun_max_proctime = 0;
+	return 0;
+}
+
 static int xrun_sync(struct loopback *loop)
 {
 	struct loopback_handle *play = loop->play;
@@ -836,6 +1127,8 @@ static int xrun_sync(struct loopback *loop)
 	snd_pcm_sframes_t pdelay, cdelay, delay1, pdelay1, cdelay1, diff;
 	int err;
 
+	if (loop->direct)
+		return xrun_sync_direct(loop);
       __again:
 	if (verbose > 5)
 		snd_output_printf(loop->output, "%s: xrun sync %i %i\n", loop->id, capt->xrun_pending, play->xrun_pending);
@@ -887,8 +1180,10 @@ static int xrun_sync(struct loopback *loop)
 	}
 	capt->counter = cdelay;
 	play->counter = pdelay;
+	sync_restart(loop);
 	if (play->buf != capt->buf)
 		cdelay += capt->buf_count;
+	cdelay += route_queued(capt);
 	pdelay += play->buf_count;
 #ifdef USE_SAMPLERATE
 	pdelay += loop->src_out_frames;
@@ -896,10 +1191,6 @@ static int xrun_sync(struct loopback *loop)
 	cdelay1 = cdelay * capt->pitch;
 	pdelay1 = pdelay * play->pitch;
 	delay1 = cdelay1 + pdelay1;
-	capt->total_queued = 0;
-	play->total_queued = 0;
-	loop->total_queued_count = 0;
-	loop->pitch_diff = loop->pitch_diff_min = loop->pitch_diff_max = 0;
 	if (verbose > 6) {
 		snd_output_printf(loop->output,
 			"sync: cdelay=%li(%li), pdelay=%li(%li), fill=%li (delay=%li)"
@@ -917,7 +1208,7 @@ static int xrun_sync(struct loopback *loop)
 			"sync: cbufcount=%li, pbufcount=%li\n",
 			(long)capt->buf_count, (long)play->buf_count);
 	}
-	if (delay1 > fill && capt->counter > 0) {
+	if (delay1 > fill && capt->counter > 0 && capt->route == NULL) {
 		if ((err = snd_pcm_drop(capt->handle)) < 0)
 			return err;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0)
@@ -1026,6 +1317,7 @@ static int xrun_sync(struct loopback *loop)
 				pdelay = -1;
 			if (play->buf != capt->buf)
 				cdelay += capt->buf_count;
+			cdelay += route_queued(capt);
 			pdelay += play->buf_count;
 #ifdef USE_SAMPLERATE
 			pdelay += loop->src_out_frames;
@@ -1085,6 +1377,12 @@ void update_pitch(struct loopback *loop)
 {
 	double pitch = loop->pitch;
 
+	if (loop->resampler) {
+		double ratio = resample_set_ratio(loop, (double)1.0 / (pitch *
+				loop->play->pitch * loop->capt->pitch));
+		if (verbose > 2)
+			snd_output_printf(loop->output, "%s: Resampler ratio update: %.8f\n", loop->id, ratio);
+	} else
 #ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_SAMPLERATE) {
 		loop->src_data.src_ratio = (double)1.0 / (pitch *
@@ -1118,8 +1416,179 @@ void update_pitch(struct loopback *loop)
 		}
 #endif
 	}
-	if (verbose)
-		snd_output_printf(loop->output, "New pitch for %s: %.8f (min/max samples = %li/%li)\n", loop->id, pitch, loop->pitch_diff_min, loop->pitch_diff_max);
+	if (verbose > 5)
+		snd_output_printf(loop->output, "New pitch for %s: %.8f (error %.3f frames)\n", loop->id, pitch, loop->sync_err);
+}
+
+static void sync_init(struct loopback *loop)
+{
+	double omega = 2 * M_PI * loop->sync_bandwidth;
+	double rate = loop->play->rate_req;
+
+	/*
+	 * The latency integrates the pitch error, so a PI controller
+	 * gives a second order loop with the natural frequency omega.
+	 */
+	loop->sync_kp = 2 * SYNC_DAMPING * omega / rate;
+	loop->sync_ki = omega * omega / rate;
+	loop->sync_integ = 0;
+	loop->sync_err = 0;
+	loop->sync_time = 0;
+	loop->sync_start = 0;
+	loop->sync_in_range = 0;
+	loop->sync_lock_time = -1;
+	loop->sync_locked = 0;
+	loop->sync_relocks = 0;
+	loop->sync_count = 0;
+	loop->sync_err_min = loop->sync_err_max = 0;
+	loop->sync_err_sum = loop->sync_err_sum2 = 0;
+}
+
+/* keep the drift estimate, but start over the measurement */
+static void sync_restart(struct loopback *loop)
+{
+	loop->sync_time = 0;
+	loop->sync_in_range = 0;
+	loop->sync_locked = 0;
+}
+
+static int sync_delay(struct loopback_handle *lhandle,
+		      snd_pcm_status_t *status,
+		      snd_pcm_sframes_t *delay, double *tstamp)
+{
+	snd_htimestamp_t ts;
+	int err;
+
+	err = snd_pcm_status(lhandle->handle, status);
+	if (err < 0)
+		return err;
+	if (snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING)
+		return -EPIPE;
+	*delay = snd_pcm_status_get_delay(status);
+	snd_pcm_status_get_htstamp(status, &ts);
+	/* no pointer update since the start or prepare */
+	if (ts.tv_sec == 0 && ts.tv_nsec == 0)
+		return -EAGAIN;
+	*tstamp = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	return 0;
+}
+
+/*
+ * The delay and the timestamp come from the same hardware pointer update,
+ * so both delays can be moved to the playback timestamp: the capture delay
+ * grows and the playback delay shrinks at the stream rate.
+ */
+static int sync_measure(struct loopback *loop, double *_err, double *_ptime)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_status_t *status;
+	snd_pcm_sframes_t cdelay, pdelay;
+	double ctime, ptime, err;
+	int res;
+
+	snd_pcm_status_alloca(&status);
+	if ((res = sync_delay(capt, status, &cdelay, &ctime)) < 0 ||
+	    (res = sync_delay(play, status, &pdelay, &ptime)) < 0)
+		return res;
+	if (play->buf != capt->buf)
+		cdelay += capt->buf_count;
+	cdelay += route_queued(capt);
+	pdelay += play->buf_count;
+#ifdef USE_SAMPLERATE
+	pdelay += loop->src_out_frames;
+#endif
+	err = cdelay * capt->pitch + pdelay * play->pitch +
+	      (ptime - ctime) * play->rate_req -
+	      (double)get_whole_latency(loop);
+	if (verbose > 4)
+		snd_output_printf(loop->output, "%s: queued %li/%li samples, error %.3f\n", loop->id, pdelay, cdelay, err);
+	loop->latency_now = err + get_whole_latency(loop);
+	*_err = err;
+	*_ptime = ptime;
+	return 0;
+}
+
+static void sync_update(struct loopback *loop)
+{
+	double ptime, err, dt, tau, pitch, limit;
+
+	if (sync_measure(loop, &err, &ptime) < 0)
+		return;
+	if (loop->sync_time == 0) {
+		if (loop->sync_start == 0)
+			loop->sync_start = ptime;
+		loop->sync_time = ptime;
+		loop->sync_err = err;
+		return;
+	}
+	dt = ptime - loop->sync_time;
+	if (dt <= 0)
+		return;
+	loop->sync_time = ptime;
+	/* the measurement jitter is filtered well above the loop bandwidth */
+	tau = 1 / (4 * 2 * M_PI * loop->sync_bandwidth);
+	loop->sync_err += (err - loop->sync_err) * dt / (dt + tau);
+	err = loop->sync_err;
+
+	limit = loop->resampler ? 0.001 : SYNC_PITCH_MAX;
+	loop->sync_integ += loop->sync_ki * err * dt;
+	if (loop->sync_integ > limit)
+		loop->sync_integ = limit;
+	else if (loop->sync_integ < -limit)
+		loop->sync_integ = -limit;
+	pitch = 1 + loop->sync_integ + loop->sync_kp * err;
+	if (pitch > 1 + limit)
+		pitch = 1 + limit;
+	else if (pitch < 1 - limit)
+		pitch = 1 - limit;
+	if (fabs(pitch - loop->pitch) >= SYNC_PITCH_STEP) {
+		loop->pitch = pitch;
+		update_pitch(loop);
+	}
+
+	/* convergence statistics */
+	if (fabs(err) > SYNC_LOCK_FRAMES) {
+		loop->sync_in_range = 0;
+		if (loop->sync_locked && fabs(err) > 2 * SYNC_LOCK_FRAMES)
+			loop->sync_locked = 0;
+	} else if (loop->sync_in_range == 0) {
+		loop->sync_in_range = ptime;
+	} else if (!loop->sync_locked &&
+		   ptime - loop->sync_in_range >= SYNC_LOCK_TIME) {
+		loop->sync_locked = 1;
+		if (loop->sync_lock_time < 0)
+			loop->sync_lock_time = ptime - loop->sync_start;
+		else
+			loop->sync_relocks++;
+	}
+	if (!loop->sync_locked)
+		return;
+	if (loop->sync_count == 0 || err < loop->sync_err_min)
+		loop->sync_err_min = err;
+	if (loop->sync_count == 0 || err > loop->sync_err_max)
+		loop->sync_err_max = err;
+	loop->sync_err_sum += err;
+	loop->sync_err_sum2 += err * err;
+	loop->sync_count++;
+}
+
+static void sync_stats(struct loopback *loop, snd_output_t *out)
+{
+	double mean = 0, rms = 0;
+
+	if (loop->sync_count > 0) {
+		mean = loop->sync_err_sum / loop->sync_count;
+		rms = sqrt(loop->sync_err_sum2 / loop->sync_count);
+	}
+	snd_output_printf(out, "%s: sync pitch %.8f, error %.3f frames, %s",
+			  loop->id, loop->pitch, loop->sync_err,
+			  loop->sync_locked ? "locked" : "unlocked");
+	if (loop->sync_lock_time >= 0)
+		snd_output_printf(out, " (first lock %.1fs, relocks %u)",
+				  loop->sync_lock_time, loop->sync_relocks);
+	snd_output_printf(out, ", locked error min/max %.3f/%.3f, mean %.3f, rms %.3f\n",
+			  loop->sync_err_min, loop->sync_err_max, mean, rms);
 }
 
 static int get_active(struct loopback_handle *lhandle)
@@ -1293,6 +1762,14 @@ static int openit(struct loopback_handle *lhandle)
 				SND_PCM_STREAM_PLAYBACK :
 				SND_PCM_STREAM_CAPTURE;
 	int err, card, device, subdevice;
+
+	if (!route_owner(lhandle)) {
+		/* the owner is in the same thread and opened before */
+		lhandle->handle = lhandle->route->members[0]->handle;
+		lhandle->card_number = lhandle->route->members[0]->card_number;
+		lhandle->ctl = NULL;
+		return 0;
+	}
 	pcm_open_lock();
 	err = snd_pcm_open(&lhandle->handle, lhandle->device, stream, SND_PCM_NONBLOCK);
 	pcm_open_unlock();
@@ -1342,6 +1819,10 @@ static int closeit(struct loopback_handle *lhandle)
 {
 	int err = 0;
 
+	if (!route_owner(lhandle)) {
+		lhandle->handle = NULL;
+		return 0;
+	}
 	set_rate_shift(lhandle, 1);
 	if (lhandle->ctl_rate_shift)
 		snd_ctl_elem_value_free(lhandle->ctl_rate_shift);
@@ -1394,17 +1875,24 @@ int pcmjob_init(struct loopback *loop)
 	snprintf(id, sizeof(id), "%s/%s", loop->play->id, loop->capt->id);
 	id[sizeof(id)-1] = '\0';
 	loop->id = strdup(id);
-	if (loop->sync == SYNC_TYPE_AUTO && (loop->capt->ctl_rate_shift || loop->capt->ctl_pitch))
+	if (loop->sync == SYNC_TYPE_AUTO && !loop->capt->route &&
+	    (loop->capt->ctl_rate_shift || loop->capt->ctl_pitch))
 		loop->sync = SYNC_TYPE_CAPTRATESHIFT;
-	if (loop->sync == SYNC_TYPE_AUTO && (loop->play->ctl_rate_shift || loop->play->ctl_pitch))
+	if (loop->sync == SYNC_TYPE_AUTO && !loop->play->route &&
+	    (loop->play->ctl_rate_shift || loop->play->ctl_pitch))
 		loop->sync = SYNC_TYPE_PLAYRATESHIFT;
-#ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable)
 		loop->sync = SYNC_TYPE_SAMPLERATE;
-#endif
 	if (loop->sync == SYNC_TYPE_AUTO)
 		loop->sync = SYNC_TYPE_SIMPLE;
+	if ((loop->sync == SYNC_TYPE_CAPTRATESHIFT && loop->capt->route) ||
+	    (loop->sync == SYNC_TYPE_PLAYRATESHIFT && loop->play->route)) {
+		logit(LOG_CRIT, "%s: rate shift sync cannot be used for a shared PCM\n", loop->id);
+		err = -EINVAL;
+		goto __error;
+	}
 	if (loop->slave == SLAVE_TYPE_AUTO &&
+	    !loop->capt->route &&
 	    loop->capt->ctl_notify &&
 	    loop->capt->ctl_active &&
 	    loop->capt->ctl_format &&
@@ -1433,6 +1921,13 @@ int pcmjob_init(struct loopback *loop)
 
 static void freeloop(struct loopback *loop)
 {
+	resample_done(loop);
+	dsp_stop(loop);
+	probe_stop(loop);
+	free(loop->convert_block);
+	loop->convert_block = NULL;
+	free(loop->convert_map);
+	loop->convert_map = NULL;
 #ifdef USE_SAMPLERATE
 	if (loop->use_samplerate) {
 		if (loop->src_state)
@@ -1456,8 +1951,15 @@ int pcmjob_done(struct loopback *loop)
 	closeit(loop->play);
 	closeit(loop->capt);
 	freeloop(loop);
+	dsp_free(loop);
 	free(loop->id);
 	loop->id = NULL;
+	free(loop->probe_device);
+	loop->probe_device = NULL;
+	free(loop->cpus);
+	loop->cpus = NULL;
+	free(loop->chmap);
+	loop->chmap = NULL;
 #ifdef FILE_PWRITE
 	if (loop->pfile) {
 		fclose(loop->pfile);
@@ -1473,12 +1975,52 @@ int pcmjob_done(struct loopback *loop)
 	return 0;
 }
 
+/* the channel map and the block for the conversion between the rings */
+static int convert_start(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	unsigned int c;
+
+	if (loop->direct || play->buf == capt->buf || loop->resampler)
+		return 0;
+	if (loop->chmap || play->channels != capt->channels) {
+		loop->convert_map = malloc(play->channels * sizeof(int));
+		if (loop->convert_map == NULL)
+			return -ENOMEM;
+		for (c = 0; c < play->channels; c++) {
+			if (c < loop->chmap_count)
+				loop->convert_map[c] = loop->chmap[c];
+			else
+				loop->convert_map[c] = c % capt->channels;
+			if (loop->convert_map[c] >= (int)capt->channels) {
+				logit(LOG_CRIT, "%s: channel map uses capture channel %i, only %u channels\n", loop->id, loop->convert_map[c], capt->channels);
+				return -EINVAL;
+			}
+		}
+	}
+	if (loop->use_samplerate)
+		return 0;
+	if (loop->convert_map == NULL && play->format == capt->format)
+		return 0;
+	if (!convert_supported(capt->format) ||
+	    !convert_supported(play->format)) {
+		logit(LOG_CRIT, "%s: format conversion supports only S16, S24, S24_3LE, S32 or FLOAT formats (play=%s, capt=%s)\n", loop->id, snd_pcm_format_name(play->format), snd_pcm_format_name(capt->format));
+		return -EINVAL;
+	}
+	loop->convert_block = malloc(CONVERT_BLOCK * play->channels * sizeof(float));
+	if (loop->convert_block == NULL)
+		return -ENOMEM;
+	if (verbose > 1)
+		snd_output_printf(loop->output, "%s: format conversion %s/%u -> %s/%u\n", loop->id, snd_pcm_format_name(capt->format), capt->channels, snd_pcm_format_name(play->format), play->channels);
+	return 0;
+}
+
 static void lhandle_start(struct loopback_handle *lhandle)
 {
 	lhandle->buf_pos = 0;
 	lhandle->buf_count = 0;
 	lhandle->counter = 0;
-	lhandle->total_queued = 0;
 }
 
 static void fix_format(struct loopback *loop, int force)
@@ -1498,21 +2040,39 @@ static void fix_format(struct loopback *loop, int force)
 	loop->play->format = format;
 }
 
-int pcmjob_start(struct loopback *loop)
+/*
+ * The number of the PCM descriptors may differ once the hardware
+ * parameters are set or the stream is prepared again, a change bumps
+ * pollfd_gen, so the thread registers the descriptors again.
+ */
+static int poll_count(struct loopback *loop)
 {
-	snd_pcm_uframes_t count;
 	int err;
 
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
 	if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
-		goto __error;
+		return err;
+	if (loop->play->pollfd_count != err)
+		loop->pollfd_gen++;
 	loop->play->pollfd_count = err;
 	loop->pollfd_count += err;
 	if ((err = snd_pcm_poll_descriptors_count(loop->capt->handle)) < 0)
-		goto __error;
+		return err;
+	if (loop->capt->pollfd_count != err)
+		loop->pollfd_gen++;
 	loop->capt->pollfd_count = err;
 	loop->pollfd_count += err;
+	return 0;
+}
+
+int pcmjob_start(struct loopback *loop)
+{
+	snd_pcm_uframes_t count;
+	int err;
+
+	if ((err = poll_count(loop)) < 0)
+		goto __error;
 	if (loop->slave == SLAVE_TYPE_ON) {
 		err = get_active(loop->capt);
 		if (err < 0)
@@ -1535,6 +2095,24 @@ int pcmjob_start(struct loopback *loop)
 	}
 	loop->reinit = 0;
 	loop->use_samplerate = 0;
+	loop->direct = 0;
+	if (loop->mmap && (loop->play->route || loop->capt->route)) {
+		logit(LOG_WARNING, "%s: direct mmap transfer is not available for a shared PCM\n", loop->id);
+	} else if (loop->mmap && (loop->dsp || loop->probe_device)) {
+		logit(LOG_WARNING, "%s: direct mmap transfer is not available with a DSP chain or the latency test\n", loop->id);
+	} else if (loop->mmap) {
+		if (loop->play->format == loop->capt->format &&
+		    loop->play->rate_req == loop->capt->rate_req &&
+		    loop->play->channels == loop->capt->channels &&
+		    loop->chmap == NULL &&
+		    loop->sync != SYNC_TYPE_SAMPLERATE)
+			loop->direct = 1;
+		else
+			logit(LOG_WARNING, "%s: direct mmap transfer requires identical stream parameters\n", loop->id);
+		loop->play->access = loop->capt->access = loop->direct ?
+						SND_PCM_ACCESS_MMAP_INTERLEAVED :
+						SND_PCM_ACCESS_RW_INTERLEAVED;
+	}
 __again:
 	if (loop->latency_req) {
 		loop->latency_reqtime = frames_to_time(loop->play->rate_req,
@@ -1542,14 +2120,38 @@ __again:
 		loop->latency_req = 0;
 	}
 	loop->latency = time_to_frames(loop->play->rate_req, loop->latency_reqtime);
+	if ((err = route_join(loop->play)) < 0 ||
+	    (err = route_join(loop->capt)) < 0)
+		goto __error;
 	if ((err = setparams(loop, loop->latency/2)) < 0)
 		goto __error;
+	if ((err = route_config(loop->play)) < 0 ||
+	    (err = route_config(loop->capt)) < 0)
+		goto __error;
 	if (verbose)
 		showlatency(loop->output, loop->latency, loop->play->rate_req, "Latency");
-	if (loop->play->access == loop->capt->access &&
+	if (loop->direct && loop->play->rate != loop->capt->rate) {
+		logit(LOG_WARNING, "%s: rates differ, direct mmap transfer disabled\n", loop->id);
+		loop->direct = 0;
+		loop->play->access = loop->capt->access =
+						SND_PCM_ACCESS_RW_INTERLEAVED;
+		pcmjob_stop(loop);
+		goto __again;
+	}
+	if (loop->direct) {
+		if (verbose > 1)
+			snd_output_printf(loop->output, "direct mmap transfer\n");
+		if ((err = init_handle(loop->play, 0)) < 0)
+			goto __error;
+		if ((err = init_handle(loop->capt, 0)) < 0)
+			goto __error;
+		loop->play->buf_size = 0;
+		loop->capt->buf_size = 0;
+	} else if (loop->play->access == loop->capt->access &&
 	    loop->play->format == loop->capt->format &&
 	    loop->play->rate == loop->capt->rate &&
 	    loop->play->channels == loop->capt->channels &&
+	    loop->chmap == NULL &&
 	    loop->sync != SYNC_TYPE_SAMPLERATE) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
@@ -1584,22 +2186,42 @@ __again:
 			goto __error;
 		if ((err = init_handle(loop->capt, 1)) < 0)
 			goto __error;
+		/* the conversion layer handles the format differences */
 		if (loop->play->rate_req != loop->play->rate ||
-                    loop->capt->rate_req != loop->capt->rate) {
-                        snd_pcm_format_t format1, format2;
+		    loop->capt->rate_req != loop->capt->rate)
 			loop->use_samplerate = 1;
-                        format1 = loop->play->format;
-                        format2 = loop->capt->format;
-                        fix_format(loop, 1);
-                        if (loop->play->format != format1 ||
-                            loop->capt->format != format2) {
-                                pcmjob_stop(loop);
-                                goto __again;
-                        }
-                }
+	}
+#ifndef USE_SAMPLERATE
+	/* only the internal resampler can compensate the drift */
+	if (loop->sync == SYNC_TYPE_SAMPLERATE &&
+	    loop->src_converter_type != SRC_INTERNAL) {
+		logit(LOG_WARNING, "%s: alsaloop is compiled without libsamplerate support, using the internal resampler\n", loop->id);
+		loop->src_converter_type = SRC_INTERNAL;
+	}
+#endif
+	if (loop->sync == SYNC_TYPE_SAMPLERATE &&
+	    loop->src_converter_type == SRC_INTERNAL) {
+		if (loop->use_samplerate) {
+			logit(LOG_CRIT, "internal resampler compensates only the clock drift (play=%uHz, capt=%uHz)\n", loop->play->rate, loop->capt->rate);
+			loop->use_samplerate = 0;
+			err = -EIO;
+			goto __error;
+		}
+		if (loop->capt->format != loop->play->format ||
+		    loop->capt->channels != loop->play->channels ||
+		    loop->chmap ||
+		    (loop->capt->format != SND_PCM_FORMAT_S16 &&
+		     loop->capt->format != SND_PCM_FORMAT_S32)) {
+			logit(LOG_WARNING, "%s: internal resampler requires same channels and the same %s or %s format, using simple sync\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32));
+			loop->sync = SYNC_TYPE_SIMPLE;
+			pcmjob_stop(loop);
+			goto __again;
+		}
+		if ((err = resample_init(loop)) < 0)
+			goto __error;
 	}
 #ifdef USE_SAMPLERATE
-	if (loop->sync == SYNC_TYPE_SAMPLERATE)
+	if (loop->sync == SYNC_TYPE_SAMPLERATE && !loop->resampler)
 		loop->use_samplerate = 1;
 	if (loop->use_samplerate && !loop->src_enable) {
 		logit(LOG_CRIT, "samplerate conversion required but disabled\n");
@@ -1608,18 +2230,16 @@ __again:
 		goto __error;		
 	}
 	if (loop->use_samplerate) {
-		if ((loop->capt->format != SND_PCM_FORMAT_S16 ||
-		    loop->play->format != SND_PCM_FORMAT_S16) &&
-		    (loop->capt->format != SND_PCM_FORMAT_S32 ||
-		     loop->play->format != SND_PCM_FORMAT_S32)) {
-			logit(LOG_CRIT, "samplerate conversion supports only %s or %s formats (play=%s, capt=%s)\n", snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
+		if (!convert_supported(loop->capt->format) ||
+		    !convert_supported(loop->play->format)) {
+			logit(LOG_CRIT, "samplerate conversion supports only S16, S24, S24_3LE, S32 or FLOAT formats (play=%s, capt=%s)\n", snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
 			loop->use_samplerate = 0;
 			err = -EIO;
 			goto __error;		
 		}
 		loop->src_state = src_new(loop->src_converter_type,
 					  loop->play->channels, &err);
-		loop->src_data.data_in = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
+		loop->src_data.data_in = calloc(1, sizeof(float)*loop->play->channels*loop->capt->buf_size);
 		if (loop->src_data.data_in == NULL) {
 			err = -ENOMEM;
 			goto __error;
@@ -1637,23 +2257,26 @@ __again:
 		loop->src_state = NULL;
 	}
 #else
-	if (loop->sync == SYNC_TYPE_SAMPLERATE || loop->use_samplerate) {
+	if (loop->use_samplerate) {
 		logit(LOG_CRIT, "alsaloop is compiled without libsamplerate support\n");
 		err = -EIO;
 		goto __error;
 	}
 #endif
+	if ((err = convert_start(loop)) < 0 ||
+	    (err = dsp_start(loop)) < 0 ||
+	    (err = probe_start(loop)) < 0)
+		goto __error;
 	if (verbose) {
 		snd_output_printf(loop->output, "%s sync type: %s", loop->id, sync_types[loop->sync]);
-#ifdef USE_SAMPLERATE
 		if (loop->sync == SYNC_TYPE_SAMPLERATE)
 			snd_output_printf(loop->output, " (%s)", src_types[loop->src_converter_type]);
-#endif
 		snd_output_printf(loop->output, "\n");
 	}
 	lhandle_start(loop->play);
 	lhandle_start(loop->capt);
-	if ((err = snd_pcm_format_set_silence(loop->play->format,
+	if (loop->play->buf &&
+	    (err = snd_pcm_format_set_silence(loop->play->format,
 					      loop->play->buf,
 					      loop->play->buf_size * loop->play->channels)) < 0) {
 		logit(LOG_CRIT, "%s: silence error\n", loop->id);
@@ -1663,24 +2286,29 @@ __again:
 		snd_output_printf(loop->output, "%s: capt->buffer_size = %li, play->buffer_size = %li\n", loop->id, loop->capt->buf_size, loop->play->buf_size);
 	loop->pitch = 1.0;
 	update_pitch(loop);
-	loop->pitch_delta = 1.0 / ((double)loop->capt->rate * 4);
-	loop->total_queued_count = 0;
-	loop->pitch_diff = 0;
+	sync_init(loop);
 	count = get_whole_latency(loop) / loop->play->pitch;
-	loop->play->buf_count = count;
-	if (loop->play->buf == loop->capt->buf)
-		loop->capt->buf_pos = count;
-	err = writeit(loop->play);
+	if (loop->direct) {
+		err = direct_silence(loop->play, count);
+	} else {
+		loop->play->buf_count = count;
+		if (loop->play->buf == loop->capt->buf)
+			loop->capt->buf_pos = count;
+		err = writeit(loop->play);
+	}
 	if (verbose > 4)
 		snd_output_printf(loop->output, "%s: silence queued %i samples\n", loop->id, err);
 	if (count > loop->play->buffer_size)
 		count = loop->play->buffer_size;
-	if (err != (int)count) {
+	if (err != (int)count && !loop->play->route_joined) {
 		logit(LOG_CRIT, "%s: initial playback fill error (%i/%i/%u)\n", loop->id, err, (int)count, loop->play->buffer_size);
 		err = -EIO;
 		goto __error;
 	}
+	if ((err = poll_count(loop)) < 0)
+		goto __error;
 	loop->running = 1;
+	loop->pollfd_gen++;
 	loop->stop_pending = 0;
 	if (loop->xrun) {
 		getcurtimestamp(&loop->xrun_last_update);
@@ -1688,11 +2316,12 @@ __again:
 		loop->xrun_last_cdelay = XRUN_PROFILE_UNKNOWN;
 		loop->xrun_max_proctime = 0;
 	}
-	if ((err = snd_pcm_start(loop->capt->handle)) < 0) {
+	if (!loop->capt->route_joined &&
+	    (err = snd_pcm_start(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "pcm start %s error: %s\n", loop->capt->id, snd_strerror(err));
 		goto __error;
 	}
-	if (!loop->linked) {
+	if (!loop->linked && !loop->play->route_joined) {
 		if ((err = snd_pcm_start(loop->play->handle)) < 0) {
 			logit(LOG_CRIT, "pcm start %s error: %s\n", loop->play->id, snd_strerror(err));
 			goto __error;
@@ -1706,18 +2335,22 @@ __again:
 
 int pcmjob_stop(struct loopback *loop)
 {
-	int err;
+	int err, cstop, pstop;
 
+	/* a shared PCM is stopped by the last member */
+	cstop = route_release(loop->capt);
+	pstop = route_release(loop->play);
 	if (loop->running) {
-		if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
+		if (cstop && (err = snd_pcm_drop(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_drop(loop->play->handle)) < 0)
+		if (pstop && (err = snd_pcm_drop(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->play->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->capt->handle)) < 0)
+		if (cstop && (err = snd_pcm_hw_free(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
+		if (pstop && (err = snd_pcm_hw_free(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
 		loop->running = 0;
+		loop->pollfd_gen++;
 	}
 	freeloop(loop);
 	return 0;
@@ -1727,11 +2360,14 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 {
 	int err, idx = 0;
 
-	if (loop->running) {
+	/* a shared PCM is polled only by its owner */
+	if (loop->running && route_owner(loop->play)) {
 		err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
 		if (err < 0)
 			return err;
 		idx += loop->play->pollfd_count;
+	}
+	if (loop->running && route_owner(loop->capt)) {
 		err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
 		if (err < 0)
 			return err;
@@ -1755,32 +2391,6 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 	return idx;
 }
 
-static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
-{
-	snd_pcm_sframes_t delay;
-
-	if (snd_pcm_delay(loop->play->handle, &delay) < 0)
-		return 0;
-	loop->play->last_delay = delay;
-	delay += loop->play->buf_count;
-#ifdef USE_SAMPLERATE
-	delay += loop->src_out_frames;
-#endif
-	return delay;
-}
-
-static snd_pcm_sframes_t get_queued_capture_samples(struct loopback *loop)
-{
-	snd_pcm_sframes_t delay;
-	int err;
-
-	if ((err = snd_pcm_delay(loop->capt->handle, &delay)) < 0)
-		return 0;
-	loop->capt->last_delay = delay;
-	delay += loop->capt->buf_count;
-	return delay;
-}
-
 static int ctl_event_check(snd_ctl_elem_value_t *val, snd_ctl_event_t *ev)
 {
 	snd_ctl_elem_id_t *id1, *id2;
@@ -1855,6 +2465,57 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 	return 1;
 }
 
+void pcmjob_reset_stats(struct loopback *loop)
+{
+	loop->play->xruns = loop->capt->xruns = 0;
+	loop->play->buf_over = loop->capt->buf_over = 0;
+	loop->play->max = loop->capt->max = 0;
+	loop->sync_relocks = 0;
+	loop->sync_count = 0;
+	loop->sync_err_min = loop->sync_err_max = 0;
+	loop->sync_err_sum = loop->sync_err_sum2 = 0;
+	loop->xrun_max_proctime = 0;
+	hist_reset(&loop->proc);
+	probe_reset_stats(loop);
+}
+
+/* the latency is changed in place when it fits to the ring buffers */
+static int set_latency(struct loopback *loop, unsigned int usec)
+{
+	snd_pcm_uframes_t latency;
+
+	latency = time_to_frames(loop->play->rate_req, usec);
+	loop->latency_reqtime = usec;
+	loop->latency_req = 0;
+	if (!loop->running)
+		return 0;
+	if (verbose)
+		showlatency(loop->output, latency, loop->play->rate_req, "New latency");
+	if (loop->direct ||
+	    latency * 2 > loop->play->buf_size ||
+	    latency * 2 > loop->capt->buf_size) {
+		loop->reinit = 1;
+		return 0;
+	}
+	loop->latency = latency;
+	return xrun_sync(loop);
+}
+
+static int pcmjob_command(struct loopback *loop)
+{
+	unsigned int latency = loop->cmd_latency;
+
+	if (loop->cmd_reset) {
+		loop->cmd_reset = 0;
+		pcmjob_reset_stats(loop);
+	}
+	if (latency) {
+		loop->cmd_latency = 0;
+		return set_latency(loop, latency);
+	}
+	return 0;
+}
+
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 {
 	struct loopback_handle *play = loop->play;
@@ -1865,6 +2526,10 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 
 	if (verbose > 11)
 		snd_output_printf(loop->output, "%s: pollfds handle\n", loop->id);
+	if (loop->cmd_latency || loop->cmd_reset) {
+		if ((err = pcmjob_command(loop)) < 0)
+			return err;
+	}
 	if (verbose > 13 || loop->xrun)
 		getcurtimestamp(&loop->tstamp_start);
 	if (verbose > 12) {
@@ -1880,18 +2545,23 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	}
 	idx = 0;
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors_revents(play->handle, fds,
-						       play->pollfd_count,
-						       &prevents);
-		if (err < 0)
-			return err;
-		idx += play->pollfd_count;
-		err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
-						       capt->pollfd_count,
-						       &crevents);
-		if (err < 0)
-			return err;
-		idx += capt->pollfd_count;
+		prevents = crevents = 0;
+		if (route_owner(play)) {
+			err = snd_pcm_poll_descriptors_revents(play->handle, fds,
+							       play->pollfd_count,
+							       &prevents);
+			if (err < 0)
+				return err;
+			idx += play->pollfd_count;
+		}
+		if (route_owner(capt)) {
+			err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
+							       capt->pollfd_count,
+							       &crevents);
+			if (err < 0)
+				return err;
+			idx += capt->pollfd_count;
+		}
 		if (loop->xrun) {
 			if (prevents || crevents) {
 				loop->xrun_last_wake = loop->xrun_last_wake0;
@@ -1940,8 +2610,15 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	if (!loop->running)
 		goto __pcm_end;
 	do {
-		ccount = readit(capt);
-		if (prevents != 0 && crevents == 0 &&
+		if (loop->direct) {
+			snd_pcm_sframes_t r = direct_transfer(loop);
+			if (r < 0)
+				return r;
+			ccount = pcount = r;
+		} else {
+			ccount = readit(capt);
+		}
+		if (prevents != 0 && crevents == 0 && route_owner(capt) &&
 		    ccount == 0 && loopcount == 0) {
 			if (play->stall > 20) {
 				play->stall = 0;
@@ -1953,6 +2630,13 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		}
 		if (ccount > 0)
 			play->stall = 0;
+		if (loop->direct) {
+			if (play->xrun_pending || capt->xrun_pending ||
+			    loop->reinit)
+				break;
+			loopcount++;
+			continue;
+		}
 		buf_add(loop, ccount);
 		if (capt->xrun_pending || loop->reinit)
 			break;
@@ -1969,6 +2653,8 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	if (play->xrun_pending || capt->xrun_pending) {
 		if ((err = xrun_sync(loop)) < 0)
 			return err;
+		if ((err = poll_count(loop)) < 0)
+			return err;
 	}
 	if (loop->reinit) {
 		err = pcmjob_stop(loop);
@@ -1978,60 +2664,23 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		if (err < 0)
 			return err;
 	}
-	if (loop->sync != SYNC_TYPE_NONE &&
-	    play->counter >= play->sync_point &&
-	    capt->counter >= play->sync_point) {
-		snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
-		diff = ((double)(((double)play->total_queued * play->pitch) +
-				 ((double)capt->total_queued * capt->pitch)) /
-			(double)loop->total_queued_count) - lat;
-		/* FIXME: this algorithm may be slightly better */
-		if (verbose > 3)
-			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
-		if (diff > 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch += loop->pitch_delta;
-			else if (diff > loop->pitch_diff)
-				loop->pitch += loop->pitch_delta*2;
-		} else if (diff < 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta;
-			else if (diff < loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta*2;
-		}
-		loop->pitch_diff = diff;
-		if (loop->pitch_diff_min > diff)
-			loop->pitch_diff_min = diff;
-		if (loop->pitch_diff_max < diff)
-			loop->pitch_diff_max = diff;
-		update_pitch(loop);
-		play->counter -= play->sync_point;
-		capt->counter -= play->sync_point;
-		play->total_queued = 0;
-		capt->total_queued = 0;
-		loop->total_queued_count = 0;
-	}
-	if (loop->sync != SYNC_TYPE_NONE) {
-		snd_pcm_sframes_t pqueued, cqueued;
-
-		/* Reduce cumulative error by interleaving playback vs capture reading order */
-		if (loop->total_queued_count & 1) {
-			pqueued = get_queued_playback_samples(loop);
-			cqueued = get_queued_capture_samples(loop);
-		} else {
-			cqueued = get_queued_capture_samples(loop);
-			pqueued = get_queued_playback_samples(loop);
+	if (loop->sync == SYNC_TYPE_NONE) {
+		double serr, stime;
+		/* the measured latency is only reported on the stats socket */
+		if (loop->stats)
+			sync_measure(loop, &serr, &stime);
+	} else {
+		sync_update(loop);
+		if (play->counter >= play->sync_point &&
+		    capt->counter >= play->sync_point) {
+			if (verbose)
+				sync_stats(loop, loop->output);
+			play->counter -= play->sync_point;
+			capt->counter -= play->sync_point;
 		}
-
-		if (verbose > 4)
-			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
-		if (pqueued > 0)
-			play->total_queued += pqueued;
-		if (cqueued > 0)
-			capt->total_queued += cqueued;
-		if (pqueued > 0 || cqueued > 0)
-			loop->total_queued_count += 1;
 	}
+	if (loop->probe)
+		probe_capture(loop);
 	if (verbose > 12) {
 		snd_pcm_sframes_t pdelay, cdelay;
 		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
@@ -2056,6 +2705,27 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	return 0;
 }
 
+/* time from the last hardware pointer update of the loop in usec */
+long pcmjob_wake_latency(struct loopback *loop)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t pts, cts, now;
+
+	if (!loop->running)
+		return -1;
+	if (snd_pcm_htimestamp(loop->play->handle, &avail, &pts) < 0 ||
+	    snd_pcm_htimestamp(loop->capt->handle, &avail, &cts) < 0)
+		return -1;
+	if (cts.tv_sec > pts.tv_sec ||
+	    (cts.tv_sec == pts.tv_sec && cts.tv_nsec > pts.tv_nsec))
+		pts = cts;
+	if (pts.tv_sec == 0 && pts.tv_nsec == 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - pts.tv_sec) * 1000000L +
+	       (now.tv_nsec - pts.tv_nsec) / 1000;
+}
+
 #define OUT(args...) \
 	snd_output_printf(loop->state, ##args)
 
@@ -2072,9 +2742,14 @@ static void show_handle(struct loopback_handle *lhandle, const char *id)
 		return;
 	OUT("    access = %s, format = %s, rate = %u, channels = %u\n", snd_pcm_access_name(lhandle->access), snd_pcm_format_name(lhandle->format), lhandle->rate, lhandle->channels);
 	OUT("    buffer_size = %u, period_size = %u, avail_min = %li\n", lhandle->buffer_size, lhandle->period_size, lhandle->avail_min);
-	OUT("    xrun_pending = %i\n", lhandle->xrun_pending);
+	OUT("    xrun_pending = %i, xruns = %lu\n", lhandle->xrun_pending, lhandle->xruns);
 	OUT("    buf_size = %li, buf_pos = %li, buf_count = %li, buf_over = %li\n", lhandle->buf_size, lhandle->buf_pos, lhandle->buf_count, lhandle->buf_over);
 	OUT("    pitch = %.8f\n", lhandle->pitch);
+	if (lhandle->route)
+		OUT("    shared by %i jobs (%s), queued %li, gain %.3f\n",
+		    lhandle->route->members_count,
+		    route_owner(lhandle) ? "owner" : "member",
+		    (long)lhandle->queue_frames, loop->gain);
 }
 
 void pcmjob_state(struct loopback *loop)
@@ -2088,8 +2763,23 @@ void pcmjob_state(struct loopback *loop)
 	if (!loop->running)
 		goto __skip;
 	OUT("  pollfd_count = %i\n", loop->pollfd_count);
-	OUT("  pitch = %.8f, delta = %.8f, diff = %li, min = %li, max = %li\n", loop->pitch, loop->pitch_delta, loop->pitch_diff, loop->pitch_diff_min, loop->pitch_diff_max);
+	OUT("  pitch = %.8f, sync bandwidth = %.3fHz\n", loop->pitch, loop->sync_bandwidth);
+	if (loop->sync != SYNC_TYPE_NONE) {
+		OUT("  ");
+		sync_stats(loop, loop->state);
+	}
 	OUT("  use_samplerate = %i\n", loop->use_samplerate);
+	OUT("  direct = %i\n", loop->direct);
+	OUT("  measured latency = %.1f frames, mute = %i\n", loop->latency_now, loop->mute);
+	if (loop->probe_stats.count > 0)
+		OUT("  latency test: loop %.3fms (min %.3fms, max %.3fms, mean %.3fms), round trip %.3fms, markers %lu, lost %lu\n",
+		    loop->probe_stats.loop_ms, loop->probe_stats.loop_min,
+		    loop->probe_stats.loop_max,
+		    loop->probe_stats.loop_sum / loop->probe_stats.count,
+		    loop->probe_stats.round_trip_ms,
+		    loop->probe_stats.count, loop->probe_stats.lost);
+	else if (loop->probe_device)
+		OUT("  latency test: no marker detected, lost %lu\n", loop->probe_stats.lost);
       __skip:
 	show_handle(loop->play, "playback");
 	show_handle(loop->capt, "capture");
@@ -0,0 +1,391 @@
+/*
+ *  A simple PCM loopback utility - measured latency self-test
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * A short noise burst (the marker) periodically replaces the frames just
+ * added to the playback ring. A reference capture device, which records
+ * the output of the playback device, is read without blocking at each
+ * job wakeup and correlated with the marker. All times are taken from
+ * the monotonic hardware timestamps of the streams:
+ *
+ *   loop        capture of the replaced frames -> reference input
+ *   round trip  playback of the marker (by the ALSA delay) -> reference
+ *               input, i.e. the converters, the wiring and the
+ *               reference capture, which the ALSA delays do not show
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define PROBE_LEN	256	/* marker length in frames */
+#define PROBE_READ	1024	/* reference read block in frames */
+#define PROBE_LEVEL	0.25	/* marker amplitude (-12dBFS) */
+#define PROBE_THRESHOLD	0.5	/* normalized correlation for a detection */
+#define PROBE_TIMEOUT	1.0	/* minimal detection timeout in seconds */
+
+enum {
+	PROBE_IDLE,
+	PROBE_INJECT,		/* the marker is written to the playback */
+	PROBE_SEARCH,		/* waiting for the marker on the reference */
+};
+
+struct loopback_probe {
+	snd_pcm_t *handle;
+	unsigned int rate;
+	int state;
+	float tmpl[PROBE_LEN];
+	double tmpl_energy;
+	float *marker;			/* interleaved playback frames */
+	unsigned int inject_pos;	/* marker frames written */
+	int16_t read[PROBE_READ];
+	float hist[2 * PROBE_LEN];	/* the window is always contiguous */
+	unsigned int hist_pos;
+	double energy;			/* energy of the window */
+	unsigned long long frames;	/* reference frames read */
+	/* the time of a reference frame */
+	unsigned long long anchor_frame;
+	double anchor_time;
+	/* the current marker */
+	double next;			/* next injection time */
+	double capt_time;		/* capture time of the replaced frames */
+	double play_time;		/* playback time by the ALSA delay */
+	double best;			/* best correlation */
+	unsigned long long best_frame;	/* last window frame of the best */
+};
+
+static double probe_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int probe_delay(snd_pcm_t *handle, snd_pcm_status_t *status,
+		       snd_pcm_sframes_t *delay, double *tstamp)
+{
+	snd_htimestamp_t ts;
+	int err;
+
+	err = snd_pcm_status(handle, status);
+	if (err < 0)
+		return err;
+	if (snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING)
+		return -EPIPE;
+	*delay = snd_pcm_status_get_delay(status);
+	snd_pcm_status_get_htstamp(status, &ts);
+	*tstamp = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	return 0;
+}
+
+static void probe_marker(struct loopback_probe *probe)
+{
+	uint32_t lfsr = 0xace1u;
+	double w;
+	int i;
+
+	/* Hann windowed pseudo-random noise, the autocorrelation is sharp */
+	probe->tmpl_energy = 0;
+	for (i = 0; i < PROBE_LEN; i++) {
+		lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xb400u);
+		w = 0.5 - 0.5 * cos(2 * M_PI * (i + 0.5) / PROBE_LEN);
+		probe->tmpl[i] = (lfsr & 1 ? PROBE_LEVEL : -PROBE_LEVEL) * w;
+		probe->tmpl_energy += probe->tmpl[i] * probe->tmpl[i];
+	}
+}
+
+static int probe_setparams(struct loopback *loop, snd_pcm_t *handle)
+{
+	snd_pcm_sw_params_t *swparams;
+	int err;
+
+	err = snd_pcm_set_params(handle, SND_PCM_FORMAT_S16,
+				 SND_PCM_ACCESS_RW_INTERLEAVED, 1,
+				 loop->play->rate, 1, 500000);
+	if (err < 0)
+		return err;
+	snd_pcm_sw_params_alloca(&swparams);
+	if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0 ||
+	    (err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE)) < 0 ||
+	    (err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0 ||
+	    (err = snd_pcm_sw_params(handle, swparams)) < 0)
+		return err;
+	return 0;
+}
+
+int probe_start(struct loopback *loop)
+{
+	struct loopback_probe *probe;
+	unsigned int channels = loop->play->channels;
+	float *frame;
+	int err, i;
+
+	if (loop->probe_device == NULL)
+		return 0;
+	if (!convert_supported(loop->play->format)) {
+		logit(LOG_CRIT, "%s: latency test does not support the %s format\n", loop->id, snd_pcm_format_name(loop->play->format));
+		return -EINVAL;
+	}
+	probe = calloc(1, sizeof(*probe));
+	if (probe == NULL)
+		return -ENOMEM;
+	loop->probe = probe;
+	probe->marker = malloc(PROBE_LEN * channels * sizeof(float));
+	if (probe->marker == NULL) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	probe_marker(probe);
+	for (i = 0, frame = probe->marker; i < PROBE_LEN; i++) {
+		unsigned int c;
+		for (c = 0; c < channels; c++)
+			*frame++ = probe->tmpl[i];
+	}
+	err = snd_pcm_open(&probe->handle, loop->probe_device,
+			   SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+	if (err < 0) {
+		probe->handle = NULL;
+		logit(LOG_CRIT, "%s: reference capture open error: %s\n", loop->probe_device, snd_strerror(err));
+		goto __error;
+	}
+	if ((err = probe_setparams(loop, probe->handle)) < 0) {
+		logit(LOG_CRIT, "%s: reference capture setup error: %s\n", loop->probe_device, snd_strerror(err));
+		goto __error;
+	}
+	if ((err = snd_pcm_start(probe->handle)) < 0) {
+		logit(LOG_CRIT, "%s: reference capture start error: %s\n", loop->probe_device, snd_strerror(err));
+		goto __error;
+	}
+	probe->rate = loop->play->rate;
+	/* let the streams settle before the first marker */
+	probe->next = probe_now() + loop->probe_interval / 1000.0;
+	return 0;
+      __error:
+	probe_stop(loop);
+	return err;
+}
+
+void probe_stop(struct loopback *loop)
+{
+	struct loopback_probe *probe = loop->probe;
+
+	if (probe == NULL)
+		return;
+	if (probe->handle)
+		snd_pcm_close(probe->handle);
+	free(probe->marker);
+	free(probe);
+	loop->probe = NULL;
+}
+
+void probe_reset_stats(struct loopback *loop)
+{
+	struct loopback_probe_stats *stats = &loop->probe_stats;
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+static void probe_lost(struct loopback *loop)
+{
+	struct loopback_probe *probe = loop->probe;
+
+	loop->probe_stats.lost++;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: latency test marker lost\n", loop->id);
+	probe->state = PROBE_IDLE;
+}
+
+/*
+ * Replace the frames added to the playback ring behind the given queued
+ * frame with the marker. Called from buf_add().
+ */
+void probe_inject(struct loopback *loop, snd_pcm_uframes_t from)
+{
+	struct loopback_probe *probe = loop->probe;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_status_t *status;
+	snd_pcm_sframes_t pdelay, cdelay;
+	snd_pcm_uframes_t pos, count;
+	double ptime, ctime;
+
+	if (from >= play->buf_count)
+		return;
+	if (probe->state == PROBE_IDLE) {
+		if (probe_now() < probe->next)
+			return;
+		snd_pcm_status_alloca(&status);
+		if (probe_delay(play->handle, status, &pdelay, &ptime) < 0 ||
+		    probe_delay(capt->handle, status, &cdelay, &ctime) < 0)
+			return;
+		/* the frames behind 'from' are the oldest of the new ones */
+		cdelay += play->buf_count - from + route_queued(capt);
+		if (play->buf != capt->buf)
+			cdelay += capt->buf_count;
+		probe->capt_time = ctime - (double)cdelay / capt->rate;
+		probe->play_time = ptime + (double)(pdelay + from) / play->rate;
+		probe->next += loop->probe_interval / 1000.0;
+		if (probe->next < ptime)
+			probe->next = ptime + loop->probe_interval / 1000.0;
+		probe->inject_pos = 0;
+		probe->best = 0;
+		probe->state = PROBE_INJECT;
+	}
+	if (probe->state != PROBE_INJECT)
+		return;
+	pos = (play->buf_pos + from) % play->buf_size;
+	while (from < play->buf_count && probe->inject_pos < PROBE_LEN) {
+		count = play->buf_count - from;
+		if (count + pos > play->buf_size)
+			count = play->buf_size - pos;
+		if (count > PROBE_LEN - probe->inject_pos)
+			count = PROBE_LEN - probe->inject_pos;
+		convert_from_float(play->format,
+			       probe->marker + probe->inject_pos * play->channels,
+			       play->buf + pos * play->frame_size,
+			       count * play->channels);
+		probe->inject_pos += count;
+		from += count;
+		pos = 0;
+	}
+	if (probe->inject_pos == PROBE_LEN)
+		probe->state = PROBE_SEARCH;
+}
+
+static void probe_result(struct loopback *loop)
+{
+	struct loopback_probe *probe = loop->probe;
+	struct loopback_probe_stats *stats = &loop->probe_stats;
+	double ref_time, lat, rt;
+	long long frames;
+
+	/* the frames from the first marker frame to the reference anchor */
+	frames = (long long)probe->anchor_frame -
+		 ((long long)probe->best_frame + 1 - PROBE_LEN);
+	if (frames < 0) {
+		/* the match precedes the anchor, no valid time reference */
+		probe_lost(loop);
+		return;
+	}
+	ref_time = probe->anchor_time - (double)frames / probe->rate;
+	lat = (ref_time - probe->capt_time) * 1000;
+	rt = (ref_time - probe->play_time) * 1000;
+	if (stats->count == 0 || lat < stats->loop_min)
+		stats->loop_min = lat;
+	if (stats->count == 0 || lat > stats->loop_max)
+		stats->loop_max = lat;
+	stats->count++;
+	stats->loop_sum += lat;
+	stats->loop_ms = lat;
+	stats->round_trip_ms = rt;
+	stats->correlation = probe->best;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: measured latency: loop %.3fms, round trip %.3fms, expected %.3fms (correlation %.2f)\n", loop->id, lat, rt, (double)loop->latency * 1000 / loop->play->rate_req, probe->best);
+	probe->state = PROBE_IDLE;
+}
+
+static void probe_correlate(struct loopback *loop, const int16_t *buf,
+			    snd_pcm_uframes_t frames)
+{
+	struct loopback_probe *probe = loop->probe;
+	snd_pcm_uframes_t i;
+	const float *w;
+	double dot, ncc;
+	float x, old;
+	int k;
+
+	for (i = 0; i < frames; i++) {
+		x = buf[i] * (1.0f / 32768.0f);
+		old = probe->hist[probe->hist_pos];
+		probe->hist[probe->hist_pos] = x;
+		probe->hist[probe->hist_pos + PROBE_LEN] = x;
+		probe->energy += (double)x * x - (double)old * old;
+		if (++probe->hist_pos == PROBE_LEN) {
+			probe->hist_pos = 0;
+			/* no drift of the running sum */
+			probe->energy = 0;
+			for (k = 0; k < PROBE_LEN; k++)
+				probe->energy += (double)probe->hist[k] * probe->hist[k];
+		}
+		probe->frames++;
+		if (probe->state == PROBE_IDLE)
+			continue;
+		if (probe->best > 0 &&
+		    probe->frames > probe->best_frame + PROBE_LEN) {
+			probe_result(loop);
+			continue;
+		}
+		if (probe->energy < probe->tmpl_energy * 0.01)
+			continue;
+		w = probe->hist + probe->hist_pos;
+		dot = 0;
+		for (k = 0; k < PROBE_LEN; k++)
+			dot += w[k] * probe->tmpl[k];
+		ncc = dot / sqrt(probe->energy * probe->tmpl_energy);
+		if (ncc > PROBE_THRESHOLD && ncc > probe->best) {
+			probe->best = ncc;
+			probe->best_frame = probe->frames - 1;
+		}
+	}
+}
+
+/* read the reference capture, called at each job wakeup */
+void probe_capture(struct loopback *loop)
+{
+	struct loopback_probe *probe = loop->probe;
+	snd_pcm_status_t *status;
+	snd_pcm_sframes_t delay, r;
+	double timeout, now;
+	int err;
+
+	snd_pcm_status_alloca(&status);
+	if ((err = probe_delay(probe->handle, status, &delay, &now)) < 0)
+		goto __xrun;
+	probe->anchor_frame = probe->frames + delay;
+	probe->anchor_time = now;
+	while ((r = snd_pcm_readi(probe->handle, probe->read, PROBE_READ)) > 0)
+		probe_correlate(loop, probe->read, r);
+	if (r < 0 && r != -EAGAIN) {
+		err = r;
+		goto __xrun;
+	}
+	timeout = loop->probe_interval / 1000.0;
+	if (timeout < PROBE_TIMEOUT)
+		timeout = PROBE_TIMEOUT;
+	if (probe->state == PROBE_SEARCH && probe->best == 0 &&
+	    probe_now() > probe->play_time + timeout)
+		probe_lost(loop);
+	return;
+      __xrun:
+	if (verbose)
+		snd_output_printf(loop->output, "%s: reference capture error: %s\n", loop->probe_device, snd_strerror(err));
+	if (probe->state == PROBE_SEARCH)
+		probe_lost(loop);
+	snd_pcm_drop(probe->handle);
+	if (snd_pcm_prepare(probe->handle) >= 0)
+		snd_pcm_start(probe->handle);
+}
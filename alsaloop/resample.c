@@ -0,0 +1,267 @@
+/*
+ *  A simple PCM loopback utility - drift compensation resampler
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The converter is a windowed sinc polyphase filter meant for ratios very
+ * close to 1.0 (the clock drift between two cards), so the cutoff does not
+ * depend on the ratio. The coefficients between two table phases are
+ * interpolated linearly once per output frame and shared by all channels.
+ * Each channel keeps its own delay line, written twice, so the filter
+ * window is always contiguous and the dot product vectorizes.
+ */
+
+#include "aconfig.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define RESAMPLE_TAPS		32	/* filter length in input frames */
+#define RESAMPLE_PHASE_BITS	8
+#define RESAMPLE_PHASES		(1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_CUTOFF		0.90	/* relative to the Nyquist frequency */
+#define RESAMPLE_BETA		8.0	/* Kaiser window shape */
+#define RESAMPLE_MAX_DEVIATION	0.001	/* +-1000ppm */
+#define RESAMPLE_ONE		(1ULL << 32)
+
+struct resampler {
+	unsigned int channels;
+	float *coef;		/* (RESAMPLE_PHASES + 1) rows of taps */
+	float *hist;		/* two copies of the delay line per channel */
+	float *cur;		/* coefficients for the current output frame */
+	unsigned int hist_pos;	/* oldest frame in the delay line */
+	uint64_t pos;		/* next output position, Q32 input frames */
+	uint64_t step;		/* input frames per output frame, Q32 */
+};
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static void resample_table(float *coef)
+{
+	double x, w, v, sum;
+	int p, j;
+
+	for (p = 0; p <= RESAMPLE_PHASES; p++) {
+		float *row = coef + p * RESAMPLE_TAPS;
+		sum = 0;
+		for (j = 0; j < RESAMPLE_TAPS; j++) {
+			/* distance of the tap from the output position */
+			x = RESAMPLE_TAPS / 2 - 1 - j +
+				(double)p / RESAMPLE_PHASES;
+			w = x / (RESAMPLE_TAPS / 2);
+			if (w <= -1 || w >= 1) {
+				row[j] = 0;
+				continue;
+			}
+			v = RESAMPLE_CUTOFF;
+			if (x != 0)
+				v = sin(M_PI * RESAMPLE_CUTOFF * x) / (M_PI * x);
+			v *= bessel_i0(RESAMPLE_BETA * sqrt(1 - w * w)) /
+			     bessel_i0(RESAMPLE_BETA);
+			row[j] = v;
+			sum += v;
+		}
+		/* unity gain at DC for every phase */
+		for (j = 0; j < RESAMPLE_TAPS; j++)
+			row[j] /= sum;
+	}
+}
+
+int resample_init(struct loopback *loop)
+{
+	struct resampler *r;
+	size_t size;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return -ENOMEM;
+	r->channels = loop->play->channels;
+	size = (RESAMPLE_PHASES + 1) * RESAMPLE_TAPS * sizeof(float);
+	if (posix_memalign((void **)&r->coef, 32, size))
+		goto __nomem;
+	size = r->channels * 2 * RESAMPLE_TAPS * sizeof(float);
+	if (posix_memalign((void **)&r->hist, 32, size)) {
+		r->hist = NULL;
+		goto __nomem;
+	}
+	memset(r->hist, 0, size);
+	if (posix_memalign((void **)&r->cur, 32, RESAMPLE_TAPS * sizeof(float))) {
+		r->cur = NULL;
+		goto __nomem;
+	}
+	resample_table(r->coef);
+	r->pos = RESAMPLE_ONE;
+	r->step = RESAMPLE_ONE;
+	loop->resampler = r;
+	return 0;
+      __nomem:
+	loop->resampler = r;
+	resample_done(loop);
+	return -ENOMEM;
+}
+
+void resample_done(struct loopback *loop)
+{
+	struct resampler *r = loop->resampler;
+
+	if (r == NULL)
+		return;
+	free(r->coef);
+	free(r->hist);
+	free(r->cur);
+	free(r);
+	loop->resampler = NULL;
+}
+
+/* ratio is the output rate divided by the input rate */
+double resample_set_ratio(struct loopback *loop, double ratio)
+{
+	struct resampler *r = loop->resampler;
+
+	if (ratio > 1 + RESAMPLE_MAX_DEVIATION)
+		ratio = 1 + RESAMPLE_MAX_DEVIATION;
+	else if (ratio < 1 - RESAMPLE_MAX_DEVIATION)
+		ratio = 1 - RESAMPLE_MAX_DEVIATION;
+	r->step = llrint(RESAMPLE_ONE / ratio);
+	return ratio;
+}
+
+static inline void push_frame(struct resampler *r,
+			      snd_pcm_format_t format,
+			      const char *src)
+{
+	float *h = r->hist + r->hist_pos;
+	unsigned int c;
+
+	if (format == SND_PCM_FORMAT_S32) {
+		const int32_t *s = (const int32_t *)src;
+		for (c = 0; c < r->channels; c++, h += 2 * RESAMPLE_TAPS)
+			h[0] = h[RESAMPLE_TAPS] = s[c] * (1.0f / 2147483648.0f);
+	} else {
+		const int16_t *s = (const int16_t *)src;
+		for (c = 0; c < r->channels; c++, h += 2 * RESAMPLE_TAPS)
+			h[0] = h[RESAMPLE_TAPS] = s[c] * (1.0f / 32768.0f);
+	}
+	if (++r->hist_pos == RESAMPLE_TAPS)
+		r->hist_pos = 0;
+}
+
+static inline float dot(const float *a, const float *b)
+{
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int k;
+
+	for (k = 0; k < RESAMPLE_TAPS; k += 4) {
+		s0 += a[k] * b[k];
+		s1 += a[k + 1] * b[k + 1];
+		s2 += a[k + 2] * b[k + 2];
+		s3 += a[k + 3] * b[k + 3];
+	}
+	return (s0 + s1) + (s2 + s3);
+}
+
+static inline void pull_frame(struct resampler *r,
+			      snd_pcm_format_t format,
+			      char *dst)
+{
+	uint32_t frac = r->pos;
+	unsigned int phase = frac >> (32 - RESAMPLE_PHASE_BITS), k, c;
+	float alpha = (frac & ((1U << (32 - RESAMPLE_PHASE_BITS)) - 1)) *
+		      (1.0f / (1U << (32 - RESAMPLE_PHASE_BITS)));
+	const float *c0 = r->coef + phase * RESAMPLE_TAPS;
+	const float *c1 = c0 + RESAMPLE_TAPS;
+	const float *h = r->hist + r->hist_pos;
+	float v;
+
+	for (k = 0; k < RESAMPLE_TAPS; k++)
+		r->cur[k] = c0[k] + alpha * (c1[k] - c0[k]);
+	if (format == SND_PCM_FORMAT_S32) {
+		int32_t *d = (int32_t *)dst;
+		for (c = 0; c < r->channels; c++, h += 2 * RESAMPLE_TAPS) {
+			double s = (double)dot(r->cur, h) * 2147483648.0;
+			if (s >= 2147483647.0)
+				d[c] = 0x7fffffff;
+			else if (s <= -2147483648.0)
+				d[c] = -0x7fffffff - 1;
+			else
+				d[c] = lrint(s);
+		}
+	} else {
+		int16_t *d = (int16_t *)dst;
+		for (c = 0; c < r->channels; c++, h += 2 * RESAMPLE_TAPS) {
+			v = dot(r->cur, h) * 32768.0f;
+			if (v >= 32767.0f)
+				d[c] = 0x7fff;
+			else if (v <= -32768.0f)
+				d[c] = -0x8000;
+			else
+				d[c] = lrintf(v);
+		}
+	}
+}
+
+/*
+ * Convert from one contiguous segment of the capture ring to one
+ * contiguous segment of the playback ring. On return, the frame counts
+ * hold the consumed input and the produced output frames.
+ */
+void resample_process(struct loopback *loop,
+		      const char *src, snd_pcm_uframes_t *src_frames,
+		      char *dst, snd_pcm_uframes_t *dst_frames)
+{
+	struct resampler *r = loop->resampler;
+	snd_pcm_format_t format = loop->capt->format;
+	unsigned int src_size = loop->capt->frame_size;
+	unsigned int dst_size = loop->play->frame_size;
+	snd_pcm_uframes_t in = 0, out = 0;
+
+	for (;;) {
+		if (r->pos >= RESAMPLE_ONE) {
+			if (in == *src_frames)
+				break;
+			push_frame(r, format, src + in * src_size);
+			in++;
+			r->pos -= RESAMPLE_ONE;
+			continue;
+		}
+		if (out == *dst_frames)
+			break;
+		pull_frame(r, format, dst + out * dst_size);
+		out++;
+		r->pos += r->step;
+	}
+	*src_frames = in;
+	*dst_frames = out;
+}
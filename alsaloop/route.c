@@ -0,0 +1,441 @@
+/*
+ *  A simple PCM loopback utility - routing of shared PCM devices
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Jobs in one thread which use the same PCM device share it. The first
+ * job (the owner) opens and polls the PCM, the first running member sets
+ * it up and the last one stops it.
+ *
+ * A shared capture PCM is read once into reference counted periods which
+ * are queued to all members (fan-out). Each member copies the periods to
+ * its own ring buffer at its own pace.
+ *
+ * A shared playback PCM is written once with the mix of the ring buffers
+ * of all members (fan-in), each scaled by the gain of the member job.
+ */
+
+#include "aconfig.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define ROUTE_GAIN_SHIFT	16	/* fixed point gain */
+
+int route_link(struct loopback_handle *lhandle, struct loopback_handle *member)
+{
+	struct loopback_route *route = lhandle->route;
+	struct loopback_handle **members;
+
+	if (member->route)
+		return member->route == route ? 0 : -EINVAL;
+	if (route == NULL) {
+		route = calloc(1, sizeof(*route));
+		if (route == NULL)
+			return -ENOMEM;
+		route->members = malloc(sizeof(*route->members));
+		if (route->members == NULL) {
+			free(route);
+			return -ENOMEM;
+		}
+		route->members[route->members_count++] = lhandle;
+		lhandle->route = route;
+	}
+	members = realloc(route->members, (route->members_count + 1) *
+						sizeof(*route->members));
+	if (members == NULL)
+		return -ENOMEM;
+	route->members = members;
+	route->members[route->members_count++] = member;
+	member->route = route;
+	return 0;
+}
+
+/* the handle opens and polls the PCM */
+int route_owner(struct loopback_handle *lhandle)
+{
+	return lhandle->route == NULL || lhandle->route->members[0] == lhandle;
+}
+
+static void period_put(struct loopback_route *route, struct route_period *p)
+{
+	p->next = route->pool;
+	route->pool = p;
+}
+
+static struct route_period *period_get(struct loopback_route *route)
+{
+	struct route_period *p = route->pool;
+
+	if (p) {
+		route->pool = p->next;
+		return p;
+	}
+	return malloc(sizeof(*p) + route->period_size * route->frame_size);
+}
+
+static void period_release(struct loopback_route *route, struct route_period *p)
+{
+	if (--p->refs == 0)
+		period_put(route, p);
+}
+
+static void queue_pop(struct loopback_handle *lhandle)
+{
+	struct route_period *p = lhandle->queue[lhandle->queue_head];
+
+	lhandle->queue_frames -= p->frames - lhandle->queue_pos;
+	lhandle->queue_pos = 0;
+	lhandle->queue_head = (lhandle->queue_head + 1) % lhandle->queue_size;
+	lhandle->queue_count--;
+	period_release(lhandle->route, p);
+}
+
+static void queue_flush(struct loopback_handle *lhandle)
+{
+	while (lhandle->queue_count > 0)
+		queue_pop(lhandle);
+	free(lhandle->queue);
+	lhandle->queue = NULL;
+	lhandle->queue_size = 0;
+	lhandle->queue_head = 0;
+}
+
+static int queue_push(struct loopback_handle *lhandle, struct route_period *p)
+{
+	struct loopback_route *route = lhandle->route;
+
+	if (lhandle->queue == NULL) {
+		/* the queue holds up to the ring buffer size */
+		lhandle->queue_size = lhandle->buf_size / route->period_size + 2;
+		lhandle->queue = calloc(lhandle->queue_size, sizeof(p));
+		if (lhandle->queue == NULL)
+			return -ENOMEM;
+	}
+	if (lhandle->queue_count == lhandle->queue_size) {
+		lhandle->buf_over += lhandle->queue[lhandle->queue_head]->frames -
+				     lhandle->queue_pos;
+		queue_pop(lhandle);
+	}
+	lhandle->queue[(lhandle->queue_head + lhandle->queue_count) %
+					lhandle->queue_size] = p;
+	lhandle->queue_count++;
+	lhandle->queue_frames += p->frames;
+	p->refs++;
+	return 0;
+}
+
+static void route_free_pool(struct loopback_route *route)
+{
+	struct route_period *p;
+
+	while ((p = route->pool) != NULL) {
+		route->pool = p->next;
+		free(p);
+	}
+	free(route->mix);
+	route->mix = NULL;
+	free(route->acc);
+	route->acc = NULL;
+}
+
+/*
+ * Returns 1 when the PCM is already running with the setup of another
+ * member, 0 when the handle must set up the PCM.
+ */
+int route_join(struct loopback_handle *lhandle)
+{
+	struct loopback_route *route = lhandle->route;
+
+	if (route == NULL)
+		return 0;
+	if (lhandle->route_active)
+		return lhandle->route_joined;
+	if (route->running == 0) {
+		route_free_pool(route);
+		lhandle->route_active = 1;
+		lhandle->route_joined = 0;
+		route->running++;
+		return 0;
+	}
+	if (lhandle->format != route->format ||
+	    lhandle->channels != route->channels ||
+	    lhandle->rate_req != route->rate_req) {
+		logit(LOG_CRIT, "%s: shared PCM is used with other parameters (%s, %uHz, %u channels)\n",
+		      lhandle->id, snd_pcm_format_name(route->format),
+		      route->rate_req, route->channels);
+		return -EINVAL;
+	}
+	lhandle->rate = route->rate;
+	lhandle->pitch = route->pitch;
+	lhandle->buffer_size = route->buffer_size;
+	lhandle->period_size = route->period_size;
+	lhandle->avail_min = route->avail_min;
+	lhandle->route_active = 1;
+	lhandle->route_joined = 1;
+	route->running++;
+	return 1;
+}
+
+/* remember the setup of the PCM for the members joining later */
+int route_config(struct loopback_handle *lhandle)
+{
+	struct loopback_route *route = lhandle->route;
+
+	if (route == NULL || lhandle->route_joined)
+		return 0;
+	route->format = lhandle->format;
+	route->rate = lhandle->rate;
+	route->rate_req = lhandle->rate_req;
+	route->channels = lhandle->channels;
+	route->buffer_size = lhandle->buffer_size;
+	route->period_size = lhandle->period_size;
+	route->avail_min = lhandle->avail_min;
+	route->pitch = lhandle->pitch;
+	route->frame_size = (snd_pcm_format_physical_width(route->format) / 8) *
+			    route->channels;
+	if (lhandle != lhandle->loopback->play)
+		return 0;
+	if (route->format != SND_PCM_FORMAT_S16 &&
+	    route->format != SND_PCM_FORMAT_S32) {
+		logit(LOG_CRIT, "%s: mixing supports only %s or %s formats\n",
+		      lhandle->id, snd_pcm_format_name(SND_PCM_FORMAT_S16),
+		      snd_pcm_format_name(SND_PCM_FORMAT_S32));
+		return -EINVAL;
+	}
+	free(route->mix);
+	free(route->acc);
+	route->mix = malloc(route->buffer_size * route->frame_size);
+	route->acc = malloc(route->buffer_size * route->channels *
+			    sizeof(*route->acc));
+	if (route->mix == NULL || route->acc == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+/* returns 1 when the last member left and the PCM should be stopped */
+int route_release(struct loopback_handle *lhandle)
+{
+	struct loopback_route *route = lhandle->route;
+
+	if (route == NULL)
+		return 1;
+	if (!lhandle->route_active)
+		return 0;
+	queue_flush(lhandle);
+	lhandle->route_active = 0;
+	lhandle->route_joined = 0;
+	return --route->running == 0;
+}
+
+static int route_member(struct loopback_handle *lhandle,
+			struct loopback_handle *caller)
+{
+	return lhandle->route_active &&
+	       (lhandle == caller || lhandle->loopback->running);
+}
+
+/* read the shared capture PCM and queue the periods to all members */
+snd_pcm_sframes_t route_capture(struct loopback_handle *lhandle)
+{
+	struct loopback_route *route = lhandle->route;
+	struct route_period *p;
+	snd_pcm_sframes_t avail, r, res = 0;
+	int i, err;
+
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail < 0)
+		return avail;
+	while (avail > 0) {
+		p = period_get(route);
+		if (p == NULL)
+			return -ENOMEM;
+		r = avail;
+		if (r > route->period_size)
+			r = route->period_size;
+		r = snd_pcm_readi(lhandle->handle, p->data, r);
+		if (r <= 0) {
+			period_put(route, p);
+			return r < 0 ? r : res;
+		}
+		p->frames = r;
+		p->refs = 1;
+		for (i = 0; i < route->members_count; i++) {
+			if (!route_member(route->members[i], lhandle))
+				continue;
+			err = queue_push(route->members[i], p);
+			if (err < 0) {
+				period_release(route, p);
+				return err;
+			}
+		}
+		period_release(route, p);
+		res += r;
+		avail -= r;
+	}
+	return res;
+}
+
+/* copy the queued periods to the ring buffer */
+snd_pcm_uframes_t route_dequeue(struct loopback_handle *lhandle)
+{
+	struct route_period *p;
+	snd_pcm_uframes_t r, res = 0;
+
+	while (lhandle->queue_count > 0 &&
+	       lhandle->buf_count < lhandle->buf_size) {
+		p = lhandle->queue[lhandle->queue_head];
+		r = lhandle->buf_size - lhandle->buf_count;
+		if (r + lhandle->buf_pos > lhandle->buf_size)
+			r = lhandle->buf_size - lhandle->buf_pos;
+		if (r > p->frames - lhandle->queue_pos)
+			r = p->frames - lhandle->queue_pos;
+		memcpy(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
+		       p->data + lhandle->queue_pos * lhandle->frame_size,
+		       r * lhandle->frame_size);
+		res += r;
+		lhandle->counter += r;
+		lhandle->buf_count += r;
+		lhandle->buf_pos += r;
+		lhandle->buf_pos %= lhandle->buf_size;
+		lhandle->queue_pos += r;
+		lhandle->queue_frames -= r;
+		if (lhandle->queue_pos == p->frames)
+			queue_pop(lhandle);
+	}
+	if (lhandle->max < res)
+		lhandle->max = res;
+	return res;
+}
+
+snd_pcm_uframes_t route_queued(struct loopback_handle *lhandle)
+{
+	return lhandle->route ? lhandle->queue_frames : 0;
+}
+
+static void mix_add(struct loopback_route *route, struct loopback_handle *lhandle,
+		    snd_pcm_uframes_t frames)
+{
+	long long gain = llrint(lhandle->loopback->gain * (1 << ROUTE_GAIN_SHIFT));
+	long long *acc = route->acc;
+	snd_pcm_uframes_t pos = lhandle->buf_pos, count;
+	unsigned int i, samples;
+
+	while (frames > 0) {
+		count = frames;
+		if (count + pos > lhandle->buf_size)
+			count = lhandle->buf_size - pos;
+		samples = count * route->channels;
+		if (route->format == SND_PCM_FORMAT_S32) {
+			const int32_t *src = (const int32_t *)(lhandle->buf +
+						pos * route->frame_size);
+			for (i = 0; i < samples; i++)
+				acc[i] += src[i] * gain;
+		} else {
+			const int16_t *src = (const int16_t *)(lhandle->buf +
+						pos * route->frame_size);
+			for (i = 0; i < samples; i++)
+				acc[i] += src[i] * gain;
+		}
+		acc += samples;
+		frames -= count;
+		pos = 0;
+	}
+}
+
+static void mix_store(struct loopback_route *route, snd_pcm_uframes_t frames)
+{
+	unsigned int i, samples = frames * route->channels;
+	long long v;
+
+	if (route->format == SND_PCM_FORMAT_S32) {
+		int32_t *dst = (int32_t *)route->mix;
+		for (i = 0; i < samples; i++) {
+			v = route->acc[i] >> ROUTE_GAIN_SHIFT;
+			dst[i] = v > 0x7fffffff ? 0x7fffffff :
+				 v < -0x7fffffffLL - 1 ? -0x7fffffff - 1 : v;
+		}
+	} else {
+		int16_t *dst = (int16_t *)route->mix;
+		for (i = 0; i < samples; i++) {
+			v = route->acc[i] >> ROUTE_GAIN_SHIFT;
+			dst[i] = v > 0x7fff ? 0x7fff : v < -0x8000 ? -0x8000 : v;
+		}
+	}
+}
+
+/*
+ * Write the mix of the ring buffers of all running members to the shared
+ * playback PCM. Only the frames available in all rings are written. The
+ * rings of the other members are advanced here, the caller's ring too, but
+ * the caller removes the written frames from its capture side itself.
+ */
+snd_pcm_sframes_t route_playback(struct loopback_handle *lhandle)
+{
+	struct loopback_route *route = lhandle->route;
+	struct loopback_handle *m;
+	snd_pcm_sframes_t avail, r;
+	snd_pcm_uframes_t frames;
+	int i;
+
+	avail = snd_pcm_avail_update(lhandle->handle);
+	if (avail < 0)
+		return avail;
+	frames = avail;
+	if (frames > route->buffer_size)
+		frames = route->buffer_size;
+	for (i = 0; i < route->members_count; i++) {
+		m = route->members[i];
+		if (route_member(m, lhandle) && m->buf_count < frames)
+			frames = m->buf_count;
+	}
+	if (frames == 0)
+		return 0;
+	memset(route->acc, 0, frames * route->channels * sizeof(*route->acc));
+	for (i = 0; i < route->members_count; i++) {
+		m = route->members[i];
+		if (route_member(m, lhandle))
+			mix_add(route, m, frames);
+	}
+	mix_store(route, frames);
+	r = snd_pcm_writei(lhandle->handle, route->mix, frames);
+	if (r <= 0)
+		return r;
+	for (i = 0; i < route->members_count; i++) {
+		m = route->members[i];
+		if (!route_member(m, lhandle))
+			continue;
+		m->counter += r;
+		m->buf_count -= r;
+		m->buf_pos += r;
+		m->buf_pos %= m->buf_size;
+		/* the written frames leave a ring shared with the capture */
+		if (m != lhandle && m->buf == m->loopback->capt->buf) {
+			if ((snd_pcm_uframes_t)r < m->loopback->capt->buf_count)
+				m->loopback->capt->buf_count -= r;
+			else
+				m->loopback->capt->buf_count = 0;
+		}
+	}
+	return r;
+}
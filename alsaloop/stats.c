@@ -0,0 +1,521 @@
+/*
+ *  A simple PCM loopback utility - runtime statistics and control socket
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The socket accepts text commands, one per line, and answers with one
+ * JSON object per line:
+ *
+ *   stats [job]             statistics of all jobs or one job
+ *   interval <ms>           stream the statistics periodically (0 = off)
+ *   latency <job> <usec>    change the target latency
+ *   mute <job> <0|1>        mute or unmute the playback
+ *   reset <job|all>         reset the statistics
+ *
+ * The job commands are only flagged here, the job thread applies them.
+ */
+
+#include "aconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define STATS_CLIENTS	16
+#define STATS_LINE	256
+#define STATS_INTERVAL	1000	/* default streaming interval in ms */
+
+struct stats_client {
+	int fd;
+	char line[STATS_LINE];
+	size_t len;
+	unsigned int interval;		/* in ms, 0 = do not stream */
+	long long next;			/* next streaming time in ms */
+};
+
+static struct stats_server {
+	char *path;
+	int fd;
+	struct loopback **loops;
+	int count;
+	struct stats_client clients[STATS_CLIENTS];
+	pthread_t thread;
+} server = { .fd = -1 };
+
+void hist_add(struct loopback_hist *hist, long usec)
+{
+	long idx = usec / hist->width;
+
+	hist->count++;
+	hist->sum += usec;
+	if (usec > hist->max)
+		hist->max = usec;
+	hist->bucket[idx < HIST_BUCKETS ? idx : HIST_BUCKETS]++;
+}
+
+/* upper bound of the bucket with the given percentile */
+long hist_percentile(struct loopback_hist *hist, int pc)
+{
+	unsigned long sum = 0, limit = (hist->count * pc + 99) / 100;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += hist->bucket[i];
+		if (sum >= limit)
+			return (i + 1) * hist->width;
+	}
+	return hist->max;
+}
+
+void hist_reset(struct loopback_hist *hist)
+{
+	unsigned int width = hist->width;
+
+	memset(hist, 0, sizeof(*hist));
+	hist->width = width;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int json_string(char *buf, size_t size, const char *str)
+{
+	size_t pos = 0;
+
+	if (size < 3)
+		return 0;
+	buf[pos++] = '"';
+	for (; str && *str && pos + 8 < size; str++) {
+		if (*str == '"' || *str == '\\') {
+			buf[pos++] = '\\';
+			buf[pos++] = *str;
+		} else if ((unsigned char)*str < 0x20) {
+			pos += snprintf(buf + pos, size - pos, "\\u%04x", *str);
+		} else {
+			buf[pos++] = *str;
+		}
+	}
+	buf[pos++] = '"';
+	buf[pos] = '\0';
+	return pos;
+}
+
+/*
+ * The job thread copies its statistics here, the stats thread reads only
+ * this copy.
+ */
+struct loopback_stats {
+	pthread_mutex_t lock;
+	int running;
+	unsigned int rate;
+	snd_pcm_uframes_t latency;
+	double latency_now;
+	double pitch;
+	int sync_locked;
+	snd_pcm_uframes_t queued;
+	unsigned long xruns_play;
+	unsigned long xruns_capt;
+	snd_pcm_uframes_t overruns;
+	struct loopback_hist proc;
+	struct loopback_probe_stats probe;
+};
+
+/* called by the job thread after each wakeup */
+void stats_publish(struct loopback *loop)
+{
+	struct loopback_stats *st = loop->stats;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+
+	if (st == NULL)
+		return;
+	/* do not wait for a reader, the next wakeup publishes again */
+	if (pthread_mutex_trylock(&st->lock))
+		return;
+	st->running = loop->running;
+	st->rate = play->rate_req;
+	st->latency = loop->latency;
+	st->latency_now = loop->latency_now;
+	st->pitch = loop->pitch;
+	st->sync_locked = loop->sync_locked;
+	st->queued = play->buf_count + route_queued(capt);
+	if (play->buf != capt->buf)
+		st->queued += capt->buf_count;
+	st->xruns_play = play->xruns;
+	st->xruns_capt = capt->xruns;
+	st->overruns = capt->buf_over;
+	st->proc = loop->proc;
+	st->probe = loop->probe_stats;
+	pthread_mutex_unlock(&st->lock);
+}
+
+static int stats_json(struct loopback *loop, int job, char *buf, size_t size)
+{
+	struct loopback_stats *st = loop->stats;
+	struct loopback_probe_stats *probe = &st->probe;
+	unsigned int rate;
+	char id[512];
+	double mean = 0;
+	int len;
+
+	json_string(id, sizeof(id), loop->id ? loop->id : loop->capt->id);
+	pthread_mutex_lock(&st->lock);
+	rate = st->rate;
+	if (st->proc.count > 0)
+		mean = st->proc.sum / st->proc.count;
+	len = snprintf(buf, size,
+		"{\"job\":%i,\"id\":%s,\"thread\":%i,\"running\":%i,\"mute\":%i,"
+		"\"rate\":%u,\"latency\":{\"target\":%lu,\"measured\":%.1f,"
+		"\"target_us\":%.0f,\"measured_us\":%.0f},"
+		"\"pitch\":%.8f,\"sync_locked\":%i,\"queued\":%lu,"
+		"\"xruns\":{\"playback\":%lu,\"capture\":%lu},"
+		"\"overruns\":%lu,"
+		"\"proc_us\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%li,"
+		"\"p90\":%li,\"p99\":%li,\"max\":%li}",
+		job, id, loop->thread, st->running, loop->mute,
+		rate, (unsigned long)st->latency, st->latency_now,
+		rate ? st->latency * 1000000.0 / rate : 0,
+		rate ? st->latency_now * 1000000.0 / rate : 0,
+		st->pitch, st->sync_locked, (unsigned long)st->queued,
+		st->xruns_play, st->xruns_capt,
+		(unsigned long)st->overruns,
+		st->proc.count, mean,
+		hist_percentile(&st->proc, 50),
+		hist_percentile(&st->proc, 90),
+		hist_percentile(&st->proc, 99),
+		st->proc.max);
+	if (loop->probe_device && len < (int)size)
+		len += snprintf(buf + len, size - len,
+			",\"latency_test\":{\"markers\":%lu,\"lost\":%lu,"
+			"\"loop_ms\":%.3f,\"loop_min_ms\":%.3f,"
+			"\"loop_max_ms\":%.3f,\"loop_mean_ms\":%.3f,"
+			"\"round_trip_ms\":%.3f}",
+			probe->count, probe->lost, probe->loop_ms,
+			probe->loop_min, probe->loop_max,
+			probe->count ? probe->loop_sum / probe->count : 0,
+			probe->round_trip_ms);
+	pthread_mutex_unlock(&st->lock);
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len, "}\n");
+	return len;
+}
+
+static void client_close(struct stats_client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+}
+
+static void client_send(struct stats_client *client, const char *buf, int len)
+{
+	ssize_t r;
+
+	while (len > 0 && client->fd >= 0) {
+		r = send(client->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			/* a slow reader loses the connection */
+			client_close(client);
+			return;
+		}
+		buf += r;
+		len -= r;
+	}
+}
+
+static void client_stats(struct stats_client *client, int job)
+{
+	char buf[2048];
+	int i, len;
+
+	for (i = 0; i < server.count; i++) {
+		if (job >= 0 && i != job)
+			continue;
+		len = stats_json(server.loops[i], i, buf, sizeof(buf));
+		if (len >= (int)sizeof(buf))
+			len = sizeof(buf) - 1;
+		client_send(client, buf, len);
+	}
+}
+
+static void client_reply(struct stats_client *client, const char *error)
+{
+	char buf[STATS_LINE + 32];
+	int len;
+
+	if (error) {
+		len = snprintf(buf, sizeof(buf), "{\"error\":");
+		len += json_string(buf + len, sizeof(buf) - len - 2, error);
+		len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+	} else {
+		len = snprintf(buf, sizeof(buf), "{\"ok\":true}\n");
+	}
+	client_send(client, buf, len);
+}
+
+static struct loopback *client_job(char *arg)
+{
+	char *end;
+	long job;
+
+	if (arg == NULL)
+		return NULL;
+	job = strtol(arg, &end, 10);
+	if (end == arg || *end || job < 0 || job >= server.count)
+		return NULL;
+	return server.loops[job];
+}
+
+static void client_command(struct stats_client *client, char *line)
+{
+	char *save, *cmd, *arg1, *arg2;
+	struct loopback *loop;
+	long val;
+	int i;
+
+	cmd = strtok_r(line, " \t\r", &save);
+	if (cmd == NULL)
+		return;
+	arg1 = strtok_r(NULL, " \t\r", &save);
+	arg2 = strtok_r(NULL, " \t\r", &save);
+	if (!strcmp(cmd, "stats")) {
+		if (arg1 && client_job(arg1) == NULL) {
+			client_reply(client, "unknown job");
+			return;
+		}
+		client_stats(client, arg1 ? atoi(arg1) : -1);
+	} else if (!strcmp(cmd, "interval") && arg1) {
+		val = atol(arg1);
+		if (val < 0) {
+			client_reply(client, "wrong interval");
+			return;
+		}
+		client->interval = val;
+		client->next = now_ms() + val;
+		client_reply(client, NULL);
+	} else if (!strcmp(cmd, "latency") && arg2) {
+		loop = client_job(arg1);
+		val = atol(arg2);
+		if (loop == NULL || val <= 0) {
+			client_reply(client, loop ? "wrong latency" : "unknown job");
+			return;
+		}
+		loop->cmd_latency = val;
+		client_reply(client, NULL);
+	} else if (!strcmp(cmd, "mute") && arg2) {
+		loop = client_job(arg1);
+		if (loop == NULL) {
+			client_reply(client, "unknown job");
+			return;
+		}
+		loop->mute = atoi(arg2) != 0;
+		client_reply(client, NULL);
+	} else if (!strcmp(cmd, "reset") && arg1) {
+		if (!strcmp(arg1, "all")) {
+			for (i = 0; i < server.count; i++)
+				server.loops[i]->cmd_reset = 1;
+		} else if ((loop = client_job(arg1)) != NULL) {
+			loop->cmd_reset = 1;
+		} else {
+			client_reply(client, "unknown job");
+			return;
+		}
+		client_reply(client, NULL);
+	} else {
+		client_reply(client, "unknown command");
+	}
+}
+
+static void client_read(struct stats_client *client)
+{
+	char *nl;
+	ssize_t r;
+
+	r = recv(client->fd, client->line + client->len,
+		 sizeof(client->line) - 1 - client->len, MSG_DONTWAIT);
+	if (r <= 0) {
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		client_close(client);
+		return;
+	}
+	client->len += r;
+	client->line[client->len] = '\0';
+	while (client->fd >= 0 &&
+	       (nl = strchr(client->line, '\n')) != NULL) {
+		*nl = '\0';
+		client_command(client, client->line);
+		client->len -= nl + 1 - client->line;
+		memmove(client->line, nl + 1, client->len + 1);
+	}
+	if (client->len == sizeof(client->line) - 1) {
+		client_reply(client, "line too long");
+		client->len = 0;
+	}
+}
+
+static void client_accept(void)
+{
+	int i, fd;
+
+	fd = accept(server.fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (i = 0; i < STATS_CLIENTS; i++) {
+		if (server.clients[i].fd < 0) {
+			server.clients[i].fd = fd;
+			server.clients[i].len = 0;
+			server.clients[i].interval = STATS_INTERVAL;
+			server.clients[i].next = now_ms();
+			return;
+		}
+	}
+	close(fd);
+}
+
+static void *stats_thread(void *arg ATTRIBUTE_UNUSED)
+{
+	struct pollfd pfds[STATS_CLIENTS + 1];
+	struct stats_client *client;
+	int idx[STATS_CLIENTS + 1];
+	long long now, wait;
+	int i, n;
+
+	while (!quit) {
+		now = now_ms();
+		wait = 200;	/* check quit regularly */
+		pfds[0].fd = server.fd;
+		pfds[0].events = POLLIN;
+		for (i = 0, n = 1; i < STATS_CLIENTS; i++) {
+			client = &server.clients[i];
+			if (client->fd < 0)
+				continue;
+			if (client->interval > 0) {
+				if (client->next <= now) {
+					client_stats(client, -1);
+					client->next = now + client->interval;
+				}
+				if (client->fd >= 0 && client->next - now < wait)
+					wait = client->next - now;
+			}
+			if (client->fd < 0)
+				continue;
+			pfds[n].fd = client->fd;
+			pfds[n].events = POLLIN;
+			idx[n++] = i;
+		}
+		if (poll(pfds, n, wait) <= 0)
+			continue;
+		if (pfds[0].revents & POLLIN)
+			client_accept();
+		for (i = 1; i < n; i++) {
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(&server.clients[idx[i]]);
+		}
+	}
+	return NULL;
+}
+
+static void stats_done(void)
+{
+	int i;
+
+	if (server.fd < 0)
+		return;
+	for (i = 0; i < STATS_CLIENTS; i++)
+		if (server.clients[i].fd >= 0)
+			close(server.clients[i].fd);
+	close(server.fd);
+	server.fd = -1;
+	unlink(server.path);
+}
+
+int stats_start(const char *path, struct loopback **loops, int count)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	sigset_t set, old;
+	int i, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logit(LOG_CRIT, "Socket path %s is too long\n", path);
+		return -EINVAL;
+	}
+	server.path = strdup(path);
+	if (server.path == NULL)
+		return -ENOMEM;
+	server.loops = loops;
+	server.count = count;
+	for (i = 0; i < count; i++) {
+		loops[i]->stats = calloc(1, sizeof(struct loopback_stats));
+		if (loops[i]->stats == NULL)
+			return -ENOMEM;
+		pthread_mutex_init(&loops[i]->stats->lock, NULL);
+	}
+	for (i = 0; i < STATS_CLIENTS; i++)
+		server.clients[i].fd = -1;
+	server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server.fd < 0)
+		goto __error;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	/* a stale socket of a previous run, never remove anything else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(server.fd, STATS_CLIENTS) < 0)
+		goto __error;
+	atexit(stats_done);
+	/* the signals are handled by the job threads */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&server.thread, NULL, stats_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		logit(LOG_CRIT, "Unable to create the stats thread: %s\n", strerror(err));
+		return -err;
+	}
+	return 0;
+      __error:
+	err = -errno;
+	logit(LOG_CRIT, "Stats socket %s error: %s\n", path, strerror(errno));
+	if (server.fd >= 0)
+		close(server.fd);
+	server.fd = -1;
+	return err;
+}
@@ -29,6 +29,9 @@
 #include "common.h"
 #include "alsa.h"
 #include "latencytest.h"
+#ifdef HAVE_LIBFFTW3F
+#include "stream.h"
+#endif
 #include "os_compat.h"
 
 struct pcm_container {
@@ -71,6 +74,39 @@ static int format_convert(struct bat *bat, snd_pcm_format_t *fmt)
 	return -EINVAL;
 }
 
+/* timestamp position updates with the monotonic clock for latency test */
+static int set_snd_pcm_tstamp(struct bat *bat, struct pcm_container *sndpcm)
+{
+	snd_pcm_sw_params_t *swparams;
+	const char *device_name = snd_pcm_name(sndpcm->handle);
+	int err;
+
+	snd_pcm_sw_params_alloca(&swparams);
+
+	err = snd_pcm_sw_params_current(sndpcm->handle, swparams);
+	if (err < 0)
+		goto fail;
+	err = snd_pcm_sw_params_set_tstamp_mode(sndpcm->handle, swparams,
+			SND_PCM_TSTAMP_ENABLE);
+	if (err < 0)
+		goto fail;
+	err = snd_pcm_sw_params_set_tstamp_type(sndpcm->handle, swparams,
+			SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if (err < 0)
+		goto fail;
+	err = snd_pcm_sw_params(sndpcm->handle, swparams);
+	if (err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	fprintf(bat->err, _("Set parameter to device error: "));
+	fprintf(bat->err, _("timestamp: %s: %s(%d)\n"),
+			device_name, snd_strerror(err), err);
+	return err;
+}
+
 static int set_snd_pcm_params(struct bat *bat, struct pcm_container *sndpcm)
 {
 	snd_pcm_hw_params_t *params;
@@ -280,6 +316,12 @@ static int set_snd_pcm_params(struct bat *bat, struct pcm_container *sndpcm)
 	fprintf(bat->log, _("Get period size: %d  buffer size: %d\n"),
 			(int) sndpcm->period_size, (int) sndpcm->buffer_size);
 
+	if (bat->latency.xcorr_number) {
+		err = set_snd_pcm_tstamp(bat, sndpcm);
+		if (err < 0)
+			return err;
+	}
+
 	err = snd_pcm_format_physical_width(format);
 	if (err < 0) {
 		fprintf(bat->err, _("Invalid parameters: "));
@@ -341,6 +383,33 @@ static int write_to_pcm(const struct pcm_container *sndpcm,
 	return 0;
 }
 
+/**
+ * Get the time the first of frames at the application pointer is played,
+ * or for capture, the time the first of frames just read was captured.
+ * avail and its timestamp are taken together by the driver at the last
+ * position update. Returns 0 if the timestamp can't be read.
+ */
+static double get_pcm_tstamp(const struct pcm_container *sndpcm,
+		struct bat *bat, int frames, bool capture)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t tstamp;
+	double t;
+
+	if (snd_pcm_avail_update(sndpcm->handle) < 0)
+		return 0.0;
+	if (snd_pcm_htimestamp(sndpcm->handle, &avail, &tstamp) < 0)
+		return 0.0;
+	if (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)
+		return 0.0;
+
+	t = tstamp.tv_sec + tstamp.tv_nsec / 1e9;
+	if (capture)
+		return t - (double) (avail + frames) / bat->rate;
+
+	return t + (double) (sndpcm->buffer_size - avail) / bat->rate;
+}
+
 /**
  * Process output data for latency test
  */
@@ -355,7 +424,8 @@ static int latencytest_process_output(struct pcm_container *sndpcm,
 
 	while (1) {
 		/* generate output data */
-		err = handleoutput(bat, sndpcm->buffer, bytes, frames);
+		err = handleoutput(bat, sndpcm->buffer, bytes, frames,
+				get_pcm_tstamp(sndpcm, bat, frames, false));
 		if (err != 0)
 			break;
 
@@ -600,6 +670,41 @@ static int read_from_pcm_loop(struct pcm_container *sndpcm, struct bat *bat)
 	return err;
 }
 
+#ifdef HAVE_LIBFFTW3F
+/**
+ * Feed captured periods to the streaming analyzer instead of storing them
+ */
+static int read_from_pcm_stream(struct pcm_container *sndpcm, struct bat *bat)
+{
+	int err = 0;
+	int frames;
+	int remain = bat->frames;
+
+	while (remain > 0) {
+		frames = (remain <= (int) sndpcm->period_size) ?
+			remain : (int) sndpcm->period_size;
+
+		/* read a chunk from pcm device */
+		err = read_from_pcm(sndpcm, frames, bat);
+		if (err != 0)
+			break;
+
+		err = stream_analyzer_feed(bat, sndpcm->buffer, frames);
+		if (err != 0)
+			break;
+
+		remain -= frames;
+		bat->periods_played++;
+
+		if (bat->period_is_limited
+				&& bat->periods_played >= bat->periods_total)
+			break;
+	}
+
+	return err;
+}
+#endif
+
 /**
  * Process input data for latency test
  */
@@ -639,7 +744,8 @@ static int latencytest_process_input(struct pcm_container *sndpcm,
 		if (bat->latency.xrun_error == true)
 			break;
 
-		err = handleinput(bat, sndpcm->buffer, frames);
+		err = handleinput(bat, sndpcm->buffer, frames,
+				get_pcm_tstamp(sndpcm, bat, frames, true));
 		if (err != 0)
 			break;
 
@@ -707,6 +813,10 @@ void *record_alsa(struct bat *bat)
 	fprintf(bat->log, _("Recording ...\n"));
 	if (bat->roundtriplatency)
 		err = latencytest_process_input(&sndpcm, bat);
+#ifdef HAVE_LIBFFTW3F
+	else if (bat->stream)
+		err = read_from_pcm_stream(&sndpcm, bat);
+#endif
 	else
 		err = read_from_pcm_loop(&sndpcm, bat);
 
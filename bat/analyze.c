@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <math.h>
 #include <fftw3.h>
@@ -28,6 +31,28 @@
 
 #include "common.h"
 #include "bat-signal.h"
+#include "impair.h"
+
+/* fftw planner is not thread-safe, only fftwf_execute() on a plan is */
+static pthread_mutex_t fftw_planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* per-channel analysis job, logs are buffered and merged in channel order */
+struct analyze_job {
+	struct bat bat;			/* private copy with job log streams */
+	int channel;
+	int err;
+	char *log_buf;
+	size_t log_size;
+	char *err_buf;
+	size_t err_size;
+};
+
+struct analyze_pool {
+	struct analyze_job *jobs;
+	int njobs;
+	int next;			/* next job to be taken */
+	pthread_mutex_t lock;
+};
 
 static void check_amplitude(struct bat *bat, float *buf)
 {
@@ -175,6 +200,10 @@ static void calc_magnitude(struct bat *bat, struct analyze *a, int N)
 	a->mag[0] = 0.0;
 }
 
+/**
+ * The caller provides a->in to receive the converted samples, which are
+ * preserved by the FFT and can be reused by the noise analysis
+ */
 static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
 		int channel)
 {
@@ -182,25 +211,23 @@ static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
 	int err = -ENOMEM, N = bat->frames;
 
 	/* Allocate FFT buffers */
-	a->in = (float *) fftwf_malloc(sizeof(float) * bat->frames);
-	if (a->in == NULL)
-		goto out1;
-
 	a->out = (float *) fftwf_malloc(sizeof(float) * bat->frames);
 	if (a->out == NULL)
-		goto out2;
+		goto out1;
 
 	a->mag = (float *) fftwf_malloc(sizeof(float) * bat->frames);
 	if (a->mag == NULL)
-		goto out3;
+		goto out2;
 
-	/* create FFT plan */
+	/* create FFT plan, wisdom makes plans after the first one cheap */
+	pthread_mutex_lock(&fftw_planner_lock);
 	p = fftwf_plan_r2r_1d(N, a->in, a->out, FFTW_R2HC,
 			FFTW_MEASURE | FFTW_PRESERVE_INPUT);
+	pthread_mutex_unlock(&fftw_planner_lock);
 	if (p == NULL)
-		goto out4;
+		goto out3;
 
-	/* convert source PCM to floats */
+	/* convert source PCM to floats, planning may have clobbered a->in */
 	bat->convert_sample_to_float(a->buf, a->in, bat->frames);
 
 	/* check amplitude */
@@ -215,74 +242,96 @@ static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
 	/* check data */
 	err = check(bat, a, channel);
 
+	pthread_mutex_lock(&fftw_planner_lock);
 	fftwf_destroy_plan(p);
+	pthread_mutex_unlock(&fftw_planner_lock);
 
-out4:
-	fftwf_free(a->mag);
 out3:
-	fftwf_free(a->out);
+	fftwf_free(a->mag);
 out2:
-	fftwf_free(a->in);
+	fftwf_free(a->out);
 out1:
 	return err;
 }
 
+/* find i where src[i] >= 0 && src[i+1] < 0 in [start, end) */
+static int find_zero_crossing(float *src, int start, int end)
+{
+	int i;
+
+	for (i = start; i < end; i++)
+		if (src[i] >= 0.0 && src[i + 1] < 0.0)
+			return i;
+
+	return -1;
+}
+
 static int calculate_noise_one_period(struct bat *bat,
 		struct noise_analyzer *na, float *src,
 		int length, int channel)
 {
-	int i, shift = 0;
-	float tmp, rms, gain, residual;
-	float a = 0.0, b = 1.0;
+	int i, k, shift = -1;
+	float s, a, b;
+	double ss[4] = {0.0}, ts[4] = {0.0};
+	double sum_ss, sum_ts, gain, residual;
 
 	/* step 1. phase compensation */
 
 	if (length < 2 * na->nsamples)
 		return -EINVAL;
 
-	/* search for the beginning of a sine period */
-	for (i = 0, tmp = 0.0, shift = -1; i < na->nsamples; i++) {
-		/* find i where src[i] >= 0 && src[i+1] < 0 */
-		if (src[i] < 0.0)
-			continue;
-		if (src[i + 1] < 0.0) {
-			tmp = src[i] - src[i + 1];
-			a = src[i] / tmp;
-			b = -src[i + 1] / tmp;
-			shift = i;
-			break;
-		}
-	}
+	/* Consecutive periods start at nearly the same offset, as sections
+	 * slide by the ceiled period. Look around the previous start first,
+	 * and search the whole period only if the track is lost. */
+	if (na->shift >= 0)
+		shift = find_zero_crossing(src,
+				na->shift > 2 ? na->shift - 2 : 0,
+				na->shift + 2 < na->nsamples ?
+				na->shift + 2 : na->nsamples);
+	if (shift == -1)
+		shift = find_zero_crossing(src, 0, na->nsamples);
+	na->shift = shift;
 
 	/* didn't find the beginning of a sine period */
 	if (shift == -1)
 		return -EINVAL;
 
-	/* shift sine waveform to source[0] = 0.0 */
-	for (i = 0; i < na->nsamples; i++)
-		na->source[i] = a * src[i + shift + 1] + b * src[i + shift];
-
-	/* step 2. gain compensation */
-
-	/* calculate rms of signal amplitude */
-	for (i = 0, tmp = 0.0; i < na->nsamples; i++)
-		tmp += na->source[i] * na->source[i];
-	rms = sqrtf(tmp / na->nsamples);
-
-	gain = na->rms_tgt / rms;
+	s = src[shift] - src[shift + 1];
+	a = src[shift] / s;
+	b = -src[shift + 1] / s;
+
+	/* step 2. gain compensation and step 3. residual in a single pass:
+	 * with the shifted source s[i] and gain g = rms_tgt / rms(s),
+	 * sum((t[i] - g * s[i])^2) = sum(t^2) - 2g * sum(t*s) + g^2 * sum(s^2)
+	 * Sums are kept in double, the residual is tiny against them.
+	 * Four partial sums are kept so that the additions don't wait on
+	 * each other, this pass is where the noise analysis spends its time. */
+	for (i = 0; i + 3 < na->nsamples; i += 4) {
+		for (k = 0; k < 4; k++) {
+			s = a * src[i + k + shift + 1] + b * src[i + k + shift];
+			ss[k] += (double) s * s;
+			ts[k] += (double) na->target[i + k] * s;
+		}
+	}
+	for (; i < na->nsamples; i++) {
+		s = a * src[i + shift + 1] + b * src[i + shift];
+		ss[0] += (double) s * s;
+		ts[0] += (double) na->target[i] * s;
+	}
+	sum_ss = (ss[0] + ss[1]) + (ss[2] + ss[3]);
+	sum_ts = (ts[0] + ts[1]) + (ts[2] + ts[3]);
 
-	for (i = 0; i < na->nsamples; i++)
-		na->source[i] *= gain;
+	gain = na->rms_tgt / sqrt(sum_ss / na->nsamples);
+	residual = na->energy_tgt - 2.0 * gain * sum_ts
+			+ gain * gain * sum_ss;
 
-	/* step 3. calculate snr in dB */
+	/* step 4. calculate noise in percentage, it is compared with the
+	 * threshold without converting to dB for every period */
 
-	for (i = 0, tmp = 0.0, residual = 0.0; i < na->nsamples; i++) {
-		tmp = fabsf(na->target[i] - na->source[i]);
-		residual += tmp * tmp;
-	}
-
-	tmp = na->rms_tgt / sqrtf(residual / na->nsamples);
-	na->snr_db = 20.0 * log10f(tmp);
+	na->noise_pc = 100.0 * sqrt(residual > 0.0 ? residual / na->nsamples
+			: 0.0) / na->rms_tgt;
+	if (na->noise_pc < NOISE_PC_MIN)
+		na->noise_pc = NOISE_PC_MIN;
 
 	return 0;
 }
@@ -292,7 +341,8 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 	int err = 0;
 	struct noise_analyzer na;
 	float freq = bat->target_freq[channel];
-	float tmp, sum_snr_pc, avg_snr_pc, avg_snr_db;
+	float sum_snr_pc, avg_snr_pc, avg_snr_db;
+	float thd_pc = 100.0 / powf(10.0, bat->snr_thd_db / 20.0);
 	int offset, i, cnt_noise, cnt_clean;
 	/* num of samples in each sine period */
 	int nsamples = (int) ceilf(bat->rate / freq);
@@ -304,16 +354,10 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 
 	fprintf(bat->log, _("samples per period: %d\n"), nsamples);
 	fprintf(bat->log, _("total sections to detect: %d\n"), nsection);
-	na.source = (float *)malloc(sizeof(float) * nsamples);
-	if (!na.source) {
-		err = -ENOMEM;
-		goto out1;
-	}
-
 	na.target = (float *)malloc(sizeof(float) * nsamples);
 	if (!na.target) {
 		err = -ENOMEM;
-		goto out2;
+		goto out1;
 	}
 
 	/* generate standard single-tone signal */
@@ -322,26 +366,25 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 		goto out3;
 
 	na.nsamples = nsamples;
+	na.shift = -1;
 
 	/* calculate rms of standard signal */
-	for (i = 0, tmp = 0.0; i < nsamples; i++)
-		tmp += na.target[i] * na.target[i];
-	na.rms_tgt = sqrtf(tmp / nsamples);
+	for (i = 0, na.energy_tgt = 0.0; i < nsamples; i++)
+		na.energy_tgt += (double) na.target[i] * na.target[i];
+	na.rms_tgt = sqrt(na.energy_tgt / nsamples);
 
 	/* calculate average noise level */
 	sum_snr_pc = 0.0;
 	cnt_clean = cnt_noise = 0;
 	for (i = 1, offset = nsamples; i < nsection; i++) {
-		na.snr_db = SNR_DB_INVALID;
-
 		err = calculate_noise_one_period(bat, &na, src + offset,
 				nsamples_per_section, channel);
 		if (err < 0)
 			goto out3;
 
-		if (na.snr_db > bat->snr_thd_db) {
+		if (na.noise_pc < thd_pc) {
 			cnt_clean++;
-			sum_snr_pc += 100.0 / powf(10.0, na.snr_db / 20.0);
+			sum_snr_pc += na.noise_pc;
 		} else {
 			cnt_noise++;
 		}
@@ -365,31 +408,10 @@ static int calculate_noise(struct bat *bat, float *src, int channel)
 
 out3:
 	free(na.target);
-out2:
-	free(na.source);
 out1:
 	return err;
 }
 
-static int find_and_check_noise(struct bat *bat, void *buf, int channel)
-{
-	int err = 0;
-	float *source;
-
-	source = (float *)malloc(sizeof(float) * bat->frames);
-	if (!source)
-		return -ENOMEM;
-
-	/* convert source PCM to floats */
-	bat->convert_sample_to_float(buf, source, bat->frames);
-
-	/* adjust waveform and calculate noise */
-	err = calculate_noise(bat, source, channel);
-
-	free(source);
-	return err;
-}
-
 /**
  * Convert interleaved samples from channels in samples from a single channel
  */
@@ -435,12 +457,190 @@ static int truncate_frames(struct bat *bat)
 	return -EINVAL;
 }
 
+/* run the whole analysis pipeline for one channel */
+static int analyze_channel(struct bat *bat, int c)
+{
+	int err = 0;
+	struct analyze a;
+
+	fprintf(bat->log, _("\nChannel %i - "), c + 1);
+	fprintf(bat->log, _("Checking for target frequency %2.2f Hz\n"),
+			bat->target_freq[c]);
+	a.buf = bat->buf +
+			c * bat->frames * bat->frame_size
+			/ bat->channels;
+
+	/* samples are converted once and shared by both analyses */
+	a.in = (float *) fftwf_malloc(sizeof(float) * bat->frames);
+	if (a.in == NULL)
+		return -ENOMEM;
+
+	if (!bat->standalone) {
+		err = find_and_check_harmonics(bat, &a, c);
+		if (err != 0)
+			goto out;
+	} else {
+		bat->convert_sample_to_float(a.buf, a.in, bat->frames);
+	}
+
+	if (snr_is_valid(bat->snr_thd_db)) {
+		fprintf(bat->log, _("\nChecking for SNR: "));
+		fprintf(bat->log, _("Threshold is %.2f dB (%.2f%%)\n"),
+				bat->snr_thd_db, 100.0
+				/ powf(10.0, bat->snr_thd_db / 20.0));
+		/* adjust waveform and calculate noise */
+		err = calculate_noise(bat, a.in, c);
+	}
+
+out:
+	fftwf_free(a.in);
+	return err;
+}
+
+static void *analyze_worker(void *data)
+{
+	struct analyze_pool *pool = data;
+	struct analyze_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->next >= pool->njobs) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		job->err = analyze_channel(&job->bat, job->channel);
+
+		/* closing a memstream finalizes its buffer */
+		if (job->bat.err != job->bat.log)
+			fclose(job->bat.err);
+		fclose(job->bat.log);
+	}
+
+	return NULL;
+}
+
+/* number of analysis threads, 0 selects the number of online cpus */
+static int get_analysis_jobs(struct bat *bat)
+{
+	long n = bat->jobs;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > bat->channels)
+		n = bat->channels;
+
+	return n < 1 ? 1 : n;
+}
+
+static int init_analyze_job(struct bat *bat, struct analyze_job *job, int c)
+{
+	memset(job, 0, sizeof(*job));
+	job->bat = *bat;
+	job->channel = c;
+
+	job->bat.log = open_memstream(&job->log_buf, &job->log_size);
+	if (job->bat.log == NULL)
+		return -errno;
+
+	if (bat->err == bat->log) {
+		job->bat.err = job->bat.log;
+	} else {
+		job->bat.err = open_memstream(&job->err_buf, &job->err_size);
+		if (job->bat.err == NULL) {
+			fclose(job->bat.log);
+			free(job->log_buf);
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Analyze channels concurrently on a pool of worker threads. The output of
+ * each channel is replayed in channel order up to the first failing one, so
+ * logs and return value are the same as for the serial analysis.
+ */
+static int analyze_channels_parallel(struct bat *bat, int nthreads)
+{
+	struct analyze_pool pool;
+	pthread_t *threads;
+	int c, i, err = 0;
+
+	pool.jobs = calloc(bat->channels, sizeof(*pool.jobs));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (pool.jobs == NULL || threads == NULL) {
+		err = -ENOMEM;
+		goto out1;
+	}
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	for (pool.njobs = 0; pool.njobs < bat->channels; pool.njobs++) {
+		err = init_analyze_job(bat, &pool.jobs[pool.njobs],
+				pool.njobs);
+		if (err < 0) {
+			fprintf(bat->err, _("Cannot allocate log stream: %d\n"),
+					err);
+			goto out2;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		err = pthread_create(&threads[i], NULL, analyze_worker, &pool);
+		if (err != 0) {
+			fprintf(bat->err, _("Cannot create analysis thread: %d\n"),
+					err);
+			err = -err;
+			break;
+		}
+	}
+	/* fall back to the calling thread if no worker could be started */
+	if (i == 0)
+		analyze_worker(&pool);
+	err = 0;
+	while (i > 0)
+		pthread_join(threads[--i], NULL);
+
+	for (c = 0; c < bat->channels; c++) {
+		struct analyze_job *job = &pool.jobs[c];
+
+		fwrite(job->log_buf, 1, job->log_size, bat->log);
+		if (job->err_buf)
+			fwrite(job->err_buf, 1, job->err_size, bat->err);
+		if (job->err != 0) {
+			err = job->err;
+			break;
+		}
+	}
+
+out2:
+	/* release streams of jobs which never ran */
+	for (c = pool.next; c < pool.njobs; c++) {
+		if (pool.jobs[c].bat.err != pool.jobs[c].bat.log)
+			fclose(pool.jobs[c].bat.err);
+		fclose(pool.jobs[c].bat.log);
+	}
+	for (c = 0; c < pool.njobs; c++) {
+		free(pool.jobs[c].log_buf);
+		free(pool.jobs[c].err_buf);
+	}
+	pthread_mutex_destroy(&pool.lock);
+out1:
+	free(threads);
+	free(pool.jobs);
+
+	return err;
+}
+
 int analyze_capture(struct bat *bat)
 {
 	int err = 0;
 	size_t items;
-	int c;
-	struct analyze a;
+	int c, nthreads;
 
 	err = truncate_frames(bat);
 	if (err < 0) {
@@ -477,32 +677,24 @@ int analyze_capture(struct bat *bat)
 		goto exit2;
 	}
 
+	err = impair_apply(bat, bat->buf, bat->frames);
+	if (err != 0)
+		goto exit2;
+
 	err = reorder_data(bat);
 	if (err != 0)
 		goto exit2;
 
-	for (c = 0; c < bat->channels; c++) {
-		fprintf(bat->log, _("\nChannel %i - "), c + 1);
-		fprintf(bat->log, _("Checking for target frequency %2.2f Hz\n"),
-				bat->target_freq[c]);
-		a.buf = bat->buf +
-				c * bat->frames * bat->frame_size
-				/ bat->channels;
-		if (!bat->standalone) {
-			err = find_and_check_harmonics(bat, &a, c);
-			if (err != 0)
-				goto exit2;
-		}
+	nthreads = get_analysis_jobs(bat);
+	if (nthreads > 1) {
+		err = analyze_channels_parallel(bat, nthreads);
+		goto exit2;
+	}
 
-		if (snr_is_valid(bat->snr_thd_db)) {
-			fprintf(bat->log, _("\nChecking for SNR: "));
-			fprintf(bat->log, _("Threshold is %.2f dB (%.2f%%)\n"),
-					bat->snr_thd_db, 100.0
-					/ powf(10.0, bat->snr_thd_db / 20.0));
-			err = find_and_check_noise(bat, a.buf, c);
-			if (err != 0)
-				goto exit2;
-		}
+	for (c = 0; c < bat->channels; c++) {
+		err = analyze_channel(bat, c);
+		if (err != 0)
+			goto exit2;
 	}
 
 exit2:
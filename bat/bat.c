@@ -40,8 +40,10 @@
 #include "convert.h"
 #ifdef HAVE_LIBFFTW3F
 #include "analyze.h"
+#include "stream.h"
 #endif
 #include "latencytest.h"
+#include "impair.h"
 
 /* get snr threshold in dB */
 static void get_snr_thd_db(struct bat *bat, char *thd)
@@ -81,6 +83,8 @@ static int get_duration(struct bat *bat)
 	float duration_f;
 	long duration_i;
 	char *ptrf, *ptri;
+	/* nothing is stored in streaming mode, allow long soak tests */
+	int max_frames = bat->stream_window ? MAX_STREAM_FRAMES : MAX_FRAMES;
 
 	duration_f = strtof(bat->narg, &ptrf);
 	err = -errno;
@@ -99,9 +103,9 @@ static int get_duration(struct bat *bat)
 	else
 		bat->frames = -1;
 
-	if (bat->frames <= 0 || bat->frames > MAX_FRAMES) {
+	if (bat->frames <= 0 || bat->frames > max_frames) {
 		fprintf(bat->err, _("Invalid duration. Range: (0, %d(%fs))\n"),
-				MAX_FRAMES, (float)MAX_FRAMES / bat->rate);
+				max_frames, (float)max_frames / bat->rate);
 		return -EINVAL;
 	}
 
@@ -113,18 +117,24 @@ err_exit:
 	return err;
 }
 
+/* get colon separated list of frequencies, the last one fills the rest */
 static void get_sine_frequencies(struct bat *bat, char *freq)
 {
 	char *tmp1;
-
-	tmp1 = strchr(freq, ':');
-	if (tmp1 == NULL) {
-		bat->target_freq[1] = bat->target_freq[0] = atof(optarg);
-	} else {
-		*tmp1 = '\0';
-		bat->target_freq[0] = atof(optarg);
-		bat->target_freq[1] = atof(tmp1 + 1);
+	int c = 0;
+
+	while (1) {
+		tmp1 = strchr(freq, ':');
+		if (tmp1 != NULL)
+			*tmp1 = '\0';
+		bat->target_freq[c++] = atof(freq);
+		if (tmp1 == NULL || c == MAX_CHANNELS)
+			break;
+		freq = tmp1 + 1;
 	}
+
+	for (; c < MAX_CHANNELS; c++)
+		bat->target_freq[c] = bat->target_freq[c - 1];
 }
 
 static void get_format(struct bat *bat, char *optarg)
@@ -336,8 +346,16 @@ _("Usage: alsabat [-options]...\n"
 "      --local            internal loop, set to bypass pcm hardware devices\n"
 "      --standalone       standalone mode, to bypass analysis\n"
 "      --roundtriplatency round trip latency mode\n"
+"      --latency-xcorr[=#] path latency between playback and capture\n"
+"                         buffers, measured # times (default 20) by\n"
+"                         cross-correlation of a chirp\n"
 "      --snr-db=#         noise detect threshold, in SNR(dB)\n"
 "      --snr-pc=#         noise detect threshold, in noise percentage(%%)\n"
+"      --jobs=#           number of analysis threads, 0 for one per cpu\n"
+"      --stream[=#]       streaming analysis of captured data with a window\n"
+"                         of # frames (power of 2, default 4096)\n"
+"      --impair=type[:#]  impair the captured signal before analysis, with\n"
+"                         drop[:ms], gain[:dB], noise[:SNR dB] or delay[:ms]\n"
 ));
 	fprintf(bat->log, _("Recognized sample formats are: "));
 	fprintf(bat->log, _("U8 S16_LE S24_3LE S32_LE\n"));
@@ -348,6 +366,8 @@ _("Usage: alsabat [-options]...\n"
 
 static void set_defaults(struct bat *bat)
 {
+	int i;
+
 	memset(bat, 0, sizeof(struct bat));
 
 	/* Set default values */
@@ -358,8 +378,8 @@ static void set_defaults(struct bat *bat)
 	bat->convert_float_to_sample = convert_float_to_int16;
 	bat->convert_sample_to_float = convert_int16_to_float;
 	bat->frames = bat->rate * 2;
-	bat->target_freq[0] = 997.0;
-	bat->target_freq[1] = 997.0;
+	for (i = 0; i < MAX_CHANNELS; i++)
+		bat->target_freq[i] = 997.0;
 	bat->sigma_k = 3.0;
 	bat->snr_thd_db = SNR_DB_INVALID;
 	bat->playback.device = NULL;
@@ -369,6 +389,7 @@ static void set_defaults(struct bat *bat)
 	bat->buffer_size = 0;
 	bat->period_size = 0;
 	bat->roundtriplatency = false;
+	bat->jobs = 0;
 #ifdef HAVE_LIBTINYALSA
 	bat->channels = 2;
 	bat->playback.fct = &playback_tinyalsa;
@@ -400,6 +421,10 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		{"snr-db",   1, 0, OPT_SNRTHD_DB},
 		{"snr-pc",   1, 0, OPT_SNRTHD_PC},
 		{"readcapture", 1, 0, OPT_READCAPTURE},
+		{"jobs",     1, 0, OPT_JOBS},
+		{"stream",   2, 0, OPT_STREAM},
+		{"latency-xcorr", 2, 0, OPT_LATENCY_XCORR},
+		{"impair",   1, 0, OPT_IMPAIR},
 		{0, 0, 0, 0}
 	};
 
@@ -429,12 +454,31 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		case OPT_ROUNDTRIPLATENCY:
 			bat->roundtriplatency = true;
 			break;
+		case OPT_LATENCY_XCORR:
+			bat->roundtriplatency = true;
+			bat->latency.xcorr_number = optarg ? atoi(optarg)
+					: LATENCY_XCORR_NUMBER;
+			if (bat->latency.xcorr_number <= 0)
+				bat->latency.xcorr_number = -1;
+			break;
 		case OPT_SNRTHD_DB:
 			get_snr_thd_db(bat, optarg);
 			break;
 		case OPT_SNRTHD_PC:
 			get_snr_thd_pc(bat, optarg);
 			break;
+		case OPT_JOBS:
+			err = atoi(optarg);
+			bat->jobs = err >= 0 ? err : 0;
+			break;
+		case OPT_IMPAIR:
+			if (impair_parse(bat, optarg) < 0)
+				exit(EXIT_FAILURE);
+			break;
+		case OPT_STREAM:
+			bat->stream_window = optarg ? atoi(optarg)
+					: STREAM_WINDOW_DEFAULT;
+			break;
 		case 'D':
 			if (bat->playback.device == NULL)
 				bat->playback.device = optarg;
@@ -520,6 +564,50 @@ static int validate_options(struct bat *bat)
 		return -EINVAL;
 	}
 
+	/* check number of cross-correlation latency measurements */
+	if (bat->latency.xcorr_number < 0
+			|| bat->latency.xcorr_number > LATENCY_XCORR_MAX_NUMBER) {
+		fprintf(bat->err, _("Invalid latency measurement number: "));
+		fprintf(bat->err, _("must be 1 to %d\n"),
+				LATENCY_XCORR_MAX_NUMBER);
+		return -EINVAL;
+	}
+#ifndef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr_number) {
+		fprintf(bat->err, _("No libfftw3 library for latency"));
+		fprintf(bat->err, _(" cross-correlation\n"));
+		return -EINVAL;
+	}
+#endif
+
+	if (bat->impair.type != IMPAIR_NONE && bat->roundtriplatency) {
+		fprintf(bat->err, _("impairments are not supported"));
+		fprintf(bat->err, _(" in latency test\n"));
+		return -EINVAL;
+	}
+
+	/* check streaming window is a supported power of 2 */
+	if (bat->stream_window) {
+#ifdef HAVE_LIBFFTW3F
+		if (bat->stream_window < (1 << SHIFT_MIN)
+				|| bat->stream_window > (1 << STREAM_SHIFT_MAX)
+				|| (bat->stream_window
+					& (bat->stream_window - 1))) {
+			fprintf(bat->err, _("Invalid stream window: %d\n"),
+					bat->stream_window);
+			return -EINVAL;
+		}
+		if (bat->roundtriplatency) {
+			fprintf(bat->err, _("streaming analysis is not"));
+			fprintf(bat->err, _(" supported in latency test\n"));
+			return -EINVAL;
+		}
+#else
+		fprintf(bat->err, _("No libfftw3 library for streaming\n"));
+		return -EINVAL;
+#endif
+	}
+
 	/* check sine wave frequency range */
 	freq_low = DC_THRESHOLD;
 	freq_high = bat->rate * RATE_FACTOR;
@@ -679,8 +767,11 @@ int main(int argc, char *argv[])
 		while (1) {
 			fprintf(bat.log,
 				_("\nStart round trip latency\n"));
-			roundtrip_latency_init(&bat);
+			err = roundtrip_latency_init(&bat);
+			if (err < 0)
+				goto out;
 			test_loopback(&bat);
+			roundtrip_latency_exit(&bat);
 
 			if (bat.latency.xrun_error == false)
 				break;
@@ -709,6 +800,19 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	err = impair_init(&bat);
+	if (err < 0)
+		goto out;
+
+#ifdef HAVE_LIBFFTW3F
+	/* captured data is analyzed by the capture thread as it arrives */
+	if (bat.stream_window) {
+		err = stream_analyzer_init(&bat);
+		if (err < 0)
+			goto out;
+	}
+#endif
+
 	/* single line capture thread: capture only, no playback */
 	if (bat.capture.mode == MODE_SINGLE) {
 		test_capture(&bat);
@@ -730,12 +834,21 @@ int main(int argc, char *argv[])
 
 analyze:
 #ifdef HAVE_LIBFFTW3F
-	if (!bat.standalone || snr_is_valid(bat.snr_thd_db))
+	if (bat.stream_window) {
+		if (bat.local || bat.capture.mode == MODE_ANALYZE_ONLY)
+			err = stream_analyze_file(&bat);
+		if (err == 0)
+			err = stream_analyzer_finish(&bat);
+	} else if (!bat.standalone || snr_is_valid(bat.snr_thd_db))
 		err = analyze_capture(&bat);
 #else
 	fprintf(bat.log, _("No libfftw3 library. Exit without analysis.\n"));
 #endif
 out:
+#ifdef HAVE_LIBFFTW3F
+	stream_analyzer_exit(&bat);
+#endif
+	impair_exit(&bat);
 	fprintf(bat.log, _("\nReturn value is %d\n"), err);
 
 	if (bat.logarg)
@@ -31,6 +31,10 @@
 #define OPT_SNRTHD_DB			(OPT_BASE + 7)
 #define OPT_SNRTHD_PC			(OPT_BASE + 8)
 #define OPT_READCAPTURE			(OPT_BASE + 9)
+#define OPT_JOBS			(OPT_BASE + 10)
+#define OPT_STREAM			(OPT_BASE + 11)
+#define OPT_LATENCY_XCORR		(OPT_BASE + 12)
+#define OPT_IMPAIR			(OPT_BASE + 13)
 
 #define COMPOSE(a, b, c, d)		((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define WAV_RIFF			COMPOSE('R', 'I', 'F', 'F')
@@ -39,7 +43,7 @@
 #define WAV_DATA			COMPOSE('d', 'a', 't', 'a')
 #define WAV_FORMAT_PCM			1	/* PCM WAVE file encoding */
 
-#define MAX_CHANNELS			2
+#define MAX_CHANNELS			32
 #define MIN_CHANNELS			1
 #define MAX_PEAKS			10
 #define MAX_FRAMES			(10 * 1024 * 1024)
@@ -64,12 +68,36 @@
 
 #define LATENCY_TEST_NUMBER			5
 #define LATENCY_TEST_TIME_LIMIT			25
+
+/* Cross-correlation latency test: a linear chirp with raised-cosine edges
+ * is played repeatedly, and found in the capture by correlation. */
+#define LATENCY_XCORR_NUMBER		20
+#define LATENCY_XCORR_MAX_NUMBER	10000
+#define LATENCY_CHIRP_MS		100
+#define LATENCY_CHIRP_FADE_MS		5
+#define LATENCY_CHIRP_F0		200.0
+#define LATENCY_CHIRP_F1		8000.0
+/* longest round trip latency that can be measured */
+#define LATENCY_XCORR_MAX_MS		500
+/* silence between two chirps */
+#define LATENCY_XCORR_GAP_MS		100
+/* minimum normalized correlation to accept a detection */
+#define LATENCY_XCORR_MIN_RHO		0.5
 #define DIV_BUFFERSIZE			2
 
+/* Impairments injected into the captured signal to test the analyzer,
+ * drop, gain and delay are applied at the middle of the signal. */
+#define IMPAIR_DROP_MS			20	/* signal replaced by silence */
+#define IMPAIR_GAIN_DB			-30.0	/* gain step, a level drop */
+#define IMPAIR_NOISE_SNR_DB		20.0	/* white noise added throughout */
+#define IMPAIR_DELAY_MS			20	/* signal interrupted and delayed */
+#define IMPAIR_MAX_MS			1000
+
 #define EBATBASE			1000
 #define ENOPEAK				(EBATBASE + 1)
 #define EONLYDC				(EBATBASE + 2)
 #define EBADPEAK			(EBATBASE + 3)
+#define ESTREAM				(EBATBASE + 4)
 
 #define DC_THRESHOLD			7.01
 
@@ -88,6 +116,24 @@
 #define SHIFT_MAX			(sizeof(int) * 8 - 2)
 #define SHIFT_MIN			8
 
+/* Window size of the streaming analysis is (1 << N) frames, with N in
+ * range [SHIFT_MIN, STREAM_SHIFT_MAX]. Windows overlap by half a window.
+ * As nothing is stored, the duration is only limited by the int frame
+ * counter: MAX_STREAM_FRAMES is about 6.2 hours at 48 kHz. */
+#define STREAM_SHIFT_MAX		16
+#define STREAM_WINDOW_DEFAULT		4096
+#define MAX_STREAM_FRAMES		(INT_MAX / 2)
+/* a channel is locked once a window has its peak on target above this SNR */
+#define STREAM_LOCK_SNR_DB		10.0
+/* window level below this ratio of the locked amplitude is a level drop */
+#define STREAM_DROPOUT_RATIO		0.1
+/* samples below this ratio of amplitude are quiet, a run of them longer
+ * than 1/8 sine period (at least STREAM_QUIET_MIN) is a dropout */
+#define STREAM_QUIET_RATIO		0.01
+#define STREAM_QUIET_MIN		4
+/* 2nd difference exceeding that of the sine by this ratio is a click */
+#define STREAM_CLICK_RATIO		0.1
+
 /* Define SNR range in dB.
  * if the noise is equal to signal, SNR = 0.0dB;
  * if the noise is zero, SNR is limited by RIFF wav data width:
@@ -99,6 +145,8 @@
 #define SNR_DB_INVALID			-1.0
 #define SNR_DB_MIN			0.0
 #define SNR_DB_MAX			200.0
+/* noise percentage at SNR_DB_MAX */
+#define NOISE_PC_MIN			1e-8
 
 static inline bool snr_is_valid(float db)
 {
@@ -143,6 +191,7 @@ struct wav_container {
 };
 
 struct bat;
+struct stream_analyzer;
 
 enum _bat_pcm_format {
 	BAT_PCM_FORMAT_UNKNOWN = -1,
@@ -179,6 +228,31 @@ struct pcm {
 };
 
 struct sin_generator;
+struct latency_xcorr;
+
+enum impair_type {
+	IMPAIR_NONE = 0,
+	IMPAIR_DROP,
+	IMPAIR_GAIN,
+	IMPAIR_NOISE,
+	IMPAIR_DELAY,
+};
+
+struct impairment {
+	enum impair_type type;
+	float value;			/* ms, dB or SNR in dB */
+
+	int start;			/* first impaired frame */
+	int frames;			/* frames seen so far */
+	float gain;
+	float noise;			/* peak of uniform noise */
+	unsigned int seed;
+	float *ring;			/* delay line of the delay impairment */
+	int ring_frames;
+	int ring_pos;
+	float *samples;			/* conversion buffer */
+	int samples_size;
+};
 
 struct sin_generator {
 	double state_real;
@@ -202,14 +276,17 @@ struct roundtrip_latency {
 	bool is_capturing;
 	bool is_playing;
 	bool xrun_error;
+	int xcorr_number;		/* measurements, 0 for threshold mode */
+	struct latency_xcorr *xcorr;	/* cross-correlation state */
 };
 
 struct noise_analyzer {
 	int nsamples;			/* number of sample */
-	float *source;			/* single-tone to be analyzed */
+	int shift;			/* start of last period, -1 if unknown */
 	float *target;			/* target single-tone as standard */
+	double energy_tgt;		/* sum of squares of target */
 	float rms_tgt;			/* rms of target single-tone */
-	float snr_db;			/* snr in dB */
+	float noise_pc;			/* noise in % of the target rms */
 };
 
 struct bat {
@@ -233,6 +310,10 @@ struct bat {
 	char *capturefile;		/* path name for previously saved recording */
 	bool standalone;		/* enable to bypass analysis */
 	bool roundtriplatency;		/* enable round trip latency */
+	int jobs;			/* analysis threads, 0 for auto */
+	int stream_window;		/* streaming window, 0 if disabled */
+	struct stream_analyzer *stream;	/* streaming analyzer state */
+	struct impairment impair;	/* impairment of captured signal */
 
 	struct pcm playback;
 	struct pcm capture;
@@ -19,96 +19,97 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+/*
+ * The converters are written as flat loops over restrict qualified
+ * pointers without branches, so that the compiler can vectorize them.
+ */
+
 void convert_uint8_to_float(void *buf, float *val, int samples)
 {
+	const uint8_t *restrict src = buf;
+	float *restrict dst = val;
 	int i;
 
 	for (i = 0; i < samples; i++)
-		val[i] = ((uint8_t *) buf)[i];
+		dst[i] = src[i];
 }
 
 void convert_int16_to_float(void *buf, float *val, int samples)
 {
+	const int16_t *restrict src = buf;
+	float *restrict dst = val;
 	int i;
 
 	for (i = 0; i < samples; i++)
-		val[i] = ((int16_t *) buf)[i];
+		dst[i] = src[i];
 }
 
 void convert_int24_to_float(void *buf, float *val, int samples)
 {
+	const uint8_t *restrict src = buf;
+	float *restrict dst = val;
 	int i;
-	int32_t tmp;
 
-	for (i = 0; i < samples; i++) {
-		tmp = ((uint8_t *) buf)[i * 3 + 2] << 24;
-		tmp |= ((uint8_t *) buf)[i * 3 + 1] << 16;
-		tmp |= ((uint8_t *) buf)[i * 3] << 8;
-		tmp >>= 8;
-		val[i] = tmp;
-	}
+	/* place the 3 bytes at the top and shift back to sign extend */
+	for (i = 0; i < samples; i++)
+		dst[i] = (int32_t) (((uint32_t) src[i * 3] << 8)
+				| ((uint32_t) src[i * 3 + 1] << 16)
+				| ((uint32_t) src[i * 3 + 2] << 24)) >> 8;
 }
 
 void convert_int32_to_float(void *buf, float *val, int samples)
 {
+	const int32_t *restrict src = buf;
+	float *restrict dst = val;
 	int i;
 
 	for (i = 0; i < samples; i++)
-		val[i] = ((int32_t *) buf)[i];
+		dst[i] = src[i];
 }
 
+/* interleaved samples are converted alike, so channels are flattened */
+
 void convert_float_to_uint8(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	const float *restrict src = val;
+	uint8_t *restrict dst = buf;
+	int i, n = samples * channels;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((uint8_t *) buf)[idx] = (uint8_t) val[idx];
-		}
-	}
+	for (i = 0; i < n; i++)
+		dst[i] = (uint8_t) src[i];
 }
 
 void convert_float_to_int16(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	const float *restrict src = val;
+	int16_t *restrict dst = buf;
+	int i, n = samples * channels;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((int16_t *) buf)[idx] = (int16_t) val[idx];
-		}
-	}
+	for (i = 0; i < n; i++)
+		dst[i] = (int16_t) src[i];
 }
 
 void convert_float_to_int24(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx_f, idx_i;
-	int32_t val_f_i;
-
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx_f = i * channels + c;
-			idx_i = 3 * idx_f;
-			val_f_i = (int32_t) val[idx_f];
-			((int8_t *) buf)[idx_i + 0] =
-				(int8_t) (val_f_i & 0xff);
-			((int8_t *) buf)[idx_i + 1] =
-				(int8_t) ((val_f_i >> 8) & 0xff);
-			((int8_t *) buf)[idx_i + 2] =
-				(int8_t) ((val_f_i >> 16) & 0xff);
-		}
+	const float *restrict src = val;
+	uint8_t *restrict dst = buf;
+	int i, n = samples * channels;
+	int32_t tmp;
+
+	for (i = 0; i < n; i++) {
+		tmp = (int32_t) src[i];
+		dst[i * 3 + 0] = (uint8_t) (tmp & 0xff);
+		dst[i * 3 + 1] = (uint8_t) ((tmp >> 8) & 0xff);
+		dst[i * 3 + 2] = (uint8_t) ((tmp >> 16) & 0xff);
 	}
 }
 
 void convert_float_to_int32(float *val, void *buf, int samples, int channels)
 {
-	int i, c, idx;
+	const float *restrict src = val;
+	int32_t *restrict dst = buf;
+	int i, n = samples * channels;
 
-	for (i = 0; i < samples; i++) {
-		for (c = 0; c < channels; c++) {
-			idx = i * channels + c;
-			((int32_t *) buf)[idx] = (int32_t) val[idx];
-		}
-	}
+	for (i = 0; i < n; i++)
+		dst[i] = (int32_t) src[i];
 }
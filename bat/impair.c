@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2013-2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include "aconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <errno.h>
+
+#include "gettext.h"
+
+#include "common.h"
+#include "impair.h"
+
+/*
+ * Impairments are injected into the captured signal before it is analyzed,
+ * so that test suites can check that the analyzer detects them:
+ *   drop[:ms]    the signal is replaced by silence
+ *   gain[:dB]    the signal level steps by the gain
+ *   noise[:dB]   white noise is added at the given SNR
+ *   delay[:ms]   the signal is interrupted and continues late
+ * All but noise are applied at the middle of the analyzed signal.
+ */
+
+static const struct {
+	const char *name;
+	enum impair_type type;
+	float value;
+} impair_table[] = {
+	{"drop",  IMPAIR_DROP,  IMPAIR_DROP_MS},
+	{"gain",  IMPAIR_GAIN,  IMPAIR_GAIN_DB},
+	{"noise", IMPAIR_NOISE, IMPAIR_NOISE_SNR_DB},
+	{"delay", IMPAIR_DELAY, IMPAIR_DELAY_MS},
+};
+
+#define IMPAIR_TABLE_SIZE	(sizeof(impair_table) / sizeof(impair_table[0]))
+
+int impair_parse(struct bat *bat, char *arg)
+{
+	struct impairment *imp = &bat->impair;
+	char *value, *end;
+	unsigned int i;
+
+	value = strchr(arg, ':');
+	if (value != NULL)
+		*value++ = '\0';
+
+	for (i = 0; i < IMPAIR_TABLE_SIZE; i++) {
+		if (strcmp(arg, impair_table[i].name) == 0)
+			break;
+	}
+	if (i == IMPAIR_TABLE_SIZE) {
+		fprintf(bat->err, _("Invalid impairment: %s\n"), arg);
+		return -EINVAL;
+	}
+
+	imp->type = impair_table[i].type;
+	imp->value = impair_table[i].value;
+	if (value == NULL)
+		return 0;
+
+	imp->value = strtof(value, &end);
+	if (*end != '\0' || end == value) {
+		fprintf(bat->err, _("Invalid impairment value: %s\n"), value);
+		return -EINVAL;
+	}
+
+	if ((imp->type == IMPAIR_DROP || imp->type == IMPAIR_DELAY)
+			&& (imp->value <= 0 || imp->value > IMPAIR_MAX_MS)) {
+		fprintf(bat->err, _("Invalid impairment duration: %s ms\n"),
+				value);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int impair_init(struct bat *bat)
+{
+	struct impairment *imp = &bat->impair;
+	/* peak of the generated sine wave */
+	float peak = ((1 << ((bat->sample_size << 3) - 1)) - 1)
+			* RANGE_FACTOR;
+
+	imp->frames = 0;
+	imp->start = bat->frames / 2;
+	imp->seed = 1;
+
+	switch (imp->type) {
+	case IMPAIR_NONE:
+		return 0;
+	case IMPAIR_DROP:
+		fprintf(bat->log, _("Impairment: %.1f ms drop"), imp->value);
+		break;
+	case IMPAIR_GAIN:
+		imp->gain = powf(10.0, imp->value / 20.0);
+		fprintf(bat->log, _("Impairment: %.1f dB gain"), imp->value);
+		break;
+	case IMPAIR_NOISE:
+		/* uniform noise of rms peak / sqrt(2) / 10^(snr / 20) */
+		imp->noise = peak * sqrtf(1.5) * powf(10.0, -imp->value / 20.0);
+		imp->start = 0;
+		fprintf(bat->log, _("Impairment: noise at %.1f dB SNR"),
+				imp->value);
+		break;
+	case IMPAIR_DELAY:
+		imp->ring_frames = imp->value * bat->rate / 1000;
+		if (imp->ring_frames < 1)
+			imp->ring_frames = 1;
+		imp->ring_pos = 0;
+		imp->ring = calloc(imp->ring_frames * bat->channels,
+				sizeof(float));
+		if (imp->ring == NULL)
+			return -ENOMEM;
+		fprintf(bat->log, _("Impairment: %.1f ms delay"), imp->value);
+		break;
+	}
+	fprintf(bat->log, _(" from frame %d\n"), imp->start);
+
+	return 0;
+}
+
+void impair_exit(struct bat *bat)
+{
+	free(bat->impair.ring);
+	bat->impair.ring = NULL;
+	free(bat->impair.samples);
+	bat->impair.samples = NULL;
+	bat->impair.samples_size = 0;
+}
+
+static float impair_sample(struct bat *bat, int frame, int c, float x)
+{
+	struct impairment *imp = &bat->impair;
+	float *slot, y;
+
+	switch (imp->type) {
+	case IMPAIR_DROP:
+		if (frame < imp->start + imp->value * bat->rate / 1000)
+			return 0.0;
+		break;
+	case IMPAIR_GAIN:
+		return x * imp->gain;
+	case IMPAIR_NOISE:
+		return x + imp->noise
+			* (2.0 * rand_r(&imp->seed) / RAND_MAX - 1.0);
+	case IMPAIR_DELAY:
+		/* the delay line starts silent */
+		slot = &imp->ring[imp->ring_pos * bat->channels + c];
+		y = *slot;
+		*slot = x;
+		return y;
+	case IMPAIR_NONE:
+		break;
+	}
+
+	return x;
+}
+
+/**
+ * Apply the impairment in place to the next frames of the captured signal
+ */
+int impair_apply(struct bat *bat, void *buf, int frames)
+{
+	struct impairment *imp = &bat->impair;
+	int i, c, first, size = frames * bat->channels;
+	float *samples, offset, max, min, x;
+
+	if (imp->type == IMPAIR_NONE || imp->frames + frames <= imp->start) {
+		imp->frames += frames;
+		return 0;
+	}
+
+	if (size > imp->samples_size) {
+		samples = realloc(imp->samples, sizeof(float) * size);
+		if (samples == NULL)
+			return -ENOMEM;
+		imp->samples = samples;
+		imp->samples_size = size;
+	}
+
+	offset = bat->format == BAT_PCM_FORMAT_U8 ? 128.0 : 0.0;
+	/* the largest float below full scale truncates to the largest sample,
+	 * (float) INT32_MAX would round up out of range */
+	min = -ldexpf(1.0, (bat->sample_size << 3) - 1);
+	max = nextafterf(-min, 0.0);
+
+	bat->convert_sample_to_float(buf, imp->samples, size);
+
+	first = imp->start > imp->frames ? imp->start - imp->frames : 0;
+	samples = imp->samples + first * bat->channels;
+	for (i = first; i < frames; i++) {
+		for (c = 0; c < bat->channels; c++) {
+			x = impair_sample(bat, imp->frames + i, c,
+					*samples - offset);
+			if (x > max)
+				x = max;
+			else if (x < min)
+				x = min;
+			*samples++ = x + offset;
+		}
+		if (imp->ring)
+			imp->ring_pos = (imp->ring_pos + 1) % imp->ring_frames;
+	}
+
+	bat->convert_float_to_sample(imp->samples, buf, frames,
+			bat->channels);
+	imp->frames += frames;
+
+	return 0;
+}
@@ -20,6 +20,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBFFTW3F
+#include <fftw3.h>
+#endif
 
 #include "common.h"
 #include "bat-signal.h"
@@ -31,7 +37,63 @@
    - Begin playing a ~1000 Hz sine wave and start counting the samples elapsed.
    - Stop counting and playing if the input's loudness is higher than the
      threshold, as the output wave is probably coming back.
-   - Calculate the round trip audio latency value in milliseconds. */
+   - Calculate the round trip audio latency value in milliseconds.
+
+   The cross-correlation mode instead plays a chirp and stamps the time its
+   first frame leaves the playback buffer, from the driver timestamp and
+   playback delay at the time of writing. The captured frames are stamped
+   likewise with the time they entered the capture buffer. Once a window
+   is captured, it is correlated with the chirp by FFT. The correlation
+   peak, refined by parabolic interpolation, gives the arrival time with
+   sub-sample precision. As both buffers are accounted for, the result is
+   the path latency between them: converters, codec and the loop itself,
+   plus any delay the driver does not report. This is repeated and
+   statistics are reported at the end. */
+
+#ifdef HAVE_LIBFFTW3F
+enum xcorr_state {
+	XCORR_SETTLE,			/* wait before the next chirp */
+	XCORR_ARMED,			/* next played period starts a chirp */
+	XCORR_PLAYING,			/* chirp is played and captured */
+};
+
+struct latency_xcorr {
+	pthread_mutex_t lock;		/* protects state and emit_time */
+	enum xcorr_state state;
+	double emit_time;		/* time the chirp starts playing */
+
+	float *chirp;
+	int chirp_frames;
+	double chirp_energy;
+	int chirp_pos;			/* frames of chirp played */
+
+	float *capture;			/* captured frames since emit_time */
+	int capture_frames;
+	int capture_pos;
+	double capture_start;		/* time of capture[0] */
+	int max_lag;
+
+	int fft_size;			/* power of 2 >= capture_frames */
+	float *chirp_fft;		/* spectrum of the chirp */
+	float *spectrum;		/* spectrum of the capture */
+	float *corr;			/* correlation for each lag */
+	fftwf_plan forward;
+	fftwf_plan inverse;
+
+	int settle;			/* frames to wait in XCORR_SETTLE */
+	int waited;
+
+	float *results;			/* path latency in ms */
+	int count;
+
+	float scale;			/* full scale of sample format */
+	float offset;			/* DC offset of unsigned format */
+	float *out;			/* playback conversion buffer */
+	int out_size;
+	float *in;			/* capture conversion buffer */
+	int in_size;
+};
+#endif
 
 static float sumaudio(struct bat *bat, short int *buffer, int frames)
 {
@@ -168,8 +230,356 @@ static void calculate_threshold(struct bat *bat)
 						* 32767.0f);
 }
 
-void roundtrip_latency_init(struct bat *bat)
+#ifdef HAVE_LIBFFTW3F
+/* linear chirp from LATENCY_CHIRP_F0 to LATENCY_CHIRP_F1 */
+static void generate_chirp(struct bat *bat, struct latency_xcorr *x)
+{
+	int i, n = x->chirp_frames;
+	int fade = bat->rate * LATENCY_CHIRP_FADE_MS / 1000;
+	double f1 = LATENCY_CHIRP_F1, t, d = (double) n / bat->rate;
+	float v;
+
+	if (f1 > bat->rate * RATE_FACTOR)
+		f1 = bat->rate * RATE_FACTOR;
+
+	x->chirp_energy = 0.0;
+	for (i = 0; i < n; i++) {
+		t = (double) i / bat->rate;
+		v = sin(2.0 * M_PI * (LATENCY_CHIRP_F0 * t
+				+ (f1 - LATENCY_CHIRP_F0) * t * t / (2.0 * d)));
+		if (i < fade)
+			v *= 0.5 - 0.5 * cos(M_PI * i / fade);
+		else if (i >= n - fade)
+			v *= 0.5 - 0.5 * cos(M_PI * (n - 1 - i) / fade);
+		x->chirp[i] = v;
+		x->chirp_energy += (double) v * v;
+	}
+}
+
+static void xcorr_free(struct latency_xcorr *x)
+{
+	if (x->forward)
+		fftwf_destroy_plan(x->forward);
+	if (x->inverse)
+		fftwf_destroy_plan(x->inverse);
+	free(x->chirp);
+	fftwf_free(x->chirp_fft);
+	fftwf_free(x->capture);
+	fftwf_free(x->spectrum);
+	fftwf_free(x->corr);
+	free(x->results);
+	free(x->out);
+	free(x->in);
+	free(x);
+}
+
+static int xcorr_init(struct bat *bat)
+{
+	struct latency_xcorr *x;
+	int n;
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL)
+		return -ENOMEM;
+
+	x->chirp_frames = bat->rate * LATENCY_CHIRP_MS / 1000;
+	x->max_lag = bat->rate * LATENCY_XCORR_MAX_MS / 1000;
+	x->capture_frames = x->chirp_frames + x->max_lag;
+	/* no lag up to max_lag wraps around in the circular correlation */
+	for (x->fft_size = 1; x->fft_size < x->capture_frames; )
+		x->fft_size <<= 1;
+	n = x->fft_size;
+
+	x->chirp = malloc(sizeof(float) * x->chirp_frames);
+	x->chirp_fft = (float *) fftwf_malloc(sizeof(float) * n);
+	x->capture = (float *) fftwf_malloc(sizeof(float) * n);
+	x->spectrum = (float *) fftwf_malloc(sizeof(float) * n);
+	x->corr = (float *) fftwf_malloc(sizeof(float) * n);
+	x->results = malloc(sizeof(float) * bat->latency.xcorr_number);
+	if (x->chirp == NULL || x->chirp_fft == NULL || x->capture == NULL
+			|| x->spectrum == NULL || x->corr == NULL
+			|| x->results == NULL)
+		goto fail;
+
+	/* plan before filling, FFTW_MEASURE overwrites the arrays */
+	x->forward = fftwf_plan_r2r_1d(n, x->capture, x->spectrum,
+			FFTW_R2HC, FFTW_MEASURE);
+	x->inverse = fftwf_plan_r2r_1d(n, x->spectrum, x->corr,
+			FFTW_HC2R, FFTW_MEASURE);
+	if (x->forward == NULL || x->inverse == NULL)
+		goto fail;
+
+	generate_chirp(bat, x);
+
+	/* spectrum of the zero padded chirp */
+	memset(x->capture, 0, sizeof(float) * n);
+	memcpy(x->capture, x->chirp, sizeof(float) * x->chirp_frames);
+	fftwf_execute_r2r(x->forward, x->capture, x->chirp_fft);
+	memset(x->capture, 0, sizeof(float) * n);
+
+	x->scale = ((1 << ((bat->sample_size << 3) - 1)) - 1) * RANGE_FACTOR;
+	if (bat->format == BAT_PCM_FORMAT_U8)
+		x->offset = 128.0;
+
+	/* let the streams run for one second before the first chirp */
+	x->state = XCORR_SETTLE;
+	x->settle = bat->rate;
+	x->chirp_pos = x->chirp_frames;
+	pthread_mutex_init(&x->lock, NULL);
+
+	bat->latency.xcorr = x;
+
+	return 0;
+
+fail:
+	xcorr_free(x);
+	return -ENOMEM;
+}
+
+static float *get_buffer(float **buf, int *size, int samples)
+{
+	float *tmp;
+
+	if (samples > *size) {
+		tmp = realloc(*buf, sizeof(float) * samples);
+		if (tmp == NULL)
+			return NULL;
+		*buf = tmp;
+		*size = samples;
+	}
+
+	return *buf;
+}
+
+static int compare_float(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+static void xcorr_report(struct bat *bat, struct latency_xcorr *x)
+{
+	float *sorted = x->results;
+	double sum = 0.0, var = 0.0, mean;
+	int i, n = x->count, p99;
+
+	qsort(sorted, n, sizeof(float), compare_float);
+
+	for (i = 0; i < n; i++)
+		sum += sorted[i];
+	mean = sum / n;
+	for (i = 0; i < n; i++)
+		var += (sorted[i] - mean) * (sorted[i] - mean);
+
+	/* nearest rank */
+	p99 = (int) ceil(0.99 * n) - 1;
+
+	fprintf(bat->log, _("Path latency of %d measurements:\n"), n);
+	fprintf(bat->log, _(" min %.3fms, mean %.3fms, p99 %.3fms,"),
+			sorted[0], mean, sorted[p99]);
+	fprintf(bat->log, _(" max %.3fms, jitter %.3fms (std dev)\n"),
+			sorted[n - 1], sqrt(var / n));
+
+	bat->latency.final_result = (int) lrint(mean);
+}
+
+/* cross-correlate the capture with the chirp by FFT */
+static void xcorr_correlate(struct latency_xcorr *x)
+{
+	float *X = x->spectrum, *C = x->chirp_fft;
+	float re, im;
+	int k, n = x->fft_size;
+
+	fftwf_execute(x->forward);
+
+	/* X * conj(C) in halfcomplex order, scaled for the inverse */
+	X[0] = X[0] * C[0] / n;
+	X[n / 2] = X[n / 2] * C[n / 2] / n;
+	for (k = 1; k < n / 2; k++) {
+		re = X[k] * C[k] + X[n - k] * C[n - k];
+		im = X[n - k] * C[k] - X[k] * C[n - k];
+		X[k] = re / n;
+		X[n - k] = im / n;
+	}
+
+	fftwf_execute(x->inverse);
+}
+
+/* correlation peak gives the arrival time of the chirp */
+static void xcorr_detect(struct bat *bat, struct latency_xcorr *x)
+{
+	int i, peak = 0;
+	float a, b, g, delta = 0.0;
+	double energy = 0.0, rho, ms;
+
+	xcorr_correlate(x);
+
+	for (i = 1; i <= x->max_lag; i++)
+		if (fabsf(x->corr[i]) > fabsf(x->corr[peak]))
+			peak = i;
+
+	if (peak > 0 && peak < x->max_lag) {
+		a = fabsf(x->corr[peak - 1]);
+		b = fabsf(x->corr[peak]);
+		g = fabsf(x->corr[peak + 1]);
+		if (a - 2.0 * b + g < 0.0)
+			delta = 0.5 * (a - g) / (a - 2.0 * b + g);
+	}
+
+	for (i = peak; i < peak + x->chirp_frames; i++)
+		energy += (double) x->capture[i] * x->capture[i];
+	rho = fabsf(x->corr[peak]) / sqrt(x->chirp_energy * energy + 1e-20);
+
+	if (rho < LATENCY_XCORR_MIN_RHO) {
+		fprintf(bat->err, _("Test%d, chirp not detected"),
+				x->count + 1);
+		fprintf(bat->err, _(" (correlation %.2f)\n"), rho);
+		bat->latency.error++;
+		return;
+	}
+
+	ms = (x->capture_start + (peak + delta) / bat->rate - x->emit_time)
+			* 1000.0;
+	x->results[x->count++] = ms;
+	fprintf(bat->log, _("Test%d, path latency %.3fms"), x->count, ms);
+	fprintf(bat->log, _(" (correlation %.2f)\n"), rho);
+}
+
+static int xcorr_output(struct bat *bat, void *buffer, int frames,
+		double tstamp)
 {
+	struct latency_xcorr *x = bat->latency.xcorr;
+	float *buf, v;
+	int i, c;
+
+	buf = get_buffer(&x->out, &x->out_size, frames * bat->channels);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&x->lock);
+	if (x->state == XCORR_ARMED && tstamp > 0.0) {
+		x->state = XCORR_PLAYING;
+		x->emit_time = tstamp;
+		x->chirp_pos = 0;
+	}
+	pthread_mutex_unlock(&x->lock);
+
+	for (i = 0; i < frames; i++) {
+		v = 0.0;
+		if (x->chirp_pos < x->chirp_frames)
+			v = x->chirp[x->chirp_pos++];
+		for (c = 0; c < bat->channels; c++)
+			*buf++ = v * x->scale + x->offset;
+	}
+
+	bat->convert_float_to_sample(x->out, buffer, frames, bat->channels);
+
+	return 0;
+}
+
+static int xcorr_input(struct bat *bat, void *buffer, int frames,
+		double tstamp)
+{
+	struct latency_xcorr *x = bat->latency.xcorr;
+	enum xcorr_state state;
+	double emit_time;
+	float *buf, v;
+	int i, c, start = 0;
+
+	buf = get_buffer(&x->in, &x->in_size, frames * bat->channels);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&x->lock);
+	state = x->state;
+	emit_time = x->emit_time;
+	pthread_mutex_unlock(&x->lock);
+
+	switch (state) {
+	case XCORR_SETTLE:
+		x->waited += frames;
+		if (x->waited >= x->settle) {
+			x->waited = 0;
+			pthread_mutex_lock(&x->lock);
+			x->state = XCORR_ARMED;
+			pthread_mutex_unlock(&x->lock);
+		}
+		return 0;
+	case XCORR_ARMED:
+		return 0;
+	case XCORR_PLAYING:
+		break;
+	}
+
+	if (tstamp <= 0.0)
+		return 0;
+
+	/* start collecting at the frame captured when the chirp started */
+	if (x->capture_pos == 0) {
+		start = (int) ceil((emit_time - tstamp) * bat->rate);
+		if (start >= frames)
+			return 0;
+		if (start < 0)
+			start = 0;
+		x->capture_start = tstamp + (double) start / bat->rate;
+	}
+
+	bat->convert_sample_to_float(buffer, buf, frames * bat->channels);
+
+	/* only collect the window here, it is correlated once complete */
+	for (i = start; i < frames
+			&& x->capture_pos < x->capture_frames; i++) {
+		/* mix down to mono */
+		for (c = 0, v = 0.0; c < bat->channels; c++)
+			v += buf[i * bat->channels + c] - x->offset;
+		x->capture[x->capture_pos++] = v / bat->channels;
+	}
+
+	if (x->capture_pos < x->capture_frames)
+		return 0;
+
+	xcorr_detect(bat, x);
+
+	x->capture_pos = 0;
+	x->settle = bat->rate * LATENCY_XCORR_GAP_MS / 1000;
+	pthread_mutex_lock(&x->lock);
+	x->state = XCORR_SETTLE;
+	pthread_mutex_unlock(&x->lock);
+
+	if (x->count == bat->latency.xcorr_number) {
+		xcorr_report(bat, x);
+		bat->latency.state = LATENCY_STATE_COMPLETE_SUCCESS;
+		bat->latency.is_capturing = false;
+	} else if (bat->latency.error > bat->latency.xcorr_number) {
+		fprintf(bat->err, _("Could not detect signal."));
+		fprintf(bat->err, _("Too much background noise?\n"));
+		bat->latency.state = LATENCY_STATE_COMPLETE_FAILURE;
+		bat->latency.is_capturing = false;
+	}
+
+	return 0;
+}
+#endif
+
+void roundtrip_latency_exit(struct bat *bat)
+{
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr == NULL)
+		return;
+
+	pthread_mutex_destroy(&bat->latency.xcorr->lock);
+	xcorr_free(bat->latency.xcorr);
+	bat->latency.xcorr = NULL;
+#endif
+}
+
+int roundtrip_latency_init(struct bat *bat)
+{
+#ifdef HAVE_LIBFFTW3F
+	int err;
+#endif
+
 	bat->latency.number = 1;
 	bat->latency.state = LATENCY_STATE_MEASURE_FOR_1_SECOND;
 	bat->latency.final_result = 0;
@@ -182,10 +592,35 @@ void roundtrip_latency_init(struct bat *bat)
 	bat->latency.xrun_error = false;
 	bat->frames = LATENCY_TEST_TIME_LIMIT * bat->rate;
 	bat->periods_played = 0;
+
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr_number == 0)
+		return 0;
+
+	err = xcorr_init(bat);
+	if (err < 0)
+		return err;
+
+	/* each measurement takes the capture window and the gap at most,
+	   allow for twice that */
+	bat->frames = bat->rate + 2 * bat->latency.xcorr_number *
+		(bat->latency.xcorr->capture_frames
+		+ bat->rate * LATENCY_XCORR_GAP_MS / 1000);
+#endif
+
+	return 0;
 }
 
-int handleinput(struct bat *bat, void *buffer, int frames)
+/**
+ * tstamp is the time the first frame in buffer was captured, 0 if unknown
+ */
+int handleinput(struct bat *bat, void *buffer, int frames, double tstamp)
 {
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr)
+		return xcorr_input(bat, buffer, frames, tstamp);
+#endif
+
 	switch (bat->latency.state) {
 	/* Measuring average loudness for 1 second */
 	case LATENCY_STATE_MEASURE_FOR_1_SECOND:
@@ -224,7 +659,11 @@ int handleinput(struct bat *bat, void *buffer, int frames)
 	return 0;
 }
 
-int handleoutput(struct bat *bat, void *buffer, int bytes, int frames)
+/**
+ * tstamp is the time the first frame in buffer will be played, 0 if unknown
+ */
+int handleoutput(struct bat *bat, void *buffer, int bytes, int frames,
+		double tstamp)
 {
 	int err = 0;
 
@@ -233,6 +672,11 @@ int handleoutput(struct bat *bat, void *buffer, int bytes, int frames)
 			&& bat->latency.is_capturing == false)
 		return bat->latency.state;
 
+#ifdef HAVE_LIBFFTW3F
+	if (bat->latency.xcorr)
+		return xcorr_output(bat, buffer, frames, tstamp);
+#endif
+
 	if (bat->latency.state == LATENCY_STATE_PLAY_AND_LISTEN)
 		err = generate_sine_wave(bat, frames, buffer);
 	else
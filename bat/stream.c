@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2013-2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Streaming analysis: captured periods are consumed as they arrive and
+ * analyzed in fixed-size windows overlapping by half a window, so memory
+ * use does not depend on the test duration.
+ *
+ * Every sample is checked for clicks and dropouts as it arrives, every
+ * window is checked for peak frequency, level, SNR and THD. Anomalies are
+ * reported immediately with their position in the stream.
+ */
+
+#include "aconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <math.h>
+#include <fftw3.h>
+
+#include "gettext.h"
+
+#include "common.h"
+#include "stream.h"
+#include "impair.h"
+
+/* half width in bins of a Blackman-Harris windowed tone */
+#define LOBE_BINS			5
+/* highest harmonic taken into THD */
+#define MAX_HARMONIC			5
+/* smallest power, avoids log of zero */
+#define POWER_FLOOR			1e-20
+
+struct stream_channel {
+	float *hist;			/* ring of the last window samples */
+	bool locked;			/* signal found at target frequency */
+	float amplitude;		/* amplitude of the locked signal */
+	float step;			/* max 2nd difference of unit sine */
+	int quiet_limit;		/* quiet samples making a dropout */
+	int quiet;			/* length of current quiet run */
+	int holdoff;			/* samples until next click report */
+	float prev[2];			/* previous two samples */
+
+	float peak_min;
+	float peak_max;
+	float snr_min;
+	float thd_max;
+	unsigned int dropouts;
+	unsigned int clicks;
+	unsigned int level_drops;
+	unsigned int freq_errors;
+	unsigned int noisy;
+};
+
+struct stream_analyzer {
+	int window;			/* window size in frames */
+	int hop;			/* frames between two windows */
+	int pos;			/* oldest sample in the rings */
+	int pending;			/* frames fed since last window */
+	long long frames;		/* frames fed in total */
+	unsigned int windows;		/* windows analyzed */
+	float offset;			/* DC offset of unsigned formats */
+	float *coef;			/* window coefficients */
+	float *in;
+	float *out;
+	float *samples;			/* converted samples of one chunk */
+	int samples_size;
+	fftwf_plan plan;
+	struct stream_channel ch[MAX_CHANNELS];
+};
+
+static double frames_to_sec(struct bat *bat, long long frames)
+{
+	return (double) frames / bat->rate;
+}
+
+static void stream_analyzer_free(struct bat *bat, struct stream_analyzer *sa)
+{
+	int c;
+
+	if (sa->plan)
+		fftwf_destroy_plan(sa->plan);
+	for (c = 0; c < bat->channels; c++)
+		free(sa->ch[c].hist);
+	free(sa->samples);
+	fftwf_free(sa->out);
+	fftwf_free(sa->in);
+	free(sa->coef);
+	free(sa);
+}
+
+int stream_analyzer_init(struct bat *bat)
+{
+	struct stream_analyzer *sa;
+	struct stream_channel *ch;
+	int i, c, n = bat->stream_window;
+	double x;
+
+	sa = calloc(1, sizeof(*sa));
+	if (sa == NULL)
+		return -ENOMEM;
+
+	sa->window = n;
+	sa->hop = n / 2;
+	if (bat->format == BAT_PCM_FORMAT_U8)
+		sa->offset = 128.0;
+
+	sa->coef = malloc(sizeof(float) * n);
+	sa->in = (float *) fftwf_malloc(sizeof(float) * n);
+	sa->out = (float *) fftwf_malloc(sizeof(float) * n);
+	if (sa->coef == NULL || sa->in == NULL || sa->out == NULL)
+		goto fail;
+
+	/* 4-term Blackman-Harris, sidelobes are below -92 dB */
+	for (i = 0; i < n; i++) {
+		x = 2.0 * M_PI * i / n;
+		sa->coef[i] = 0.35875 - 0.48829 * cos(x)
+				+ 0.14128 * cos(2.0 * x)
+				- 0.01168 * cos(3.0 * x);
+	}
+
+	for (c = 0; c < bat->channels; c++) {
+		ch = &sa->ch[c];
+		ch->hist = calloc(n, sizeof(float));
+		if (ch->hist == NULL)
+			goto fail;
+		x = sin(M_PI * bat->target_freq[c] / bat->rate);
+		ch->step = 4.0 * x * x;
+		/* a sine stays near zero for a small part of its period */
+		ch->quiet_limit = bat->rate / bat->target_freq[c] / 8;
+		if (ch->quiet_limit < STREAM_QUIET_MIN)
+			ch->quiet_limit = STREAM_QUIET_MIN;
+		ch->peak_min = bat->rate;
+		ch->snr_min = SNR_DB_MAX;
+	}
+
+	sa->plan = fftwf_plan_r2r_1d(n, sa->in, sa->out, FFTW_R2HC,
+			FFTW_MEASURE);
+	if (sa->plan == NULL)
+		goto fail;
+
+	bat->stream = sa;
+
+	fprintf(bat->log, _("Streaming analysis: window %d frames,"), n);
+	fprintf(bat->log, _(" hop %d frames\n"), sa->hop);
+
+	return 0;
+
+fail:
+	stream_analyzer_free(bat, sa);
+	return -ENOMEM;
+}
+
+/* check a single sample for discontinuities and silence */
+static void check_sample(struct bat *bat, struct stream_analyzer *sa,
+		int c, float x)
+{
+	struct stream_channel *ch = &sa->ch[c];
+	float d2;
+
+	if (!ch->locked)
+		goto out;
+
+	if (fabsf(x) < ch->amplitude * STREAM_QUIET_RATIO) {
+		if (++ch->quiet == ch->quiet_limit) {
+			ch->dropouts++;
+			fprintf(bat->err, _(" ANOMALY: %.6fs channel %d:"),
+					frames_to_sec(bat,
+					sa->frames - ch->quiet + 1), c + 1);
+			fprintf(bat->err, _(" dropout\n"));
+		}
+	} else {
+		ch->quiet = 0;
+	}
+
+	if (ch->holdoff > 0) {
+		ch->holdoff--;
+		goto out;
+	}
+
+	/* 2nd difference of a sine is bounded by its amplitude and rate */
+	d2 = fabsf(x - 2.0f * ch->prev[0] + ch->prev[1]);
+	if (d2 > ch->amplitude * (ch->step + STREAM_CLICK_RATIO)) {
+		ch->clicks++;
+		ch->holdoff = sa->hop;
+		fprintf(bat->err, _(" ANOMALY: %.6fs channel %d:"),
+				frames_to_sec(bat, sa->frames), c + 1);
+		fprintf(bat->err, _(" click, step %.1f%% of amplitude\n"),
+				d2 * 100.0 / ch->amplitude);
+	}
+
+out:
+	ch->prev[1] = ch->prev[0];
+	ch->prev[0] = x;
+}
+
+/* sum power of the bins around center */
+static double lobe_power(float *power, int center, int first, int last)
+{
+	double sum = 0.0;
+	int k;
+
+	for (k = center - LOBE_BINS; k <= center + LOBE_BINS; k++)
+		if (k >= first && k < last)
+			sum += power[k];
+
+	return sum;
+}
+
+static void analyze_window(struct bat *bat, struct stream_analyzer *sa,
+		int c)
+{
+	struct stream_channel *ch = &sa->ch[c];
+	int i, h, k, n = sa->window, peak, first, last = n / 2;
+	float *power = sa->in;
+	float hz = (float) bat->rate / n;
+	float freq, delta, snr_db, thd, tolerance, target = bat->target_freq[c];
+	double a, b, g, rms = 0.0, total = 0.0, sig, harm = 0.0, noise, level;
+	double start = frames_to_sec(bat, sa->frames - n);
+	bool anomaly = false;
+
+	for (i = 0; i < n; i++) {
+		float x = ch->hist[(sa->pos + i) & (n - 1)];
+
+		rms += x * x;
+		sa->in[i] = x * sa->coef[i];
+	}
+	rms = sqrt(rms / n);
+
+	fftwf_execute(sa->plan);
+
+	/* power spectrum, skip DC and its leakage */
+	first = (int) (DC_THRESHOLD / hz) + LOBE_BINS;
+	for (k = 0, peak = first; k < last; k++) {
+		if (k < first) {
+			power[k] = 0.0;
+			continue;
+		}
+		power[k] = sa->out[k] * sa->out[k]
+				+ sa->out[n - k] * sa->out[n - k];
+		total += power[k];
+		if (power[k] > power[peak])
+			peak = k;
+	}
+
+	/* parabolic interpolation of the log spectrum around the peak */
+	delta = 0.0;
+	if (peak > first && peak < last - 1) {
+		a = log(power[peak - 1] + POWER_FLOOR);
+		b = log(power[peak] + POWER_FLOOR);
+		g = log(power[peak + 1] + POWER_FLOOR);
+		if (a - 2.0 * b + g < 0.0)
+			delta = 0.5 * (a - g) / (a - 2.0 * b + g);
+	}
+	freq = (peak + delta) * hz;
+
+	sig = lobe_power(power, peak, first, last);
+	for (h = 2; h <= MAX_HARMONIC; h++) {
+		k = (int) lrintf(h * (peak + delta));
+		if (k + LOBE_BINS >= last)
+			break;
+		harm += lobe_power(power, k, first, last);
+	}
+	noise = total - sig - harm;
+
+	if (sig <= POWER_FLOOR)
+		snr_db = SNR_DB_MIN;
+	else if (noise <= sig * pow(10.0, -SNR_DB_MAX / 10.0))
+		snr_db = SNR_DB_MAX;
+	else
+		snr_db = 10.0 * log10(sig / noise);
+	thd = sig > POWER_FLOOR ? 100.0 * sqrt(harm / sig) : 0.0;
+
+	fprintf(bat->log, _("%.3fs channel %d: peak %.2f Hz,"),
+			start, c + 1, freq);
+	fprintf(bat->log, _(" SNR %.2f dB, THD %.3f%%\n"), snr_db, thd);
+
+	tolerance = DELTA_RATE * target;
+	if (tolerance < DELTA_HZ)
+		tolerance = DELTA_HZ;
+
+	if (!ch->locked) {
+		if (snr_db < STREAM_LOCK_SNR_DB
+				|| fabsf(freq - target) > tolerance)
+			return;
+		ch->locked = true;
+		ch->amplitude = M_SQRT2 * rms;
+		fprintf(bat->log, _("Channel %d locked at %.2f Hz"),
+				c + 1, freq);
+		fprintf(bat->log, _(" at %.3fs\n"), start);
+	}
+
+	if (fabsf(freq - target) > tolerance) {
+		ch->freq_errors++;
+		anomaly = true;
+		fprintf(bat->err, _(" ANOMALY: %.6fs channel %d:"),
+				start, c + 1);
+		fprintf(bat->err, _(" frequency error, peak %.2f Hz\n"),
+				freq);
+	}
+
+	if (M_SQRT2 * rms < ch->amplitude * STREAM_DROPOUT_RATIO) {
+		ch->level_drops++;
+		anomaly = true;
+		fprintf(bat->err, _(" ANOMALY: %.6fs channel %d:"),
+				start, c + 1);
+		fprintf(bat->err, _(" level dropped by %.1f dB\n"),
+				20.0 * log10(ch->amplitude
+				/ (M_SQRT2 * rms + POWER_FLOOR)));
+	}
+
+	if (snr_is_valid(bat->snr_thd_db) && snr_db < bat->snr_thd_db) {
+		ch->noisy++;
+		anomaly = true;
+		fprintf(bat->err, _(" ANOMALY: %.6fs channel %d:"),
+				start, c + 1);
+		fprintf(bat->err, _(" noise, SNR %.2f dB\n"), snr_db);
+	}
+
+	if (freq < ch->peak_min)
+		ch->peak_min = freq;
+	if (freq > ch->peak_max)
+		ch->peak_max = freq;
+	if (snr_db < ch->snr_min)
+		ch->snr_min = snr_db;
+	if (thd > ch->thd_max)
+		ch->thd_max = thd;
+
+	/* follow slow level changes of a clean signal */
+	level = M_SQRT2 * rms / ch->amplitude;
+	if (!anomaly && level > 1.0 / M_SQRT2 && level < M_SQRT2)
+		ch->amplitude += (M_SQRT2 * rms - ch->amplitude) / 8.0;
+}
+
+/**
+ * Consume interleaved captured frames, windows are analyzed as soon as
+ * enough new frames are available
+ */
+int stream_analyzer_feed(struct bat *bat, void *buf, int frames)
+{
+	struct stream_analyzer *sa = bat->stream;
+	int i, c, size = frames * bat->channels;
+	float *samples;
+	int err;
+
+	err = impair_apply(bat, buf, frames);
+	if (err != 0)
+		return err;
+
+	if (size > sa->samples_size) {
+		samples = realloc(sa->samples, sizeof(float) * size);
+		if (samples == NULL)
+			return -ENOMEM;
+		sa->samples = samples;
+		sa->samples_size = size;
+	}
+
+	bat->convert_sample_to_float(buf, sa->samples, size);
+
+	for (i = 0, samples = sa->samples; i < frames; i++) {
+		for (c = 0; c < bat->channels; c++) {
+			float x = *samples++ - sa->offset;
+
+			check_sample(bat, sa, c, x);
+			sa->ch[c].hist[sa->pos] = x;
+		}
+		sa->pos = (sa->pos + 1) & (sa->window - 1);
+		sa->frames++;
+
+		if (++sa->pending < sa->hop || sa->frames < sa->window)
+			continue;
+
+		for (c = 0; c < bat->channels; c++)
+			analyze_window(bat, sa, c);
+		sa->windows++;
+		sa->pending = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Print the summary of the streaming analysis and release the analyzer
+ *
+ * @return 0 if no anomaly was found, -ENOPEAK if the signal was not found
+ *         on some channel, -ESTREAM if anomalies were detected
+ */
+int stream_analyzer_finish(struct bat *bat)
+{
+	struct stream_analyzer *sa = bat->stream;
+	struct stream_channel *ch;
+	unsigned int anomalies = 0;
+	int c, err = 0;
+
+	if (sa == NULL)
+		return -EINVAL;
+
+	fprintf(bat->log, _("\nStreaming analysis: %u windows,"),
+			sa->windows);
+	fprintf(bat->log, _(" %.3fs analyzed\n"),
+			frames_to_sec(bat, sa->frames));
+
+	for (c = 0; c < bat->channels; c++) {
+		ch = &sa->ch[c];
+		fprintf(bat->log, _("\nChannel %i - "), c + 1);
+		fprintf(bat->log, _("target frequency %2.2f Hz\n"),
+				bat->target_freq[c]);
+		if (!ch->locked) {
+			fprintf(bat->err, _(" FAIL: Signal not found\n"));
+			err = -ENOPEAK;
+			continue;
+		}
+		fprintf(bat->log, _("Peak %2.2f to %2.2f Hz,"),
+				ch->peak_min, ch->peak_max);
+		fprintf(bat->log, _(" minimum SNR %.2f dB,"), ch->snr_min);
+		fprintf(bat->log, _(" maximum THD %.3f%%\n"), ch->thd_max);
+		fprintf(bat->log, _("Dropouts %u, clicks %u,"),
+				ch->dropouts, ch->clicks);
+		fprintf(bat->log, _(" level drops %u,"), ch->level_drops);
+		fprintf(bat->log, _(" frequency errors %u,"), ch->freq_errors);
+		fprintf(bat->log, _(" noisy windows %u\n"), ch->noisy);
+		anomalies += ch->dropouts + ch->clicks + ch->level_drops
+				+ ch->freq_errors + ch->noisy;
+	}
+
+	if (err == 0 && anomalies > 0) {
+		fprintf(bat->err, _("\nFAIL: %u anomalies detected\n"),
+				anomalies);
+		err = -ESTREAM;
+	} else if (err == 0) {
+		fprintf(bat->log, _("\nPASS: No anomaly detected\n"));
+	}
+
+	stream_analyzer_free(bat, sa);
+	bat->stream = NULL;
+
+	return err;
+}
+
+/* release the analyzer if the test ended before it was finished */
+void stream_analyzer_exit(struct bat *bat)
+{
+	if (bat->stream == NULL)
+		return;
+
+	stream_analyzer_free(bat, bat->stream);
+	bat->stream = NULL;
+}
+
+/* feed a previously captured file to the streaming analyzer */
+int stream_analyze_file(struct bat *bat)
+{
+	FILE *fp;
+	void *buf;
+	size_t items;
+	int err;
+
+	buf = malloc(bat->frame_size * bat->stream_window);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	fp = fopen(bat->capture.file, "rb");
+	if (fp == NULL) {
+		err = -errno;
+		fprintf(bat->err, _("Cannot open file: %s %d\n"),
+				bat->capture.file, err);
+		goto exit1;
+	}
+
+	/* Skip header */
+	err = read_wav_header(bat, bat->capture.file, fp, true);
+	if (err != 0)
+		goto exit2;
+
+	while (1) {
+		items = fread(buf, bat->frame_size, bat->stream_window, fp);
+		if (items == 0)
+			break;
+		err = stream_analyzer_feed(bat, buf, items);
+		if (err != 0)
+			break;
+	}
+	if (ferror(fp))
+		err = -EIO;
+
+exit2:
+	fclose(fp);
+exit1:
+	free(buf);
+
+	return err;
+}
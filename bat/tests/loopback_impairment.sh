@@ -0,0 +1,205 @@
+#!/bin/bash
+
+#/*
+# * Copyright (C) 2013-2016 Intel Corporation
+# *
+# * This program is free software; you can redistribute it and/or modify
+# * it under the terms of the GNU General Public License as published by
+# * the Free Software Foundation; either version 2 of the License, or
+# * (at your option) any later version.
+# *
+# * This program is distributed in the hope that it will be useful,
+# * but WITHOUT ANY WARRANTY; without even the implied warranty of
+# * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# * GNU General Public License for more details.
+# *
+# */
+
+# Test alsabat without audio hardware. Each format/rate/channels combination
+# is tested with a clean signal, which must pass, and with each impairment,
+# which the streaming analyzer must detect.
+#
+# With the snd-aloop driver, alsabat plays and captures on a pair of loopback
+# substreams, one pair per parallel job. Without it, alsabat plays to a file
+# plugin writing to /dev/null and captures from a file plugin reading a sine
+# wave recorded beforehand, both on the null plugin. Either way, the playback
+# and capture threads run as in a hardware test.
+#
+# The analysis throughput is measured separately, by timing the analysis of
+# the recorded sine waves in local mode.
+#
+# usage: loopback_impairment.sh [alsabat binary] [parallel jobs]
+
+bin=${1:-alsabat}
+jobs=${2:-`nproc`}
+
+#set test matrix
+format_table="U8 S16_LE S24_3LE S32_LE"
+rate_table="44100 48000"
+channel_table="1 2 8"
+impair_table="none drop gain noise delay"
+
+#test duration in seconds, and SNR threshold to catch the noise impairment
+duration=2
+snr_db=30
+
+#size of the wav header written by alsabat
+wav_header=44
+
+logdir="`pwd`/log/loopback"
+mkdir -p $logdir
+
+#snd-aloop has 8 substreams per device
+card=`grep -m 1 "Loopback" /proc/asound/cards 2>/dev/null | cut -d " " -f 2`
+if [ "$card" = "" ] && [ `id -u` -eq 0 ]; then
+	modprobe snd-aloop > /dev/null 2>&1 && sleep 1
+	card=`grep -m 1 "Loopback" /proc/asound/cards 2>/dev/null \
+		| cut -d " " -f 2`
+fi
+if [ "$card" != "" ]; then
+	echo "Using snd-aloop card $card"
+	[ $jobs -gt 8 ] && jobs=8
+else
+	echo "No snd-aloop card, using the file and null plugins"
+fi
+
+#record a sine wave of twice the duration on the null plugin
+record_reference()
+{
+	local format=$1 rate=$2 channels=$3
+	local name="$format-$rate-$channels"
+
+	$bin -P null -f $format -r $rate -c $channels \
+		-n $((duration * 2))s --saveplay=$logdir/$name.wav \
+		--log=$logdir/$name.play.log > /dev/null 2>&1
+	tail -c +$((wav_header + 1)) $logdir/$name.wav > $logdir/$name.raw
+}
+
+#file plugin devices for the test, in a config of their own
+write_asoundrc()
+{
+	local dir=$1 raw=$2
+
+	mkdir -p $dir
+	cat > $dir/.asoundrc << EOF
+pcm.batplay {
+	type file
+	slave.pcm null
+	file "/dev/null"
+	format "raw"
+}
+pcm.batcapture {
+	type file
+	slave.pcm null
+	file "/dev/null"
+	infile "$raw"
+	format "raw"
+}
+EOF
+}
+
+#run one test case, with the loopback substream given as slot
+run_case()
+{
+	local format=$1 rate=$2 channels=$3 impair=$4 slot=$5
+	local name="$format-$rate-$channels-$impair"
+	local log="$logdir/$name.log"
+	local args="-f $format -r $rate -c $channels -n ${duration}s --stream"
+	local ret
+
+	args="$args --snr-db=$snr_db"
+	[ "$impair" != "none" ] && args="$args --impair=$impair"
+
+	if [ "$card" != "" ]; then
+		$bin -P hw:$card,0,$slot -C hw:$card,1,$slot $args \
+			--log=$log > /dev/null 2>&1
+		ret=$?
+	else
+		write_asoundrc $logdir/$name \
+			$logdir/$format-$rate-$channels.raw
+		HOME=$logdir/$name $bin -P batplay -C batcapture $args \
+			--log=$log > /dev/null 2>&1
+		ret=$?
+		rm -rf $logdir/$name
+	fi
+
+	# the clean signal must pass, an impaired one must fail
+	if [ "$impair" = "none" -a $ret -eq 0 ] \
+			|| [ "$impair" != "none" -a $ret -ne 0 ]; then
+		echo "$name: pass" > $logdir/$name.result
+	else
+		echo "$name: fail ($ret)" > $logdir/$name.result
+	fi
+}
+
+#time the streaming analysis of a whole recorded sine wave
+measure_analysis()
+{
+	local format=$1 rate=$2 channels=$3
+	local name="$format-$rate-$channels"
+	local start end
+
+	start=`date +%s%N`
+	$bin --local --file=$logdir/$name.wav --stream \
+		--log=$logdir/$name.perf.log > /dev/null 2>&1
+	end=`date +%s%N`
+
+	echo "$((rate * duration * 2)) $((end - start))" \
+		> $logdir/$name.perf
+}
+
+#run a command for each format/rate/channels, jobs at a time
+for_each_config()
+{
+	local n=0 format rate channels
+
+	for format in $format_table; do
+		for rate in $rate_table; do
+			for channels in $channel_table; do
+				"$@" $format $rate $channels &
+				n=$((n + 1))
+				if [ $n -eq $jobs ]; then
+					wait
+					n=0
+				fi
+			done
+		done
+	done
+	wait
+}
+
+rm -f $logdir/*.result $logdir/*.perf
+for_each_config record_reference
+
+slot=0
+for format in $format_table; do
+	for rate in $rate_table; do
+		for channels in $channel_table; do
+			for impair in $impair_table; do
+				run_case $format $rate $channels $impair \
+					$slot &
+				slot=$((slot + 1))
+				if [ $slot -eq $jobs ]; then
+					wait
+					slot=0
+				fi
+			done
+		done
+	done
+done
+wait
+
+for_each_config measure_analysis
+
+cat $logdir/*.result | grep fail
+pass_number=`cat $logdir/*.result | grep -c ": pass"`
+total_number=`ls $logdir/*.result | wc -l`
+
+echo "PASS: $pass_number/$total_number cases"
+cat $logdir/*.perf | awk '{ frames += $1; ns += $2 }
+END { printf "Analysis: %d frames in %.2fs, %.0f frames/s per job\n",
+	frames, ns / 1e9, frames / (ns / 1e9) }'
+
+rm -f $logdir/*.wav $logdir/*.raw
+
+[ $pass_number -eq $total_number ]
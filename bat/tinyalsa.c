@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #include <tinyalsa/asoundlib.h>
 
@@ -29,6 +30,9 @@
 #include "common.h"
 #include "tinyalsa.h"
 #include "latencytest.h"
+#ifdef HAVE_LIBFFTW3F
+#include "stream.h"
+#endif
 
 struct format_map_table {
 	enum _bat_pcm_format format_bat;
@@ -157,6 +161,28 @@ exit:
 	return err;
 }
 
+/**
+ * Get the time the first of frames at the application pointer is played,
+ * or for capture, the time the first of frames just read was captured.
+ * Returns 0 if the timestamp can't be read.
+ */
+static double get_pcm_tstamp(struct bat *bat, struct pcm *pcm, int frames,
+		bool capture)
+{
+	unsigned int avail;
+	struct timespec tstamp;
+	double t;
+
+	if (pcm_get_htimestamp(pcm, &avail, &tstamp) != 0)
+		return 0.0;
+
+	t = tstamp.tv_sec + tstamp.tv_nsec / 1e9;
+	if (capture)
+		return t - (double) (avail + frames) / bat->rate;
+
+	return t + (double) (pcm_get_buffer_size(pcm) - avail) / bat->rate;
+}
+
 /**
  * Process output data for latency test
  */
@@ -172,7 +198,8 @@ static int latencytest_process_output(struct bat *bat, struct pcm *pcm,
 
 	while (1) {
 		/* generate output data */
-		err = handleoutput(bat, buffer, bytes, frames);
+		err = handleoutput(bat, buffer, bytes, frames,
+				get_pcm_tstamp(bat, pcm, frames, false));
 		if (err != 0)
 			break;
 
@@ -423,6 +450,36 @@ static int capture_sample(struct bat *bat, struct pcm *pcm,
 	return err;
 }
 
+#ifdef HAVE_LIBFFTW3F
+/**
+ * Feed captured buffers to the streaming analyzer instead of storing them
+ */
+static int capture_sample_stream(struct bat *bat, struct pcm *pcm,
+		void *buffer, unsigned int bytes)
+{
+	int err = 0;
+	int frames = bytes / bat->frame_size;
+	int remain = bat->frames;
+
+	while (remain > 0 && !pcm_read(pcm, buffer, bytes)) {
+		err = stream_analyzer_feed(bat, buffer,
+				remain < frames ? remain : frames);
+		if (err != 0)
+			break;
+
+		remain -= frames;
+
+		bat->periods_played++;
+
+		if (bat->period_is_limited
+				&& bat->periods_played >= bat->periods_total)
+			break;
+	}
+
+	return err;
+}
+#endif
+
 /**
  * Process input data for latency test
  */
@@ -455,7 +512,9 @@ static int latencytest_process_input(struct bat *bat, struct pcm *pcm,
 		if (fwrite(buffer, 1, bytes, fp) != bytes)
 			break;
 
-		err = handleinput(bat, buffer, bytes / bat->frame_size);
+		err = handleinput(bat, buffer, bytes / bat->frame_size,
+				get_pcm_tstamp(bat, pcm,
+					bytes / bat->frame_size, true));
 		if (err != 0)
 			break;
 
@@ -532,6 +591,10 @@ void *record_tinyalsa(struct bat *bat)
 	fprintf(bat->log, _("Recording ...\n"));
 	if (bat->roundtriplatency)
 		err = latencytest_process_input(bat, pcm, buffer, bufbytes);
+#ifdef HAVE_LIBFFTW3F
+	else if (bat->stream)
+		err = capture_sample_stream(bat, pcm, buffer, bufbytes);
+#endif
 	else
 		err = capture_sample(bat, pcm, buffer, bufbytes);
 	if (err != 0) {